@@ -0,0 +1,462 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  capture.cpp
+ *
+ *  Saves the raw frames around interesting events.  The capture process
+ *  reads every frame from the frame buffer and keeps the last
+ *  pre_trigger_seconds of them in memory.  When the tracker reports a
+ *  completed track, or a CaptureTrigger message arrives, the frames from
+ *  pre_trigger_seconds before the event to post_trigger_seconds after it
+ *  are written to a capture file by a separate disk thread.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+#include <iostream> // cout, cin, cerr
+#include <fstream>  // ofstream
+#include <string>   // for strings
+#include <deque>
+#include <algorithm> // max
+#include <vector>
+#include <memory>   // shared_ptr
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <boost/filesystem.hpp>
+
+#include "yaml-cpp/yaml.h"
+
+#include "nims_ipc.h" // NIMS signal handling, queues, shared mem
+#include "log.h"      // NIMS logging
+#include "frame_buffer.h"
+#include "tracks_message.h"
+#include "capture_trigger.h"
+
+using namespace std;
+using namespace boost;
+namespace fs = boost::filesystem;
+
+/*
+ Capture file format (little endian, packed):
+
+   8 bytes       "NIMSCAP1"
+   records       each a CaptureRecord followed by size bytes:
+                   kGeometryRecord:  FrameGeometry, written before the first
+                                     frame and whenever the geometry changes
+                   kFrameRecord:     FrameHeader, uint64 data size, frame data
+   index         one CaptureIndexEntry per frame record
+   trailer       CaptureTrailer
+
+ A reader seeks to the trailer at the end of the file to find the index,
+ then can seek to any frame by number or ping time.  A file without a
+ trailer (the process was killed) can still be read record by record.
+*/
+const char kCaptureMagic[8] = { 'N', 'I', 'M', 'S', 'C', 'A', 'P', '1' };
+
+enum CaptureRecordType { kGeometryRecord = 1, kFrameRecord = 2 };
+
+struct __attribute__ ((__packed__)) CaptureRecord
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t size;     // bytes that follow
+};
+
+struct __attribute__ ((__packed__)) CaptureIndexEntry
+{
+    int64_t  frame_number; // frame buffer number of the frame
+    uint32_t ping_sec;
+    uint32_t ping_millisec;
+    uint64_t offset;       // file offset of the frame's CaptureRecord
+};
+
+struct __attribute__ ((__packed__)) CaptureTrailer
+{
+    uint64_t index_offset;
+    uint64_t num_frames;
+    char     magic[8];
+};
+
+// A frame kept in memory for capture.  Frames are shared between the
+// pre-trigger history and the disk thread's queue, and are not changed
+// once they have been read.
+struct CapturedFrame
+{
+    long  frame_number;
+    Frame frame;
+    double ping_time() const
+        { return frame.header.ping_sec + frame.header.ping_millisec/1000.0; };
+};
+typedef std::shared_ptr<CapturedFrame> CapturedFramePtr;
+
+//-----------------------------------------------------------------------------
+// Writes capture files on its own thread, so the frame reader never waits
+// on the disk.  If the disk falls behind by more than max_queue_bytes,
+// frames are dropped from the capture instead.
+class CaptureWriter
+{
+    public:
+        CaptureWriter(const fs::path &directory, size_t max_queue_bytes);
+        ~CaptureWriter();
+
+        void Open(const std::string &file_name);
+        // Returns false if the frame was dropped.
+        bool Write(const CapturedFramePtr &frame);
+        void Close();
+
+    private:
+        struct Job
+        {
+            enum { kOpen, kFrame, kClose } what;
+            std::string file_name;
+            CapturedFramePtr frame;
+        };
+        void Push(const Job &job);
+        void Run(); // disk thread
+        void WriteFrame(const CapturedFrame &frame);
+        void WriteIndex();
+
+        fs::path directory_;
+        size_t max_queue_bytes_;
+        std::deque<Job> jobs_;
+        size_t queued_bytes_;
+        bool done_;
+        std::mutex lock_;
+        std::condition_variable cond_;
+        std::thread t_;
+
+        // used only by the disk thread
+        std::ofstream file_;
+        fs::path file_path_;
+        std::vector<CaptureIndexEntry> index_;
+        uint32_t geometry_id_; // last geometry written to the file
+
+}; // class CaptureWriter
+
+CaptureWriter::CaptureWriter(const fs::path &directory, size_t max_queue_bytes)
+: directory_(directory), max_queue_bytes_(max_queue_bytes)
+{
+    queued_bytes_ = 0;
+    done_ = false;
+    geometry_id_ = 0;
+    t_ = std::thread(&CaptureWriter::Run, this);
+
+} // CaptureWriter Constructor
+
+CaptureWriter::~CaptureWriter()
+{
+    // finish the queued work first
+    Close();
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        done_ = true;
+    }
+    cond_.notify_one();
+    t_.join();
+
+} // CaptureWriter Destructor
+
+void CaptureWriter::Open(const std::string &file_name)
+{
+    Job job;
+    job.what = Job::kOpen;
+    job.file_name = file_name;
+    Push(job);
+
+} // CaptureWriter::Open
+
+bool CaptureWriter::Write(const CapturedFramePtr &frame)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (queued_bytes_ + frame->frame.size() > max_queue_bytes_) return false;
+        queued_bytes_ += frame->frame.size();
+    }
+    Job job;
+    job.what = Job::kFrame;
+    job.frame = frame;
+    Push(job);
+    return true;
+
+} // CaptureWriter::Write
+
+void CaptureWriter::Close()
+{
+    Job job;
+    job.what = Job::kClose;
+    Push(job);
+
+} // CaptureWriter::Close
+
+void CaptureWriter::Push(const Job &job)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        jobs_.push_back(job);
+    }
+    cond_.notify_one();
+
+} // CaptureWriter::Push
+
+void CaptureWriter::Run()
+{
+    while (1)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            cond_.wait(guard, [this]{ return done_ || !jobs_.empty(); });
+            if (jobs_.empty()) return; // done
+            job = jobs_.front();
+            jobs_.pop_front();
+        }
+
+        switch (job.what)
+        {
+            case Job::kOpen:
+                if (file_.is_open()) WriteIndex();
+                file_path_ = directory_ / job.file_name;
+                file_.open(file_path_.string().c_str(), ios::out | ios::binary);
+                if (!file_.is_open())
+                {
+                    NIMS_LOG_ERROR << "Error opening capture file: " << file_path_;
+                    break;
+                }
+                NIMS_LOG_DEBUG << "capturing frames to " << file_path_;
+                file_.write(kCaptureMagic, sizeof(kCaptureMagic));
+                index_.clear();
+                geometry_id_ = 0;
+                break;
+            case Job::kFrame:
+                if (file_.is_open()) WriteFrame(*job.frame);
+                {
+                    std::lock_guard<std::mutex> guard(lock_);
+                    queued_bytes_ -= job.frame->frame.size();
+                }
+                break;
+            case Job::kClose:
+                if (file_.is_open()) WriteIndex();
+                break;
+        }
+    }
+
+} // CaptureWriter::Run
+
+void CaptureWriter::WriteFrame(const CapturedFrame &frame)
+{
+    const FrameHeader &hdr = frame.frame.header;
+    const FrameGeometry *geom = frame.frame.geometry.get();
+    if (geom != nullptr && geom->generation != geometry_id_)
+    {
+        CaptureRecord rec = { kGeometryRecord, 0, sizeof(FrameGeometry) };
+        file_.write((const char *)&rec, sizeof(rec));
+        file_.write((const char *)geom, sizeof(FrameGeometry));
+        geometry_id_ = geom->generation;
+    }
+
+    CaptureIndexEntry entry = { frame.frame_number, hdr.ping_sec, hdr.ping_millisec,
+                                (uint64_t)file_.tellp() };
+    uint64_t data_size = frame.frame.size();
+    CaptureRecord rec = { kFrameRecord, 0, sizeof(FrameHeader) + sizeof(data_size) + data_size };
+    file_.write((const char *)&rec, sizeof(rec));
+    file_.write((const char *)&hdr, sizeof(hdr));
+    file_.write((const char *)&data_size, sizeof(data_size));
+    file_.write((const char *)frame.frame.data_ptr(), data_size);
+    if (!file_)
+    {
+        NIMS_LOG_ERROR << "Error writing frame " << frame.frame_number << " to " << file_path_;
+        file_.close();
+        return;
+    }
+    index_.push_back(entry);
+
+} // CaptureWriter::WriteFrame
+
+void CaptureWriter::WriteIndex()
+{
+    CaptureTrailer trailer;
+    trailer.index_offset = file_.tellp();
+    trailer.num_frames = index_.size();
+    memcpy(trailer.magic, kCaptureMagic, sizeof(kCaptureMagic));
+    file_.write((const char *)index_.data(), index_.size()*sizeof(CaptureIndexEntry));
+    file_.write((const char *)&trailer, sizeof(trailer));
+    file_.close();
+    NIMS_LOG_DEBUG << "saved " << index_.size() << " frames to " << file_path_;
+
+} // CaptureWriter::WriteIndex
+
+///////////////////////////////////////////////////////////////////////////////
+//  MAIN
+///////////////////////////////////////////////////////////////////////////////
+int main (int argc, char * argv[]) {
+
+    string cfgpath, log_level;
+    if ( parse_command_line(argc, argv, cfgpath, log_level) != 0 ) return -1;
+    setup_logging(string(basename(argv[0])), cfgpath, log_level);
+    setup_signal_handling();
+
+    // READ CONFIG FILE
+    string fb_name; // frame buffer
+    float pre_secs = 10.0;
+    float post_secs = 10.0;
+    fs::path directory;
+    size_t max_queue_bytes;
+
+    try
+    {
+        YAML::Node config = YAML::LoadFile(cfgpath); // throws exception if bad path
+        fb_name = config["FRAMEBUFFER_NAME"].as<string>();
+        YAML::Node params = config["CAPTURE"];
+        pre_secs = params["pre_trigger_seconds"].as<float>();
+        NIMS_LOG_DEBUG << "pre_trigger_seconds = " << pre_secs;
+        post_secs = params["post_trigger_seconds"].as<float>();
+        NIMS_LOG_DEBUG << "post_trigger_seconds = " << post_secs;
+        directory = params["directory"].as<string>();
+        NIMS_LOG_DEBUG << "directory = " << directory;
+        max_queue_bytes = params["max_queue_mb"].as<float>()*1024*1024;
+        NIMS_LOG_DEBUG << "max_queue_mb = " << params["max_queue_mb"].as<float>();
+    }
+    catch( const std::exception& e )
+    {
+        NIMS_LOG_ERROR << "Error reading config file: " << cfgpath << endl;
+        NIMS_LOG_ERROR << e.what() << endl;
+        return -1;
+    }
+
+    boost::system::error_code ec;
+    fs::create_directories(directory, ec);
+    if (ec)
+    {
+        NIMS_LOG_ERROR << "Error creating capture directory " << directory << ": " << ec.message();
+        return -1;
+    }
+
+	//--------------------------------------------------------------------------
+	// DO STUFF
+    NIMS_LOG_DEBUG << "Starting " << argv[0];
+    SubprocessCheckin(getpid()); // Synchronize with main NIMS process.
+
+    // Frames the capture does not get are only missing from the captures,
+    // so never hold up the writer; only kLagBlock readers do, in ring and
+    // per-frame mode alike.
+    FrameBufferReader fb(fb_name);
+    if ( -1 == fb.Connect(kLagDropOldest) )
+    {
+        NIMS_LOG_ERROR << "Error connecting to framebuffer.";
+        return -1;
+    }
+
+    // completed tracks from the tracker, and triggers from anyone
+    mqd_t mq_trk = CreateMessageQueue(MQ_TRACKER_CAPTURE_QUEUE, sizeof(TracksMessage), true);
+    if (mq_trk < 0)
+    {
+        NIMS_LOG_ERROR << "Error creating MQ_TRACKER_CAPTURE_QUEUE";
+        return -1;
+    }
+    mqd_t mq_trig = CreateMessageQueue(MQ_CAPTURE_TRIGGER_QUEUE, sizeof(CaptureTrigger), true);
+    if (mq_trig < 0)
+    {
+        NIMS_LOG_ERROR << "Error creating MQ_CAPTURE_TRIGGER_QUEUE";
+        return -1;
+    }
+
+    CaptureWriter writer(directory, max_queue_bytes);
+    std::deque<CapturedFramePtr> history; // the last pre_secs of frames
+    CapturedFramePtr spare;               // an old frame to reuse
+    double capture_end = -1.0;  // ping time to capture until, or -1
+    long last_captured = 0;     // last frame sent to the writer
+    long frames_dropped = 0;
+
+    //-------------------------------------------------------------------------
+    // MAIN LOOP
+    while ( !sigint_received )
+    {
+        CapturedFramePtr next = spare ? spare : std::make_shared<CapturedFrame>();
+        spare.reset();
+        next->frame_number = fb.GetNextFrame(&(next->frame));
+        if (next->frame_number == -1) break;
+        const double ping_time = next->ping_time();
+
+        // keep the pre-trigger window; frames the disk thread is done with
+        // can be reused
+        history.push_back(next);
+        while (ping_time - history.front()->ping_time() > pre_secs)
+        {
+            if (history.front().use_count() == 1) spare = history.front();
+            history.pop_front();
+        }
+
+        // Triggers extend the current capture or start a new one.
+        TracksMessage msg_trk;
+        CaptureTrigger msg_trig;
+        std::vector<CaptureTrigger> triggers;
+        while (mq_receive(mq_trk, (char *)&msg_trk, sizeof(msg_trk), nullptr) != -1)
+        {
+            if (msg_trk.num_tracks == 0) continue;
+            NIMS_LOG_DEBUG << msg_trk.num_tracks << " completed tracks at frame "
+                           << msg_trk.frame_num;
+            // The track started before it was completed; the pre-trigger
+            // window should be longer than the tracks of interest.
+            msg_trig.trigger_time = msg_trk.ping_time;
+            triggers.push_back(msg_trig);
+        }
+        while (mq_receive(mq_trig, (char *)&msg_trig, sizeof(msg_trig), nullptr) != -1)
+        {
+            NIMS_LOG_DEBUG << "capture triggered at " << std::fixed << msg_trig.trigger_time;
+            if (msg_trig.trigger_time == 0.0) msg_trig.trigger_time = ping_time;
+            triggers.push_back(msg_trig);
+        }
+        for (size_t k=0; k<triggers.size(); ++k)
+        {
+            const CaptureTrigger &trig = triggers[k];
+            double start = trig.trigger_time - (trig.pre_seconds > 0.0 ? trig.pre_seconds : pre_secs);
+            double end = trig.trigger_time + (trig.post_seconds > 0.0 ? trig.post_seconds : post_secs);
+            if (capture_end < 0.0)
+            {
+                time_t rawtime = trig.trigger_time;
+                char timestr[16]; // YYYYMMDD-hhmmss
+                strftime(timestr, 16, "%Y%m%d-%H%M%S", gmtime(&rawtime));
+                writer.Open("nims_capture-" + string(timestr) + ".dat");
+            }
+            capture_end = std::max(capture_end, end);
+
+            // frames already in the history
+            for (size_t i=0; i<history.size(); ++i)
+            {
+                if (history[i]->frame_number <= last_captured
+                    || history[i]->ping_time() < start) continue;
+                if (!writer.Write(history[i])) ++frames_dropped;
+                last_captured = history[i]->frame_number;
+            }
+        }
+
+        if (capture_end < 0.0) continue;
+        if (ping_time <= capture_end)
+        {
+            if (next->frame_number > last_captured)
+            {
+                if (!writer.Write(next)) ++frames_dropped;
+                last_captured = next->frame_number;
+            }
+        }
+        else
+        {
+            writer.Close();
+            capture_end = -1.0;
+            if (frames_dropped > 0)
+                NIMS_LOG_WARNING << "disk is not keeping up; dropped " << frames_dropped
+                                 << " frames from the capture";
+            frames_dropped = 0;
+        }
+
+    } // main loop
+
+    //-------------------------------------------------------------------------
+	// CLEANUP
+    mq_close(mq_trk);
+    mq_close(mq_trig);
+    NIMS_LOG_DEBUG << "Ending " << argv[0];
+    return 0;
+}
@@ -0,0 +1,33 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  capture_trigger.h
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#ifndef __NIMS_CAPTURE_TRIGGER_H__
+#define __NIMS_CAPTURE_TRIGGER_H__
+
+#include <cstdint>  // fixed width integer types
+
+// Message sent to the capture process on MQ_CAPTURE_TRIGGER_QUEUE to save
+// the raw frames around an event.  Using fundamental types because this
+// structure may be sent by an external application.
+struct __attribute__ ((__packed__)) CaptureTrigger
+{
+    double   trigger_time; // seconds since Jan 1, 1970, or 0 for the latest ping
+    float    pre_seconds;  // save frames this long before the trigger,
+    float    post_seconds; // and this long after; 0 for the configured values
+
+    CaptureTrigger()
+    {
+        trigger_time = 0.0;
+        pre_seconds = 0.0;
+        post_seconds = 0.0;
+    };
+
+}; // CaptureTrigger
+
+#endif // __NIMS_CAPTURE_TRIGGER_H__
@@ -13,6 +13,8 @@
 
 
 #include "frame_buffer.h"
+
+#include <memory> // shared_ptr
 /*-----------------------------------------------------------------------------
 Base class for sonar data sources.  Classes for specific devices will be
 derived from this class.  The unit of data is a ping, which includes both the ping
@@ -33,6 +35,16 @@ class DataSource {
  protected:
   int input_; // file descriptor for the source
   
+  // Give the frame this beam geometry, sharing the geometry object of the
+  // previous frame if the beams have not changed.
+  void SetGeometry(Frame* pframe, const FrameGeometry& geometry)
+  {
+      if (!geometry_ || !geometry_->same_beams(geometry))
+          geometry_ = std::make_shared<const FrameGeometry>(geometry);
+      pframe->geometry = geometry_;
+  };
+  std::shared_ptr<const FrameGeometry> geometry_; // of the last ping
+  
 }; // DataSource
    
 
@@ -20,6 +20,12 @@
 #include <dirent.h> // list files in directory
 #include <cmath> // modf
 #include <thread> // sleep_for
+#include <vector>
+#include <cerrno>
+#include <fcntl.h> // open, posix_fadvise
+#include <poll.h>
+#include <unistd.h> // read, close
+#include <sys/inotify.h> // watch the data directory
 #include <cv.h> // opencv
 //#include <highgui.h> // imwrite for TEST
 
@@ -38,6 +44,12 @@ DataSourceBlueView::DataSourceBlueView(BlueViewParams const &params)
     else
         host_or_path_ = params.host_addr;
     pulse_rate_hz_ = params.pulse_rate_hz;
+    pace_ = params.pace;
+    watch_fd_ = -1;
+    file_pings_ = next_ping_ = 0;
+    file_num_ = 0;
+    image_threads_ = params.image_threads;
+    stop_ = false;
     son_ = NULL;
     head_ = NULL;
     imager_ = NULL;
@@ -57,6 +69,13 @@ DataSourceBlueView::DataSourceBlueView(BlueViewParams const &params)
 //-----------------------------------------------------------------------------
 DataSourceBlueView::~DataSourceBlueView() 
 {
+    StopImagers();
+    if (next_file_.valid())
+    {
+        SonFile next = next_file_.get();
+        CloseFile(next);
+    }
+    if (watch_fd_ != -1) close(watch_fd_);
     BVTImageGenerator_Destroy(imager_);
     BVTHead_Destroy(head_);
 	BVTSonar_Destroy(son_); 
@@ -70,30 +89,18 @@ int DataSourceBlueView::connect()
 		NIMS_LOG_ERROR << "BVTSonar_Create: failed";
 		return -1;
 	}
+    if (imager_ == NULL) imager_ = BVTImageGenerator_Create();
     int ret = -1;
     if (files_)
     {
-        // make sure directory exists
-        DIR           *d;
-        struct dirent *dir;
-        d = opendir(host_or_path_.c_str());
-        if (d == nullptr)
-        {
-            // TODO: perror
-            NIMS_LOG_ERROR << "Error reading data directory " << host_or_path_;
-            return -1;
-        }
-         // put existing files in queue
-         while ((dir = readdir(d)) != NULL)
-        {
-            NIMS_LOG_DEBUG <<  dir->d_name;
-        }
-       closedir(d);
-            
-        // watch for new files
-        // open first file
-       string filename("../data/BlueView/2016_03_24_00_41_00.son");
-        ret = BVTSonar_Open(son_, "FILE", filename.c_str());
+        // each file is a sonar of its own
+        StopImagers();
+        if ( -1 == ReadDirectory() || -1 == NextFile() ) return -1;
+        ret = 0;
+        // files are read as fast as images are made, so make them in 
+        // parallel; a live sonar has one ping at a time to give
+        for (int k=0; image_threads_ > 1 && k<image_threads_; ++k)
+            imagers_.push_back(std::thread(&DataSourceBlueView::RunImager, this));
     }
     else
         ret = BVTSonar_Open(son_, "NET", host_or_path_.c_str());
@@ -120,6 +127,8 @@ int DataSourceBlueView::connect()
 	NIMS_LOG_DEBUG << "BVTSonar_GetHeadCount: " << heads;
 
 
+    if (files_) return 0; // NextFile has the head
+
     // TODO:  Make the head a configuration parameter.
 	// Get the first head.
 	ret = BVTSonar_GetHead(son_, 0, &head_);
@@ -132,7 +141,6 @@ int DataSourceBlueView::connect()
     // TODO: Might need to set the sound speed.
     
     // Initialize an image generator for the head.
-     imager_ = BVTImageGenerator_Create();
      ret = BVTImageGenerator_SetHead(imager_, head_);
 	if( ret != 0 )
 	{
@@ -145,6 +153,281 @@ int DataSourceBlueView::connect()
 } // DataSourceBlueView::connect
 
 
+//-----------------------------------------------------------------------------
+static bool IsSonFile(const string &name)
+{
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".son") == 0;
+}
+
+//-----------------------------------------------------------------------------
+// Open a .son file and its head.  The file is read through first, so 
+// its pings come from memory once it is being played; this runs on a 
+// background thread while the file before it plays.  The head is NULL if
+// the file cannot be opened.
+DataSourceBlueView::SonFile DataSourceBlueView::OpenFile(const string &path)
+{
+    SonFile file = { path, NULL, NULL, 0 };
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd != -1)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        vector<char> buffer(1024*1024);
+        while (read(fd, buffer.data(), buffer.size()) > 0) {}
+        close(fd);
+    }
+
+    file.son = BVTSonar_Create();
+    int ret = (file.son == NULL) ? -1 : BVTSonar_Open(file.son, "FILE", path.c_str());
+    if (ret == 0) ret = BVTSonar_GetHead(file.son, 0, &file.head);
+    if (ret == 0) ret = BVTHead_GetPingCount(file.head, &file.num_pings);
+    if (ret != 0)
+    {
+        NIMS_LOG_ERROR << "Error opening " << path << ": ret = " << ret;
+        CloseFile(file);
+    }
+    return file;
+} // DataSourceBlueView::OpenFile
+
+//-----------------------------------------------------------------------------
+void DataSourceBlueView::CloseFile(SonFile &file)
+{
+    if (file.head != NULL) BVTHead_Destroy(file.head);
+    if (file.son != NULL) BVTSonar_Destroy(file.son);
+    file.head = NULL;
+    file.son = NULL;
+} // DataSourceBlueView::CloseFile
+
+//-----------------------------------------------------------------------------
+// Queue the .son files in the data directory, and watch it for files that
+// are written or moved there later.  The watch starts first, so a file
+// arriving meanwhile is not missed.
+int DataSourceBlueView::ReadDirectory()
+{
+    if (watch_fd_ != -1) close(watch_fd_);
+    queue_.clear();
+    watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ( watch_fd_ == -1 
+         || -1 == inotify_add_watch(watch_fd_, host_or_path_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) )
+    {
+        nims_perror(("DataSourceBlueView watching " + host_or_path_).c_str());
+        return -1;
+    }
+
+    DIR *d = opendir(host_or_path_.c_str());
+    if (d == nullptr)
+    {
+        nims_perror(("Error reading data directory " + host_or_path_).c_str());
+        return -1;
+    }
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL)
+    {
+        if (IsSonFile(dir->d_name)) queue_.insert(dir->d_name);
+    }
+    closedir(d);
+    NIMS_LOG_DEBUG << queue_.size() << " files in " << host_or_path_;
+    return 0;
+} // DataSourceBlueView::ReadDirectory
+
+//-----------------------------------------------------------------------------
+// Queue the .son files that have arrived in the data directory.  With 
+// wait, wait for one if there are none.  Returns -1 on error, or if a
+// signal came while waiting.
+int DataSourceBlueView::UpdateQueue(bool wait)
+{
+    while (true)
+    {
+        char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(watch_fd_, buffer, sizeof(buffer));
+        if (len > 0)
+        {
+            for (char *p = buffer; p < buffer + len; )
+            {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                if (event->len > 0 && IsSonFile(event->name))
+                {
+                    NIMS_LOG_DEBUG << "new file " << event->name;
+                    queue_.insert(event->name);
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+            continue;
+        }
+        if (len == -1 && errno != EAGAIN)
+        {
+            nims_perror("DataSourceBlueView inotify read");
+            return -1;
+        }
+        if (!wait || !queue_.empty()) return 0;
+
+        NIMS_LOG_DEBUG << "waiting for files in " << host_or_path_;
+        struct pollfd pfd = { watch_fd_, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1)
+        {
+            if (errno != EINTR) nims_perror("DataSourceBlueView poll");
+            return -1;
+        }
+    }
+} // DataSourceBlueView::UpdateQueue
+
+//-----------------------------------------------------------------------------
+// Start opening the first file in the queue, to play after the current one.
+void DataSourceBlueView::Prefetch()
+{
+    if ( next_file_.valid() || -1 == UpdateQueue(false) || queue_.empty() ) return;
+    const string path = host_or_path_ + "/" + *queue_.begin();
+    queue_.erase(queue_.begin());
+    next_file_ = std::async(std::launch::async, OpenFile, path);
+} // DataSourceBlueView::Prefetch
+
+//-----------------------------------------------------------------------------
+// Switch to the next file:  the one opened in the background, or else the
+// first in the queue, waiting for one if need be.  Files that will not
+// open are skipped.  Returns -1 on error or SIGINT.
+int DataSourceBlueView::NextFile()
+{
+    while (true)
+    {
+        if ( !next_file_.valid() )
+        {
+            if ( -1 == UpdateQueue(true) ) return -1;
+            // Prefetch starts nothing if it cannot read the directory
+            Prefetch();
+            if ( !next_file_.valid() )
+            {
+                NIMS_LOG_ERROR << "DataSourceBlueView: no file to play next in " 
+                               << host_or_path_;
+                return -1;
+            }
+        }
+        SonFile next = next_file_.get();
+        if (next.head == NULL) continue;
+
+        BVTImageGenerator_SetHead(imager_, next.head);
+        SonFile last = { file_, son_, head_, 0 };
+        CloseFile(last);
+        son_ = next.son;
+        head_ = next.head;
+        file_ = next.path;
+        file_pings_ = next.num_pings;
+        next_ping_ = 0;
+        ++file_num_;
+        NIMS_LOG_DEBUG << "playing " << file_pings_ << " pings from " << file_;
+
+        Prefetch();
+        return 0;
+    }
+} // DataSourceBlueView::NextFile
+
+//-----------------------------------------------------------------------------
+/*
+ Worker thread:  make images of the pings in todo_, with an image generator
+ of its own.  The pings of a file are handed out in order, so consecutive
+ pings are done at the same time; NextImage takes them back in order.
+*/
+void DataSourceBlueView::RunImager()
+{
+    BVTImageGenerator imager = BVTImageGenerator_Create();
+    int file_num = -1; // the file whose head the generator has
+    while (1)
+    {
+        ImageJob *job;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            work_cond_.wait(guard, [this]{ return stop_ || !todo_.empty(); });
+            if (stop_) break;
+            job = todo_.front();
+            todo_.pop_front();
+        }
+
+        if (job->file_num != file_num)
+        {
+            BVTImageGenerator_SetHead(imager, job->head);
+            file_num = job->file_num;
+        }
+        BVTMagImage img = NULL;
+        int ret = BVTImageGenerator_GetImageRTheta(imager, job->ping, &img);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            job->img = img;
+            job->ret = ret;
+            job->done = true;
+        }
+        done_cond_.notify_one();
+    }
+    BVTImageGenerator_Destroy(imager);
+} // DataSourceBlueView::RunImager
+
+//-----------------------------------------------------------------------------
+void DataSourceBlueView::StopImagers()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+    }
+    work_cond_.notify_all();
+    for (size_t k=0; k<imagers_.size(); ++k) imagers_[k].join();
+    imagers_.clear();
+    for (size_t k=0; k<in_flight_.size(); ++k)
+    {
+        if (in_flight_[k].img != NULL) BVTMagImage_Destroy(in_flight_[k].img);
+        BVTPing_Destroy(in_flight_[k].ping);
+    }
+    in_flight_.clear();
+    todo_.clear();
+    stop_ = false;
+} // DataSourceBlueView::StopImagers
+
+//-----------------------------------------------------------------------------
+// The next ping of the files and its image.  Pings are read ahead, two for
+// each worker, so none waits while this thread puts out a frame.  A file
+// is closed only once its pings are all out, as their images need its
+// head.  Pings that fail are skipped.  Returns -1 on error or SIGINT.
+int DataSourceBlueView::NextImage(BVTPing *ping, BVTMagImage *img)
+{
+    while (1)
+    {
+        while ( in_flight_.empty() && next_ping_ >= file_pings_ )
+            if ( -1 == NextFile() ) return -1;
+
+        while ( in_flight_.size() < 2*imagers_.size() && next_ping_ < file_pings_ )
+        {
+            ImageJob job = { NULL, head_, file_num_, NULL, 0, false };
+            int ret = BVTHead_GetPing(head_, next_ping_++, &job.ping);
+            if ( ret != 0 )
+            {
+                NIMS_LOG_ERROR << "BVTHead_GetPing failed: ret = " << ret;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                in_flight_.push_back(job);
+                todo_.push_back(&in_flight_.back());
+            }
+            work_cond_.notify_one();
+        }
+        if ( in_flight_.empty() ) continue;
+
+        ImageJob job;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            done_cond_.wait(guard, [this]{ return in_flight_.front().done; });
+            job = in_flight_.front();
+            in_flight_.pop_front();
+        }
+        if ( job.ret != 0 )
+        {
+            NIMS_LOG_ERROR << "BVTImageGenerator_GetImageRTheta failed: ret = " << job.ret;
+            if (job.img != NULL) BVTMagImage_Destroy(job.img);
+            BVTPing_Destroy(job.ping);
+            continue;
+        }
+        *ping = job.ping;
+        *img = job.img;
+        return 0;
+    }
+} // DataSourceBlueView::NextImage
+
 //-----------------------------------------------------------------------------
 int DataSourceBlueView::GetPing(Frame* pframe)
 {
@@ -154,24 +437,42 @@ int DataSourceBlueView::GetPing(Frame* pframe)
         return -1;
     }
     if (files_)
-         // simulate the ping rate, otherwise the file is read as fast as possible
-        this_thread::sleep_until(t_last_ping_ + pri_sec_);
+    {
+        // open the next file while this one is read, if it is there yet
+        if ( !next_file_.valid() ) Prefetch();
+        // simulate the ping rate, otherwise the file is read as fast as possible
+        if (pace_)
+            this_thread::sleep_until(t_last_ping_ + pri_sec_);
+    }
 
     BVTPing ping;
-    int ret = BVTHead_GetPing(head_, -1, &ping);
-    if( ret != 0 )
-	{
-		NIMS_LOG_ERROR << "BVTHead_GetPing failed: ret = " << ret;
-		return -1;
-	}
-    // get the ping data in range-bearing coordinates
     BVTMagImage img;
-    BVTImageGenerator_GetImageRTheta(imager_, ping, &img);
+    int ret = 0;
+    if ( !imagers_.empty() )
+    {
+        // the workers made the image while the pings before it went out
+        if ( -1 == NextImage(&ping, &img) ) return -1;
+    }
+    else
+    {
+        while ( files_ && next_ping_ >= file_pings_ )
+            if ( -1 == NextFile() ) return -1;
+        ret = BVTHead_GetPing(head_, files_ ? next_ping_++ : -1, &ping);
+        if( ret != 0 )
+        {
+            NIMS_LOG_ERROR << "BVTHead_GetPing failed: ret = " << ret;
+            return -1;
+        }
+        // get the ping data in range-bearing coordinates
+        BVTImageGenerator_GetImageRTheta(imager_, ping, &img);
+    }
 
     ++ping_count_;
     
     NIMS_LOG_DEBUG << "    extracting header";
     
+    // start from a clean header; a reused frame has the last ping's
+    pframe->header = FrameHeader();
     //TODO:  use name and model returned from calls in constructor
     strncpy(pframe->header.device, "Teledyne BlueView Imaging Sonar",
             sizeof(pframe->header.device));
@@ -212,11 +513,11 @@ int DataSourceBlueView::GetPing(Frame* pframe)
     double brg_res_deg;
     BVTMagImage_GetBearingResolution(img, &brg_res_deg);
  
-    for (int m=0; m<pframe->header.num_beams; ++m)
-    {
-        if (kMaxBeams == m) break; // max in frame_buffer.h
-        pframe->header.beam_angles_deg[m] = min_beam + float(m*brg_res_deg);
-    }
+    FrameGeometry geometry;
+    geometry.num_beams = pframe->header.num_beams;
+    for (int m=0; m<geometry.num_beams; ++m)
+        geometry.beam_angles_deg[m] = min_beam + float(m*brg_res_deg);
+    SetGeometry(pframe, geometry);
     
      int freq;
     BVTHead_GetCenterFreq(head_, &freq);
@@ -239,8 +540,14 @@ int DataSourceBlueView::GetPing(Frame* pframe)
     // Note that few programs actually support loading a 16bit PGM.
     //BVTMagImage_SavePGM(img, "MagImage.pgm");
     
+    // The image data is unsigned short 16-bit, so keep it that way in the
+    // frame buffer; readers scale it to [0,1].
+    pframe->header.encoding = kSampleUInt16;
+    pframe->header.data_scale = 1./65535.;
+    pframe->header.data_offset = 0.0;
+    
     // allocate memory for data
-    size_t frame_data_size = sizeof(framedata_t)*imh*imw;
+    size_t frame_data_size = SampleSize(kSampleUInt16)*imh*imw;
     NIMS_LOG_DEBUG << "frame_data_size = " << frame_data_size;
     pframe->malloc_data(frame_data_size);
     if ( pframe->size() != frame_data_size )
@@ -248,15 +555,12 @@ int DataSourceBlueView::GetPing(Frame* pframe)
     framedata_t* fdp = pframe->data_ptr();
     
     //  The image data is organized in Row-Major order (just like C/C++).
-    //  The data type is unsigned short 16-bit.  Use openCV conversion for speed.
     unsigned short *pdata = nullptr;
     BVTMagImage_GetBits(img, &pdata);
     Mat im1(imh, imw, CV_16UC1, pdata); // Mat wrapper
-    int type_code = (sizeof(framedata_t) == 64) ? CV_64FC1 : CV_32FC1;
-    Mat im2(imh, imw, type_code, fdp); // Mat wrapper
-    im1.convertTo(im2, type_code, 1./65535., 0); // convert type with scaling
+    Mat im2(imh, imw, CV_16UC1, fdp); // Mat wrapper
     // flip it because it's upside down
-    flip(im2,im2, 0);
+    flip(im1,im2, 0);
 
     // TEST
     // imwrite("MatGetBits.png", im1);
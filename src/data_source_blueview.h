@@ -16,6 +16,13 @@
 
  #include <string>
  #include <chrono> // time functions
+#include <set>
+#include <deque>
+#include <vector>
+#include <future> // opening the next file in the background
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <bvt_sdk.h> // BlueView SDK
 
@@ -28,6 +35,8 @@ struct BlueViewParams {
   std::string host_addr; // address to live instrument, ignored if files==true
   std::string datadir; // path for files to process, ignored if files==false
   int pulse_rate_hz;   // pulse rate for files
+  bool pace;           // play files at pulse_rate_hz, else as fast as possible
+  int image_threads;   // make images of this many pings of files at once
 };
 
 class DataSourceBlueView : public DataSource {
@@ -37,11 +46,38 @@ class DataSourceBlueView : public DataSource {
   
   int connect();   // connect to data source
   bool is_good() { return (head_ != NULL); };  // check if source is in a good state
-  bool more_data() { return true; };  // TODO: check for not "end of file" condition
+  bool more_data() { return true; };  // files are waited for as they arrive
   int GetPing(Frame* pdata);     // get the next ping from the source
   //virtual size_t ReadPings(Frame* pdata, const size_t& num_pings) =0; // read consecutive pings
     
     private:
+      // a .son file opened for reading
+      struct SonFile {
+          std::string path;
+          BVTSonar son;
+          BVTHead head;
+          int num_pings;
+      };
+      static SonFile OpenFile(const std::string &path);
+      static void CloseFile(SonFile &file);
+      int ReadDirectory();   // queue the .son files there and watch for more
+      int UpdateQueue(bool wait); // queue files that have arrived
+      int NextFile();        // switch to the next file in the queue
+      void Prefetch();       // start opening the file after this one
+
+      // a ping of a file the image workers are making an image of
+      struct ImageJob {
+          BVTPing ping;
+          BVTHead head;
+          int file_num;
+          BVTMagImage img;
+          int ret;
+          bool done;
+      };
+      void RunImager();      // worker thread
+      void StopImagers();
+      int NextImage(BVTPing *ping, BVTMagImage *img);
+
       bool files_;
     	std::string host_or_path_;
       int pulse_rate_hz_;
@@ -51,6 +87,26 @@ class DataSourceBlueView : public DataSource {
       uint32_t  ping_count_;
       std::chrono::steady_clock::time_point t_last_ping_; // used for file playback
       std::chrono::duration<double> pri_sec_; // pulse repitition interval
+      bool pace_;
+      // file playback:  the .son files are named for the time they start,
+      // so in name order they are in time order
+      int watch_fd_;                    // inotify on the data directory
+      std::set<std::string> queue_;     // files not opened yet
+      std::string file_;                // the one being read
+      int file_pings_;                  // number of pings in it
+      int next_ping_;                   // next to read from it
+      std::future<SonFile> next_file_;  // the next one, opening
+      int file_num_;                    // counts the files opened
+      // image workers; the pings are in in_flight_ in order until they 
+      // are taken, and in todo_ until a worker takes them
+      int image_threads_;
+      std::vector<std::thread> imagers_;
+      std::deque<ImageJob> in_flight_;
+      std::deque<ImageJob*> todo_;
+      bool stop_;
+      std::mutex lock_;
+      std::condition_variable work_cond_;
+      std::condition_variable done_cond_;
 
 }; // DataSourceBlueView
    
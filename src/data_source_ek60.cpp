@@ -20,14 +20,11 @@
 #include <arpa/inet.h> // inet_addr()
 #include <unistd.h> // close()
 #include <assert.h> // assert()
-//#include <ctime> // time functions
-//#include <boost/date_time/posix_time/posix_time_io.hpp>
+#include <ctime> // time functions
+#include <cerrno>
  
 #include "log.h"
 
-namespace dt = boost::date_time;
-namespace pt = boost::posix_time;
-namespace greg = boost::gregorian;
 using namespace std;
 
 // Data types from the Simrad EK60 Scientific Echo Sounder Reference Manual
@@ -73,21 +70,49 @@ DataSourceEK60::DataSourceEK60(std::string const &host_addr, EK60Params const &p
     host_.sin_addr.s_addr = htonl(INADDR_ANY);
     host_.sin_port = htons(params.port);
 
-    // initialize time base
-    t_epoch_ = pt::ptime(greg::date(1970,1,1),pt::time_duration(0,0,0));
     pcount_ = 0;
+    
+    // point a message header at each packet of the pool for recvmmsg
+    packet_pool_.resize(PACKET_BATCH*DATA_BUFFER_SIZE);
+    msgs_.resize(PACKET_BATCH);
+    iovecs_.resize(PACKET_BATCH);
+    memset(msgs_.data(), 0, PACKET_BATCH*sizeof(struct mmsghdr));
+    for (int k=0; k<PACKET_BATCH; ++k)
+    {
+        iovecs_[k].iov_base = packet_pool_.data() + k*DATA_BUFFER_SIZE;
+        iovecs_[k].iov_len = DATA_BUFFER_SIZE;
+        msgs_[k].msg_hdr.msg_iov = &iovecs_[k];
+        msgs_[k].msg_hdr.msg_iovlen = 1;
+    }
+    num_packets_ = next_packet_ = 0;
+    memset(ping_time_, '0', sizeof(ping_time_));
+    memset(clock_time_, '0', sizeof(clock_time_));
 
     // initialize angle scaling
     // transducer-dependent, 
     // for three examples I have, the sensitivity is the same for both directions
     // sensitivity is a user-settable parameter, 0 to 100
     // offset is user-settable, -10 to 10
-    A_along_ = ANGLE_SCALE/params_.along_sensitivity;
+    A_along_ = ANGLE_SCALE/params.along_sensitivity;
     B_along_ = params.along_offset;
-    A_athwart_ = ANGLE_SCALE/params .athwart_sensitivity;
+    A_athwart_ = ANGLE_SCALE/params.athwart_sensitivity;
     B_athwart_ = params.athwart_offset;
 
     params_ = params;
+    if (params_.channels.empty())
+    {
+        EK60Channel only = { 1, params.along_sensitivity, params.along_offset };
+        params_.channels.push_back(only);
+    }
+    channels_.resize(params_.channels.size());
+    for (size_t k=0; k<channels_.size(); ++k)
+    {
+        channels_[k].number = params_.channels[k].number;
+        channels_[k].angle_bytes = 0;
+        memset(channels_[k].angle_time, '0', sizeof(channels_[k].angle_time));
+        if (channels_[k].number < 1 || channels_[k].number > 9)
+            NIMS_LOG_ERROR << "EK60 channel " << channels_[k].number << " out of range 1 to 9";
+    }
     
     // 
 } // DataSourceEK60::DataSourceEK60
@@ -111,6 +136,11 @@ int DataSourceEK60::connect()
     }
     // set this so bind doesn't fail because address is in use from last attempt
     setsockopt(input_,SOL_SOCKET,SO_REUSEADDR, nullptr, 0);
+    // room for a few pings of every channel while the ingester is busy;
+    // the kernel caps this at net.core.rmem_max
+    int rcvbuf = 8*1024*1024;
+    if (setsockopt(input_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1)
+        nims_perror("DataSourceEK60 setsockopt(SO_RCVBUF)");
     // bind to the port to receive incoming messages
     if (bind(input_, (struct sockaddr *)&host_, sizeof(host_)) == -1)
     {
@@ -124,14 +154,14 @@ int DataSourceEK60::connect()
     // get parameter datagrams
         sockaddr_in sender;
         socklen_t socklen = sizeof(sender);
-        int n = recvfrom(input_, buf_, DATA_BUFFER_SIZE, 0, (struct sockaddr *)&sender, &socklen);
+        int n = recvfrom(input_, packet_pool_.data(), DATA_BUFFER_SIZE, 0, (struct sockaddr *)&sender, &socklen);
         if (n < 0)
         {
             // TODO: maybe try again before returning.
             NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error reading datagram.";
             return -1;    
         }
-        NIMS_LOG_DEBUG << "read " << n << " bytes from " << inet_ntoa(sender.sin_addr) << ": " << string(buf_, 12)<< endl;
+        NIMS_LOG_DEBUG << "read " << n << " bytes from " << inet_ntoa(sender.sin_addr) << ": " << string(packet_pool_.data(), 12)<< endl;
 */
     strncpy(header_.device, "Simrad EK60 echo sounder", sizeof(header_.device));
     
@@ -151,11 +181,19 @@ int DataSourceEK60::connect()
  
     // create virtual beams to represent angles within a single beam
     header_.num_beams      = NUM_VIRTUAL_BEAMS; 
-   for (int m=0; m<header_.num_beams; ++m)
+    for (size_t k=0; k<channels_.size(); ++k)
     {
-        header_.beam_angles_deg[m] = ANGLE_SCALE/params_.along_sensitivity*(-128.0 + m) 
-           + params_.along_offset;
+        const EK60Channel &transducer = params_.channels[k];
+        FrameGeometry geometry;
+        geometry.num_beams = NUM_VIRTUAL_BEAMS;
+        for (int m=0; m<geometry.num_beams; ++m)
+        {
+            geometry.beam_angles_deg[m] = ANGLE_SCALE/transducer.along_sensitivity*(-128.0 + m) 
+               + transducer.along_offset;
+        }
+        channels_[k].geometry = std::make_shared<const FrameGeometry>(geometry);
     }
+    geometry_ = channels_[0].geometry;
 
 
     header_.freq_hz           = 0;
@@ -178,6 +216,32 @@ int DataSourceEK60::connect()
 //const double SECS_PER_NANO = 1.0e-9;
 //#define NT_TO_UTC(nt) { nt/100 * SECS_PER_NANO - (DAYS_1601_TO_1970 * SECS_PER_DAY) }
 
+// value of count decimal digits, or 0 if they are not all digits
+static int digits(const char *p, int count)
+{
+    int value = 0;
+    for (int k=0; k<count; ++k)
+    {
+        if (p[k] < '0' || p[k] > '9') return 0;
+        value = 10*value + (p[k] - '0');
+    }
+    return value;
+}
+
+// Seconds since 1-Jan-1970 of a ping time of day (HHMMSShh), taken as the
+// latest such time not after now, in local time like the sonar host.
+static uint32_t ping_seconds(const char *ping_time)
+{
+    time_t now = time(nullptr);
+    struct tm local;
+    localtime_r(&now, &local);
+    const long local_now = (long)now + local.tm_gmtoff;
+    long ping = local_now - local_now % 86400
+                + 3600*digits(ping_time, 2) + 60*digits(ping_time+2, 2) + digits(ping_time+4, 2);
+    if (ping > local_now) ping -= 86400;
+    return (uint32_t)ping;
+}
+
 
 
 //-----------------------------------------------------------------------------
@@ -196,59 +260,77 @@ datagrams are sent then power.  The datagrams will have the same timestamp.
 All the datagrams for each type will be sent consecutively followed by the next
 type.  This is true if there are multiple transducers.
 */
-    char* buf_power = nullptr;
-    char* buf_angle = nullptr;
-
-string ptime_str;
+// Take angle datagrams until a power datagram of the same channel and time
+// follows one, so a lost packet costs only the ping of the channel it was in.
+Channel *ch = nullptr;
 size_t data_bytes = 0;
-data_bytes = get_datagram("B1", ptime_str, buf_angle);
-if (!(data_bytes>0)) {
-    NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error getting angle data.";
-    return -1;
-}
-data_bytes = get_datagram("W1", ptime_str, buf_power);
-if (!(data_bytes>0)) {
-    NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error getting power data.";
-    return -1;
+while (data_bytes == 0)
+{
+    char dtype[2];
+    size_t bytes = get_datagram(dtype, ping_time_);
+    if (bytes == 0) {
+        NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error getting ping data.";
+        return -1;
+    }
+    ch = channel(dtype);
+    if (dtype[0] == 'B')
+    {
+        ch->angle_bytes = bytes;
+        memcpy(ch->angle_time, ping_time_, sizeof(ch->angle_time));
+    }
+    else if (ch->angle_bytes > 0 && memcmp(ch->angle_time, ping_time_, sizeof(ch->angle_time)) == 0)
+        data_bytes = bytes;
+    else
+        NIMS_LOG_WARNING << "power datagram without angle data on channel " << ch->number
+                         << ", waiting for next ping";
 }
+    const size_t angle_bytes = ch->angle_bytes;
+    ch->angle_bytes = 0;
+    const char *buf_angle = ch->angle_data.data();
+    const char *buf_power = power_data_.data();
 
     //NIMS_LOG_DEBUG << "    constructing header";
     pframe->header = header_; // copy constant part of header
+    pframe->geometry = ch->geometry;
+    pframe->header.channel = ch->number;
     
     // TODO:  need to assign a ping number since there is none in datagram
-    pframe->header.ping_num = ++pcount_;
+    // The channels transmit together, so pings with the same time are one
+    // ping and share a number.
+    if (memcmp(clock_time_, ping_time_, sizeof(clock_time_)) != 0)
+    {
+        ++pcount_;
+        memcpy(clock_time_, ping_time_, sizeof(clock_time_));
+    }
+    pframe->header.ping_num = pcount_;
 
     // time of ping in seconds since midnight 1-Jan-1970
     // NOTE:  Assumes sonar host computer is set to same timezone
     // as NIMS computer.  Assumes current time is always later than
     // ping time, since ping happened in the past.
-    pt::ptime tnow(pt::second_clock::local_time());
-    // ISO time sting: YYYYMMDDTHHMMSS,fffffffff
-    string tnow_str = pt::to_iso_string(tnow);
-    //NIMS_LOG_DEBUG << "time now is " << tnow_str;
-    string tping_str = string(tnow_str,0,9) + string(buf_+3,6) + ',' + string(buf_+9,2) + "0000000";
-    //NIMS_LOG_DEBUG << "ping time is " << tping_str;
-    pt::ptime tping = pt::from_iso_string(tping_str);
-    if (tping > tnow) tping = tping - greg::days(1);
-    pt::time_duration diff = tping - t_epoch_;
-    pframe->header.ping_sec      = (uint32_t)(diff.total_seconds()); 
-    pframe->header.ping_millisec = (uint32_t)stoi(string(buf_+9,2),nullptr,10)*10;
-
-    pframe->header.num_samples = data_bytes/sizeof(SHORT);
+    pframe->header.ping_sec      = ping_seconds(ping_time_); 
+    pframe->header.ping_millisec = 10*digits(ping_time_+6, 2);
+
+    pframe->header.num_samples = std::min(angle_bytes, data_bytes)/sizeof(SHORT);
+    
+    // The power samples are 16-bit, so keep them that way in the frame 
+    // buffer, shifted to unsigned; readers get raw*POWER_SCALE.
+    pframe->header.encoding = kSampleUInt16;
+    pframe->header.data_scale = POWER_SCALE;
+    pframe->header.data_offset = -32768*POWER_SCALE;
     
     // copy data to frame 
     //NIMS_LOG_DEBUG << "    allocating frame memory";
-    size_t frame_data_size = sizeof(framedata_t)*(pframe->header.num_samples)*(pframe->header.num_beams);
+    size_t frame_data_size = SampleSize(kSampleUInt16)*(pframe->header.num_samples)*(pframe->header.num_beams);
     pframe->malloc_data(frame_data_size);
     if ( pframe->size() != frame_data_size )
     {
         NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error allocating memory for frame data.";
-        free(buf_angle);
-        free(buf_power);
         return -1;
     }
     //NIMS_LOG_DEBUG << "    extracting data, " << pframe->header.num_samples << " samples";
-    framedata_t* fdp = pframe->data_ptr();
+    uint16_t* fdp = (uint16_t *)pframe->data_ptr();
+    memset(fdp, 0, frame_data_size);
     BYTE b;
     SHORT raw;
     for (int r = 0; r < pframe->header.num_samples; ++r) // row
@@ -256,95 +338,145 @@ if (!(data_bytes>0)) {
         memcpy(&b, buf_angle+(2*r), 1);      
         memcpy(&raw, buf_power+(2*r), 2);
         //NIMS_LOG_DEBUG << "r = " << r << ", b = " << +b << ", power = " << raw;
-        fdp[(b+128)*(pframe->header.num_samples) + r] = (framedata_t)(raw*POWER_SCALE);
+        fdp[(b+128)*(pframe->header.num_samples) + r] = (uint16_t)(raw + 32768);
     }
 
     //NIMS_LOG_DEBUG << " done getting ping data.";
-    free(buf_angle);
-    free(buf_power);
      return 0;
 
     
 } // DataSourceEK60::GetPing
 
+//-----------------------------------------------------------------------------
+// Point packet at the next packet from the socket and return its size, or
+// -1 on error.  Packets are taken a batch at a time:  recvmmsg waits for
+// the first and takes whatever else is already queued, so at high ping 
+// rates there is one system call per batch instead of per packet.
+int DataSourceEK60::next_packet(const char* &packet)
+{
+    if (next_packet_ == num_packets_)
+    {
+        num_packets_ = next_packet_ = 0;
+        int n = recvmmsg(input_, msgs_.data(), PACKET_BATCH, MSG_WAITFORONE, nullptr);
+        if (n <= 0)
+        {
+            nims_perror("DataSourceEK60 recvmmsg()");
+            return -1;
+        }
+        num_packets_ = n;
+    }
+    const int k = next_packet_++;
+    packet = (const char *)iovecs_[k].iov_base;
+    return msgs_[k].msg_len;
+} // DataSourceEK60::next_packet
+
+// EK500 datagram packet:  the type ("W1"), a comma, the ping time
+// (HHMMSShh), a comma, then the packet number, end of data flag, offset of
+// the first data byte, and the number of data bytes in this packet
+const int PKT_TYPE = 0;
+const int PKT_TIME = 3;
+const int PKT_TIME_SIZE = 8;
+const int PKT_NUM = 12;
+const int PKT_EOD = 13;
+const int PKT_FIRSTBYTE = 14;
+const int PKT_BYTES = 16;
+const int PKT_DATA = 18;
+const BYTE PKT_LAST = (BYTE)0x80; // end of data flag of the last packet
 
-size_t DataSourceEK60::get_datagram(string dtype_str, string& dtime_str, char* &buf_data)
+//-----------------------------------------------------------------------------
+// The channel of an angle ("B1") or power ("W1") datagram type, or nullptr
+// if it is not one being read.
+DataSourceEK60::Channel* DataSourceEK60::channel(const char *dtype)
 {
-     
-    BYTE pkt_num;
-    SHORT firstbyte;
-    SHORT bytes_in_pkt;
-    size_t bytes_so_far = 0; // data bytes copied to buffer so far
-
-// loop here until we get a full datagram of the desired type, which may be
-// split over multiple packets
-bool got_it = false;
-while (!got_it)
+    if (dtype[0] != 'B' && dtype[0] != 'W') return nullptr;
+    for (size_t k=0; k<channels_.size(); ++k)
+        if (dtype[1] == '0' + channels_[k].number) return &channels_[k];
+    return nullptr;
+} // DataSourceEK60::channel
+
+//-----------------------------------------------------------------------------
+// Buffer for reassembling datagrams of a type, or nullptr if GetPing does
+// not use the type.
+vector<char>* DataSourceEK60::datagram_buffer(const char *dtype)
 {
-    //NIMS_LOG_DEBUG << "getting datagram...";
-    if (bytes_so_far > 0) free(buf_data);
-    buf_data = nullptr;
-    bytes_so_far = 0;
-    int last_pkt = 0; // sequence number of last packet received
-
-    BYTE eod = 0x00; // end of data flag
-    while (eod == 0x00) // more packets, 0x80 indicates last packet
+    Channel *ch = channel(dtype);
+    if (ch == nullptr) return nullptr;
+    return (dtype[0] == 'B') ? &ch->angle_data : &power_data_;
+} // DataSourceEK60::datagram_buffer
+
+//-----------------------------------------------------------------------------
+// Reassemble the next whole datagram of a type GetPing uses, on any of the
+// channels, into its buffer, which only grows, and set dtype and dtime to its type and ping
+// time.  A datagram missing a packet is dropped.  Returns the datagram 
+// size, or 0 on error.
+size_t DataSourceEK60::get_datagram(char *dtype, char *dtime)
+{
+    vector<char> *data = nullptr; // datagram being reassembled, if any
+    size_t bytes_so_far = 0;      // data bytes copied to it so far
+    int last_pkt = 0;             // sequence number of last packet received
+    while (true)
     {
-        sockaddr_in sender;
-        socklen_t socklen = sizeof(sender);
-        int n = recvfrom(input_, buf_, DATA_BUFFER_SIZE, 0, (struct sockaddr *)&sender, &socklen);
+        const char *pkt;
+        int n = next_packet(pkt);
         if (n < 0)
         {
-            // TODO: maybe try again before returning.
             NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error reading datagram.";
-            return -1;    
+            return 0;
         }
-       // NIMS_LOG_DEBUG << "read " << n << " bytes from " << inet_ntoa(sender.sin_addr) << ": " << string(buf_, 12)<< endl;
-
-        // check type
-        string dtype = string(buf_,2);
-        if (dtype != dtype_str) 
+        
+        // parse packet header
+        BYTE pkt_num, eod;
+        SHORT bytes_in_pkt;
+        if (n >= PKT_DATA)
         {
-            NIMS_LOG_WARNING << "ignoring invalid datagram type: " << dtype;
-            break; // start over looking for datagram
+            memcpy(&pkt_num, pkt+PKT_NUM, sizeof(pkt_num));
+            memcpy(&eod, pkt+PKT_EOD, sizeof(eod));
+            memcpy(&bytes_in_pkt, pkt+PKT_BYTES, sizeof(bytes_in_pkt));
         }
-
-        // parse datagram
-        // TODO: make offsets #defines for maintainability
-        string pingtimestr = string(buf_+3,8);
-        memcpy(&pkt_num, buf_+12, sizeof(pkt_num));
-        memcpy(&eod, buf_+13, sizeof(eod));
-        memcpy(&firstbyte, buf_+14, sizeof(firstbyte));
-        memcpy(&bytes_in_pkt, buf_+16, sizeof(bytes_in_pkt));
- 
- NIMS_LOG_DEBUG << "pkt num = " << (short)pkt_num << ", firstbyte = " << firstbyte << ", bytes_in_pkt = " << bytes_in_pkt;
-
-        // check for lost packets
-        if ((int)pkt_num > last_pkt + 1)
-        {   
-            //last_pkt = -1;
-            NIMS_LOG_WARNING << "dropped packet, waiting for next ping";
-            break; // start over looking for angle datagram
+        if (n < PKT_DATA || bytes_in_pkt < 0 || bytes_in_pkt > n - PKT_DATA)
+        {
+            NIMS_LOG_WARNING << "ignoring bad packet of " << n << " bytes";
+            data = nullptr;
+            continue;
         }
-        // TODO: could also check for same timestring
-        last_pkt = pkt_num;
-        char* new_buf = (char *)realloc(buf_data, bytes_so_far + bytes_in_pkt);
-        if (new_buf == nullptr)
+        
+        // The packets of a datagram come in order, one after another.
+        if (data != nullptr && pkt_num == last_pkt + 1 && memcmp(pkt+PKT_TYPE, dtype, 2) == 0
+            && memcmp(pkt+PKT_TIME, dtime, PKT_TIME_SIZE) == 0)
         {
-            NIMS_LOG_ERROR << "DataSourceEK60::GetPing() Error allocating memory";
-            return -1;
+            // next packet of this datagram
+        }
+        else if (pkt_num <= 1)
+        {
+            // first packet of a datagram
+            if (data != nullptr)
+                NIMS_LOG_WARNING << "dropped packet, waiting for next ping";
+            data = datagram_buffer(pkt+PKT_TYPE);
+            if (data == nullptr)
+            {
+                // sample data of a channel not being read is expected
+                if (pkt[PKT_TYPE] != 'B' && pkt[PKT_TYPE] != 'W')
+                    NIMS_LOG_WARNING << "ignoring invalid datagram type: " << string(pkt, 2);
+                continue;
+            }
+            memcpy(dtype, pkt+PKT_TYPE, 2);
+            memcpy(dtime, pkt+PKT_TIME, PKT_TIME_SIZE);
+            bytes_so_far = 0;
         }
-        buf_data = new_buf;
-        memcpy(buf_data+bytes_so_far,buf_+18,bytes_in_pkt);
+        else
+        {
+            // the rest of a datagram missing a packet, or not wanted
+            if (data != nullptr)
+                NIMS_LOG_WARNING << "dropped packet, waiting for next ping";
+            data = nullptr;
+            continue;
+        }
+        
+        last_pkt = pkt_num;
+        if (data->size() < bytes_so_far + bytes_in_pkt)
+            data->resize(2*(bytes_so_far + bytes_in_pkt));
+        memcpy(data->data()+bytes_so_far, pkt+PKT_DATA, bytes_in_pkt);
         bytes_so_far += bytes_in_pkt;
-
-    } // while (eod == 0x00) 
-    
-    //NIMS_LOG_DEBUG << "eod: " << eod;
-    if (eod == -128) got_it = true;
-} // while (!got_it)
-//NIMS_LOG_DEBUG << "got datagram: " << pkt_num +1 << " packets, " << bytes_so_far << " total bytes";
-
-return bytes_so_far;
-
+        if (eod == PKT_LAST) return bytes_so_far;
+    }
 } // DataSourceEK60::get_datagram
\ No newline at end of file
@@ -15,8 +15,9 @@
 #include "data_source.h"
 
 #include <string>
+#include <vector>
 #include <netinet/in.h> // struct sockaddr_in
-#include "boost/date_time/posix_time/posix_time.hpp" //no i/o just types
+#include <sys/socket.h> // struct mmsghdr
 /*-----------------------------------------------------------------------------
 Class for Simrad EK60 Echosounder.
 */
@@ -25,6 +26,16 @@ Class for Simrad EK60 Echosounder.
 // header size + power samples + angle samples
 // = 88 + LONG_MAX * sizeof(SHORT) * 2
 const long DATA_BUFFER_SIZE  = 65507; // practical limit for UDP packets
+// packets taken from the socket per system call, at most
+const int PACKET_BATCH = 32;
+
+// A transceiver channel to read.  Transducers differ in angle sensitivity
+// and offset, so each channel has its own.
+struct EK60Channel {
+  int number;               // transceiver channel, 1 to 9
+  float along_sensitivity;
+  float along_offset;
+};
 
 // TODO: Make a pure virtual DataSourceParams class/struct in data_source.h
 struct EK60Params {
@@ -36,6 +47,9 @@ struct EK60Params {
   float along_offset;
   float athwart_offset;
   float ping_rate_hz;
+  // channels to read; if empty, channel 1 with the sensitivity and offset
+  // above
+  std::vector<EK60Channel> channels;
 };
 
 class DataSourceEK60 : public DataSource {
@@ -46,18 +60,42 @@ class DataSourceEK60 : public DataSource {
   int connect();   // connect to data source
   bool is_good() { return (input_ != -1); };  // check if source is in a good state
   bool more_data() { return true; };  // TODO: check for not "end of file" condition
-  int GetPing(Frame* pdata);     // get the next ping from the source
+  // get the next ping of any channel from the source; the frame header
+  // has its channel, and the channels of one ping share its number
+  int GetPing(Frame* pdata);
   //virtual size_t ReadPings(Frame* pdata, const size_t& num_pings) =0; // read consecutive pings
     
 private:
-    size_t get_datagram(std::string dtype_str, std::string& dtime_str, char* &buf_data);
+    // reassembly state of a transceiver channel
+    struct Channel {
+        int number;
+        std::vector<char> angle_data; // last angle datagram ("B<n>")
+        size_t angle_bytes;           // its size, or 0 once used
+        char angle_time[8];           // its ping time
+        std::shared_ptr<const FrameGeometry> geometry;
+    };
+    Channel* channel(const char *dtype);
+    int next_packet(const char* &packet);
+    std::vector<char>* datagram_buffer(const char *dtype);
+    size_t get_datagram(char *dtype, char *dtime);
     
     struct sockaddr_in host_;
-    char buf_[DATA_BUFFER_SIZE];
+    // packets are received a batch at a time into a fixed pool
+    std::vector<char> packet_pool_;  // PACKET_BATCH packets of DATA_BUFFER_SIZE
+    std::vector<struct mmsghdr> msgs_;
+    std::vector<struct iovec> iovecs_;
+    int num_packets_;  // in the last batch
+    int next_packet_;  // index of the next one to parse
+    // datagrams reassembled from packets; they keep the size of the
+    // largest ping so far.  Angles wait for the power datagrams of the
+    // same ping, which come after the angles of every channel, so each
+    // channel has its own; power is used as soon as it arrives.
+    std::vector<Channel> channels_;
+    std::vector<char> power_data_;
+    char ping_time_[8];  // HHMMSShh of the last datagram
+    char clock_time_[8]; // HHMMSShh of ping number pcount_
     // constant part of frame header
     FrameHeader header_;
-    // used to calc utc seconds time of ping
-    boost::posix_time::ptime t_epoch_;
     // scale and offset for converting electrical angles to deg.
     float A_along_, B_along_, A_athwart_, B_athwart_;
     long pcount_;
@@ -14,175 +14,34 @@
 #include <cstring>
 #include <cstdlib>  // malloc, free
 #include <stdint.h> // fixed width integer types
-#include <math.h>   // sqrt, pow
+#include <math.h>   // sqrt
+#include <algorithm> // min
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h> // inet_addr
 #include <unistd.h> // close
+#include <fcntl.h>  // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <cerrno>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "log.h"
+#include "m3_format.h"
 
 using namespace std;
 
-//-----------------------------------------------------------------------------
-// from M3 IMB Beamformed Data Format, document 922-20007002
-//-----------------------------------------------------------------------------
-    
-#define ERROR_MSG_EXIT(err_msg)     \
-{                                   \
-    if (bfData != nullptr) free(bfData); \
-    NIMS_LOG_ERROR << err_msg;          \
-    return -1;                         \
-}                                   \
-
-#define INT32U  uint32_t
-#define INT32S  int32_t
-#define INT16U  uint16_t
-#define INT16S  int16_t
-#define INT8U   uint8_t
-
-#define HDR_SYNC_INT16U_1     (INT16U)0x8000
-#define HDR_SYNC_INT16U_2     (INT16U)0x8000
-#define HDR_SYNC_INT16U_3     (INT16U)0x8000
-#define HDR_SYNC_INT16U_4     (INT16U)0x8000
-
-#define PKT_DATA_TYPE_BEAMFORMED (INT16U)0x1002
-
-#define MAX_NUM_BEAMS           (INT32U)1024
-
-
-typedef struct
-{
-    float   I;
-    float   Q;
-} Ipp32fc_Type;
-
-#define ABS_IQ(x) sqrt(pow(x.I,2)+pow(x.Q,2));
-
-// Time Varying Gain (TVG)
-// see section 9.9.3 Changing the TVG, p. 94 in User's Manual
-// Chu, D. and Hufnagle, Jr., L., "Time varying gain (TVG) measurements
-//    of a multibeam echo sounder for applications to quantitative acoustics.", 2006
-// www.dtic.mil/cgi-bin/GetTRDoc?AD=ADA498689
-// http://www.hydro-international.com/issues/articles/id890-Digital_Sidescan_is_this_the_end_of_TVG_and_AGC.html
-//
-// TL = max(A log10 r + B r + C, L)
-// where TL is transmission loss, r is range
-typedef struct
-{
-    INT16U  A; // the spreading coefficient
-    INT16U  B; // the absorption coefficient in dB/km
-    float   C; // the TVG curve offset in dB
-    float   L; // the maximum gain limit in dB
-} TVG_Params_Type;
-
-typedef struct
-{
-	float fOffsetA;	// rotator offset A in meters
-	float fOffsetB;	// rotator offset B in meters
-	float fOffsetR;	// rotator offset R in degrees
-	float fAngle;	// rotator angle in degrees
-
-}M3_ROTATOR_OFFSETS;
-
-typedef struct
-{
-    INT16U sync_word_1;
-    INT16U sync_word_2;
-    INT16U sync_word_3;
-    INT16U sync_word_4;
-    INT16U data_type;       // always 0x1002
-    INT16U reserved_field;  // NOTE:  this is in spec but not in load_image_data.c
-    INT32U reserved[10];
-    INT32U packet_body_size;
-} Packet_Header_Struct;
-
-typedef struct
-{
-    INT32U packet_body_size; // this should match value in header
-    INT32U reserved[10];
-} Packet_Footer_Struct;
-
-/****************************
- * Data header               *
- ****************************/
-typedef struct
-{
-    INT32U  dwVersion;
-    INT32U  dwSonarID;
-    INT32U  dwSonarInfo[8];
-    INT32U  dwTimeSec;
-    INT32U  dwTimeMillisec;
-    float   fVelocitySound;
-    INT32U  nNumSamples;
-    float   fNearRange;
-    float   fFarRange;
-    float   fSWST;
-    float   fSWL;
-    INT16U  nNumBeams;
-    INT16U  wReserved1;
-    float   fBeamList[MAX_NUM_BEAMS];
-    float   fImageSampleInterval;
-    INT16U  wImageDestination;
-    INT16U  wReserved2;
-    INT32U  dwModeID;
-    INT32S  nNumHybridPRI;
-    INT32S  nHybridIndex;
-    INT16U  nPhaseSeqLength;
-    INT16U  iPhaseSeqIndex;
-    INT16U  nNumImages;
-    INT16U  iSubImageIndex;
-    
-    INT32U  dwSonarFreq;
-    INT32U  dwPulseLength;
-    INT32U  dwPingNumber;
-    
-    float   fRXFilterBW;
-    float   fRXNominalResolution;
-    float   fPulseRepFreq;
-    char    strAppName[128];
-    char    strTXPulseName[64];
-    TVG_Params_Type sTVGParameters;
-    float   fCompassHeading;
-    float   fMagneticVariation;
-    float   fPitch;
-    float   fRoll;
-    float   fDepth;
-    float   fTemperature;
-    
-    float   fXOffset;  // M3_OFFSET
-    float   fYOffset;
-    float   fZOffset;
-    float   fXRotOffset;
-    float   fYRotOffset;
-    float   fZRotOffset;
-	INT32U dwMounting;
-    
-    double  dbLatitude;
-    double  dbLongitude;
-    float   fTXWST;
-    
-	unsigned char bHeadSensorsVersion;
-	unsigned char bHeadHWStatus;
-    INT8U   byReserved1;
-    INT8U   byReserved2;
-    
-    float fInternalSensorHeading;
-	float fInternalSensorPitch;
-	float fInternalSensorRoll;
-	M3_ROTATOR_OFFSETS aAxesRotatorOffsets[3];
-
-    INT16U nStartElement;
-    INT16U nEndElement;
-    char   strCustomText1[32];
-    char   strCustomText2[32];
-    float  fLocalTimeOffset;
-    
-    unsigned char  reserved[3876];
-    
-    
- } Data_Header_Struct;
+// larger than any real ping; a bigger size means a corrupt data header
+const size_t kMaxBeamformedBytes = 256*1024*1024;
+// start of every packet
+const INT16U kSync[4] = { HDR_SYNC_INT16U_1, HDR_SYNC_INT16U_2,
+                          HDR_SYNC_INT16U_3, HDR_SYNC_INT16U_4 };
+// a recording that stops for longer than this (ms) picks up right away
+const double kMaxReplayGapMs = 10000.0;
 
 // forward declaration; implementation is at the end of this file, out of the way.
 std::ostream& operator<<(std::ostream& strm, const Data_Header_Struct& hdr);
@@ -191,7 +50,7 @@ std::ostream& operator<<(std::ostream& strm, const Data_Header_Struct& hdr);
 // DataSourceM3::DataSourceM3
 // open a connection to the M3 host program
 // expecting a host address in xxx.xxx.xxx.xxx form
-DataSourceM3::DataSourceM3(std::string const &host_addr)
+DataSourceM3::DataSourceM3(std::string const &host_addr) : buffered_(0)
 {
     
     m3_host_.sin_family = AF_INET;
@@ -221,112 +80,141 @@ int DataSourceM3::connect()
         input_ = -1;
         return -1;
     }
+    buffered_ = 0;
     return 0;
 
 } // DataSourceM3::connect
 
 
 //-----------------------------------------------------------------------------
-// DataSourceM3::GetPing
-// get the next ping from the source
-int DataSourceM3::GetPing(Frame* pframe)
+// DataSourceM3::Fill
+// receive until the buffer holds at least num_bytes
+int DataSourceM3::Fill(size_t num_bytes)
 {
-    if ( input_ == -1 ) {
-        NIMS_LOG_ERROR << ("DataSourceM3::GetPing() Not connected to source.");
+    // grows only for a bigger ping than any before
+    if (buffer_.size() < num_bytes) buffer_.resize(num_bytes);
+    while (buffered_ < num_bytes)
+    {
+        ssize_t bytes_read = recv(input_, buffer_.data() + buffered_,
+                                  num_bytes - buffered_, 0);
+        if (bytes_read > 0)
+        {
+            buffered_ += bytes_read;
+            continue;
+        }
+        if (bytes_read == 0)
+            NIMS_LOG_ERROR << "DataSourceM3: the M3 host closed the connection.";
+        else
+            nims_perror("DataSourceM3 recv()");
         return -1;
     }
-    
-    // Initialize variables
-    Packet_Header_Struct packet_header;
-    Data_Header_Struct   header;
-    Packet_Footer_Struct packet_footer;
+    return 0;
+} // DataSourceM3::Fill
 
-    //memset(&packet_header, 0, sizeof(Packet_Header_Struct));
-    //memset(&header,        0, sizeof(Data_Header_Struct));
-    //memset(&packet_footer, 0, sizeof(Packet_Footer_Struct));
+//-----------------------------------------------------------------------------
+// DataSourceM3::Discard
+// drop bytes from the front of the buffer
+void DataSourceM3::Discard(size_t num_bytes)
+{
+    buffered_ -= num_bytes;
+    // after a whole packet the buffer is usually empty, so nothing moves
+    if (buffered_ > 0)
+        memmove(buffer_.data(), buffer_.data() + num_bytes, buffered_);
+} // DataSourceM3::Discard
 
-    INT32U num_bytes_bf_data = 0;
-    Ipp32fc_Type* bfData = nullptr;
-    
-    ssize_t bytes_read = 0;
-    
-    /*
-    NIMS_LOG_DEBUG << __func__;
-    NIMS_LOG_DEBUG << "packet header size is " << sizeof(Packet_Header_Struct);
-    NIMS_LOG_DEBUG << "data header size is " << sizeof(Data_Header_Struct);
-    NIMS_LOG_DEBUG << "packet footer size is " << sizeof(Packet_Footer_Struct);
-    */
-    // Read the packet header.
-     bytes_read = recv(input_, (char *)&packet_header, sizeof(packet_header),MSG_WAITALL);
-     if ( bytes_read != sizeof(packet_header) ) {
-         nims_perror("incorrect number of bytes from recv()");
-         NIMS_LOG_ERROR << "bytes_read =  " << bytes_read;
-         ERROR_MSG_EXIT("Error reading header.");
-     }
-     
-     NIMS_LOG_DEBUG << "bytes_read =  " << bytes_read;
-
-    // Check header sync words.
-    if ( (packet_header.sync_word_1 != HDR_SYNC_INT16U_1) ||
-         (packet_header.sync_word_2 != HDR_SYNC_INT16U_2) ||
-         (packet_header.sync_word_3 != HDR_SYNC_INT16U_3) ||
-         (packet_header.sync_word_4 != HDR_SYNC_INT16U_4) )
-        ERROR_MSG_EXIT("Error reading sync words.");
-        
-    // Check packet type.
-    if ( packet_header.data_type != PKT_DATA_TYPE_BEAMFORMED )
-        ERROR_MSG_EXIT("Error wrong packet type.");
-
-   // NIMS_LOG_DEBUG << "packet header body size is " << ntohl(packet_header.packet_body_size);
-    
-    // Read data header.
-    bytes_read = recv(input_, (char *)&header, sizeof(header),MSG_WAITALL);
-    if ( bytes_read != sizeof(header) ) {
-        nims_perror("incorrect number of bytes from recv()");
-        NIMS_LOG_ERROR << "bytes_read =  " << bytes_read;
-        ERROR_MSG_EXIT("Error reading data header.");
-    }
+//-----------------------------------------------------------------------------
+// DataSourceM3::NextPacket
 /*
-    NIMS_LOG_DEBUG << "bytes_read =  " << bytes_read;
-    NIMS_LOG_DEBUG << "num samples is " << header.nNumSamples;
-    NIMS_LOG_DEBUG << "num beams is " << header.nNumBeams;
-    NIMS_LOG_DEBUG << "header:" << endl << header;
+ Receive the next beamformed packet to the front of the buffer, and return
+ its size.  The packet header, data header and footer are checked against
+ each other, the body size in the header before the body is waited for;
+ if any of them is wrong, the packet is dropped and the stream is scanned
+ for the next sync sequence, so a corrupt or truncated packet costs one
+ ping.  Bytes received past the bad packet stay in the buffer
+ and are scanned first.  Returns 0 if the connection fails.
 */
-    num_bytes_bf_data = sizeof(Ipp32fc_Type)*(header.nNumSamples)*(header.nNumBeams);
-    //NIMS_LOG_DEBUG << "num_bytes_bf_data = " << num_bytes_bf_data;
-
-    bfData = (Ipp32fc_Type*)malloc(num_bytes_bf_data);
-    if ( bfData == nullptr )
-        ERROR_MSG_EXIT("Error allocating memory for data.");
-        
-    //NIMS_LOG_DEBUG << "reading data...";
-    bytes_read = recv(input_, (char *)bfData, num_bytes_bf_data, MSG_WAITALL);
-    if ( bytes_read != num_bytes_bf_data ) {
-        nims_perror("incorrect number of bytes from recv()");
-        NIMS_LOG_ERROR << "bytes_read =  " << bytes_read;
-        ERROR_MSG_EXIT("Error reading data.");
-    }
-    //NIMS_LOG_DEBUG << "bytes_read =  " << bytes_read;
-
-    // Read packet footer.
-    bytes_read = recv(input_, (char *)&packet_footer, sizeof(packet_footer), MSG_WAITALL);
-    if ( bytes_read != sizeof(packet_footer) ) {
-        nims_perror("incorrect number of bytes from recv()");
-        NIMS_LOG_ERROR << "bytes_read =  " << bytes_read;
-        ERROR_MSG_EXIT("Error reading footer.");
+size_t DataSourceM3::NextPacket()
+{
+    const size_t kHeaderBytes = sizeof(Packet_Header_Struct) + sizeof(Data_Header_Struct);
+    size_t skipped = 0;
+    while (true)
+    {
+        if ( -1 == Fill(sizeof(Packet_Header_Struct)) ) return 0;
+
+        // scan for the sync words, keeping a partial match at the end
+        const char *sync = (const char *)memmem(buffer_.data(), buffered_, kSync, sizeof(kSync));
+        size_t offset = sync ? sync - buffer_.data() : buffered_ - sizeof(kSync) + 1;
+        if (offset > 0)
+        {
+            Discard(offset);
+            skipped += offset;
+            continue;
+        }
+        if (skipped > 0)
+        {
+            NIMS_LOG_WARNING << "DataSourceM3: skipped " << skipped
+                             << " bytes to the next packet";
+            skipped = 0;
+        }
+
+        const Packet_Header_Struct *packet_header = (const Packet_Header_Struct *)buffer_.data();
+        if ( packet_header->data_type != PKT_DATA_TYPE_BEAMFORMED )
+        {
+            NIMS_LOG_WARNING << "DataSourceM3: skipping packet of type 0x" << hex
+                             << packet_header->data_type << dec;
+            Discard(sizeof(kSync));
+            continue;
+        }
+
+        if ( -1 == Fill(kHeaderBytes) ) return 0;
+        packet_header = (const Packet_Header_Struct *)buffer_.data();
+        const Data_Header_Struct *header = 
+            (const Data_Header_Struct *)(buffer_.data() + sizeof(Packet_Header_Struct));
+        const size_t num_bytes_bf_data = 
+            sizeof(Ipp32fc_Type)*(size_t)(header->nNumSamples)*(header->nNumBeams);
+        // A corrupt sample count would have us wait for up to 
+        // kMaxBeamformedBytes of the stream, pings and all, before the 
+        // footer gave it away; the body size in the header catches it now.
+        if ( header->nNumBeams > MAX_NUM_BEAMS || num_bytes_bf_data > kMaxBeamformedBytes
+             || packet_header->packet_body_size != sizeof(Data_Header_Struct) + num_bytes_bf_data )
+        {
+            NIMS_LOG_WARNING << "DataSourceM3: bad data header, " << header->nNumBeams
+                             << " beams of " << header->nNumSamples << " samples in "
+                             << packet_header->packet_body_size << " bytes";
+            Discard(sizeof(kSync));
+            continue;
+        }
+
+        const size_t packet_size = kHeaderBytes + num_bytes_bf_data + sizeof(Packet_Footer_Struct);
+        if ( -1 == Fill(packet_size) ) return 0;
+        packet_header = (const Packet_Header_Struct *)buffer_.data();
+        const Packet_Footer_Struct *packet_footer = (const Packet_Footer_Struct *)
+            (buffer_.data() + packet_size - sizeof(Packet_Footer_Struct));
+        if ( packet_header->packet_body_size != packet_footer->packet_body_size )
+        {
+            NIMS_LOG_WARNING << "DataSourceM3: header and footer body size do not match, "
+                             << "dropping the packet";
+            Discard(sizeof(kSync));
+            continue;
+        }
+        return packet_size;
     }
+} // DataSourceM3::NextPacket
+
+//-----------------------------------------------------------------------------
+// PacketToFrame
+// Fill in a frame from a checked beamformed packet, and its beams' geometry
+// for SetGeometry.  Returns -1 if the frame data cannot be allocated.
+static int PacketToFrame(const char *packet, Frame* pframe, FrameGeometry *geometry)
+{
+    const Data_Header_Struct &header = 
+        *(const Data_Header_Struct *)(packet + sizeof(Packet_Header_Struct));
+    const Ipp32fc_Type *bfData = (const Ipp32fc_Type *)
+        (packet + sizeof(Packet_Header_Struct) + sizeof(Data_Header_Struct));
     
-    //NIMS_LOG_DEBUG << "bytes_read =  " << bytes_read;
-    //NIMS_LOG_DEBUG << "packet footer body size is " << packet_footer.packet_body_size;
-    
-    // Check packet size.
-    if ( packet_header.packet_body_size != packet_footer.packet_body_size )
-        ERROR_MSG_EXIT("Error header and footer body size do not match.");
-        
-    // Okay, good to go.
-    
-    //NIMS_LOG_DEBUG << "    extracting header";
-    
+    // a reused frame (e.g. from a FrameQueue) still has the last ping's
+    // header, which the ingester's stages may have changed
+    pframe->header = FrameHeader();
     strncpy(pframe->header.device, "Kongsberg M3 Multibeam sonar", 
             sizeof(pframe->header.device));
     pframe->header.version = header.dwVersion;
@@ -340,21 +228,26 @@ int DataSourceM3::GetPing(Frame* pframe)
     pframe->header.winstart_sec = header.fSWST;
     pframe->header.winlen_sec = header.fSWL;
     pframe->header.num_beams = header.nNumBeams;
-    for (int m=0; m<header.nNumBeams; ++m)
-    {
-        if (kMaxBeams == m) break; // max in frame_buffer.h
-        pframe->header.beam_angles_deg[m] = header.fBeamList[m];
-    }
+    geometry->num_beams = std::min((int)header.nNumBeams, kMaxBeams); // max in frame_buffer.h
+    for (int m=0; m<geometry->num_beams; ++m)
+        geometry->beam_angles_deg[m] = header.fBeamList[m];
     pframe->header.freq_hz = header.dwSonarFreq;
     pframe->header.pulselen_microsec = header.dwPulseLength;
     pframe->header.pulserep_hz = header.fPulseRepFreq;
+    // the limit L caps the gain
+    pframe->tvg.spreading = header.sTVGParameters.A;
+    pframe->tvg.absorption_db_km = header.sTVGParameters.B;
+    pframe->tvg.offset_db = header.sTVGParameters.C;
+    pframe->tvg.limit_db = header.sTVGParameters.L;
    
-    //NIMS_LOG_DEBUG << "    extracting data";
     // copy data to frame as real intensity value
     size_t frame_data_size = sizeof(framedata_t)*(header.nNumSamples)*(header.nNumBeams);
     pframe->malloc_data(frame_data_size);
     if ( pframe->size() != frame_data_size )
-        ERROR_MSG_EXIT("Error allocating memory for frame data.");
+    {
+        NIMS_LOG_ERROR << "Error allocating memory for frame data.";
+        return -1;
+    }
     /*
     NOTE: The data is stored as
 
@@ -378,19 +271,296 @@ int DataSourceM3::GetPing(Frame* pframe)
     .
     (M-1)0 (M-1)1 ... (M-1)(N-1)
     */
-    framedata_t* fdp = pframe->data_ptr();
-    for (int n = 0; n < header.nNumBeams; ++n) // beam
+    IQMagnitudeTranspose((const float *)bfData, header.nNumBeams, header.nNumSamples,
+                         pframe->data_ptr());
+    return 0;
+} // PacketToFrame
+
+//-----------------------------------------------------------------------------
+// DataSourceM3::GetPing
+// get the next ping from the source
+int DataSourceM3::GetPing(Frame* pframe)
+{
+    if ( input_ == -1 ) {
+        NIMS_LOG_ERROR << ("DataSourceM3::GetPing() Not connected to source.");
+        return -1;
+    }
+    
+    // The packet is parsed where it was received, without copying.
+    size_t packet_size = NextPacket();
+    if ( packet_size == 0 ) return -1;
+    FrameGeometry geometry;
+    int ret = PacketToFrame(buffer_.data(), pframe, &geometry);
+    if ( ret == 0 ) SetGeometry(pframe, geometry);
+    Discard(packet_size);
+    return ret;
+} // DataSourceM3::GetPing
+
+//-----------------------------------------------------------------------------
+// PacketSize
+// Size of the beamformed packet at packet, of which available bytes are
+// there, or 0 if it is not a whole beamformed packet whose headers and
+// footer agree.
+static size_t PacketSize(const char *packet, size_t available)
+{
+    const size_t kHeaderBytes = sizeof(Packet_Header_Struct) + sizeof(Data_Header_Struct);
+    if ( available < kHeaderBytes || memcmp(packet, kSync, sizeof(kSync)) != 0 ) return 0;
+    const Packet_Header_Struct *packet_header = (const Packet_Header_Struct *)packet;
+    const Data_Header_Struct *header = (const Data_Header_Struct *)(packet_header + 1);
+    const size_t num_bytes_bf_data = 
+        sizeof(Ipp32fc_Type)*(size_t)(header->nNumSamples)*(header->nNumBeams);
+    if ( packet_header->data_type != PKT_DATA_TYPE_BEAMFORMED
+         || header->nNumBeams > MAX_NUM_BEAMS || num_bytes_bf_data > kMaxBeamformedBytes
+         || packet_header->packet_body_size != sizeof(Data_Header_Struct) + num_bytes_bf_data )
+        return 0;
+    const size_t packet_size = kHeaderBytes + num_bytes_bf_data + sizeof(Packet_Footer_Struct);
+    if ( packet_size > available ) return 0;
+    const Packet_Footer_Struct *packet_footer = (const Packet_Footer_Struct *)
+        (packet + packet_size - sizeof(Packet_Footer_Struct));
+    if ( packet_header->packet_body_size != packet_footer->packet_body_size ) return 0;
+    return packet_size;
+} // PacketSize
+
+//-----------------------------------------------------------------------------
+// DataSourceM3File::DataSourceM3File
+DataSourceM3File::DataSourceM3File(std::string const &path, double rate)
+    : path_(path), rate_(rate), data_(nullptr), size_(0), next_(0), start_ms_(0.0),
+      last_ms_(0.0)
+{
+    start_.tv_sec = start_.tv_nsec = 0;
+} // DataSourceM3File::DataSourceM3File
+
+DataSourceM3File::~DataSourceM3File()
+{
+    if (data_ != nullptr) munmap((void *)data_, size_);
+}
+
+//-----------------------------------------------------------------------------
+// DataSourceM3File::connect
+/*
+ Map the recording and index its pings.  Bytes that are not a good packet,
+ such as a ping cut off when the recording stopped, are skipped to the next
+ sync sequence, as DataSourceM3 does with the live stream.
+*/
+int DataSourceM3File::connect()
+{
+    if (data_ != nullptr) munmap((void *)data_, size_);
+    data_ = nullptr;
+    index_.clear();
+    next_ = 0;
+
+    int fd = open(path_.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        nims_perror(("DataSourceM3File open " + path_).c_str());
+        return -1;
+    }
+    struct stat sb;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &sb) == 0 && sb.st_size > 0)
+        data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (data == MAP_FAILED)
+    {
+        NIMS_LOG_ERROR << "DataSourceM3File: cannot map " << path_;
+        return -1;
+    }
+    data_ = (const char *)data;
+    size_ = sb.st_size;
+    // read ahead of GetPing, and drop the pages it is done with sooner
+    madvise(data, size_, MADV_SEQUENTIAL);
+
+    size_t pos = 0, skipped = 0;
+    while (pos < size_)
     {
-        for (int m = 0; m < header.nNumSamples; ++m) // sample
+        const size_t packet_size = PacketSize(data_ + pos, size_ - pos);
+        if (packet_size > 0)
         {
-            fdp[m*(header.nNumBeams) + n] = ABS_IQ( bfData[n*(header.nNumSamples) + m] );
-            
+            index_.push_back(pos);
+            pos += packet_size;
+            continue;
         }
+        const char *sync = (const char *)memmem(data_ + pos + 1, size_ - pos - 1,
+                                                kSync, sizeof(kSync));
+        const size_t next = sync ? sync - data_ : size_;
+        skipped += next - pos;
+        pos = next;
     }
-    
-	free(bfData);
+    if (skipped > 0)
+        NIMS_LOG_WARNING << "DataSourceM3File: skipped " << skipped << " bytes of " << path_
+                         << " that are not beamformed pings";
+    NIMS_LOG_DEBUG << "DataSourceM3File: " << index_.size() << " pings in " << path_;
     return 0;
-} // DataSourceM3::GetPing
+} // DataSourceM3File::connect
+
+//-----------------------------------------------------------------------------
+// DataSourceM3File::Pace
+// Wait until the ping recorded at ping_ms is due.  Returns -1 if a signal
+// interrupted the wait.
+int DataSourceM3File::Pace(double ping_ms)
+{
+    // the replay clock starts with the first ping, and again where the 
+    // recording goes back in time or stops for a while
+    if (next_ == 0 || ping_ms < last_ms_ || ping_ms - last_ms_ > kMaxReplayGapMs)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start_);
+        start_ms_ = ping_ms;
+    }
+    last_ms_ = ping_ms;
+
+    const long long ns = start_.tv_nsec + (long long)((ping_ms - start_ms_)/rate_*1e6);
+    struct timespec due = { start_.tv_sec + (time_t)(ns/1000000000), (long)(ns%1000000000) };
+    int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, nullptr);
+    return (err == 0) ? 0 : -1;
+} // DataSourceM3File::Pace
+
+//-----------------------------------------------------------------------------
+// DataSourceM3File::GetPing
+// get the next ping from the file
+int DataSourceM3File::GetPing(Frame* pframe)
+{
+    if ( data_ == nullptr ) {
+        NIMS_LOG_ERROR << "DataSourceM3File::GetPing() File not mapped.";
+        return -1;
+    }
+    if ( !more_data() ) {
+        NIMS_LOG_DEBUG << "DataSourceM3File: end of " << path_;
+        return -1;
+    }
+
+    const char *packet = data_ + index_[next_];
+    const Data_Header_Struct &header = 
+        *(const Data_Header_Struct *)(packet + sizeof(Packet_Header_Struct));
+    if ( rate_ > 0 && -1 == Pace(1000.0*header.dwTimeSec + header.dwTimeMillisec) )
+        return -1;
+    ++next_;
+
+    FrameGeometry geometry;
+    int ret = PacketToFrame(packet, pframe, &geometry);
+    if ( ret == 0 ) SetGeometry(pframe, geometry);
+    return ret;
+} // DataSourceM3File::GetPing
+
+//-----------------------------------------------------------------------------
+// IQMagnitudeTranspose
+/*
+ The transpose is done a block of kBlockBeams beams at a time, so each
+ sample's magnitudes go out as a whole cache line while the block's input
+ rows stream in.  Within a block, tiles of kTileBeams x kTileSamples are
+ squared, summed and square rooted in registers and transposed there.
+ The SSE path is always there on x86-64; building with -mavx (or
+ -march=native) gets the 8 x 8 AVX tiles.  Edges of the ping are done
+ one sample at a time, in double precision like the original conversion;
+ the vector tiles are single precision, within an ulp or so of it.
+*/
+namespace {
+
+const int kBlockBeams = 16; // 64 bytes of each output row
+
+// the scalar conversion, for the samples from m0 on of beams [n0, n1)
+void MagnitudeTransposeScalar(const float *iq, int num_beams, int num_samples,
+                              int n0, int n1, int m0, framedata_t *out)
+{
+    for (int m = m0; m < num_samples; ++m)
+    {
+        for (int n = n0; n < n1; ++n)
+        {
+            const float *x = iq + 2*((size_t)n*num_samples + m);
+            out[(size_t)m*num_beams + n] = sqrt((double)x[0]*x[0] + (double)x[1]*x[1]);
+        }
+    }
+}
+
+#if defined(__AVX__)
+#define NIMS_M3_TILES
+const int kTileBeams = 8;
+const int kTileSamples = 8;
+
+void MagnitudeTransposeTile(const float *iq, int num_beams, int num_samples,
+                            int n, int m, framedata_t *out)
+{
+    __m256 r[8];
+    for (int k = 0; k < 8; ++k)
+    {
+        const float *x = iq + 2*((size_t)(n + k)*num_samples + m);
+        __m256 a = _mm256_loadu_ps(x);      // I0 Q0 I1 Q1 I2 Q2 I3 Q3
+        __m256 b = _mm256_loadu_ps(x + 8);  // I4 Q4 ...
+        // in-lane shuffles leave the samples in the order 0 1 4 5 2 3 6 7
+        __m256 i = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+        __m256 q = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+        r[k] = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(i, i), _mm256_mul_ps(q, q)));
+    }
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]);
+    __m256 t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]);
+    __m256 t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]);
+    __m256 t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]);
+    __m256 t7 = _mm256_unpackhi_ps(r[6], r[7]);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+    // column c of the tile is sample m + order[c]
+    const __m256 c[8] = {
+        _mm256_permute2f128_ps(s0, s4, 0x20), _mm256_permute2f128_ps(s1, s5, 0x20),
+        _mm256_permute2f128_ps(s2, s6, 0x20), _mm256_permute2f128_ps(s3, s7, 0x20),
+        _mm256_permute2f128_ps(s0, s4, 0x31), _mm256_permute2f128_ps(s1, s5, 0x31),
+        _mm256_permute2f128_ps(s2, s6, 0x31), _mm256_permute2f128_ps(s3, s7, 0x31) };
+    const int order[8] = { 0, 1, 4, 5, 2, 3, 6, 7 };
+    for (int k = 0; k < 8; ++k)
+        _mm256_storeu_ps(out + (size_t)(m + order[k])*num_beams + n, c[k]);
+}
+
+#elif defined(__SSE2__)
+#define NIMS_M3_TILES
+const int kTileBeams = 4;
+const int kTileSamples = 4;
+
+void MagnitudeTransposeTile(const float *iq, int num_beams, int num_samples,
+                            int n, int m, framedata_t *out)
+{
+    __m128 r[4];
+    for (int k = 0; k < 4; ++k)
+    {
+        const float *x = iq + 2*((size_t)(n + k)*num_samples + m);
+        __m128 a = _mm_loadu_ps(x);      // I0 Q0 I1 Q1
+        __m128 b = _mm_loadu_ps(x + 4);  // I2 Q2 I3 Q3
+        __m128 i = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2,0,2,0));
+        __m128 q = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3,1,3,1));
+        r[k] = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(i, i), _mm_mul_ps(q, q)));
+    }
+    _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+    for (int k = 0; k < 4; ++k)
+        _mm_storeu_ps(out + (size_t)(m + k)*num_beams + n, r[k]);
+}
+#endif
+
+} // namespace
+
+void IQMagnitudeTranspose(const float *iq, int num_beams, int num_samples,
+                          framedata_t *out)
+{
+    for (int n0 = 0; n0 < num_beams; n0 += kBlockBeams)
+    {
+        const int n1 = std::min(n0 + kBlockBeams, num_beams);
+        int m = 0;
+#ifdef NIMS_M3_TILES
+        if (n1 - n0 == kBlockBeams)
+        {
+            for (; m + kTileSamples <= num_samples; m += kTileSamples)
+                for (int n = n0; n < n1; n += kTileBeams)
+                    MagnitudeTransposeTile(iq, num_beams, num_samples, n, m, out);
+        }
+#endif
+        MagnitudeTransposeScalar(iq, num_beams, num_samples, n0, n1, m, out);
+    }
+} // IQMagnitudeTranspose
 
 /*
 //-----------------------------------------------------------------------------
@@ -15,6 +15,8 @@
 #include "data_source.h"
 
 #include <string>
+#include <vector>
+#include <ctime>        // struct timespec
 #include <netinet/in.h> // struct sockaddr_in
 
 /*-----------------------------------------------------------------------------
@@ -33,9 +35,56 @@ public:
     //size_t ReadPings(Frame* pdata, const size_t& num_pings); // read consecutive pings
     
 private:
+    int Fill(size_t num_bytes);     // receive until the buffer has num_bytes
+    void Discard(size_t num_bytes); // drop bytes from the front of the buffer
+    size_t NextPacket();            // size of the packet now at the front
+    
     struct sockaddr_in m3_host_;
+    std::vector<char> buffer_;      // received bytes; a packet starts at the front
+    size_t buffered_;               // number of bytes in buffer_
     
 }; // DataSourceM3
 
+/*-----------------------------------------------------------------------------
+Recorded M3 pings, as m3sim records them (.imb files).  The recording is
+memory mapped and each ping converted straight from the mapping.  Pings go
+out at the recorded ping times scaled by a rate, or as fast as they are
+taken with a rate of 0.
+*/
+
+class DataSourceM3File : public DataSource {
+public:
+    // rate 2 replays twice as fast as recorded; 0 for no pacing
+    DataSourceM3File(std::string const &path, double rate);
+    ~DataSourceM3File();
+    
+    int connect();   // map the file and index its pings
+    bool is_good()   { return (data_ != nullptr); };
+    bool more_data() { return (next_ < index_.size()); };
+    int GetPing(Frame* pdata);  // get the next ping from the file
+    
+    size_t num_pings() const { return index_.size(); };
+    
+private:
+    int Pace(double ping_ms);  // wait for the replay time of a ping
+    
+    std::string path_;
+    double rate_;
+    const char *data_;          // the mapped file
+    size_t size_;
+    std::vector<size_t> index_; // offset of each good ping
+    size_t next_;               // index of the next ping to get
+    struct timespec start_;     // when the ping at start_ms_ went out
+    double start_ms_;           // recorded time of that ping
+    double last_ms_;            // recorded time of the last ping
+    
+}; // DataSourceM3File
+
+// Magnitudes of the beamformed samples, interleaved I,Q pairs in beam major
+// order as the M3 sends them, transposed to the frame's sample major order:
+// out[m*num_beams + n] = |iq[n*num_samples + m]|.
+void IQMagnitudeTranspose(const float *iq, int num_beams, int num_samples,
+                          framedata_t *out);
+
 
 #endif // __NIMS_DATA_SOURCE_M3_H__
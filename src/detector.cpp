@@ -71,7 +71,8 @@ template<typename T> void write_mat_to_file(InputArray _mat, fs::path outfilepat
 
 
 // Generate the mapping from beam-range to x-y for display
-int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray _map_y)
+int PingImagePolarToCart(const FrameHeader &hdr, const FrameGeometry &geom, 
+                         OutputArray _map_x, OutputArray _map_y)
 {
     // range bin resolution in meters per pixel
     float rng_step = (hdr.range_max_m - hdr.range_min_m)/(hdr.num_samples - 1);
@@ -79,13 +80,13 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
     float y1 = hdr.range_min_m; // y coordinate of first row of image pixels
     float y2 = hdr.range_max_m; // y coordinate of first row of image pixels
     
-    //float beam_step = hdr.beam_angles_deg[1] - hdr.beam_angles_deg[0];
-    double theta1 = (double)hdr.beam_angles_deg[0] * M_PI/180.0;
-    double theta2 = (double)hdr.beam_angles_deg[hdr.num_beams-1] * M_PI/180.0;
+    //float beam_step = geom.beam_angles_deg[1] - geom.beam_angles_deg[0];
+    double theta1 = (double)geom.beam_angles_deg[0] * M_PI/180.0;
+    double theta2 = (double)geom.beam_angles_deg[geom.num_beams-1] * M_PI/180.0;
     float x1 = hdr.range_max_m*sin(theta1);
     float x2 = hdr.range_max_m*sin(theta2);
-    NIMS_LOG_DEBUG << "PingImagePolarToCart: beam angles from " << hdr.beam_angles_deg[0]
-    << " to " << hdr.beam_angles_deg[hdr.num_beams-1];
+    NIMS_LOG_DEBUG << "PingImagePolarToCart: beam angles from " << geom.beam_angles_deg[0]
+    << " to " << geom.beam_angles_deg[geom.num_beams-1];
     //NIMS_LOG_DEBUG << "PingImagePolarToCart: beam angle step is " << beam_step;
     NIMS_LOG_DEBUG << "PingImagePolarToCart: x1 = " << x1 << ", x2 = " << x2;
     
@@ -103,8 +104,8 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
     map_x = Mat::zeros(nrows, ncols, CV_32FC1);
     map_y = Mat::zeros(nrows, ncols, CV_32FC1);
 
-    vector<float> beam_angles_deg(hdr.beam_angles_deg,
-        hdr.beam_angles_deg + hdr.num_beams );
+    vector<float> beam_angles_deg(geom.beam_angles_deg,
+        geom.beam_angles_deg + geom.num_beams );
     vector<float>::iterator low,up;
     float x,y, rng,beam_deg,i_rng,i_beam;
     // each row is a range
@@ -122,7 +123,7 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
             //cout << endl << "rng = " << rng << ", beam_deg = " << beam_deg << endl;
             // convert beam-range to indices
            if (rng >= hdr.range_min_m && rng <= hdr.range_max_m 
-            && beam_deg >= hdr.beam_angles_deg[0] && beam_deg <= hdr.beam_angles_deg[hdr.num_beams-1])
+            && beam_deg >= geom.beam_angles_deg[0] && beam_deg <= geom.beam_angles_deg[geom.num_beams-1])
            {
                i_rng = (rng - hdr.range_min_m) / rng_step;
                up = upper_bound(beam_angles_deg.begin(), beam_angles_deg.end(), beam_deg);
@@ -130,7 +131,7 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
                 if (up != beam_angles_deg.end() ) 
                     i_beam = up - beam_angles_deg.begin() - (*up - beam_deg)/(*up - *(up -1));
                 else
-                    i_beam = hdr.num_beams-1;
+                    i_beam = geom.num_beams-1;
 
                 map_x(m,n) = i_beam;
                 map_y(m,n) = i_rng;
@@ -144,36 +145,73 @@ struct Background
     int N; // number of frames for moving window
     int total_samples; // number of elements in frame data
     vector<float> beam_angles_deg;
+    uint32_t geometry_id; // generation of the geometry beam_angles_deg is from
     vector<float> range_bins_m;
     int cv_type;       // openCV code for frame data type
     int oldest_frame; // index of oldest frame in moving window
     Mat pings; // moving window
     Mat ping_mean;
     Mat ping_stdv;
+    Mat ping_data; // ping samples widened from a 16-bit encoding
 };
 
+// The samples of a ping as a 1 x total_samples Mat.  Float frames are used 
+// in place; others are widened into bg.ping_data.
+Mat ping_samples(Background& bg, const FrameView& ping)
+{
+    if (ping.header().encoding == kSampleFloat32)
+        return Mat(1,bg.total_samples,bg.cv_type,(void *)ping.data_ptr());
+    bg.ping_data.create(1, bg.total_samples, bg.cv_type);
+    DecodeSamples(ping.header(), ping.data_ptr(), 0, bg.total_samples, 
+                  bg.ping_data.ptr<framedata_t>());
+    return bg.ping_data;
+}
+
+// Take the beam angles from a new geometry.
+void update_geometry(Background& bg, const FrameGeometry& geom)
+{
+    bg.beam_angles_deg = vector<float>(geom.beam_angles_deg, 
+                           geom.beam_angles_deg+geom.num_beams);
+    bg.geometry_id = geom.generation;
+    NIMS_LOG_DEBUG << "geometry " << geom.generation << ": beam angles from " 
+                   << bg.beam_angles_deg[0] << " to " << bg.beam_angles_deg.back();
+    
+} // update_geometry
+
 int initialize_background(Background& bg, float bg_secs, FrameBufferReader& fb)
 {
     // Initialize the moving window.
-        Frame ping;
+        FrameView ping;
+    // Start with the pings already in the buffer, if there are enough, 
+    // instead of waiting bg_secs for new ones.
+    const long latest = fb.latest_frame();
+    if (latest > 0 && fb.GetFrameAt(latest, &ping) == latest)
+    {
+        long first = fb.SeekFrame(latest - (long)(ping.header().pulserep_hz * bg_secs));
+        NIMS_LOG_DEBUG << "replaying buffered frames from " << first << " to " << latest;
+    }
     if ( fb.GetNextFrame(&ping)==-1 )
         {
             NIMS_LOG_ERROR << "Error getting ping for initial moving average.";
             return -1;
         }
     NIMS_LOG_DEBUG << "got initial frame";
+    const FrameHeader &hdr = ping.header(); // only until next GetNextFrame
+    if (ping.geometry() == nullptr)
+    {
+        NIMS_LOG_ERROR << "Initial ping has no beam geometry.";
+        return -1;
+    }
     // NOTE:  data is stored transposed
-    bg.total_samples = ping.header.num_beams*ping.header.num_samples;
-    bg.beam_angles_deg = vector<float>(ping.header.beam_angles_deg, 
-                           ping.header.beam_angles_deg+ping.header.num_beams);
-    NIMS_LOG_DEBUG << "beam angles from " << bg.beam_angles_deg[0] << " to " << bg.beam_angles_deg.back();
-
-    float range_bin_size = (ping.header.range_max_m - ping.header.range_min_m)/(ping.header.num_samples-1);
-    for (int k=0; k<ping.header.num_samples; ++k)
-        bg.range_bins_m.push_back(ping.header.range_min_m + k*range_bin_size);
+    bg.total_samples = hdr.num_beams*hdr.num_samples;
+    update_geometry(bg, *ping.geometry());
+
+    float range_bin_size = (hdr.range_max_m - hdr.range_min_m)/(hdr.num_samples-1);
+    for (int k=0; k<hdr.num_samples; ++k)
+        bg.range_bins_m.push_back(hdr.range_min_m + k*range_bin_size);
     
     NIMS_LOG_DEBUG << "range bins from " << bg.range_bins_m[0] << " to " << bg.range_bins_m.back();
-    bg.N = (int)(ping.header.pulserep_hz * bg_secs);
+    bg.N = (int)(hdr.pulserep_hz * bg_secs);
     NIMS_LOG_DEBUG << "using " << bg.N << " frames for backgroud";
     bg.oldest_frame = 0;
 
@@ -181,17 +219,30 @@ int initialize_background(Background& bg, float bg_secs, FrameBufferReader& fb)
     // the framedata_t (frame_buffer.h) is either float or double
     bg.cv_type = sizeof(framedata_t)==4 ? CV_32FC1 : CV_64FC1;
     bg.pings.create(bg.N, bg.total_samples, bg.cv_type);
-    for (int k=0; k<bg.N; ++k)
+    // Take the pings in batches of whatever is already in the buffer, 
+    // which is most of them when replaying.
+    const int kMaxBatch = 32;
+    vector<FrameView> batch(std::min(bg.N, kMaxBatch));
+    int k = 0;
+    while (k < bg.N)
     {
-        if ( fb.GetNextFrame(&ping)==-1 )
+        int count = fb.GetNextFrames(batch.data(), std::min(bg.N - k, kMaxBatch));
+        if ( count==-1 )
         {
             NIMS_LOG_ERROR << "Error getting ping for initial moving average.";
             return -1;
         }
-        // Create a cv::Mat wrapper for the ping data
-        NIMS_LOG_DEBUG << "got background frame " << k;
-        Mat ping_data(1,bg.total_samples,bg.cv_type,ping.data_ptr());
-        ping_data.copyTo(bg.pings.row(k));
+        NIMS_LOG_DEBUG << "got background frames " << k << " to " << k + count - 1;
+        for (int i=0; i<count; ++i)
+        {
+            // widen (or copy) the ping data into the window
+            DecodeSamples(batch[i].header(), batch[i].data_ptr(), 0, bg.total_samples, 
+                          bg.pings.ptr<framedata_t>(k));
+            if (!batch[i].valid())
+                NIMS_LOG_WARNING << "frame " << batch[i].frame_number() << " overwritten while copying; trying next frame";
+            else
+                ++k;
+        }
     }
     NIMS_LOG_DEBUG << "got " << bg.N << " frames for moving average";
     reduce(bg.pings, bg.ping_mean, 0, CV_REDUCE_AVG);
@@ -213,13 +264,15 @@ int initialize_background(Background& bg, float bg_secs, FrameBufferReader& fb)
 } // initialize_background
 
 
-int update_background(Background& bg, const Frame& new_ping)
+int update_background(Background& bg, const FrameView& new_ping)
 {
     // replace oldest frame with new one
     //Mat ping_data(2,bg.dim_sizes,bg.cv_type,new_ping.data_ptr());
     //ping_data.reshape(0,1).copyTo(bg.pings.row(bg.oldest_frame));
-    Mat ping_data(1,bg.total_samples,bg.cv_type,new_ping.data_ptr());
-    ping_data.copyTo(bg.pings.row(bg.oldest_frame));
+    DecodeSamples(new_ping.header(), new_ping.data_ptr(), 0, bg.total_samples, 
+                  bg.pings.ptr<framedata_t>(bg.oldest_frame));
+    // if the writer overwrote the frame, the next one will replace this row
+    if (!new_ping.valid()) return -1;
     ++bg.oldest_frame;
     bg.oldest_frame %= bg.N; // wrap around from N-1 to 0
 
@@ -242,11 +295,11 @@ int update_background(Background& bg, const Frame& new_ping)
 // used to sort detections in descending order of max intensity
 bool compare_detection(Detection d1, Detection d2) { return d1.intensity_max > d2.intensity_max; };
 
-int detect_objects(const Background& bg, const Frame& ping, 
+int detect_objects(Background& bg, const FrameView& ping, 
     float thresh_stdevs, int min_size,  vector<Detection>& detections)
 {
     detections.clear();
-    Mat ping_data(1,bg.total_samples,bg.cv_type,ping.data_ptr());
+    Mat ping_data = ping_samples(bg, ping);
     Mat foregroundMask = ((ping_data - bg.ping_mean) / bg.ping_stdv) > thresh_stdevs;
     int nz = countNonZero(foregroundMask);
     //NIMS_LOG_DEBUG << "ping " << ping.header.ping_num << ": number of samples above threshold is "<< nz << " ("
@@ -255,12 +308,12 @@ int detect_objects(const Background& bg, const Frame& ping,
     {
         PixelGrouping objects;
         //NIMS_LOG_DEBUG << "grouping pixels";
-        group_pixels(ping_data.reshape(0,(int)ping.header.num_samples), foregroundMask.reshape(0,(int)ping.header.num_samples), 
+        group_pixels(ping_data.reshape(0,(int)ping.header().num_samples), foregroundMask.reshape(0,(int)ping.header().num_samples), 
             min_size, objects);
         int n_obj = objects.size();
        // NIMS_LOG_DEBUG << ping.header.ping_num << " number of detected objects: " << n_obj;
         
-        double ts = (double)ping.header.ping_sec + (double)ping.header.ping_millisec/1000.0;
+        double ts = (double)ping.header().ping_sec + (double)ping.header().ping_millisec/1000.0;
 
         // convert pixel grouping to detections
        for (int k=0; k<n_obj; ++k)
@@ -290,7 +343,7 @@ int detect_objects(const Background& bg, const Frame& ping,
     if (TEST)
     {
         ostringstream ss;
-        ss << ping.header.ping_num << "_" << ping.header.ping_sec << "-" << ping.header.ping_millisec;
+        ss << ping.header().ping_num << "_" << ping.header().ping_sec << "-" << ping.header().ping_millisec;
         write_mat_to_file<framedata_t>(ping_data, string(ss.str() + "_ping.csv"));
         write_mat_to_file<framedata_t>(bg.ping_mean, string(ss.str() + "_mean.csv"));
         write_mat_to_file<framedata_t>(bg.ping_stdv, string(ss.str() + "_stdv.csv"));
@@ -367,7 +420,7 @@ int main (int argc, char * argv[]) {
     //-------------------------------------------------------------------------
     // INITIALIZE MOVING AVG, STDEV
     FrameBufferReader fb(fb_name);
-    if ( -1 == fb.Connect() )
+    if ( -1 == fb.Connect(kLagBlock) ) // the detector needs every ping
     {
         NIMS_LOG_ERROR << "Error connecting to framebuffer.";
         return -1;
@@ -392,15 +445,12 @@ int main (int argc, char * argv[]) {
         
        NIMS_LOG_DEBUG << "Moving average and std dev initialized";
     // Get one ping to get header info.
-    Frame next_ping;
+    FrameView next_ping;
     fb.GetNextFrame(&next_ping);
-    FrameHeader *fh = &next_ping.header; // for notational convenience
-    float beam_max = fh->beam_angles_deg[(fh->num_beams-1)];
-    float beam_min = fh->beam_angles_deg[0];
     Mat map_x, map_y;
-    if (VIEW)
+    if (VIEW && next_ping.geometry() != nullptr)
     {
-        PingImagePolarToCart(next_ping.header, map_x, map_y);
+        PingImagePolarToCart(next_ping.header(), *next_ping.geometry(), map_x, map_y);
         double min_beam, min_rng, max_beam, max_rng;
         minMaxIdx(map_x, &min_beam, &max_beam);
         minMaxIdx(map_y, &min_rng, &max_rng);
@@ -434,16 +484,41 @@ int main (int argc, char * argv[]) {
     // MAIN LOOP
     
     int frame_index = -1;
+    long frames_skipped = fb.frames_skipped();
     while ( (frame_index = fb.GetNextFrame(&next_ping)) != -1 && 0 == sigint_received)
     {
         if (sigint_received) {
             NIMS_LOG_WARNING << "exiting due to SIGINT";
             break;
         }
-        NIMS_LOG_DEBUG << "got frame " << frame_index;
+        NIMS_LOG_DEBUG << "got frame " << frame_index << ", " << fb.lag() << " frames behind";
+        if (fb.frames_skipped() > frames_skipped)
+        {
+            NIMS_LOG_WARNING << "not keeping up with the ping rate: skipped " 
+                             << fb.frames_skipped() - frames_skipped << " frames, "
+                             << fb.lag() << " frames behind";
+            frames_skipped = fb.frames_skipped();
+        }
+        // Rebuild the beam tables only when the geometry changes.
+        const FrameGeometry *geom = next_ping.geometry();
+        if (geom == nullptr || geom->num_beams != bg.beam_angles_deg.size())
+        {
+            NIMS_LOG_WARNING << "frame " << frame_index << " does not match the background beams; skipping";
+            continue;
+        }
+        if (geom->generation != bg.geometry_id)
+        {
+            update_geometry(bg, *geom);
+            if (VIEW) PingImagePolarToCart(next_ping.header(), *geom, map_x, map_y);
+        }
+        
         // Update background
         //NIMS_LOG_DEBUG << "Updating mean background";
-        update_background(bg, next_ping);
+        if (update_background(bg, next_ping) == -1)
+        {
+            NIMS_LOG_WARNING << "frame " << frame_index << " overwritten while reading; skipping";
+            continue;
+        }
 /*
         double min_val,max_val;
        // minMaxIdx(bg.pings.row(bg.N-1), &min_val, &max_val);
@@ -470,13 +545,18 @@ int main (int argc, char * argv[]) {
 
         vector<Detection> detections;
         int n_obj = detect_objects(bg, next_ping, thresh_stdevs, min_size, detections);  
+        if (!next_ping.valid())
+        {
+            NIMS_LOG_WARNING << "frame " << frame_index << " overwritten while reading; skipping";
+            continue;
+        }
             // Use max strongest objects    
         sort(detections.begin(),detections.end(),compare_detection);
         n_obj = std::min(n_obj, MAX_DETECTIONS_PER_FRAME);
 
         NIMS_LOG_DEBUG << "sending message with " << detections.size() << " detections";
-        DetectionMessage msg_det(frame_index, next_ping.header.ping_num, 
-            next_ping.header.ping_sec + (float)next_ping.header.ping_millisec/1000.0, 
+        DetectionMessage msg_det(frame_index, next_ping.header().ping_num, 
+            next_ping.header().ping_sec + (float)next_ping.header().ping_millisec/1000.0, 
             vector<Detection>(detections.begin(),detections.begin()+n_obj));
         mq_send(mq_det, (const char *)&msg_det, sizeof(msg_det), 0); // non-blocking
         mq_send(mq_det2, (const char *)&msg_det, sizeof(msg_det), 0); // non-blocking
@@ -500,18 +580,19 @@ int main (int argc, char * argv[]) {
         if (TEST)
         {
            for (int d=0; d<n_obj; ++ d)
-                ofs << next_ping.header.ping_num << "," << detections[d];
+                ofs << next_ping.header().ping_num << "," << detections[d];
         }
         
         if (VIEW)
         {
             double v1,v2;
            // ping data as 1 x total_samples vector, 32F from 0.0 to ?
-            Mat ping_data(1,bg.total_samples,bg.cv_type,next_ping.data_ptr());
+            Mat ping_data = ping_samples(bg, next_ping);
              // reshape to single channel, num_samples rows
-            Mat im1 = ping_data.reshape(0,next_ping.header.num_samples);
-            minMaxIdx(im1, &v1, &v2);
-            im1 *= 1./v2; // scale to [0,1]
+            Mat im1;
+            minMaxIdx(ping_data, &v1, &v2);
+            // scale to [0,1]; the ping data is read-only shared memory
+            ping_data.reshape(0,next_ping.header().num_samples).convertTo(im1, bg.cv_type, 1./v2);
             cvtColor(im1,im1,CV_GRAY2BGR);
             NIMS_LOG_DEBUG << "im1 from " << v1 << " to " << v2;
 
@@ -0,0 +1,219 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  fbstat.cpp
+ *
+ *  Prints the frame buffer statistics once a second:  frames written, put
+ *  latency, and for each reader, frames read and skipped and how far
+ *  behind it is.  Only reads the statistics block, so it can be run at
+ *  any time without disturbing the writer or readers.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+#include <iostream> // cout, cin, cerr
+#include <iomanip>  // setw, setprecision
+#include <string>   // for strings
+#include <cstring>  // memcpy
+
+#include <fcntl.h>    // O_* constants
+#include <unistd.h>   // usleep
+#include <signal.h>   // kill
+#include <sys/mman.h> // mmap, shm_open
+
+#include <boost/program_options.hpp>
+
+#include "yaml-cpp/yaml.h"
+
+#include "frame_buffer.h"
+#include "frame_buffer_stats.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// The counters of one sample, copied out of shared memory.
+struct StatsSample
+{
+    int64_t  last_frame;
+    uint64_t frames_written;
+    uint64_t bytes_written;
+    uint64_t put_errors;
+    uint64_t put_ns_total;
+    uint64_t put_ns_bins[kStatsLatencyBins];
+    uint64_t blocked_puts;
+    uint64_t blocked_ns_total;
+    uint64_t queue_full;
+    uint64_t queue_errors;
+    struct {
+        int32_t  pid;
+        uint32_t policy;
+        int64_t  last_frame;
+        uint64_t frames_read;
+        uint64_t frames_skipped;
+        uint64_t queue_full;
+    } readers[kMaxStatsReaders];
+};
+
+static void TakeSample(const FrameBufferStats *stats, StatsSample *sample)
+{
+    sample->last_frame = stats->last_frame.load();
+    sample->frames_written = stats->frames_written.load();
+    sample->bytes_written = stats->bytes_written.load();
+    sample->put_errors = stats->put_errors.load();
+    sample->put_ns_total = stats->put_ns_total.load();
+    for (int k=0; k<kStatsLatencyBins; ++k)
+        sample->put_ns_bins[k] = stats->put_ns_bins[k].load();
+    sample->blocked_puts = stats->blocked_puts.load();
+    sample->blocked_ns_total = stats->blocked_ns_total.load();
+    sample->queue_full = stats->queue_full.load();
+    sample->queue_errors = stats->queue_errors.load();
+    for (int k=0; k<kMaxStatsReaders; ++k)
+    {
+        const FrameBufferReaderStats &r = stats->readers[k];
+        sample->readers[k].pid = r.pid.load();
+        sample->readers[k].policy = r.policy.load();
+        sample->readers[k].last_frame = r.last_frame.load();
+        sample->readers[k].frames_read = r.frames_read.load();
+        sample->readers[k].frames_skipped = r.frames_skipped.load();
+        sample->readers[k].queue_full = r.queue_full.load();
+    }
+}
+
+// Upper bound (ms) of the put latency bin holding the given fraction of
+// the puts between two samples.
+static double PutLatencyPercentile(const StatsSample &now, const StatsSample &then,
+                                   double fraction)
+{
+    uint64_t total = 0;
+    for (int k=0; k<kStatsLatencyBins; ++k)
+        total += now.put_ns_bins[k] - then.put_ns_bins[k];
+    uint64_t count = 0;
+    for (int k=0; k<kStatsLatencyBins; ++k)
+    {
+        count += now.put_ns_bins[k] - then.put_ns_bins[k];
+        if (count > 0 && count >= fraction*total) return (2ull << k)/1e6;
+    }
+    return 0.0;
+}
+
+static void PrintSample(const StatsSample &now, const StatsSample &then, double secs)
+{
+    const uint64_t frames = now.frames_written - then.frames_written;
+    cout << fixed << setprecision(1)
+         << "frame " << now.last_frame << ": " << frames/secs << " frames/s, "
+         << (now.bytes_written - then.bytes_written)/secs/1048576.0 << " MB/s";
+    if (frames > 0)
+        cout << setprecision(3) << ", put " << (now.put_ns_total - then.put_ns_total)/1e6/frames
+             << " ms mean, p50 < " << PutLatencyPercentile(now, then, 0.5)
+             << " ms, p99 < " << PutLatencyPercentile(now, then, 0.99) << " ms";
+    cout << endl;
+    if (now.blocked_puts != then.blocked_puts || now.put_errors != then.put_errors
+        || now.queue_full != then.queue_full || now.queue_errors != then.queue_errors)
+        cout << setprecision(3) << "  " << now.blocked_puts - then.blocked_puts
+             << " puts waited for readers ("
+             << (now.blocked_ns_total - then.blocked_ns_total)/1e6 << " ms), "
+             << now.put_errors - then.put_errors << " put errors, "
+             << now.queue_full - then.queue_full << " full reader queues, "
+             << now.queue_errors - then.queue_errors << " queue errors" << endl;
+
+    const char *policies[] = { "block", "drop", "latest" };
+    for (int k=0; k<kMaxStatsReaders; ++k)
+    {
+        const auto &r = now.readers[k];
+        if (r.pid == 0) continue;
+        // a new reader in the entry since the last sample starts from 0
+        const auto &p = then.readers[k];
+        const bool same = (p.pid == r.pid);
+        cout << setprecision(1) << "  reader " << setw(6) << r.pid << " " << setw(6)
+             << (r.policy < 3 ? policies[r.policy] : "?") << ": "
+             << (r.frames_read - (same ? p.frames_read : 0))/secs << " frames/s, "
+             << (r.frames_skipped - (same ? p.frames_skipped : 0))/secs << " skipped/s, lag "
+             << (r.last_frame > 0 ? now.last_frame - r.last_frame : 0);
+        if (r.queue_full != (same ? p.queue_full : 0))
+            cout << ", queue full " << r.queue_full - (same ? p.queue_full : 0);
+        cout << endl;
+    }
+}
+
+int main (int argc, char * argv[]) {
+	//--------------------------------------------------------------------------
+    // PARSE COMMAND LINE
+	//
+	po::options_description desc;
+	desc.add_options()
+	("help",                                                    "print help message")
+	("cfg,c", po::value<string>()->default_value("./config.yaml"), "path to config file")
+	("name,n", po::value<string>(),                             "frame buffer name, if not FRAMEBUFFER_NAME")
+	("interval,i", po::value<float>()->default_value(1.0),     "seconds between samples")
+	;
+	po::variables_map options;
+    try
+    {
+        po::store( po::parse_command_line( argc, argv, desc ), options );
+    }
+    catch( const std::exception& e )
+    {
+        cerr << "Sorry, couldn't parse that: " << e.what() << endl;
+        cerr << desc << endl;
+        return -1;
+    }
+
+	po::notify( options );
+
+    if( options.count( "help" ) > 0 )
+    {
+        cerr << desc << endl;
+        return 0;
+    }
+
+    string fb_name;
+    if (options.count("name") > 0)
+        fb_name = options["name"].as<string>();
+    else try
+    {
+        YAML::Node config = YAML::LoadFile(options["cfg"].as<string>());
+        fb_name = config["FRAMEBUFFER_NAME"].as<string>();
+    }
+    catch( const std::exception& e )
+    {
+        cerr << "Error reading config file: " << options["cfg"].as<string>() << endl;
+        cerr << e.what() << endl;
+        return -1;
+    }
+    const float interval = options["interval"].as<float>();
+
+	//--------------------------------------------------------------------------
+	// DO STUFF
+    const string stats_name = "/" + fb_name + "-stats";
+    int fd = shm_open(stats_name.c_str(), O_RDONLY, S_IRUSR);
+    if (-1 == fd)
+    {
+        perror(("fbstat: " + stats_name).c_str());
+        return -1;
+    }
+    const FrameBufferStats *stats = (const FrameBufferStats *)mmap(NULL, sizeof(FrameBufferStats),
+                                                                 PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == stats || stats->magic != kStatsMagic)
+    {
+        cerr << "fbstat: " << stats_name << " is not a frame buffer statistics block" << endl;
+        return -1;
+    }
+
+    StatsSample then, now;
+    TakeSample(stats, &then);
+    uint64_t t0 = StatsClock();
+    while (1)
+    {
+        usleep(interval*1000000);
+        TakeSample(stats, &now);
+        const uint64_t t1 = StatsClock();
+        int32_t pid = stats->writer_pid.load();
+        if (pid == 0 || (-1 == kill(pid, 0) && errno == ESRCH))
+            cout << "(no writer) ";
+        PrintSample(now, then, (t1 - t0)/1e9);
+        then = now;
+        t0 = t1;
+    }
+    return 0;
+}
@@ -13,16 +13,30 @@
 // for POSIX shared memory
 #include <fcntl.h>    // O_* constants
 #include <unistd.h>   // sysconf, getpid
+#include <signal.h>   // kill
 #include <assert.h>   // assert
 #include <sys/mman.h> // mmap, shm_open
+#include <sys/stat.h> // fstat
+#include <sys/socket.h> // accept, shutdown
 
 #include <exception>  // exception class
+#include <atomic>     // slot sequence numbers
+#include <climits>    // INT_MAX
+#include <algorithm>  // max
+#include <linux/futex.h>  // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h>  // SYS_futex, SYS_memfd_create
+#include <linux/memfd.h>  // MFD_HUGETLB
+#include <cmath>      // lrint
+#ifdef __F16C__
+#include <immintrin.h> // half precision conversion
+#endif
 
 #include <boost/lexical_cast.hpp>
 #include <boost/log/trivial.hpp>
 
 #include "log.h"
 #include "nims_ipc.h"
+#include "frame_buffer_stats.h"
 
 using namespace std;
 
@@ -63,7 +77,7 @@ const size_t kMaxMessage = 8; // maximum number of messages that can exist on th
  components start sharing memory, we can make this external.
 */
 const size_t kPageSize = sysconf(_SC_PAGE_SIZE);
-static size_t SizeForSharedFrame(const Frame &f)
+static size_t SizeForSharedFrame(size_t data_size)
 {
 /*
     static size_t page_size = 0;
@@ -76,12 +90,178 @@ static size_t SizeForSharedFrame(const Frame &f)
     return page_size * number_of_pages;
 */
     assert(kPageSize > 0);
-    const size_t len = f.size() + sizeof(f);
+    const size_t len = data_size + sizeof(Frame);
     const size_t number_of_pages = len / kPageSize + 1;
     return kPageSize * number_of_pages;
 
 }
 
+// A shared frame is the header, the data size, and the data.
+const size_t kSharedDataOffset = sizeof(FrameHeader) + sizeof(uint64_t);
+
+/*
+ The frame ring is one shared memory object:  a control block, padded
+ to a page, followed by num_slots slots of slot_size bytes.  Each slot
+ starts with a RingSlot header and the frame data follows at
+ kSlotDataOffset.
+
+ The slot sequence number works like a seqlock.  While frame n is being
+ copied in, seq is 2n-1 (odd); once the copy is complete it is 2n.  A
+ reader checks seq before and after copying a frame; if it is not 2n
+ both times, the frame was overwritten while it was being read.
+
+ Readers of the ring do not get a message per frame.  The writer bumps
+ notify_seq after each frame, and readers that have caught up sleep on
+ it with a futex.  The waiters count lets the writer skip the wake-up
+ system call when nobody is sleeping, so publishing a frame costs the
+ same no matter how many readers there are.
+
+ Each ring reader claims an entry in the readers table.  A reader with
+ the kLagBlock policy sets done_frame as it finishes with frames; before
+ reusing a slot the writer waits, on the reader_seq futex word, until
+ every blocking reader is done with the frame in that slot.
+
+ A persistent ring stays behind when its writer exits.  A writer that 
+ finds a ring with the same layout takes it over as is, readers table and
+ all, and bumps writer_generation.  Otherwise the writer sets replaced in
+ the old ring, unlinks it, and makes a new one, continuing the frame 
+ numbers, and the readers map the new ring in place of the old one.  
+ Either way the new writer opens the ready queues (see GetReadyFd) of the
+ readers in the old table, whose names it can tell from their pids.
+*/
+const uint32_t kRingMagic = 0x4e494d53; // "NIMS"
+
+struct RingReader
+{
+    std::atomic<int32_t>  pid;        // 0 if this entry is free
+    std::atomic<uint32_t> policy;     // LagPolicy
+    std::atomic<int64_t>  done_frame; // reader no longer needs this or older
+    std::atomic<uint64_t> frames_read;
+    std::atomic<uint64_t> frames_skipped;
+};
+
+struct RingControl
+{
+    uint32_t magic;
+    uint32_t num_slots;
+    uint64_t slot_size;     // bytes per slot, including the RingSlot header
+    uint64_t slots_offset;  // offset of slot 0 from the start of the ring
+    uint64_t map_size;      // bytes to map, a multiple of the page size used
+    std::atomic<int64_t> last_frame; // number of the newest complete frame
+    int64_t first_frame;    // number of the first frame put in this ring
+    std::atomic<uint32_t> notify_seq; // futex word, bumped for each new frame
+    std::atomic<uint32_t> waiters;    // number of readers sleeping on notify_seq
+    std::atomic<uint32_t> reader_seq; // futex word, bumped when a blocking reader is done
+    std::atomic<uint32_t> writer_waiting; // writer is sleeping on reader_seq
+    std::atomic<uint32_t> writer_generation; // bumped by each writer of the ring
+    std::atomic<uint32_t> replaced;   // a new writer has made a new ring
+    RingReader readers[kMaxRingReaders];
+};
+
+struct RingSlot
+{
+    std::atomic<uint64_t> seq;
+    int64_t  frame_number;
+    uint64_t data_size;
+    FrameHeader header;
+};
+
+// keep frame data cache line aligned
+const size_t kSlotDataOffset = (sizeof(RingSlot) + 63) & ~(size_t)63;
+
+static long futex(std::atomic<uint32_t> *uaddr, int op, uint32_t val,
+                  const struct timespec *timeout=nullptr)
+{
+    // not FUTEX_PRIVATE_FLAG; the word is shared between processes
+    return syscall(SYS_futex, (uint32_t *)uaddr, op, val, timeout, nullptr, 0);
+}
+
+/*
+ The geometry table is a separate shared memory object, used in both 
+ modes.  Geometry generation g is kept in entry g % kMaxGeometries.  The
+ entry's published word is 0 while the writer is copying a geometry in and
+ g when it is complete, so a reader can tell if it was replaced.
+*/
+struct GeometryEntry
+{
+    std::atomic<uint32_t> published;
+    FrameGeometry geometry;
+};
+
+struct GeometryTable
+{
+    uint32_t magic;
+    std::atomic<uint32_t> latest; // generation of the newest geometry
+    GeometryEntry entries[kMaxGeometries];
+};
+
+/*
+ The per-frame index lets readers find the frames that have not been 
+ unlinked yet.  Frame n is the shared memory object "/<fb_name>-n" and is 
+ listed in entry n % kMaxFramesInBuffer.  The entry's frame_number is -1 
+ while the writer updates it.
+*/
+struct FrameIndexEntry
+{
+    std::atomic<int64_t> frame_number;
+    uint64_t map_length;    // size of the shared memory object
+    uint64_t ping_msec;     // ping time in milliseconds since 1-Jan-1970
+};
+
+struct FrameIndex
+{
+    uint32_t magic;
+    std::atomic<int64_t> last_frame; // number of the newest frame
+    FrameIndexEntry entries[kMaxFramesInBuffer];
+};
+
+static uint64_t PingTime(const FrameHeader &header)
+{
+    return (uint64_t)header.ping_sec*1000 + header.ping_millisec;
+}
+
+/*
+ With FrameBufferParams::huge_pages the ring is a memfd instead of a named
+ shared memory object, backed by huge pages (MFD_HUGETLB) if the system has
+ some reserved, otherwise by normal shmem with MADV_HUGEPAGE so transparent
+ huge pages can be used.  The control block and ring size are rounded to
+ the default x86 huge page size.  Since a memfd has no name, readers get
+ the descriptor from the writer over a Unix socket.
+*/
+const size_t kHugePageSize = 2*1024*1024;
+
+static int memfd(const char *name, unsigned int flags)
+{
+    return syscall(SYS_memfd_create, name, flags);
+}
+
+// The ready queue of ring reader pid (see GetReadyFd), or -1 if it has none.
+static mqd_t OpenReadyQueue(const std::string &fb_name, int32_t pid)
+{
+    if (pid == 0) return -1;
+    std::string name = "/" + fb_name + "-mq-" + boost::lexical_cast<std::string>(pid);
+    return mq_open(name.c_str(), O_WRONLY | O_NONBLOCK);
+}
+
+static RingReader& ReaderEntry(char *ring, int index)
+{
+    return ((RingControl *)ring)->readers[index];
+}
+
+static RingSlot* SlotForFrame(char *ring, int64_t frame_number)
+{
+    RingControl *ctl = (RingControl *)ring;
+    return (RingSlot *)(ring + ctl->slots_offset 
+                        + (frame_number % ctl->num_slots)*ctl->slot_size);
+}
+
+bool FrameGeometry::same_beams(const FrameGeometry& other) const
+{
+    return num_beams == other.num_beams
+           && 0 == memcmp(beam_angles_deg, other.beam_angles_deg, 
+                          std::min<uint32_t>(num_beams, kMaxBeams)*sizeof(float));
+}
+
 std::ostream& operator<<(std::ostream& strm, const FrameHeader& fh)
 {
     strm << "   device = " << fh.device << endl;
@@ -96,24 +276,166 @@ std::ostream& operator<<(std::ostream& strm, const FrameHeader& fh)
     strm << "   winstart_sec = " << fh.winstart_sec << endl;
     strm << "   winlen_sec = " << fh.winlen_sec << endl;
     strm << "   num_beams = " << fh.num_beams << endl;
-    if (fh.num_beams > 0)
-        strm << "   beam_angles_deg = " << fh.beam_angles_deg[0] << " to " << fh.beam_angles_deg[fh.num_beams-1] << endl;
+    strm << "   geometry_id = " << fh.geometry_id << endl;
     strm << "   freq_hz = " << fh.freq_hz << endl;
     strm << "   pulselen_microsec = " << fh.pulselen_microsec << endl;
     strm << "   pulserep_hz = " << fh.pulserep_hz << endl;
+    strm << "   encoding = " << fh.encoding << endl;
+    strm << "   data_scale = " << fh.data_scale << endl;
+    strm << "   data_offset = " << fh.data_offset << endl;
+    strm << "   channel = " << fh.channel << endl;
+    strm << "   units = " << fh.units << endl;
     
 	return strm;
     
 } // operator<<
 
+//-----------------------------------------------------------------------------
+// *******  Sample encodings  ********
+//-----------------------------------------------------------------------------
+static float HalfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t f;
+    if (exp == 31)      // inf or nan
+        f = sign | 0x7f800000 | (mant << 13);
+    else if (exp != 0)  // normal
+        f = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    else if (mant == 0) // zero
+        f = sign;
+    else                // subnormal; normalize it
+    {
+        exp = 127 - 15 + 1;
+        while (!(mant & 0x400)) { mant <<= 1; --exp; }
+        f = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float value;
+    memcpy(&value, &f, sizeof(value));
+    return value;
+}
+
+// round to nearest even, like the F16C instructions
+static uint16_t FloatToHalf(float value)
+{
+    uint32_t f;
+    memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000;
+    int32_t exp = (int32_t)((f >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = f & 0x7fffff;
+    if (((f >> 23) & 0xff) == 0xff)                // inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 31) return sign | 0x7c00;           // too big; inf
+    if (exp <= 0)                                  // subnormal or zero
+    {
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) ++h;
+        return sign | h;
+    }
+    uint32_t h = ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h; // may round up to inf
+    return sign | h;
+}
+
+size_t SampleSize(uint32_t encoding)
+{
+    return encoding == kSampleFloat32 ? sizeof(framedata_t) : sizeof(uint16_t);
+}
+
+// The loops are simple enough for the compiler to vectorize; the half 
+// precision ones use F16C when the target has it (-mf16c or -march=native).
+void DecodeSamples(const FrameHeader& header, const void *data, 
+                   size_t first, size_t count, framedata_t *out)
+{
+    if (header.encoding == kSampleFloat32)
+    {
+        memcpy(out, (const framedata_t *)data + first, count*sizeof(framedata_t));
+        return;
+    }
+    
+    const uint16_t *in = (const uint16_t *)data + first;
+    size_t k = 0;
+    if (header.encoding == kSampleUInt16)
+    {
+        const float scale = header.data_scale;
+        const float offset = header.data_offset;
+        for (; k < count; ++k)
+            out[k] = scale*in[k] + offset;
+        return;
+    }
+#ifdef __F16C__
+    for (; k + 8 <= count; k += 8)
+        _mm256_storeu_ps(out + k, 
+            _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + k))));
+#endif
+    for (; k < count; ++k)
+        out[k] = HalfToFloat(in[k]);
+    
+} // DecodeSamples
+
+void EncodeSamples(const FrameHeader& header, const framedata_t *in, 
+                   size_t count, void *data)
+{
+    if (header.encoding == kSampleFloat32)
+    {
+        memcpy(data, in, count*sizeof(framedata_t));
+        return;
+    }
+    
+    uint16_t *out = (uint16_t *)data;
+    size_t k = 0;
+    if (header.encoding == kSampleUInt16)
+    {
+        const float inv_scale = 1.0f/header.data_scale;
+        const float offset = header.data_offset;
+        for (; k < count; ++k)
+        {
+            float v = (in[k] - offset)*inv_scale;
+            v = std::min(std::max(v, 0.0f), 65535.0f);
+            out[k] = (uint16_t)lrintf(v);
+        }
+        return;
+    }
+#ifdef __F16C__
+    for (; k + 8 <= count; k += 8)
+        _mm_storeu_si128((__m128i *)(out + k), 
+            _mm256_cvtps_ph(_mm256_loadu_ps(in + k), _MM_FROUND_TO_NEAREST_INT));
+#endif
+    for (; k < count; ++k)
+        out[k] = FloatToHalf(in[k]);
+    
+} // EncodeSamples
+
 //-----------------------------------------------------------------------------
 // FrameBufferWriter Constructor
-FrameBufferWriter::FrameBufferWriter(const std::string &fb_name)
-: fb_name_(fb_name)
+FrameBufferWriter::FrameBufferWriter(const std::string &fb_name,
+                                     const FrameBufferParams &params)
+: fb_name_(fb_name), params_(params)
 { 
     shm_prefix_ = "/" + fb_name_ + "-";
     mqw_name_ = "/" + fb_name;
     mqw_ = -1;
+    ring_name_ = "/" + fb_name_ + "-ring";
+    ring_ = nullptr;
+    ring_size_ = 0;
+    geometry_name_ = "/" + fb_name_ + "-geometry";
+    geometry_table_ = nullptr;
+    index_name_ = "/" + fb_name_ + "-index";
+    frame_index_ = nullptr;
+    ring_fd_ = -1;
+    ring_socket_ = -1;
+    shared_frame_ = nullptr;
+    shared_length_ = 0;
+    reserved_data_ = nullptr;
+    reserved_size_ = 0;
+    stats_name_ = "/" + fb_name_ + "-stats";
+    stats_ = nullptr;
     (void) pthread_mutex_init(&mqr_lock_, NULL);
    
     NIMS_LOG_DEBUG << "max messsage size is " << kMaxMessageSize;
@@ -135,6 +457,18 @@ int FrameBufferWriter::Initialize()
     // Fresh start.
     CleanUp();
     
+    // The ring or index and the geometry table have to exist before 
+    // readers can connect.
+    if (params_.ring && -1 == CreateRing())
+        return -1;
+    if (!params_.ring && -1 == CreateFrameIndex())
+        return -1;
+    if (-1 == CreateGeometryTable())
+        return -1;
+    // the counters are only for watching; carry on without them
+    if (-1 == CreateStats())
+        NIMS_LOG_WARNING << "FrameBufferWriter: no statistics in " << stats_name_;
+    
      // Create the message queue for receiving reader connections.
    NIMS_LOG_DEBUG << "creating frame buffer connection msg queue " << mqw_name_;
    /*
@@ -152,7 +486,10 @@ int FrameBufferWriter::Initialize()
         nims_perror("FrameBufferWriter");
         return -1;
     }
+    // a ring taken over from an earlier writer goes on from its last frame
     frame_count_ = 0;
+    if (ring_ != nullptr) frame_count_ = ((RingControl *)ring_)->last_frame.load();
+    if (stats_ != nullptr) stats_->last_frame.store(frame_count_);
     
     // Start thread for servicing reader connections
     NIMS_LOG_DEBUG << "starting connection thread";
@@ -169,11 +506,136 @@ long FrameBufferWriter::PutNewFrame(const Frame &new_frame)
 {
     if ( !initialized() ) return -1;
     
+    const uint64_t start_ns = StatsClock();
+    long n = PutFrame(new_frame);
+    CountPut(n, new_frame.size(), start_ns);
+    return n;
+    
+} // FrameBufferWriter::PutNewFrame
+
+//-----------------------------------------------------------------------------
+long FrameBufferWriter::PutFrame(const Frame &new_frame)
+{
+    // the data is already in shared memory
+    if (reserved_data_ != nullptr && new_frame.data_ptr() == reserved_data_)
+        return PublishReservedFrame(new_frame);
+    
+    // a reservation that was not used is dropped
+    reserved_data_ = nullptr;
+    reserved_size_ = 0;
+    if (ring_ != nullptr) return PutRingFrame(new_frame);
+    
+    if (shared_frame_ != nullptr) DiscardSharedFrame();
+    char *shared_frame = CreateSharedFrame(new_frame.size());
+    
+    // !!! early return
+    if (shared_frame == nullptr) return -1;
+        
+    // copy frame data to the shared frame; the header is added on publishing
+    memcpy(shared_frame + kSharedDataOffset, new_frame.data_ptr(), new_frame.size());
+    return PublishSharedFrame(new_frame);
+    
+} // FrameBufferWriter::PutFrame
+
+//-----------------------------------------------------------------------------
+// Count a put in the statistics block:  a few relaxed stores to cache
+// lines only the writer touches, and two reads of the vDSO clock.
+void FrameBufferWriter::CountPut(long frame_number, size_t data_size, uint64_t start_ns)
+{
+    if (stats_ == nullptr) return;
+    if (frame_number == -1)
+    {
+        StatsAdd<uint64_t>(stats_->put_errors, 1);
+        return;
+    }
+    const uint64_t ns = StatsClock() - start_ns;
+    StatsAdd<uint64_t>(stats_->frames_written, 1);
+    StatsAdd<uint64_t>(stats_->bytes_written, data_size);
+    StatsAdd<uint64_t>(stats_->put_ns_total, ns);
+    StatsAdd<uint64_t>(stats_->put_ns_bins[StatsLatencyBin(ns)], 1);
+    if (ns > stats_->put_ns_max.load(std::memory_order_relaxed))
+        stats_->put_ns_max.store(ns, std::memory_order_relaxed);
+    stats_->last_frame.store(frame_number, std::memory_order_relaxed);
+    
+} // FrameBufferWriter::CountPut
+
+//-----------------------------------------------------------------------------
+// Reserve shared memory for the data of the next frame.  Returns nullptr
+// if the frame does not fit in a ring slot, or on error.
+framedata_t* FrameBufferWriter::ReserveFrame(size_t size)
+{
+    if ( !initialized() ) return nullptr;
+    
+    if (ring_ != nullptr)
+    {
+        RingControl *ctl = (RingControl *)ring_;
+        if (kSlotDataOffset + size > ctl->slot_size)
+        {
+            NIMS_LOG_WARNING << "ReserveFrame: frame of " << size 
+                             << " bytes does not fit in a ring slot";
+            return nullptr;
+        }
+        // A slot that is already reserved is reused.
+        int64_t n = frame_count_ + 1;
+        if (reserved_data_ == nullptr) BeginRingFrame(n);
+        reserved_data_ = (framedata_t *)((char *)SlotForFrame(ring_, n) + kSlotDataOffset);
+        reserved_size_ = size;
+        return reserved_data_;
+    }
+    
+    // drop a shared frame that was reserved but never committed
+    if (shared_frame_ != nullptr) DiscardSharedFrame();
+    char *shared_frame = CreateSharedFrame(size);
+    if (shared_frame == nullptr) return nullptr;
+    reserved_data_ = (framedata_t *)(shared_frame + kSharedDataOffset);
+    reserved_size_ = size;
+    return reserved_data_;
+    
+} // FrameBufferWriter::ReserveFrame
+
+//-----------------------------------------------------------------------------
+// Publish the frame whose data was written to the memory from ReserveFrame.
+// Returns the index of the new frame.
+long FrameBufferWriter::CommitFrame(const Frame &new_frame)
+{
+    if ( !initialized() ) return -1;
+    
+    const uint64_t start_ns = StatsClock();
+    long n = PublishReservedFrame(new_frame);
+    CountPut(n, new_frame.size(), start_ns);
+    return n;
+    
+} // FrameBufferWriter::CommitFrame
+
+//-----------------------------------------------------------------------------
+long FrameBufferWriter::PublishReservedFrame(const Frame &new_frame)
+{
+    if (reserved_data_ == nullptr || new_frame.data_ptr() != reserved_data_
+        || new_frame.size() > reserved_size_)
+    {
+        NIMS_LOG_ERROR << "CommitFrame: frame data is not the reserved frame";
+        return -1;
+    }
+    reserved_data_ = nullptr;
+    reserved_size_ = 0;
+    
+    if (ring_ != nullptr) return EndRingFrame(new_frame, frame_count_ + 1);
+    return PublishSharedFrame(new_frame);
+    
+} // FrameBufferWriter::PublishReservedFrame
+
+//-----------------------------------------------------------------------------
+// Create and map the shared memory object for the next frame (per-frame
+// mode).  Returns the mapped object, with the data at kSharedDataOffset,
+// or nullptr on error.
+char* FrameBufferWriter::CreateSharedFrame(size_t data_size)
+{
+    // named for the frame number it will have
     std::string shared_name(shm_prefix_);
-    shared_name += boost::lexical_cast<std::string>(frame_count_++);
+    shared_name += boost::lexical_cast<std::string>(frame_count_ + 1);
     
    // NIMS_LOG_DEBUG << "FrameBufferWriter: putting frame " 
-   //                << frame_count_ << "(ping " << new_frame.header.ping_num << ")" << " in " << shared_name;
+   //                << frame_count_ << " in " << shared_name;
         
     /*
      Create -rw------- since we don't need executable pages.
@@ -186,18 +648,19 @@ long FrameBufferWriter::PutNewFrame(const Frame &new_frame)
     // !!! early return
     if (-1 == fd) {
         nims_perror("shm_open() in FrameBufferWriter::PutNewFrame");
-        return -1;
+        return nullptr;
     }
     
-    const size_t map_length = SizeForSharedFrame(new_frame);
+    const size_t map_length = SizeForSharedFrame(data_size);
     assert(map_length > sizeof(Frame));
     
     // !!! early return
     // could use fallocate or posix_fallocate, but ftruncate is portable
     if (0 != ftruncate(fd, map_length)) {
         nims_perror("ftruncate() in FrameBufferWriter::PutNewFrame");
+        close(fd);
         shm_unlink(shared_name.c_str());
-        return -1;
+        return nullptr;
     }
 
     // mmap the file descriptor from shm_open into this address space
@@ -211,27 +674,190 @@ long FrameBufferWriter::PutNewFrame(const Frame &new_frame)
     if (MAP_FAILED == shared_frame) {
         nims_perror("mmap() in FrameBufferInterface::PutNewFrame");
         shm_unlink(shared_name.c_str());
-        return -1;
+        return nullptr;
     }
-        
-    // copy frame header and data to the shared frame
+    
+    shared_frame_ = shared_frame;
+    shared_name_ = shared_name;
+    shared_length_ = map_length;
+    return shared_frame;
+    
+} // FrameBufferWriter::CreateSharedFrame
+
+//-----------------------------------------------------------------------------
+// Add the header to the shared frame from CreateSharedFrame and notify 
+// the readers.  Returns the index of the new frame.
+long FrameBufferWriter::PublishSharedFrame(const Frame &new_frame)
+{
+    uint32_t geometry_id = PublishGeometry(new_frame);
+    
+    // copy frame header and data size to the shared frame
+    char *shared_frame = shared_frame_;
     memcpy(shared_frame, &(new_frame.header), sizeof(new_frame.header));
+    ((FrameHeader *)shared_frame)->geometry_id = geometry_id;
     size_t data_size = new_frame.size();
     memcpy(shared_frame + sizeof(new_frame.header), &data_size, sizeof(data_size));
-    memcpy(shared_frame + sizeof(new_frame.header) + sizeof(data_size), 
-           new_frame.data_ptr(), data_size);
      
     // done with the region in this process; ok to do this?
     // pretty sure we can't shm_unlink here
-    munmap(shared_frame, map_length);
-    shared_frame = nullptr;
+    munmap(shared_frame, shared_length_);
+    shared_frame_ = nullptr;
+    ++frame_count_;
+    
+    // replace the oldest frame in the index, then unlink it
+    int ind = frame_count_ % kMaxFramesInBuffer;
+    FrameIndexEntry &entry = frame_index_->entries[ind];
+    entry.frame_number.store(-1);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry.map_length = shared_length_;
+    entry.ping_msec = PingTime(new_frame.header);
+    entry.frame_number.store(frame_count_, std::memory_order_release);
+    frame_index_->last_frame.store(frame_count_, std::memory_order_release);
+    shm_unlink(shm_names_[ind].c_str());
         
+    NotifyReaders(shared_name_, shared_length_);
+    
+    // save the name of new frame
+    //NIMS_LOG_DEBUG << "Replacing framebuffer slot " << ind << " (" << shm_names_[ind]
+    //   << ") with (" << shared_name_ << ")";
+    shm_names_[ind] = shared_name_;
+
+    return frame_count_;
+    
+} // FrameBufferWriter::PublishSharedFrame
+
+//-----------------------------------------------------------------------------
+// Remove a shared frame that was created but not published.
+void FrameBufferWriter::DiscardSharedFrame()
+{
+    munmap(shared_frame_, shared_length_);
+    shm_unlink(shared_name_.c_str());
+    shared_frame_ = nullptr;
+    reserved_data_ = nullptr;
+    reserved_size_ = 0;
+    
+} // FrameBufferWriter::DiscardSharedFrame
+
+//-----------------------------------------------------------------------------
+// Copy a new frame into its slot in the ring.  Returns the index of the
+// new frame.
+long FrameBufferWriter::PutRingFrame(const Frame &new_frame)
+{
+    RingControl *ctl = (RingControl *)ring_;
+    size_t data_size = new_frame.size();
+    if (kSlotDataOffset + data_size > ctl->slot_size)
+    {
+        NIMS_LOG_ERROR << "PutNewFrame: frame of " << data_size 
+                       << " bytes does not fit in a ring slot";
+        return -1;
+    }
+    
+    int64_t n = frame_count_ + 1;
+    BeginRingFrame(n);
+    memcpy((char *)SlotForFrame(ring_, n) + kSlotDataOffset, 
+           new_frame.data_ptr(), data_size);
+    return EndRingFrame(new_frame, n);
+    
+} // FrameBufferWriter::PutRingFrame
+
+//-----------------------------------------------------------------------------
+// Mark the slot for frame n as being written, once blocking readers are
+// done with the frame it holds.
+void FrameBufferWriter::BeginRingFrame(int64_t frame_number)
+{
+    RingControl *ctl = (RingControl *)ring_;
+    WaitForBlockingReaders(frame_number - ctl->num_slots);
+    RingSlot *slot = SlotForFrame(ring_, frame_number);
+    slot->seq.store(2*frame_number - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    
+} // FrameBufferWriter::BeginRingFrame
+
+//-----------------------------------------------------------------------------
+// Finish frame n, whose data is in its slot, and wake the readers.  Returns
+// the index of the new frame.
+long FrameBufferWriter::EndRingFrame(const Frame &new_frame, int64_t frame_number)
+{
+    RingControl *ctl = (RingControl *)ring_;
+    const int64_t n = frame_number;
+    RingSlot *slot = SlotForFrame(ring_, n);
+    
+    slot->frame_number = n;
+    slot->data_size = new_frame.size();
+    memcpy(&(slot->header), &(new_frame.header), sizeof(new_frame.header));
+    slot->header.geometry_id = PublishGeometry(new_frame);
+    
+    slot->seq.store(2*n, std::memory_order_release);
+    ctl->last_frame.store(n, std::memory_order_release);
+    frame_count_ = n;
+    
+    // wake ring readers
+    ctl->notify_seq.fetch_add(1);
+    if (ctl->waiters.load() > 0)
+        futex(&(ctl->notify_seq), FUTEX_WAKE, INT_MAX);
+    
+    // readers using message queues
+    NotifyReaders(ring_name_, ring_size_);
+    
+    return n;
+    
+} // FrameBufferWriter::EndRingFrame
+
+//-----------------------------------------------------------------------------
+// Wait until every reader with the kLagBlock policy is done with a frame,
+// so its slot can be reused.  Readers that have exited are dropped.
+void FrameBufferWriter::WaitForBlockingReaders(int64_t frame_number)
+{
+    if (frame_number <= 0) return;
+    
+    RingControl *ctl = (RingControl *)ring_;
+    uint64_t start_ns = 0; // set once the writer has to wait
+    for (int k=0; k<kMaxRingReaders; ++k)
+    {
+        RingReader &reader = ctl->readers[k];
+        while (reader.pid.load() != 0 && reader.policy.load() == kLagBlock
+               && reader.done_frame.load() < frame_number)
+        {
+            if (start_ns == 0) start_ns = StatsClock();
+            // same handshake as the readers use on notify_seq
+            ctl->writer_waiting.store(1);
+            uint32_t seq = ctl->reader_seq.load();
+            if (reader.done_frame.load() >= frame_number) break;
+            
+            struct timespec timeout = { 0, 100000000 }; // 100 ms
+            if (-1 == futex(&(ctl->reader_seq), FUTEX_WAIT, seq, &timeout)
+                && errno == EINTR)
+            {
+                nims_perror("PutNewFrame waiting for reader");
+                break;
+            }
+            
+            int32_t pid = reader.pid.load();
+            if (pid != 0 && -1 == kill(pid, 0) && errno == ESRCH)
+            {
+                NIMS_LOG_WARNING << "PutNewFrame: dropping ring reader " << pid 
+                                 << ", which has exited";
+                reader.pid.compare_exchange_strong(pid, 0);
+            }
+        }
+    }
+    ctl->writer_waiting.store(0);
+    if (start_ns != 0 && stats_ != nullptr)
+    {
+        StatsAdd<uint64_t>(stats_->blocked_puts, 1);
+        StatsAdd<uint64_t>(stats_->blocked_ns_total, StatsClock() - start_ns);
+    }
+    
+} // FrameBufferWriter::WaitForBlockingReaders
+
+//-----------------------------------------------------------------------------
+// Send a message with the latest frame number to each connected reader.
+void FrameBufferWriter::NotifyReaders(const std::string &shm_name, size_t map_length)
+{
     // create a message to notify the consumers
     // lock around access to mq_readers_, since it's shared between threads
     (void) pthread_mutex_lock(&mqr_lock_);
-    NIMS_LOG_DEBUG << "sending frame messages to " << mq_readers_.size() << " readers";
-    //FrameMsg msg(frame_count_, map_length, shared_name);
-    FrameMsg msg(frame_count_, map_length, shared_name);
+    FrameMsg msg(frame_count_, map_length, shm_name);
 //NIMS_LOG_DEBUG << "size of frame msg is " << sizeof(msg)  << " bytes";
   //struct timespec tm;
    // clock_gettime(CLOCK_REALTIME, &tm); // get the current time
@@ -239,7 +865,21 @@ long FrameBufferWriter::PutNewFrame(const Frame &new_frame)
     {
         //if (0 != mq_timedsend(mq_readers_[k], (char *)(&msg), sizeof(msg), 0, &tm))
         if (0 != mq_send(mq_readers_[k], (char *)(&msg), sizeof(msg), 0))
-       {
+        {
+            if (errno == EAGAIN) CountQueueFull(k);
+            else if (stats_ != nullptr) StatsAdd<uint64_t>(stats_->queue_errors, 1);
+            // a ring reader with a full queue has a wake-up already
+            if (errno == EAGAIN && ring_ != nullptr) continue;
+            // A per-frame reader that does not block the writer loses its
+            // oldest message to make room; it sees the gap in frame numbers.
+            if (errno == EAGAIN)
+            {
+                FrameMsg oldest;
+                mq_receive(mq_readers_[k], (char *)(&oldest), sizeof(oldest), 0);
+                if (0 == mq_send(mq_readers_[k], (char *)(&msg), sizeof(msg), 0)) continue;
+                if (errno == EAGAIN) continue;
+            }
+            
             // TODO:  Need to handle an error here more comprehensively. 
             //        If there is problem with queue, may need to remove it from the list.
             nims_perror("mq_send() in FrameBufferInterface::PutNewFrame");
@@ -248,53 +888,446 @@ long FrameBufferWriter::PutNewFrame(const Frame &new_frame)
     } // for mq_readers_
     (void) pthread_mutex_unlock(&mqr_lock_);
     
-    // unlink oldest shared frame and save the name of new frame
-    int ind = frame_count_ % kMaxFramesInBuffer;
-    shm_unlink(shm_names_[ind].c_str());
-    //NIMS_LOG_DEBUG << "Replacing framebuffer slot " << ind << " (" << shm_names_[ind]
-    //   << ") with (" << shared_name << ")";
-    shm_names_[ind] = shared_name;
+} // FrameBufferWriter::NotifyReaders
 
-    return frame_count_;
+//-----------------------------------------------------------------------------
+// Count a frame message that reader queue k had no room for.
+void FrameBufferWriter::CountQueueFull(int reader)
+{
+    if (stats_ == nullptr) return;
+    StatsAdd<uint64_t>(stats_->queue_full, 1);
+    for (int k=0; k<kMaxStatsReaders; ++k)
+    {
+        FrameBufferReaderStats &entry = stats_->readers[k];
+        if (entry.pid.load(std::memory_order_relaxed) == mq_reader_pids_[reader])
+        {
+            StatsAdd<uint64_t>(entry.queue_full, 1);
+            break;
+        }
+    }
     
-} // FrameBufferWriter::PutNewFrame
+} // FrameBufferWriter::CountQueueFull
 
-//-----------------------------------------------------------------------------	    
-void FrameBufferWriter::CleanUp()
+//-----------------------------------------------------------------------------
+// Create and map the frame ring.  It is mapped once here and stays
+// mapped until CleanUp.
+int FrameBufferWriter::CreateRing()
 {
-   // wait for connection thread to return
-    if (t_.joinable())
-    {
-       char msg = 'x';
-       NIMS_LOG_DEBUG << "sending exit message to connection thread";
-        mq_send(mqw_, &msg, sizeof(msg), 0);
-        NIMS_LOG_DEBUG << "waiting for thread to return";
-        t_.join();
-        mq_unlink(mqw_name_.c_str());
-        mq_close(mqw_);
-        NIMS_LOG_DEBUG << __func__ << " cleaned up thread and writer queue";
-     }
+    const size_t page_size = params_.huge_pages ? kHugePageSize : kPageSize;
+    const size_t slot_size = (kSlotDataOffset + params_.slot_bytes + kPageSize - 1)
+                             / kPageSize * kPageSize;
+    const size_t slots_offset = (sizeof(RingControl) / page_size + 1) * page_size;
+    ring_size_ = slots_offset + slot_size * params_.num_slots;
+    ring_size_ = (ring_size_ + page_size - 1) / page_size * page_size;
     
-    // close reader message queues
-    for (int k=0; k<mq_readers_.size(); ++k) {
-        mq_close(mq_readers_[k]);
-        NIMS_LOG_DEBUG << __func__ << " cleaned up reader queue " << mq_readers_[k];
+    NIMS_LOG_DEBUG << "creating frame ring " << ring_name_ << " with " 
+                   << params_.num_slots << " slots of " << slot_size << " bytes";
+    
+    if (params_.persistent && params_.huge_pages)
+        NIMS_LOG_WARNING << "a frame ring in huge pages can't be persistent";
+    int64_t last_frame = 0;
+    if (params_.persistent && !params_.huge_pages)
+    {
+        ring_ = TakeOverRing(slot_size, slots_offset, &last_frame);
+        if (ring_ != nullptr) return 0;
     }
     
-    // clean up shared memory
-    for (int k=0; k<kMaxFramesInBuffer; ++k) {
-        shm_unlink(shm_names_[k].c_str());
-        // ??? could this be a std::vector
-        if (shm_names_[k].size())
-            NIMS_LOG_DEBUG << __func__ << " cleaned up " << shm_names_[k];
+    char *ring = nullptr;
+    if (params_.huge_pages) ring = CreateHugePageRing();
+    if (ring == nullptr)
+    {
+        int fd = shm_open(ring_name_.c_str(), O_CREAT | O_TRUNC | O_RDWR, 
+                S_IRUSR | S_IWUSR);
+        if (-1 == fd) {
+            nims_perror("shm_open() in FrameBufferWriter::CreateRing");
+            return -1;
+        }
+        if (0 != ftruncate(fd, ring_size_)) {
+            nims_perror("ftruncate() in FrameBufferWriter::CreateRing");
+            close(fd);
+            shm_unlink(ring_name_.c_str());
+            return -1;
+        }
+        ring = (char *)mmap(NULL, ring_size_, PROT_READ | PROT_WRITE, 
+                            MAP_SHARED, fd, 0);
+        close(fd);
+        if (MAP_FAILED == ring) {
+            nims_perror("mmap() in FrameBufferWriter::CreateRing");
+            shm_unlink(ring_name_.c_str());
+            return -1;
+        }
     }
     
-    pthread_mutex_destroy(&mqr_lock_);
+    // ftruncate zero-fills, so every slot starts with seq = 0 (empty)
+    RingControl *ctl = (RingControl *)ring;
+    ctl->num_slots = params_.num_slots;
+    ctl->slot_size = slot_size;
+    ctl->slots_offset = slots_offset;
+    ctl->map_size = ring_size_;
+    ctl->last_frame.store(last_frame);
+    ctl->first_frame = last_frame + 1;
+    ctl->notify_seq.store(0);
+    ctl->waiters.store(0);
+    ctl->writer_generation.store(1);
+    ctl->replaced.store(0);
+    std::atomic_thread_fence(std::memory_order_release);
+    ctl->magic = kRingMagic;
     
-} // FrameBufferWriter::CleanUp
-	    
-//-----------------------------------------------------------------------------	    
-void FrameBufferWriter::HandleMessages()
+    ring_ = ring;
+    return 0;
+    
+} // FrameBufferWriter::CreateRing
+
+//-----------------------------------------------------------------------------
+// Map the ring left by an earlier writer and take it over if its layout 
+// is the same.  Returns nullptr if there is none to take over; last_frame
+// is then the number of the last frame in the old ring, or 0.
+char* FrameBufferWriter::TakeOverRing(size_t slot_size, size_t slots_offset, 
+                                      int64_t* last_frame)
+{
+    *last_frame = 0;
+    int fd = shm_open(ring_name_.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+    if (-1 == fd) return nullptr;
+    
+    struct stat st;
+    char *ring = (char *)MAP_FAILED;
+    if (0 == fstat(fd, &st) && st.st_size >= (off_t)sizeof(RingControl))
+        ring = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, 
+                            MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == ring) 
+    {
+        shm_unlink(ring_name_.c_str());
+        return nullptr;
+    }
+    
+    RingControl *ctl = (RingControl *)ring;
+    if (ctl->magic != kRingMagic || ctl->map_size != (uint64_t)st.st_size)
+    {
+        munmap(ring, st.st_size);
+        shm_unlink(ring_name_.c_str());
+        return nullptr;
+    }
+    *last_frame = ctl->last_frame.load();
+    
+    // keep waking the readers that asked the old writer to
+    for (int k=0; k<kMaxRingReaders; ++k)
+    {
+        int32_t pid = ctl->readers[k].pid.load();
+        mqd_t mqr = OpenReadyQueue(fb_name_, pid);
+        if (mqr == -1) continue;
+        mq_readers_.push_back(mqr);
+        mq_reader_pids_.push_back(pid);
+    }
+    
+    if (ctl->num_slots == (uint32_t)params_.num_slots && ctl->slot_size == slot_size
+        && ctl->slots_offset == slots_offset && ctl->map_size == ring_size_)
+    {
+        // the old writer may have died waiting for a reader
+        ctl->writer_waiting.store(0);
+        uint32_t generation = ctl->writer_generation.fetch_add(1) + 1;
+        NIMS_LOG_WARNING << "taking over frame ring " << ring_name_ << " after frame " 
+                         << *last_frame << " as writer generation " << generation;
+        return ring;
+    }
+    
+    // Readers move to the new ring once it is there; wake them to look.
+    NIMS_LOG_WARNING << "frame ring " << ring_name_ << " has a different layout; replacing it";
+    shm_unlink(ring_name_.c_str());
+    ctl->replaced.store(1);
+    ctl->notify_seq.fetch_add(1);
+    futex(&(ctl->notify_seq), FUTEX_WAKE, INT_MAX);
+    FrameMsg msg(*last_frame, 0, ring_name_);
+    for (size_t k=0; k<mq_readers_.size(); ++k)
+        mq_send(mq_readers_[k], (char *)(&msg), sizeof(msg), 0);
+    munmap(ring, st.st_size);
+    return nullptr;
+    
+} // FrameBufferWriter::TakeOverRing
+
+//-----------------------------------------------------------------------------
+// Create and map a memfd of ring_size_ bytes backed by huge pages, and
+// start handing it to readers.  Returns nullptr if the ring should fall
+// back to normal shared memory.
+char* FrameBufferWriter::CreateHugePageRing()
+{
+    char *ring = (char *)MAP_FAILED;
+    int fd = memfd(ring_name_.c_str(), MFD_CLOEXEC | MFD_HUGETLB);
+    if (fd != -1)
+    {
+        // mmap fails if there are not enough huge pages reserved
+        if (0 == ftruncate(fd, ring_size_))
+            ring = (char *)mmap(NULL, ring_size_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (MAP_FAILED == ring)
+        {
+            NIMS_LOG_WARNING << "no huge pages for the frame ring (see " 
+                             << "/proc/sys/vm/nr_hugepages); trying transparent huge pages";
+            close(fd);
+            fd = -1;
+        }
+        else NIMS_LOG_DEBUG << "frame ring is in huge pages";
+    }
+    if (fd == -1 && -1 != (fd = memfd(ring_name_.c_str(), MFD_CLOEXEC)))
+    {
+        if (0 == ftruncate(fd, ring_size_))
+            ring = (char *)mmap(NULL, ring_size_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+        if (MAP_FAILED == ring)
+        {
+            close(fd);
+            fd = -1;
+        }
+        // only a hint; depends on /sys/kernel/mm/transparent_hugepage/shmem_enabled
+        else if (0 != madvise(ring, ring_size_, MADV_HUGEPAGE))
+            NIMS_LOG_WARNING << "transparent huge pages are not available for the frame ring";
+    }
+    if (fd == -1)
+    {
+        nims_perror("FrameBufferWriter::CreateRing huge pages");
+        NIMS_LOG_WARNING << "using normal pages for the frame ring";
+        return nullptr;
+    }
+    
+    // readers get the descriptor from the ring socket
+    ring_socket_ = ListenUnixSocket(ring_name_);
+    if (-1 == ring_socket_)
+    {
+        munmap(ring, ring_size_);
+        close(fd);
+        NIMS_LOG_WARNING << "using normal pages for the frame ring";
+        return nullptr;
+    }
+    ring_fd_ = fd;
+    t_ring_ = std::thread(&FrameBufferWriter::HandleRingConnections, this);
+    return ring;
+    
+} // FrameBufferWriter::CreateHugePageRing
+
+//-----------------------------------------------------------------------------
+// Thread function that sends the ring memfd to each reader that connects.
+void FrameBufferWriter::HandleRingConnections()
+{
+    int sock;
+    // accept fails once CleanUp shuts down the socket
+    while (-1 != (sock = accept(ring_socket_, nullptr, nullptr)))
+    {
+        SendFileDescriptor(sock, ring_fd_);
+        close(sock);
+    }
+    
+} // FrameBufferWriter::HandleRingConnections
+
+//-----------------------------------------------------------------------------
+// Create and map the geometry table.
+int FrameBufferWriter::CreateGeometryTable()
+{
+    // Readers of a persistent ring keep the table mapped, so don't truncate
+    // it under them; new geometries are numbered on from the last one.
+    const int trunc = (ring_ != nullptr && params_.persistent) ? 0 : O_TRUNC;
+    int fd = shm_open(geometry_name_.c_str(), O_CREAT | trunc | O_RDWR, 
+            S_IRUSR | S_IWUSR);
+    if (-1 == fd) {
+        nims_perror("shm_open() in FrameBufferWriter::CreateGeometryTable");
+        return -1;
+    }
+    if (0 != ftruncate(fd, sizeof(GeometryTable))) {
+        nims_perror("ftruncate() in FrameBufferWriter::CreateGeometryTable");
+        close(fd);
+        shm_unlink(geometry_name_.c_str());
+        return -1;
+    }
+    void *table = mmap(NULL, sizeof(GeometryTable), PROT_READ | PROT_WRITE, 
+                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == table) {
+        nims_perror("mmap() in FrameBufferWriter::CreateGeometryTable");
+        shm_unlink(geometry_name_.c_str());
+        return -1;
+    }
+    
+    // zero-filled, so nothing is published yet
+    geometry_table_ = (GeometryTable *)table;
+    geometry_table_->magic = kRingMagic;
+    geometry_.reset();
+    return 0;
+    
+} // FrameBufferWriter::CreateGeometryTable
+
+//-----------------------------------------------------------------------------
+// Publish the geometry of a new frame if it differs from the last one.
+// Returns the generation of the frame's geometry, or 0 if it has none.
+uint32_t FrameBufferWriter::PublishGeometry(const Frame &new_frame)
+{
+    if (!new_frame.geometry) return 0;
+    
+    // usually the data source hands us the same object every ping
+    if (geometry_ && (new_frame.geometry == geometry_ 
+                      || new_frame.geometry->same_beams(*geometry_)))
+        return geometry_->generation;
+    
+    uint32_t generation = geometry_table_->latest.load() + 1;
+    std::shared_ptr<FrameGeometry> geometry(new FrameGeometry(*new_frame.geometry));
+    geometry->generation = generation;
+    
+    GeometryEntry &entry = geometry_table_->entries[generation % kMaxGeometries];
+    entry.published.store(0);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&entry.geometry, geometry.get(), sizeof(FrameGeometry));
+    entry.published.store(generation, std::memory_order_release);
+    geometry_table_->latest.store(generation, std::memory_order_release);
+    
+    NIMS_LOG_DEBUG << "published geometry " << generation << " with " 
+                   << geometry->num_beams << " beams";
+    geometry_ = geometry;
+    return generation;
+    
+} // FrameBufferWriter::PublishGeometry
+
+//-----------------------------------------------------------------------------
+// Create and map the per-frame index.
+int FrameBufferWriter::CreateFrameIndex()
+{
+    int fd = shm_open(index_name_.c_str(), O_CREAT | O_TRUNC | O_RDWR, 
+            S_IRUSR | S_IWUSR);
+    if (-1 == fd) {
+        nims_perror("shm_open() in FrameBufferWriter::CreateFrameIndex");
+        return -1;
+    }
+    if (0 != ftruncate(fd, sizeof(FrameIndex))) {
+        nims_perror("ftruncate() in FrameBufferWriter::CreateFrameIndex");
+        close(fd);
+        shm_unlink(index_name_.c_str());
+        return -1;
+    }
+    void *index = mmap(NULL, sizeof(FrameIndex), PROT_READ | PROT_WRITE, 
+                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == index) {
+        nims_perror("mmap() in FrameBufferWriter::CreateFrameIndex");
+        shm_unlink(index_name_.c_str());
+        return -1;
+    }
+    
+    // zero-filled, so entries are for frame 0, which never exists
+    frame_index_ = (FrameIndex *)index;
+    frame_index_->magic = kRingMagic;
+    return 0;
+    
+} // FrameBufferWriter::CreateFrameIndex
+
+//-----------------------------------------------------------------------------
+// Create and map the statistics block.  Like the geometry table, it is 
+// kept for the readers of a persistent ring, and the counts go on.
+int FrameBufferWriter::CreateStats()
+{
+    const int trunc = (ring_ != nullptr && params_.persistent) ? 0 : O_TRUNC;
+    int fd = shm_open(stats_name_.c_str(), O_CREAT | trunc | O_RDWR, 
+            S_IRUSR | S_IWUSR);
+    if (-1 == fd) {
+        nims_perror("shm_open() in FrameBufferWriter::CreateStats");
+        return -1;
+    }
+    if (0 != ftruncate(fd, sizeof(FrameBufferStats))) {
+        nims_perror("ftruncate() in FrameBufferWriter::CreateStats");
+        close(fd);
+        shm_unlink(stats_name_.c_str());
+        return -1;
+    }
+    void *stats = mmap(NULL, sizeof(FrameBufferStats), PROT_READ | PROT_WRITE, 
+                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == stats) {
+        nims_perror("mmap() in FrameBufferWriter::CreateStats");
+        shm_unlink(stats_name_.c_str());
+        return -1;
+    }
+    
+    // zero-filled, so all counts are 0 and the reader entries are free
+    stats_ = (FrameBufferStats *)stats;
+    stats_->magic = kStatsMagic;
+    stats_->writer_pid.store(getpid());
+    return 0;
+    
+} // FrameBufferWriter::CreateStats
+
+//-----------------------------------------------------------------------------	    
+void FrameBufferWriter::CleanUp()
+{
+   // wait for connection thread to return
+    if (t_.joinable())
+    {
+       char msg = 'x';
+       NIMS_LOG_DEBUG << "sending exit message to connection thread";
+        mq_send(mqw_, &msg, sizeof(msg), 0);
+        NIMS_LOG_DEBUG << "waiting for thread to return";
+        t_.join();
+        mq_unlink(mqw_name_.c_str());
+        mq_close(mqw_);
+        NIMS_LOG_DEBUG << __func__ << " cleaned up thread and writer queue";
+     }
+    
+    // close reader message queues
+    for (int k=0; k<mq_readers_.size(); ++k) {
+        mq_close(mq_readers_[k]);
+        NIMS_LOG_DEBUG << __func__ << " cleaned up reader queue " << mq_readers_[k];
+    }
+    mq_readers_.clear();
+    mq_reader_pids_.clear();
+    
+    // clean up shared memory
+    if (shared_frame_ != nullptr) DiscardSharedFrame();
+    reserved_data_ = nullptr;
+    reserved_size_ = 0;
+    if (t_ring_.joinable())
+    {
+        shutdown(ring_socket_, SHUT_RDWR);
+        t_ring_.join();
+    }
+    if (ring_socket_ != -1) close(ring_socket_);
+    ring_socket_ = -1;
+    if (ring_fd_ != -1) close(ring_fd_);
+    ring_fd_ = -1;
+    if (ring_ != nullptr) {
+        munmap(ring_, ring_size_);
+        ring_ = nullptr;
+        NIMS_LOG_DEBUG << __func__ << " cleaned up " << ring_name_;
+    }
+    if (geometry_table_ != nullptr) {
+        munmap(geometry_table_, sizeof(GeometryTable));
+        geometry_table_ = nullptr;
+    }
+    if (frame_index_ != nullptr) {
+        munmap(frame_index_, sizeof(FrameIndex));
+        frame_index_ = nullptr;
+    }
+    if (stats_ != nullptr) {
+        stats_->writer_pid.store(0);
+        munmap(stats_, sizeof(FrameBufferStats));
+        stats_ = nullptr;
+    }
+    // always unlink, in case these were left behind by an earlier run,
+    // except what the next writer of a persistent ring takes over
+    if (!params_.persistent || !params_.ring || params_.huge_pages)
+    {
+        shm_unlink(ring_name_.c_str());
+        shm_unlink(geometry_name_.c_str());
+        shm_unlink(stats_name_.c_str());
+    }
+    shm_unlink(index_name_.c_str());
+    for (int k=0; k<kMaxFramesInBuffer; ++k) {
+        shm_unlink(shm_names_[k].c_str());
+        // ??? could this be a std::vector
+        if (shm_names_[k].size())
+            NIMS_LOG_DEBUG << __func__ << " cleaned up " << shm_names_[k];
+    }
+    
+    pthread_mutex_destroy(&mqr_lock_);
+    
+} // FrameBufferWriter::CleanUp
+	    
+//-----------------------------------------------------------------------------	    
+void FrameBufferWriter::HandleMessages()
 {
     char msg[kMaxMessageSize];
     mqd_t mqr;
@@ -314,13 +1347,36 @@ void FrameBufferWriter::HandleMessages()
         NIMS_LOG_DEBUG << "got a message with " << numbytes << " bytes: " << msg;
         if (numbytes==1 && msg[0] == 'x') return;
         
-        // Open reader message queue.
-        NIMS_LOG_DEBUG << "opening message queue " << msg;
-        mqr = mq_open(msg,O_WRONLY);
+        // The message is the reader's queue name and its lag policy.
+        uint32_t policy = kLagBlock;
+        char *space = strchr(msg, ' ');
+        if (space != nullptr)
+        {
+            policy = atoi(space + 1);
+            *space = '\0';
+        }
+        
+        // Open reader message queue.  Only a per-frame kLagBlock reader
+        // makes the writer wait for room; for the others the writer drops
+        // the oldest message, so it can read the queue too.  Ring readers
+        // only use the messages to wake up.
+        NIMS_LOG_DEBUG << "opening message queue " << msg << ", lag policy " << policy;
+        if (ring_ == nullptr && policy == kLagBlock)
+            mqr = mq_open(msg, O_WRONLY);
+        else
+            mqr = mq_open(msg, O_RDWR | O_NONBLOCK);
+        if (mqr == -1)
+        {
+            nims_perror("connection thread opening reader queue");
+            continue;
+        }
         //mq_unlink(msg);
         
         (void) pthread_mutex_lock(&mqr_lock_);
         mq_readers_.push_back(mqr); // Add it to the list.
+        // the queue is named for the reader's pid
+        const char *pid = strrchr(msg, '-');
+        mq_reader_pids_.push_back(pid != nullptr ? atoi(pid + 1) : 0);
         (void) pthread_mutex_unlock(&mqr_lock_);
     }
     
@@ -336,6 +1392,23 @@ FrameBufferReader::FrameBufferReader(const std::string &fb_name)
     mqw_name_ = "/" + fb_name;
     mqw_ = -1;
     mqr_ = -1;
+    ring_name_ = "/" + fb_name_ + "-ring";
+    ring_ = nullptr;
+    ring_size_ = 0;
+    next_frame_ = 0;
+    last_msg_frame_ = -1;
+    replaying_ = false;
+    policy_ = kLagDropOldest;
+    reader_index_ = -1;
+    writer_generation_ = 0;
+    frames_skipped_ = 0;
+    geometry_name_ = "/" + fb_name_ + "-geometry";
+    geometry_table_ = nullptr;
+    index_name_ = "/" + fb_name_ + "-index";
+    frame_index_ = nullptr;
+    stats_name_ = "/" + fb_name_ + "-stats";
+    stats_ = nullptr;
+    stats_index_ = -1;
    
    NIMS_LOG_DEBUG << "max messsage size is " << kMaxMessageSize;
    
@@ -348,11 +1421,34 @@ FrameBufferReader::~FrameBufferReader()
     mq_close(mqr_);
     mq_unlink(mqr_name_.c_str());
     NIMS_LOG_DEBUG << __func__ << " cleaned up message queue " << mqr_name_;
+    if (ring_ != nullptr) 
+    {
+        // give up our reader entry and let the writer know
+        if (reader_index_ != -1)
+        {
+            RingControl *ctl = (RingControl *)ring_;
+            ctl->readers[reader_index_].pid.store(0);
+            ctl->reader_seq.fetch_add(1);
+            if (ctl->writer_waiting.load())
+                futex(&(ctl->reader_seq), FUTEX_WAKE, 1);
+        }
+        munmap(ring_, ring_size_);
+    }
+    if (geometry_table_ != nullptr)
+        munmap((void *)geometry_table_, sizeof(GeometryTable));
+    if (frame_index_ != nullptr)
+        munmap((void *)frame_index_, sizeof(FrameIndex));
+    if (stats_ != nullptr)
+    {
+        if (stats_index_ != -1) stats_->readers[stats_index_].pid.store(0);
+        munmap(stats_, sizeof(FrameBufferStats));
+    }
 
 } // FrameBufferReader Destructor
 
-int FrameBufferReader::Connect()
+int FrameBufferReader::Connect(LagPolicy policy)
 {
+        policy_ = policy;
          // create the message queue for reading new data messages
         mqr_name_ = "/" + fb_name_ + "-mq-" + boost::lexical_cast<std::string>(getpid());
        NIMS_LOG_DEBUG << "creating reader message queue " << mqr_name_;
@@ -391,8 +1487,46 @@ int FrameBufferReader::Connect()
            return -1;
        }
 
+       // The writer creates the geometry table before its queue.  Without
+       // it, frames come without their geometry.
+       if (-1 == MapGeometryTable())
+           NIMS_LOG_WARNING << "FrameBufferReader::Connect: no frame geometry from " 
+                            << geometry_name_;
+       // Nor is it a problem to go uncounted.
+       if (-1 == MapStats())
+           NIMS_LOG_DEBUG << "FrameBufferReader::Connect: not counted in " << stats_name_;
+
+       // The writer creates the ring, if it uses one, before its queue.
+       // Ring readers wait on the ring itself instead of a message queue.
+       if (MapRing() == 0)
+       {
+           mq_close(mqw_);
+           mqw_ = -1;
+           mq_close(mqr_);
+           mq_unlink(mqr_name_.c_str());
+           mqr_ = -1;
+           // start with the next new frame
+           RingControl *ctl = (RingControl *)ring_;
+           next_frame_ = ctl->last_frame.load() + 1;
+           writer_generation_ = ctl->writer_generation.load();
+           if (-1 == ClaimRingReader())
+           {
+               munmap(ring_, ring_size_);
+               ring_ = nullptr;
+               return -1;
+           }
+           return 0;
+       }
+
+       // Without the index, only new frames can be read.
+       if (-1 == MapFrameIndex())
+           NIMS_LOG_WARNING << "FrameBufferReader::Connect: no frame index from " 
+                            << index_name_;
+       
+       // frames written from now on and not received count as skipped
+       last_msg_frame_ = (frame_index_ != nullptr) ? latest_frame() : -1;
        NIMS_LOG_DEBUG << "sending connection message";
-       if (-1 == mq_send(mqw_, mqr_name_.c_str(), mqr_name_.size(), 0))
+       if (-1 == SendConnectMsg(mqw_))
        {
            nims_perror("FrameBufferReader::Connect mq_send");
            // clean up
@@ -407,78 +1541,1028 @@ int FrameBufferReader::Connect()
 }
 
 //-----------------------------------------------------------------------------
-// Get the next frame in the buffer, "next" meaning
-// relative to the last frame that was retrieved by the
-// calling process.  Returns the index of the frame if successful.
-long FrameBufferReader::GetNextFrame(Frame* next_frame)
+// Ask the writer to send frame messages to this reader's queue:  the queue
+// name and the lag policy, which says whether the writer waits for room.
+int FrameBufferReader::SendConnectMsg(mqd_t mqw)
 {
-    if ( !connected() ) return -1;
+    std::string msg = mqr_name_ + " " + boost::lexical_cast<std::string>((int)policy_);
+    return mq_send(mqw, msg.c_str(), msg.size(), 0);
     
-    // TODO:  Not sure if this is a valid test to make sure the caller
-    //        is passing the address of a Frame struct.
-    if (next_frame == nullptr)
+} // FrameBufferReader::SendConnectMsg
+
+//-----------------------------------------------------------------------------
+// Claim an entry in the reader table of the ring; take over entries of
+// readers that exited without releasing theirs.  Returns -1 if the table
+// is full.
+int FrameBufferReader::ClaimRingReader()
+{
+    RingControl *ctl = (RingControl *)ring_;
+    reader_index_ = -1;
+    for (int k=0; k<kMaxRingReaders && reader_index_ == -1; ++k)
     {
-        NIMS_LOG_ERROR << "GetNextFrame: pointer argument must be initialized!";
+        RingReader &reader = ctl->readers[k];
+        int32_t pid = reader.pid.load();
+        if (pid != 0 && !(-1 == kill(pid, 0) && errno == ESRCH)) continue;
+        if (!reader.pid.compare_exchange_strong(pid, getpid())) continue;
+        reader.done_frame.store(next_frame_ - 1);
+        reader.frames_read.store(0);
+        reader.frames_skipped.store(0);
+        reader.policy.store(policy_);
+        reader_index_ = k;
+    }
+    if (reader_index_ == -1)
+    {
+        NIMS_LOG_ERROR << "FrameBufferReader: too many readers for " << ring_name_;
         return -1;
     }
-    // Read messages until we get a valid shared memory name.  If the reader
-    // is behind, then a message may be old and the shared memory name 
-    // contained in the message may already be unlinked.
-    FrameMsg msg;
-     int fd = -1; // shared memory file descriptor
-     while ( fd == -1 )
+    NIMS_LOG_DEBUG << "ring reader " << reader_index_ << ", lag policy " << policy_;
+    return 0;
+    
+} // FrameBufferReader::ClaimRingReader
+
+//-----------------------------------------------------------------------------
+// Keep up with a restarted writer of a persistent ring:  move to the new
+// ring if the writer replaced ours.  Returns -1 if this reader has lost 
+// the ring.
+int FrameBufferReader::CheckRingWriter()
+{
+    RingControl *ctl = (RingControl *)ring_;
+    if (ctl->replaced.load())
     {
-        // Note this will block if queue is empty.
-        if ( -1 == mq_receive(mqr_, (char *)&msg, sizeof(msg), 0) )
+        // MapRing fails until the writer has finished the new ring
+        char *old_ring = ring_;
+        size_t old_size = ring_size_;
+        if (-1 == MapRing()) return 0;
+        
+        ctl->readers[reader_index_].pid.store(0);
+        munmap(old_ring, old_size);
+        if (-1 == ClaimRingReader())
         {
-            nims_perror("GetNextFrame");
+            munmap(ring_, ring_size_);
+            ring_ = nullptr;
             return -1;
         }
-        // Attempt to open the shared memory.
-        fd = shm_open(msg.shm_open_name, O_RDONLY, S_IRUSR);
-   }
+        // frames between our next one and the new ring's first are lost
+        ctl = (RingControl *)ring_;
+        if (next_frame_ < ctl->first_frame)
+        {
+            CountSkipped(ctl->first_frame - next_frame_);
+            next_frame_ = ctl->first_frame;
+            ctl->readers[reader_index_].done_frame.store(next_frame_ - 1);
+        }
+        NIMS_LOG_WARNING << "moved to the new frame ring " << ring_name_ 
+                         << " at frame " << next_frame_;
+        writer_generation_ = 0;
+    }
     
-  //   NIMS_LOG_DEBUG << "FrameBufferReader: getting frame " 
-  //                 << msg.frame_number << " in " << msg.shm_open_name
-  //                 << ", " << msg.mapped_data_size << " bytes";
-    // size of mmap region
-    assert(msg.mapped_data_size > sizeof(Frame));
-     
-    // mmap a shared framebuffer on the file descriptor we have from shm_open
-    char *shared_frame;
-    shared_frame = (char *)mmap(NULL, msg.mapped_data_size,
-                                            PROT_READ, MAP_PRIVATE, fd, 0);
+    uint32_t generation = ctl->writer_generation.load();
+    if (generation == writer_generation_) return 0;
+    NIMS_LOG_WARNING << "frame buffer writer restarted (generation " << generation 
+                     << "); continuing at frame " << next_frame_;
+    writer_generation_ = generation;
+    return 0;
     
-    close(fd);
+} // FrameBufferReader::CheckRingWriter
+
+//-----------------------------------------------------------------------------
+// Map the writer's frame ring, if there is one.  Returns 0 if the ring
+// was mapped, -1 if the writer puts frames in separate shared memory objects.
+int FrameBufferReader::MapRing()
+{
+    // Readers write to the control block (see WaitForRingFrame)
+    int fd = shm_open(ring_name_.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+    bool huge_pages = false;
+    if (-1 == fd)
+    {
+        // a ring in huge pages has no name; ask the writer for it
+        int sock = ConnectUnixSocket(ring_name_);
+        if (-1 == sock) return -1;
+        fd = ReceiveFileDescriptor(sock);
+        close(sock);
+        if (-1 == fd) return -1;
+        huge_pages = true;
+    }
     
-    // !!! early return
-    if (MAP_FAILED == shared_frame) {
-        nims_perror("mmap() in GetNextFrame");
+    // map the control block first to find out how big the ring is
+    RingControl *ctl = (RingControl *)mmap(NULL, sizeof(RingControl),
+                                            PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == ctl) {
+        nims_perror("mmap() in FrameBufferReader::MapRing");
+        close(fd);
         return -1;
     }
-    // copy the data into this address space
-    memset(&(next_frame->header), 0, sizeof(next_frame->header));
-    //NIMS_LOG_DEBUG << "copying header, " << sizeof(next_frame->header) << " bytes";
-    memcpy(&(next_frame->header), shared_frame, sizeof(next_frame->header));
-    size_t data_size;
-    memcpy(&data_size, shared_frame + sizeof(next_frame->header), sizeof(data_size));
-    next_frame->malloc_data(data_size);
-    if (next_frame->size() != data_size)
-    {
-        NIMS_LOG_ERROR << "Error: Can't allocate memory for frame data.";
+    size_t ring_size = 0;
+    if (ctl->magic == kRingMagic)
+        ring_size = ctl->map_size;
+    munmap(ctl, sizeof(RingControl));
+    
+    if (ring_size == 0) {
+        NIMS_LOG_WARNING << ring_name_ << " is not initialized; using per-frame shared memory";
+        close(fd);
         return -1;
     }
-    //NIMS_LOG_DEBUG << "copying data, " << data_size << " bytes";
-    memcpy(next_frame->data_ptr(), shared_frame + sizeof(next_frame->header) 
-           + sizeof(data_size), data_size);
     
-    // clean up
-    //clog << "GetNextFrame: unmapping shared memory" << endl;
-    munmap(shared_frame, msg.mapped_data_size);
+    char *ring = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, 
+                              MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == ring) {
+        nims_perror("mmap() in FrameBufferReader::MapRing");
+        return -1;
+    }
+    // but the frames are read-only
+    const size_t slots_offset = ((RingControl *)ring)->slots_offset;
+    if (0 != mprotect(ring + slots_offset, ring_size - slots_offset, PROT_READ))
+        nims_perror("mprotect() in FrameBufferReader::MapRing");
+    if (huge_pages) madvise(ring, ring_size, MADV_HUGEPAGE);
+    ring_ = ring;
+    ring_size_ = ring_size;
+    NIMS_LOG_DEBUG << "mapped frame ring " << ring_name_ << ", " << ring_size_ << " bytes";
+    return 0;
     
-    //clog << "GetNextFrame: Done." << endl;
-    return msg.frame_number;
+} // FrameBufferReader::MapRing
+
+//-----------------------------------------------------------------------------
+// Get the next frame in the buffer, "next" meaning
+// relative to the last frame that was retrieved by the
+// calling process.  Returns the index of the frame if successful.
+long FrameBufferReader::GetNextFrame(Frame* next_frame)
+{
+    ReleaseRingFrames();
+    return GetFrame(next_frame, true);
     
 } // FrameBufferReader::GetNextFrame
-	    
 
+//-----------------------------------------------------------------------------
+long FrameBufferReader::GetNextFrame(FrameView* next_view)
+{
+    ReleaseRingFrames();
+    return GetView(next_view, true);
+    
+} // FrameBufferReader::GetNextFrame
+
+//-----------------------------------------------------------------------------
+// Get the next frame if there is one ready.  Returns the index of the 
+// frame, 0 if there is none, or -1 on error.
+long FrameBufferReader::TryGetNextFrame(Frame* next_frame)
+{
+    ReleaseRingFrames();
+    return GetFrame(next_frame, false);
+    
+} // FrameBufferReader::TryGetNextFrame
+
+//-----------------------------------------------------------------------------
+long FrameBufferReader::TryGetNextFrame(FrameView* next_view)
+{
+    ReleaseRingFrames();
+    return GetView(next_view, false);
+    
+} // FrameBufferReader::TryGetNextFrame
+
+//-----------------------------------------------------------------------------
+// Get a batch of frames with one wait.  The ring frames of the last batch 
+// are released once, up front, so a kLagBlock writer can't reuse the slots
+// of earlier views in the batch while later ones are taken.
+int FrameBufferReader::GetNextFrames(FrameView* views, int max_frames)
+{
+    if (views == nullptr || max_frames < 1)
+    {
+        NIMS_LOG_ERROR << "GetNextFrames: need at least one view";
+        return -1;
+    }
+    for (int k=0; k<max_frames; ++k) views[k].Release();
+    if (policy_ == kLagLatest) max_frames = 1;
+    
+    ReleaseRingFrames();
+    int count = 0;
+    while (count < max_frames)
+    {
+        long n = GetView(&views[count], count == 0);
+        if (n == -1 && count == 0) return -1;
+        if (n <= 0) break;
+        ++count;
+    }
+    return count;
+    
+} // FrameBufferReader::GetNextFrames
+
+//-----------------------------------------------------------------------------
+int FrameBufferReader::GetNextFrames(FrameHeader* headers, void* data, 
+                                     size_t frame_stride, int max_frames, 
+                                     long* frame_numbers)
+{
+    if (headers == nullptr || data == nullptr || max_frames < 1)
+    {
+        NIMS_LOG_ERROR << "GetNextFrames: pointer arguments must be initialized!";
+        return -1;
+    }
+    if (policy_ == kLagLatest) max_frames = 1;
+    
+    ReleaseRingFrames();
+    FrameView view;
+    int count = 0;
+    while (count < max_frames)
+    {
+        long n = GetView(&view, count == 0);
+        if (n == -1 && count == 0) return -1;
+        if (n <= 0) break;
+        if (view.size() > frame_stride)
+        {
+            NIMS_LOG_WARNING << "GetNextFrames: skipping frame " << n << ", which is " 
+                             << view.size() << " bytes";
+            CountSkipped(1);
+            continue;
+        }
+        headers[count] = view.header();
+        memcpy((char *)data + count*frame_stride, view.data_ptr(), view.size());
+        if (!view.valid()) // overwritten while copying
+        {
+            CountSkipped(1);
+            continue;
+        }
+        if (frame_numbers != nullptr) frame_numbers[count] = n;
+        ++count;
+    }
+    return count;
+    
+} // FrameBufferReader::GetNextFrames
+
+//-----------------------------------------------------------------------------
+// Copy the next frame, waiting for it if wait is set.  Returns the index
+// of the frame, 0 if there is none and wait is not set, or -1 on error.
+long FrameBufferReader::GetFrame(Frame* next_frame, bool wait)
+{
+    if ( !connected() ) return -1;
+    
+    // TODO:  Not sure if this is a valid test to make sure the caller
+    //        is passing the address of a Frame struct.
+    if (next_frame == nullptr)
+    {
+        NIMS_LOG_ERROR << "GetNextFrame: pointer argument must be initialized!";
+        return -1;
+    }
+    // With a ring, wait until we get a frame that has not been overwritten.
+    if (ring_ != nullptr)
+    {
+        int64_t n = -1;
+        int ret = -1;
+        while (ret == -1)
+        {
+            if ( 0 >= (n = WaitForRingFrame(wait)) ) return n;
+            ret = GetRingFrame(n, next_frame);
+            next_frame_ = n + 1;
+            if (ret == -1) CountSkipped(1); // overwritten while reading
+        }
+        CountRead(n);
+        return n;
+    }
+    
+    // After SeekFrame, get frames from the index until caught up.
+    while (replaying_)
+    {
+        int64_t n = next_frame_;
+        if (n > latest_frame()) { replaying_ = false; break; }
+        ++next_frame_;
+        if (GetFrameAt(n, next_frame) == n) { CountRead(n); return n; }
+        CountSkipped(1);
+    }
+    
+    // Read messages until we get a frame that still exists.  If the reader
+    // is behind, then a message may be old and the shared memory name 
+    // contained in the message may already be unlinked.
+    FrameMsg msg;
+    int ret = -1;
+    while (ret == -1)
+    {
+        // Note this will block if queue is empty and wait is set.
+        int got = ReceiveFrameMsg(&msg, wait);
+        if (got != 1) return got;
+        if (msg.frame_number < next_frame_) continue; // already replayed
+        ret = GetSharedFrame(msg.shm_open_name, msg.mapped_data_size, next_frame);
+        if (ret == -1) CountSkipped(1);
+    }
+    next_frame_ = msg.frame_number + 1;
+    CountRead(msg.frame_number);
+    return msg.frame_number;
+    
+} // FrameBufferReader::GetFrame
+
+//-----------------------------------------------------------------------------
+// Copy a per-frame shared memory object.  Returns 0 if successful, or -1 
+// if the object no longer exists.
+int FrameBufferReader::GetSharedFrame(const char *shm_name, size_t map_length, 
+                                      Frame* next_frame)
+{
+    int fd = shm_open(shm_name, O_RDONLY, S_IRUSR);
+    if (fd == -1) return -1;
+    
+    // size of mmap region
+    assert(map_length > sizeof(Frame));
+     
+    // mmap a shared framebuffer on the file descriptor we have from shm_open
+    char *shared_frame;
+    shared_frame = (char *)mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    close(fd);
+    
+    // !!! early return
+    if (MAP_FAILED == shared_frame) {
+        nims_perror("mmap() in GetNextFrame");
+        return -1;
+    }
+    // copy the data into this address space
+    memset(&(next_frame->header), 0, sizeof(next_frame->header));
+    memcpy(&(next_frame->header), shared_frame, sizeof(next_frame->header));
+    size_t data_size;
+    memcpy(&data_size, shared_frame + sizeof(next_frame->header), sizeof(data_size));
+    next_frame->malloc_data(data_size);
+    if (next_frame->size() != data_size)
+    {
+        NIMS_LOG_ERROR << "Error: Can't allocate memory for frame data.";
+        munmap(shared_frame, map_length);
+        return -1;
+    }
+    memcpy(next_frame->data_ptr(), shared_frame + sizeof(next_frame->header) 
+           + sizeof(data_size), data_size);
+    
+    // clean up
+    munmap(shared_frame, map_length);
+    
+    next_frame->geometry = GetGeometry(next_frame->header.geometry_id);
+    return 0;
+    
+} // FrameBufferReader::GetSharedFrame
+	    
+
+//-----------------------------------------------------------------------------
+// Copy a frame out of the ring.  Returns 0 if successful, or -1 if the 
+// frame was overwritten before or while it was copied.
+int FrameBufferReader::GetRingFrame(int64_t frame_number, Frame* next_frame)
+{
+    const RingSlot *slot = SlotForFrame(ring_, frame_number);
+    const uint64_t seq = 2*frame_number;
+    if (slot->seq.load(std::memory_order_acquire) != seq)
+    {
+        NIMS_LOG_WARNING << "GetNextFrame: frame " << frame_number 
+                         << " was overwritten before it was read";
+        return -1;
+    }
+    
+    size_t data_size = slot->data_size;
+    memcpy(&(next_frame->header), &(slot->header), sizeof(next_frame->header));
+    next_frame->malloc_data(data_size);
+    if (next_frame->size() != data_size)
+    {
+        NIMS_LOG_ERROR << "Error: Can't allocate memory for frame data.";
+        return -1;
+    }
+    memcpy(next_frame->data_ptr(), (const char *)slot + kSlotDataOffset, data_size);
+    
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) != seq)
+    {
+        NIMS_LOG_WARNING << "GetNextFrame: frame " << frame_number 
+                         << " was overwritten while it was read";
+        return -1;
+    }
+    next_frame->geometry = GetGeometry(next_frame->header.geometry_id);
+    return 0;
+    
+} // FrameBufferReader::GetRingFrame
+
+//-----------------------------------------------------------------------------
+// Get the next frame without copying it out of shared memory, waiting for
+// it if wait is set.  Returns the index of the frame, 0 if there is none 
+// and wait is not set, or -1 on error.
+long FrameBufferReader::GetView(FrameView* next_view, bool wait)
+{
+    if ( !connected() ) return -1;
+    
+    if (next_view == nullptr)
+    {
+        NIMS_LOG_ERROR << "GetNextFrame: pointer argument must be initialized!";
+        return -1;
+    }
+    next_view->Release();
+    
+    if (ring_ != nullptr)
+    {
+        int64_t n = -1;
+        int ret = -1;
+        while (ret == -1)
+        {
+            if ( 0 >= (n = WaitForRingFrame(wait)) ) return n;
+            ret = GetRingView(n, next_view);
+            next_frame_ = n + 1;
+            if (ret == -1) CountSkipped(1); // overwritten while reading
+        }
+        CountRead(n);
+        return n;
+    }
+    
+    // After SeekFrame, get frames from the index until caught up.
+    while (replaying_)
+    {
+        int64_t n = next_frame_;
+        if (n > latest_frame()) { replaying_ = false; break; }
+        ++next_frame_;
+        if (GetFrameAt(n, next_view) == n) { CountRead(n); return n; }
+        CountSkipped(1);
+    }
+    
+    // Read messages until we get a frame that still exists.
+    FrameMsg msg;
+    int ret = -1;
+    while (ret == -1)
+    {
+        int got = ReceiveFrameMsg(&msg, wait);
+        if (got != 1) return got;
+        if (msg.frame_number < next_frame_) continue; // already replayed
+        ret = MapFrameView(msg.shm_open_name, msg.mapped_data_size, 
+                           msg.frame_number, next_view);
+        if (ret == -1) CountSkipped(1);
+    }
+    next_frame_ = msg.frame_number + 1;
+    next_view->geometry_ = GetGeometry(next_view->header().geometry_id);
+    CountRead(msg.frame_number);
+    return msg.frame_number;
+    
+} // FrameBufferReader::GetView
+
+//-----------------------------------------------------------------------------
+// Point a view at a frame in the ring.  Returns 0 if successful, or -1 
+// if the frame has already been overwritten.
+int FrameBufferReader::GetRingView(int64_t frame_number, FrameView* view)
+{
+    const RingSlot *slot = SlotForFrame(ring_, frame_number);
+    const uint64_t seq = 2*frame_number;
+    if (slot->seq.load(std::memory_order_acquire) != seq)
+    {
+        NIMS_LOG_WARNING << "GetNextFrame: frame " << frame_number 
+                         << " was overwritten before it was read";
+        return -1;
+    }
+    view->header_ = &(slot->header);
+    view->pdata_ = (const framedata_t *)((const char *)slot + kSlotDataOffset);
+    view->data_size_ = slot->data_size;
+    view->frame_number_ = frame_number;
+    view->slot_ = slot;
+    view->seq_ = seq;
+    
+    // make sure data_size belonged to this frame
+    if (!view->valid())
+    {
+        view->Release();
+        return -1;
+    }
+    view->geometry_ = GetGeometry(view->header_->geometry_id);
+    return 0;
+    
+} // FrameBufferReader::GetRingView
+
+//-----------------------------------------------------------------------------
+// Map a per-frame shared memory object for a view.  The mapping belongs to
+// the view, so it stays valid after the writer unlinks the object.  Returns
+// 0 if successful, or -1 if the object no longer exists.
+int FrameBufferReader::MapFrameView(const char *shm_name, size_t map_length,
+                                    int64_t frame_number, FrameView* view)
+{
+    int fd = shm_open(shm_name, O_RDONLY, S_IRUSR);
+    if (fd == -1) return -1;
+    
+    assert(map_length > sizeof(Frame));
+    char *shared_frame = (char *)mmap(NULL, map_length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == shared_frame) {
+        nims_perror("mmap() in GetNextFrame");
+        return -1;
+    }
+    
+    size_t data_size;
+    memcpy(&data_size, shared_frame + sizeof(FrameHeader), sizeof(data_size));
+    view->header_ = (const FrameHeader *)shared_frame;
+    view->pdata_ = (const framedata_t *)(shared_frame + sizeof(FrameHeader) 
+                                         + sizeof(data_size));
+    view->data_size_ = data_size;
+    view->frame_number_ = frame_number;
+    view->map_ = shared_frame;
+    view->map_length_ = map_length;
+    return 0;
+    
+} // FrameBufferReader::MapFrameView
+
+//-----------------------------------------------------------------------------
+// Map the writer's geometry table read-only.
+int FrameBufferReader::MapGeometryTable()
+{
+    int fd = shm_open(geometry_name_.c_str(), O_RDONLY, S_IRUSR);
+    if (fd == -1) return -1;
+    void *table = mmap(NULL, sizeof(GeometryTable), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == table) {
+        nims_perror("mmap() in FrameBufferReader::MapGeometryTable");
+        return -1;
+    }
+    geometry_table_ = (const GeometryTable *)table;
+    return 0;
+    
+} // FrameBufferReader::MapGeometryTable
+
+//-----------------------------------------------------------------------------
+// Get a published geometry.  The last one is kept, so it is only copied
+// out of shared memory when the generation changes.  Returns nullptr if
+// the frame has no geometry or it has been replaced in the table.
+std::shared_ptr<const FrameGeometry> FrameBufferReader::GetGeometry(uint32_t generation)
+{
+    if (generation == 0 || geometry_table_ == nullptr) return nullptr;
+    if (geometry_ && geometry_->generation == generation) return geometry_;
+    
+    const GeometryEntry &entry = geometry_table_->entries[generation % kMaxGeometries];
+    std::shared_ptr<FrameGeometry> geometry(new FrameGeometry);
+    if (entry.published.load(std::memory_order_acquire) == generation)
+    {
+        memcpy(geometry.get(), &entry.geometry, sizeof(FrameGeometry));
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    if (entry.published.load(std::memory_order_relaxed) != generation 
+        || geometry->generation != generation)
+    {
+        NIMS_LOG_WARNING << "GetNextFrame: geometry " << generation 
+                         << " is no longer available";
+        return nullptr;
+    }
+    NIMS_LOG_DEBUG << "got geometry " << generation << " with " 
+                   << geometry->num_beams << " beams";
+    geometry_ = geometry;
+    return geometry_;
+    
+} // FrameBufferReader::GetGeometry
+
+//-----------------------------------------------------------------------------
+// *******  FrameView  ********
+//-----------------------------------------------------------------------------
+FrameView::FrameView()
+{
+    header_ = nullptr;
+    pdata_ = nullptr;
+    data_size_ = 0;
+    frame_number_ = -1;
+    slot_ = nullptr;
+    seq_ = 0;
+    map_ = nullptr;
+    map_length_ = 0;
+    
+} // FrameView Constructor
+
+bool FrameView::valid() const
+{
+    if (header_ == nullptr) return false;
+    // per-frame shared memory is never reused
+    if (slot_ == nullptr) return true;
+    
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot_->seq.load(std::memory_order_relaxed) == seq_;
+    
+} // FrameView::valid
+
+void FrameView::Release()
+{
+    if (map_ != nullptr) munmap(map_, map_length_);
+    header_ = nullptr;
+    pdata_ = nullptr;
+    data_size_ = 0;
+    frame_number_ = -1;
+    slot_ = nullptr;
+    seq_ = 0;
+    map_ = nullptr;
+    map_length_ = 0;
+    geometry_.reset();
+    
+} // FrameView::Release
+
+//-----------------------------------------------------------------------------
+// Sleep until the writer has put frame next_frame_ in the ring.  Returns
+// the number of the frame, -1 if interrupted by a signal, or 0 if wait is
+// not set and the frame is not there yet.
+int64_t FrameBufferReader::WaitForRingFrame(bool wait)
+{
+    if (-1 == CheckRingWriter()) return -1;
+    
+    // Empty the ready queue before looking at the ring, so a frame that
+    // comes after this leaves the queue readable.
+    DrainReadyQueue();
+    
+    RingControl *ctl = (RingControl *)ring_;
+    while (ctl->last_frame.load(std::memory_order_acquire) < next_frame_)
+    {
+        if (!wait) return 0;
+        
+        // Register as a waiter before sampling the futex word, so the 
+        // writer either sees us waiting or changes the word first.
+        ctl->waiters.fetch_add(1);
+        uint32_t seq = ctl->notify_seq.load();
+        if (ctl->last_frame.load(std::memory_order_acquire) < next_frame_)
+        {
+            // wake up now and then in case the writer has gone away
+            struct timespec timeout = { 1, 0 };
+            if (-1 == futex(&(ctl->notify_seq), FUTEX_WAIT, seq, &timeout)
+                && errno == EINTR)
+            {
+                ctl->waiters.fetch_sub(1);
+                nims_perror("GetNextFrame");
+                return -1;
+            }
+        }
+        ctl->waiters.fetch_sub(1);
+        
+        if (-1 == CheckRingWriter()) return -1;
+        ctl = (RingControl *)ring_;
+    }
+    
+    // apply the lag policy
+    const int64_t last = ctl->last_frame.load(std::memory_order_acquire);
+    const int64_t oldest = last - ctl->num_slots + 1; // oldest frame in the ring
+    int64_t first = next_frame_;
+    if (policy_ == kLagLatest) first = last;
+    else if (policy_ == kLagDropOldest) first = std::max(next_frame_, oldest);
+    if (first > next_frame_)
+    {
+        CountSkipped(first - next_frame_);
+        next_frame_ = first;
+    }
+    
+    return next_frame_;
+    
+} // FrameBufferReader::WaitForRingFrame
+
+//-----------------------------------------------------------------------------
+// Receive the next new frame message (per-frame mode).  A kLagLatest reader
+// discards queued messages for all but the newest frame rather than trying
+// to open frames that the writer has probably already unlinked.  Messages
+// the writer dropped for want of room count as skipped frames.  Returns 1
+// if a message was received, 0 if wait is not set and the queue is empty,
+// or -1 on error.
+int FrameBufferReader::ReceiveFrameMsg(FrameMsg* msg, bool wait)
+{
+    // Note this will block if queue is empty and wait is set.  A timeout
+    // in the past makes mq_timedreceive return at once.
+    const struct timespec now = { 0, 0 };
+    if ( -1 == (wait ? mq_receive(mqr_, (char *)msg, sizeof(*msg), 0)
+                     : mq_timedreceive(mqr_, (char *)msg, sizeof(*msg), 0, &now)) )
+    {
+        if (!wait && errno == ETIMEDOUT) return 0;
+        nims_perror("GetNextFrame");
+        return -1;
+    }
+    CountDroppedMsgs(*msg);
+    if (policy_ != kLagLatest) return 1;
+    
+    struct mq_attr attr;
+    while (0 == mq_getattr(mqr_, &attr) && attr.mq_curmsgs > 0)
+    {
+        if ( -1 == mq_receive(mqr_, (char *)msg, sizeof(*msg), 0) )
+        {
+            nims_perror("GetNextFrame");
+            return -1;
+        }
+        CountSkipped(1);
+        CountDroppedMsgs(*msg);
+    }
+    return 1;
+    
+} // FrameBufferReader::ReceiveFrameMsg
+
+//-----------------------------------------------------------------------------
+// Count the frames between the last message received and this one.
+void FrameBufferReader::CountDroppedMsgs(const FrameMsg &msg)
+{
+    if (last_msg_frame_ >= 0 && msg.frame_number > last_msg_frame_ + 1)
+        CountSkipped(msg.frame_number - last_msg_frame_ - 1);
+    last_msg_frame_ = msg.frame_number;
+    
+} // FrameBufferReader::CountDroppedMsgs
+
+//-----------------------------------------------------------------------------
+// Discard the wake-up messages a ring reader gets once it has asked for a
+// ready descriptor; the ring itself says which frames are there.
+void FrameBufferReader::DrainReadyQueue()
+{
+    if (mqr_ == -1) return;
+    
+    FrameMsg msg;
+    const struct timespec now = { 0, 0 };
+    while (-1 != mq_timedreceive(mqr_, (char *)&msg, sizeof(msg), 0, &now))
+        ;
+    
+} // FrameBufferReader::DrainReadyQueue
+
+//-----------------------------------------------------------------------------
+// Descriptor that is readable when there may be a frame to get.
+int FrameBufferReader::GetReadyFd()
+{
+    if ( !connected() ) return -1;
+    if (mqr_ != -1) return mqr_; // on Linux, a message queue is a descriptor
+    
+    // A ring reader waits on a futex, which can't be polled, so ask the 
+    // writer for a message per frame as well.
+    mqr_name_ = "/" + fb_name_ + "-mq-" + boost::lexical_cast<std::string>(getpid());
+    mqr_ = CreateMessageQueue(mqr_name_, kMaxMessageSize);
+    if (mqr_ == -1) 
+    {
+        nims_perror("FrameBufferReader::GetReadyFd mq_open reader");
+        return -1;
+    }
+    mqd_t mqw = mq_open(mqw_name_.c_str(), O_WRONLY);
+    if (mqw == -1 || -1 == SendConnectMsg(mqw))
+    {
+        nims_perror("FrameBufferReader::GetReadyFd connecting to writer");
+        if (mqw != -1) mq_close(mqw);
+        mq_close(mqr_);
+        mq_unlink(mqr_name_.c_str());
+        mqr_ = -1;
+        return -1;
+    }
+    mq_close(mqw);
+    return mqr_;
+    
+} // FrameBufferReader::GetReadyFd
+
+//-----------------------------------------------------------------------------
+// Tell the writer that this reader is done with every frame before 
+// next_frame_.  Only the writer's kLagBlock wait looks at this.
+void FrameBufferReader::ReleaseRingFrames()
+{
+    if (ring_ == nullptr) return;
+    
+    RingControl *ctl = (RingControl *)ring_;
+    RingReader &reader = ctl->readers[reader_index_];
+    reader.done_frame.store(next_frame_ - 1);
+    if (policy_ == kLagBlock)
+    {
+        ctl->reader_seq.fetch_add(1);
+        if (ctl->writer_waiting.load())
+            futex(&(ctl->reader_seq), FUTEX_WAKE, 1);
+    }
+    
+} // FrameBufferReader::ReleaseRingFrames
+
+//-----------------------------------------------------------------------------
+// Count a frame this reader got.
+void FrameBufferReader::CountRead(int64_t frame_number)
+{
+    if (ring_ != nullptr)
+        ReaderEntry(ring_, reader_index_).frames_read.fetch_add(1, std::memory_order_relaxed);
+    if (stats_index_ != -1)
+    {
+        FrameBufferReaderStats &entry = stats_->readers[stats_index_];
+        StatsAdd<uint64_t>(entry.frames_read, 1);
+        entry.last_frame.store(frame_number, std::memory_order_relaxed);
+    }
+    
+} // FrameBufferReader::CountRead
+
+//-----------------------------------------------------------------------------
+// Count frames this reader did not get.
+void FrameBufferReader::CountSkipped(int64_t num_frames)
+{
+    frames_skipped_ += num_frames;
+    if (ring_ != nullptr)
+        ReaderEntry(ring_, reader_index_).frames_skipped.fetch_add(num_frames, 
+                                                        std::memory_order_relaxed);
+    if (stats_index_ != -1)
+        StatsAdd<uint64_t>(stats_->readers[stats_index_].frames_skipped, num_frames);
+    
+} // FrameBufferReader::CountSkipped
+
+//-----------------------------------------------------------------------------
+// Number of frames written but not yet retrieved by this reader.
+long FrameBufferReader::lag() const
+{
+    if (ring_ != nullptr)
+    {
+        RingControl *ctl = (RingControl *)ring_;
+        return std::max<int64_t>(0, ctl->last_frame.load() - (next_frame_ - 1));
+    }
+    
+    if (replaying_)
+        return std::max<int64_t>(0, latest_frame() - (next_frame_ - 1));
+    
+    // messages waiting in our queue
+    struct mq_attr attr;
+    if (mqr_ == -1 || -1 == mq_getattr(mqr_, &attr)) return 0;
+    return attr.mq_curmsgs;
+    
+} // FrameBufferReader::lag
+
+//-----------------------------------------------------------------------------
+// Number of the newest frame in the buffer, or 0 if there is none.
+long FrameBufferReader::latest_frame() const
+{
+    if (ring_ != nullptr)
+        return ((RingControl *)ring_)->last_frame.load(std::memory_order_acquire);
+    if (frame_index_ != nullptr)
+        return frame_index_->last_frame.load(std::memory_order_acquire);
+    return 0;
+    
+} // FrameBufferReader::latest_frame
+
+//-----------------------------------------------------------------------------
+// Number of the oldest frame in the buffer.  It is only a guess; the writer
+// may be overwriting it already.
+long FrameBufferReader::oldest_frame() const
+{
+    int64_t num_frames = kMaxFramesInBuffer;
+    if (ring_ != nullptr) num_frames = ((RingControl *)ring_)->num_slots;
+    return std::max<int64_t>(1, latest_frame() - num_frames + 1);
+    
+} // FrameBufferReader::oldest_frame
+
+//-----------------------------------------------------------------------------
+// Copy a frame in the buffer by number.  Returns the frame number if 
+// successful, or -1 if the frame is not in the buffer.
+long FrameBufferReader::GetFrameAt(long frame_number, Frame* frame)
+{
+    if ( !connected() || frame == nullptr ) return -1;
+    if (frame_number < oldest_frame() || frame_number > latest_frame()) return -1;
+    
+    if (ring_ != nullptr)
+        return GetRingFrame(frame_number, frame) == 0 ? frame_number : -1;
+    
+    size_t map_length;
+    uint64_t ping_msec;
+    if (-1 == LookupSharedFrame(frame_number, &map_length, &ping_msec)) return -1;
+    if (-1 == GetSharedFrame(SharedFrameName(frame_number).c_str(), map_length, frame))
+        return -1;
+    return frame_number;
+    
+} // FrameBufferReader::GetFrameAt
+
+//-----------------------------------------------------------------------------
+// Point a view at a frame in the buffer by number.  Returns the frame 
+// number if successful, or -1 if the frame is not in the buffer.
+long FrameBufferReader::GetFrameAt(long frame_number, FrameView* view)
+{
+    if ( !connected() || view == nullptr ) return -1;
+    view->Release();
+    if (frame_number < oldest_frame() || frame_number > latest_frame()) return -1;
+    
+    if (ring_ != nullptr)
+        return GetRingView(frame_number, view) == 0 ? frame_number : -1;
+    
+    size_t map_length;
+    uint64_t ping_msec;
+    if (-1 == LookupSharedFrame(frame_number, &map_length, &ping_msec)) return -1;
+    if (-1 == MapFrameView(SharedFrameName(frame_number).c_str(), map_length, 
+                           frame_number, view))
+        return -1;
+    view->geometry_ = GetGeometry(view->header().geometry_id);
+    return frame_number;
+    
+} // FrameBufferReader::GetFrameAt
+
+//-----------------------------------------------------------------------------
+// Binary search of the buffer for the first frame pinged at or after the 
+// given time.  Returns the frame number, or -1 if there is none.
+long FrameBufferReader::FindFrame(uint32_t ping_sec, uint32_t ping_millisec)
+{
+    if ( !connected() ) return -1;
+    
+    const uint64_t ping_msec = (uint64_t)ping_sec*1000 + ping_millisec;
+    const int64_t last = latest_frame();
+    int64_t first = oldest_frame();
+    int64_t end = last + 1;
+    while (first < end)
+    {
+        int64_t mid = first + (end - first)/2;
+        uint64_t mid_msec;
+        // a frame that is gone was older than the ones still there
+        if (-1 == GetPingTime(mid, &mid_msec) || mid_msec < ping_msec)
+            first = mid + 1;
+        else
+            end = mid;
+    }
+    return first <= last ? first : -1;
+    
+} // FrameBufferReader::FindFrame
+
+//-----------------------------------------------------------------------------
+// Make GetNextFrame continue from a frame in the buffer.  Returns the 
+// number of the next frame.
+long FrameBufferReader::SeekFrame(long frame_number)
+{
+    if ( !connected() ) return -1;
+    if (policy_ == kLagLatest)
+    {
+        NIMS_LOG_WARNING << "SeekFrame: a kLagLatest reader always gets the newest frame";
+        return -1;
+    }
+    
+    next_frame_ = std::min<int64_t>(std::max<int64_t>(frame_number, oldest_frame()), 
+                                    latest_frame() + 1);
+    // ring readers get frames from the ring anyway
+    if (ring_ == nullptr) replaying_ = true;
+    NIMS_LOG_DEBUG << "SeekFrame: next frame is " << next_frame_;
+    return next_frame_;
+    
+} // FrameBufferReader::SeekFrame
+
+//-----------------------------------------------------------------------------
+// Ping time of a frame in the buffer, in milliseconds.  Returns 0 if 
+// successful, or -1 if the frame is not in the buffer.
+int FrameBufferReader::GetPingTime(int64_t frame_number, uint64_t* ping_msec) const
+{
+    if (ring_ == nullptr)
+    {
+        size_t map_length;
+        return LookupSharedFrame(frame_number, &map_length, ping_msec);
+    }
+    
+    const RingSlot *slot = SlotForFrame(ring_, frame_number);
+    const uint64_t seq = 2*frame_number;
+    if (slot->seq.load(std::memory_order_acquire) != seq) return -1;
+    *ping_msec = PingTime(slot->header);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) != seq) return -1;
+    return 0;
+    
+} // FrameBufferReader::GetPingTime
+
+//-----------------------------------------------------------------------------
+// Look up a frame in the per-frame index.  Returns 0 if successful, or -1
+// if the frame is not listed.
+int FrameBufferReader::LookupSharedFrame(int64_t frame_number, size_t* map_length, 
+                                         uint64_t* ping_msec) const
+{
+    if (frame_index_ == nullptr || frame_number < 1) return -1;
+    
+    const FrameIndexEntry &entry = frame_index_->entries[frame_number % kMaxFramesInBuffer];
+    if (entry.frame_number.load(std::memory_order_acquire) != frame_number) return -1;
+    *map_length = entry.map_length;
+    *ping_msec = entry.ping_msec;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.frame_number.load(std::memory_order_relaxed) != frame_number) return -1;
+    return 0;
+    
+} // FrameBufferReader::LookupSharedFrame
+
+//-----------------------------------------------------------------------------
+// Shared memory name of a frame in per-frame mode.
+std::string FrameBufferReader::SharedFrameName(int64_t frame_number) const
+{
+    return "/" + fb_name_ + "-" + boost::lexical_cast<std::string>(frame_number);
+    
+} // FrameBufferReader::SharedFrameName
+
+//-----------------------------------------------------------------------------
+// Map the writer's per-frame index read-only.
+int FrameBufferReader::MapFrameIndex()
+{
+    int fd = shm_open(index_name_.c_str(), O_RDONLY, S_IRUSR);
+    if (fd == -1) return -1;
+    void *index = mmap(NULL, sizeof(FrameIndex), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == index) {
+        nims_perror("mmap() in FrameBufferReader::MapFrameIndex");
+        return -1;
+    }
+    frame_index_ = (const FrameIndex *)index;
+    return 0;
+    
+} // FrameBufferReader::MapFrameIndex
+
+//-----------------------------------------------------------------------------
+// Map the statistics block and claim an entry in its readers table, taking
+// over entries of readers that exited without giving theirs up.  Returns
+// -1 if there is no block or no free entry.
+int FrameBufferReader::MapStats()
+{
+    int fd = shm_open(stats_name_.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+    if (-1 == fd) return -1;
+    void *stats = mmap(NULL, sizeof(FrameBufferStats), PROT_READ | PROT_WRITE, 
+                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == stats) {
+        nims_perror("mmap() in FrameBufferReader::MapStats");
+        return -1;
+    }
+    if (((FrameBufferStats *)stats)->magic != kStatsMagic) {
+        munmap(stats, sizeof(FrameBufferStats));
+        return -1;
+    }
+    stats_ = (FrameBufferStats *)stats;
+    
+    for (int k=0; k<kMaxStatsReaders && stats_index_ == -1; ++k)
+    {
+        FrameBufferReaderStats &entry = stats_->readers[k];
+        int32_t pid = entry.pid.load();
+        if (pid != 0 && !(-1 == kill(pid, 0) && errno == ESRCH)) continue;
+        if (!entry.pid.compare_exchange_strong(pid, getpid())) continue;
+        entry.policy.store(policy_);
+        entry.last_frame.store(0);
+        entry.frames_read.store(0);
+        entry.frames_skipped.store(0);
+        entry.queue_full.store(0);
+        stats_index_ = k;
+    }
+    return (stats_index_ == -1) ? -1 : 0;
+    
+} // FrameBufferReader::MapStats
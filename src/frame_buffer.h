@@ -16,13 +16,91 @@
 #include <vector>
 #include <thread>   // for threads
 #include <iostream> // clog
+#include <memory>   // shared_ptr
 
 // TODO:  Change these to all caps, like old-school constants/macros
-const int kMaxBeams = 512;
+const int kMaxBeams = 1024; // MAX_NUM_BEAMS of the M3
 const int kMaxSamples = 20000;
 // TODO:  Need a rational determination based on memory, frame size/page size, 
 //        frame rate.  
 const int kMaxFramesInBuffer = 100;
+// number of geometries kept in shared memory, so frames still in the
+// buffer can refer to the geometry before the latest one
+const int kMaxGeometries = 8;
+// maximum number of readers attached to a frame ring at once
+const int kMaxRingReaders = 16;
+
+// What a reader does when it falls behind the writer.
+enum LagPolicy {
+    kLagBlock,       // get every frame; the writer waits for this reader
+    kLagDropOldest,  // get every frame still in the ring, skip overwritten ones
+    kLagLatest       // always jump to the newest frame
+};
+
+// How the samples of a frame are stored (FrameHeader::encoding).  The 
+// 16-bit encodings halve the size of a frame in the buffer; readers widen
+// the samples to framedata_t with DecodeSamples.
+enum SampleEncoding {
+    kSampleFloat32 = 0, // framedata_t
+    kSampleFloat16 = 1, // IEEE 754 half precision
+    kSampleUInt16  = 2  // value = data_scale*sample + data_offset
+};
+
+// What the sample values are (FrameHeader::units).  Calibrated frames are
+// volume backscattering strength, Sv, from the ingester's calibration.
+enum SampleUnits {
+    kUnitsSonar      = 0, // as the sonar gives them
+    kUnitsSvLinear   = 1, // sv (1/m)
+    kUnitsSvDecibels = 2  // Sv (dB re 1/m)
+};
+
+// Frame buffer options, from the FRAMEBUFFER section of config.yaml.
+struct FrameBufferParams {
+  // Share frames through one preallocated ring of fixed-size slots,
+  // mapped once by the writer and each reader, instead of creating a
+  // new shared memory object for every ping.
+  bool ring;
+  int num_slots;      // number of frames kept in the ring
+  size_t slot_bytes;  // largest frame (data bytes) a slot can hold
+  // Back the ring with huge pages, falling back to normal pages.
+  bool huge_pages;
+  // Leave the ring and geometry table in place when the writer exits, so
+  // a restarted writer takes them over and readers keep reading.  Not 
+  // with huge_pages, whose ring goes away with the writer.
+  bool persistent;
+
+  FrameBufferParams()
+  {
+      ring = false;
+      huge_pages = false;
+      persistent = false;
+      num_slots = kMaxFramesInBuffer;
+      slot_bytes = 4*1024*1024;
+  };
+};
+
+// Beam geometry of the sonar, which rarely changes during a run.  The
+// frame buffer writer publishes each geometry to shared memory once and 
+// numbers it; frames refer to it by FrameHeader::geometry_id instead of
+// carrying the beam angles with every ping.
+struct FrameGeometry
+{
+    uint32_t  generation;      // set by FrameBufferWriter when published
+    uint32_t  num_beams;       // number of beams
+    // NOTE: The beam angles of the M3 are not uniformly spaced; they are
+    // wider at the ends of the array and narrower in the middle.
+    float     beam_angles_deg[kMaxBeams] { }; // beam angles (deg)
+    
+    FrameGeometry()
+    {
+        generation = 0;
+        num_beams = 0;
+        beam_angles_deg[0] = 0.0; // C++0x initializer in declaration
+    };
+    
+    // Same beams; the generation is not compared.
+    bool same_beams(const FrameGeometry& other) const;
+}; // struct FrameGeometry
 
 // packed for sharing compatibility; we may want to manually align members
 // by padding
@@ -42,12 +120,15 @@ struct  FrameHeader
     float     winstart_sec;    // start of sampling window (sec)
     float     winlen_sec;      // length of sampling window (sec)
     uint32_t  num_beams;       // number of beams
-    // NOTE: The beam angles of the M3 are not uniformly spaced; they are
-    // wider at the ends of the array and narrower in the middle.
-    float     beam_angles_deg[kMaxBeams] { }; // beam angles (deg)
+    uint32_t  geometry_id;     // generation of the FrameGeometry for this ping
     uint32_t  freq_hz;         // sonar frequency (Hz)
     uint32_t  pulselen_microsec;     // pulse length (microsec)
     float     pulserep_hz;     // pulse repitition frequency (Hz)
+    uint32_t  encoding;        // SampleEncoding of the frame data
+    float     data_scale;      // kSampleUInt16 scale and offset
+    float     data_offset;
+    uint32_t  channel;         // transceiver channel of a multi-channel sonar
+    uint32_t  units;           // SampleUnits of the values
     
     FrameHeader() 
     {
@@ -64,10 +145,15 @@ struct  FrameHeader
         winstart_sec = 0.0;    
         winlen_sec = 0.0;      
         num_beams = 0;       
-        beam_angles_deg[0] = 0.0; // C++0x initializer in declaration
+        geometry_id = 0;
         freq_hz = 0;         
         pulselen_microsec = 0;
         pulserep_hz = 0.0;     
+        encoding = kSampleFloat32;
+        data_scale = 1.0;
+        data_offset = 0.0;
+        channel = 0;
+        units = kUnitsSonar;
     };
 }; // struct FrameHeader
 
@@ -97,39 +183,183 @@ std::ostream& operator<<(std::ostream& strm, const FrameHeader& fh);
 // 
 // 
 typedef float framedata_t; // type for data values
+
+// Bytes per sample in an encoding.
+size_t SampleSize(uint32_t encoding);
+// Widen count samples, starting at sample first, of frame data in the 
+// header's encoding to framedata_t.
+void DecodeSamples(const FrameHeader& header, const void *data, 
+                   size_t first, size_t count, framedata_t *out);
+// Store count samples in the header's encoding.  kSampleUInt16 values 
+// are rounded and clamped to the range of the scale and offset.
+void EncodeSamples(const FrameHeader& header, const framedata_t *in, 
+                   size_t count, void *data);
+inline framedata_t DecodeSample(const FrameHeader& header, const void *data, size_t k)
+{
+    if (header.encoding == kSampleFloat32) return ((const framedata_t *)data)[k];
+    framedata_t value;
+    DecodeSamples(header, data, k, 1, &value);
+    return value;
+}
+
+// Supplies the memory for frame data in place of the heap, so a data 
+// source can decode a ping directly into the frame buffer.
+class FrameAllocator
+{
+    public:
+        virtual ~FrameAllocator() {};
+        // Returns nullptr if the memory is not available.
+        virtual framedata_t* ReserveFrame(size_t size) =0;
+};
+
+// Time varying gain the sonar applied to the samples, in dB at range r (m):
+//   min(spreading*log10(r) + absorption_db_km*r/1000 + offset_db, limit_db)
+// where a limit_db of 0 is no limit.  All 0 for no gain.
+struct FrameTVG
+{
+    float spreading;
+    float absorption_db_km;
+    float offset_db;
+    float limit_db;
+    
+    FrameTVG() { spreading = absorption_db_km = offset_db = limit_db = 0.0; };
+    bool operator==(const FrameTVG& other) const
+    {
+        return spreading == other.spreading && absorption_db_km == other.absorption_db_km
+               && offset_db == other.offset_db && limit_db == other.limit_db;
+    };
+}; // struct FrameTVG
+
 struct Frame
 {
     FrameHeader header;
+    // Set by the data source; frames with the same geometry should share
+    // one object.  Readers get the published geometry, or nullptr.
+    std::shared_ptr<const FrameGeometry> geometry;
+    // Set by the data source of a sonar that says what gain it applied;
+    // not published.
+    FrameTVG tvg;
+    
+    // If set, malloc_data takes memory from here before trying the heap.
+    FrameAllocator *allocator;
     
     Frame()
     {
        data_size = 0;
        pdata = nullptr;
+       owns_data = false;
+       capacity = 0;
+       allocator = nullptr;
      };
     
     ~Frame()
     {
-        if (data_size > 0) free(pdata);
+        free_data();
     };
     
     size_t size() const { return data_size; };
+    // samples in header.encoding
     framedata_t * const data_ptr() const { return pdata; };
     framedata_t get(int range_bin, int beam) const 
-        { return pdata[range_bin*header.num_beams + beam]; };
+        { return DecodeSample(header, pdata, range_bin*header.num_beams + beam); };
     
+    // Keep only the first size bytes of the data, where they are.
+    void shrink_data(size_t size) { if (size < data_size) data_size = size; };
+    
+    // A frame reused for ping after ping keeps its heap memory, so after
+    // the biggest ping nothing more is allocated.
     void malloc_data(size_t size) {
-      if (data_size > 0) free(pdata);
+      if (allocator == nullptr && owns_data && capacity >= size)
+      {
+          data_size = size;
+          return;
+      }
+      free_data();
+      if (allocator != nullptr 
+          && (pdata = allocator->ReserveFrame(size)) != nullptr)
+      {
+          data_size = size;
+          return;
+      }
       pdata = (framedata_t*)malloc(size);
-      if (pdata != nullptr) data_size = size;
+      if (pdata != nullptr)
+      {
+          data_size = size;
+          capacity = size;
+          owns_data = true;
+      }
     };
     
 private:
+    void free_data() {
+      if (owns_data) free(pdata);
+      data_size = 0;
+      capacity = 0;
+      pdata = nullptr;
+      owns_data = false;
+    };
+    
     // copied to shared memory: notionally a size_t and float *
     uint64_t data_size;
     framedata_t *pdata;
+    bool owns_data; // false if the data belongs to the allocator
+    size_t capacity; // bytes of heap memory at pdata
 
 }; // struct Frame
 
+struct RingSlot; // shared memory layout, defined in frame_buffer.cpp
+
+// A read-only view of a frame in the frame buffer's shared memory.  
+// FrameBufferReader::GetNextFrame(FrameView*) points the view directly at 
+// the shared frame, so there is no copy of the frame data.  The view is 
+// usable until it is released (by Release(), the destructor, or reuse in 
+// GetNextFrame) or until the writer recycles the slot.  Call valid() after 
+// reading the data to make sure it was not overwritten in the meantime.
+class FrameView
+{
+    public:
+        FrameView();
+        ~FrameView() { Release(); };
+        
+        const FrameHeader& header() const { return *header_; };
+        size_t size() const { return data_size_; };
+        // samples in header().encoding
+        const framedata_t * data_ptr() const { return pdata_; };
+        framedata_t get(int range_bin, int beam) const 
+            { return DecodeSample(*header_, pdata_, range_bin*header_->num_beams + beam); };
+        long frame_number() const { return frame_number_; };
+        // published beam geometry of the frame, or nullptr
+        const FrameGeometry* geometry() const { return geometry_.get(); };
+        
+        bool empty() const { return header_ == nullptr; };
+        // False if the writer has started to overwrite this frame.
+        bool valid() const;
+        void Release();
+        
+    private:
+        friend class FrameBufferReader;
+        FrameView(const FrameView&);            // not copyable
+        FrameView& operator=(const FrameView&);
+        
+        const FrameHeader *header_;
+        const framedata_t *pdata_;
+        size_t data_size_;
+        long frame_number_;
+        const RingSlot *slot_; // ring slot and its sequence number when 
+        uint64_t seq_;         // the view was taken, or nullptr
+        void *map_;            // per-frame shared memory mapped for this view
+        size_t map_length_;
+        std::shared_ptr<const FrameGeometry> geometry_;
+        
+}; // class FrameView
+
+// Shared memory layout of the frame ring and geometry table, and the new
+// frame message; defined in frame_buffer.cpp.
+struct RingControl;
+struct GeometryTable;
+struct FrameIndex;
+struct FrameMsg;
+struct FrameBufferStats; // frame_buffer_stats.h
 
 // One process (the ingester) will instantiate  a FrameBufferWriter.
 // This process will put new frames
@@ -139,13 +369,37 @@ private:
 // order that they arrived in the buffer.  A specified number
 // of frames will exist at any one time; old frames are removed
 // as new frames arrive.
-class FrameBufferWriter
+//
+// By default each frame is put in its own POSIX shared memory object,
+// and readers are sent the object name.  With FrameBufferParams::ring
+// the writer instead creates one shared memory object holding a small
+// control block and a fixed number of slots.  Frame n is written to
+// slot n % num_slots; each slot carries a sequence number so a reader
+// can tell whether the writer overwrote the frame while it was being read.
+//
+// In both modes the writer also keeps the last kMaxGeometries frame 
+// geometries in a small shared memory table; readers attach the geometry
+// to each frame they get, copying it only when the generation changes.
+// It also keeps running counters for itself and each reader in a shared
+// memory statistics block (frame_buffer_stats.h), which fbstat samples.
+//
+// Frames are numbered from 1.  Readers can get any frame still in the
+// buffer by number, not just the next one.  The ring slots serve as the
+// index of the ring.  In per-frame mode the writer keeps a shared memory
+// index of the frames it has not unlinked yet.
+//
+// A persistent ring outlives its writer.  The next writer takes it over,
+// numbering frames on from the last one, and bumps the writer generation;
+// readers carry on without reconnecting.  If the ring layout changed, the
+// new writer makes a new ring and readers of the old one move over to it.
+class FrameBufferWriter : public FrameAllocator
 {
 	public:
     // Each sonar device has a unique buffer. The buffer name is obtained from config.yml
     //  and passed in to the constructor.
        
-	    FrameBufferWriter(const std::string &fb_name);
+	    FrameBufferWriter(const std::string &fb_name,
+	                      const FrameBufferParams &params=FrameBufferParams());
 	    ~FrameBufferWriter();
 
 	   // Open for business.  Will re-initialize if already intialized.
@@ -157,19 +411,68 @@ class FrameBufferWriter
 	    // index of the new frame.
 	    long PutNewFrame(const Frame &new_frame); 
 	    
+	    // Reserve shared memory for the data of the next frame, so it can be
+	    // written in place (set Frame::allocator to the writer).  Returns
+	    // nullptr if the frame does not fit; use heap memory then.  There is
+	    // one reservation at a time; reserving again replaces it.
+	    framedata_t* ReserveFrame(size_t size);
+	    // Publish a frame whose data is in the reserved memory.  PutNewFrame
+	    // does this too.  The frame's data pointer is not usable afterward.
+	    long CommitFrame(const Frame &new_frame);
+	    
     private:
         void CleanUp();  // used by destructor and intialize
+        long PutFrame(const Frame &new_frame);
+        long PublishReservedFrame(const Frame &new_frame);
+        void CountPut(long frame_number, size_t data_size, uint64_t start_ns);
         void HandleMessages();  // thread function run by writer
+        int CreateRing();
+        char* TakeOverRing(size_t slot_size, size_t slots_offset, int64_t* last_frame);
+        char* CreateHugePageRing();
+        void HandleRingConnections(); // thread function for huge page ring
+        long PutRingFrame(const Frame &new_frame);
+        void BeginRingFrame(int64_t frame_number);
+        long EndRingFrame(const Frame &new_frame, int64_t frame_number);
+        char* CreateSharedFrame(size_t data_size);
+        long PublishSharedFrame(const Frame &new_frame);
+        void DiscardSharedFrame();
+        void WaitForBlockingReaders(int64_t frame_number);
+        void NotifyReaders(const std::string &shm_name, size_t map_length);
+        int CreateGeometryTable();
+        uint32_t PublishGeometry(const Frame &new_frame);
+        int CreateFrameIndex();
+        int CreateStats();
+        void CountQueueFull(int reader);
     
         std::string fb_name_;    // unique name for this frame buffer
+        FrameBufferParams params_;
         std::string shm_prefix_; // framebuffer shared memory path name prefix
         std::string mqw_name_;   // writer message queue name
         mqd_t mqw_;              // writer message queue (FIFO)
         std::thread t_;          // writer's connection service thread
         std::vector<mqd_t> mq_readers_;             // list of reader queues
+        std::vector<int32_t> mq_reader_pids_;       // and their processes
         std::string shm_names_[kMaxFramesInBuffer]; // "slots" for frames in shared mem
         int64_t frame_count_;   // number of frames written
         pthread_mutex_t mqr_lock_;
+        std::string ring_name_;  // shared memory name of the frame ring
+        char *ring_;             // mapped frame ring, or nullptr
+        size_t ring_size_;       // bytes mapped at ring_
+        int ring_fd_;            // memfd of a huge page ring, or -1
+        int ring_socket_;        // listening for readers of a huge page ring
+        std::thread t_ring_;     // sends ring_fd_ to readers
+        std::string geometry_name_; // shared memory name of the geometry table
+        GeometryTable *geometry_table_;
+        std::shared_ptr<const FrameGeometry> geometry_; // last published
+        std::string index_name_; // shared memory name of the per-frame index
+        FrameIndex *frame_index_;
+        char *shared_frame_;        // per-frame object being written, or nullptr
+        std::string shared_name_;
+        size_t shared_length_;
+        framedata_t *reserved_data_; // from ReserveFrame, until committed
+        size_t reserved_size_;
+        std::string stats_name_; // shared memory name of the statistics block
+        FrameBufferStats *stats_;
     
  }; // class FrameBufferWriter
 
@@ -180,24 +483,133 @@ class FrameBufferReader
 	    FrameBufferReader(const std::string &fb_name);
 	    ~FrameBufferReader();
 	    
-	    // Connect to the writer 
-	    int Connect();
+	    // Connect to the writer.  Only a kLagBlock reader can hold up the
+	    // writer.  In per-frame mode that is only while its message queue is
+	    // full, and frames are unlinked after kMaxFramesInBuffer newer ones
+	    // regardless, so it can still skip frames there.
+	    int Connect(LagPolicy policy=kLagDropOldest);
 	   
- 	    bool connected() { return (mqr_ != -1); };
+ 	    bool connected() { return (mqr_ != -1 || ring_ != nullptr); };
 	    
 	    // Get the next frame in the buffer, "next" meaning
 	    // relative to the last frame that was retrieved by the
 	    // calling process.  Returns the index of the frame.
 	    long GetNextFrame(Frame* next_frame);
 	    
+	    // Same as above, but point the view at the frame in shared
+	    // memory instead of copying it.
+	    long GetNextFrame(FrameView* next_view);
+	    
+	    // Same as GetNextFrame, but return 0 instead of waiting if there is
+	    // no frame ready.  The view is released either way.
+	    long TryGetNextFrame(Frame* next_frame);
+	    long TryGetNextFrame(FrameView* next_view);
+	    
+	    // Get up to max_frames frames at once:  wait for the next frame as 
+	    // GetNextFrame does, then take the frames after it that are already
+	    // in the buffer.  Returns the number of frames, or -1 on error.
+	    // A kLagLatest reader gets only the newest frame.
+	    //
+	    // The views are used as in GetNextFrame(FrameView*); all of them 
+	    // stay usable until the next call for frames.
+	    int GetNextFrames(FrameView* views, int max_frames);
+	    // Copy the frames into one block supplied by the caller:  the data
+	    // of frame k goes at data + k*frame_stride bytes and its header in 
+	    // headers[k], and its number in frame_numbers[k] if that is given.
+	    // Frames bigger than frame_stride are skipped.
+	    int GetNextFrames(FrameHeader* headers, void* data, size_t frame_stride,
+	                      int max_frames, long* frame_numbers=nullptr);
+	    
+	    // A descriptor for poll/select/epoll that is readable when there
+	    // may be a frame ready.  It is level triggered, and only cleared by
+	    // getting frames, so call TryGetNextFrame until it returns 0 after 
+	    // each wake-up.  In per-frame mode this is the reader's message 
+	    // queue.  A ring reader has no queue until the first call, which 
+	    // asks the writer to also send it a message per frame.  Returns -1 
+	    // if not connected or on error.
+	    int GetReadyFd();
+	    
+	    // Number of frames this reader has skipped because it fell behind.
+	    long frames_skipped() const { return frames_skipped_; };
+	    // Number of frames written but not yet retrieved by this reader.
+	    long lag() const;
+	    
+	    // Numbers of the oldest and newest frames in the buffer.  
+	    // latest_frame() is 0 until the first frame is written.
+	    long oldest_frame() const;
+	    long latest_frame() const;
+	    
+	    // Get a frame in the buffer by number.  This does not change which 
+	    // frame GetNextFrame gets.  Returns the frame number, or -1 if the
+	    // frame is not (or no longer) in the buffer.
+	    long GetFrameAt(long frame_number, Frame* frame);
+	    long GetFrameAt(long frame_number, FrameView* view);
+	    
+	    // Number of the first frame in the buffer with a ping time at or 
+	    // after the given time, or -1 if there is none.  Assumes ping times
+	    // increase with frame number.
+	    long FindFrame(uint32_t ping_sec, uint32_t ping_millisec);
+	    
+	    // Make GetNextFrame continue from the given frame, or from the oldest
+	    // frame in the buffer if that one is gone; e.g. to replay the last n
+	    // frames, SeekFrame(latest_frame() - n + 1).  Returns the number of
+	    // the next frame, or -1 for a kLagLatest reader, which always gets 
+	    // the newest frame.
+	    long SeekFrame(long frame_number);
 	    
     private:
+        int MapRing();
+        int ClaimRingReader();
+        int CheckRingWriter();
+        int GetRingFrame(int64_t frame_number, Frame* next_frame);
+        int GetRingView(int64_t frame_number, FrameView* view);
+        long GetFrame(Frame* next_frame, bool wait);
+        long GetView(FrameView* next_view, bool wait);
+        int64_t WaitForRingFrame(bool wait);
+        void DrainReadyQueue();
+        void ReleaseRingFrames();
+        void CountRead(int64_t frame_number);
+        void CountSkipped(int64_t num_frames);
+        int ReceiveFrameMsg(FrameMsg* msg, bool wait);
+        void CountDroppedMsgs(const FrameMsg &msg);
+        int SendConnectMsg(mqd_t mqw);
+        int MapFrameView(const char *shm_name, size_t map_length, 
+                         int64_t frame_number, FrameView* view);
+        int MapGeometryTable();
+        std::shared_ptr<const FrameGeometry> GetGeometry(uint32_t generation);
+        int MapFrameIndex();
+        int MapStats();
+        int LookupSharedFrame(int64_t frame_number, size_t* map_length, 
+                              uint64_t* ping_msec) const;
+        std::string SharedFrameName(int64_t frame_number) const;
+        int GetSharedFrame(const char *shm_name, size_t map_length, Frame* frame);
+        int GetPingTime(int64_t frame_number, uint64_t* ping_msec) const;
+
         std::string fb_name_;    // unique name for this frame buffer
         std::string mqw_name_;    // writer message queue name
         mqd_t mqw_;                // writer message queue
         std::string mqr_name_;
-        mqd_t mqr_;                // reader message queue
-
+        mqd_t mqr_;                // reader message queue; for a ring 
+                                   // reader, only set by GetReadyFd
+        std::string ring_name_;  // shared memory name of the frame ring
+        char *ring_;             // mapped frame ring, or nullptr in per-frame mode
+        size_t ring_size_;       // bytes mapped at ring_
+        int64_t next_frame_;     // next frame to get
+        int64_t last_msg_frame_; // per-frame mode: frame of the last message,
+                                 // or -1 if not known
+        bool replaying_;         // per-frame mode: getting frames from the index
+        LagPolicy policy_;
+        int reader_index_;       // this reader's entry in the ring control block
+        uint32_t writer_generation_; // ring writer this reader last saw
+        long frames_skipped_;
+        std::string geometry_name_; // shared memory name of the geometry table
+        const GeometryTable *geometry_table_;
+        std::shared_ptr<const FrameGeometry> geometry_; // last one retrieved
+        std::string index_name_; // shared memory name of the per-frame index
+        const FrameIndex *frame_index_;
+        std::string stats_name_; // shared memory name of the statistics block
+        FrameBufferStats *stats_;
+        int stats_index_;        // this reader's entry in the statistics block
 
 }; // class FrameBufferReader
 
@@ -0,0 +1,88 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_buffer_stats.h
+ *
+ *  Counters the frame buffer keeps in shared memory for fbstat and
+ *  anything else that wants to watch it.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+#ifndef __NIMS_FRAMEBUFFER_STATS_H__
+#define __NIMS_FRAMEBUFFER_STATS_H__
+
+#include <atomic>
+#include <cstdint>  // fixed width integer types
+#include <ctime>    // clock_gettime
+
+/*
+ The statistics block is the shared memory object "/<fb_name>-stats",
+ created by the writer in both modes.  Every counter has one process that
+ writes it:  the writer keeps its own counters, and each reader claims an
+ entry in the readers table and keeps its counters there, except
+ queue_full, which the writer counts for it.  So the counters are updated
+ with plain relaxed loads and stores (StatsAdd) instead of locked
+ read-modify-write instructions, and readers on other cores never
+ contend for the writer's cache lines.  Everything is a running total;
+ a monitor samples the block and takes differences.
+*/
+const uint32_t kStatsMagic = 0x4e495354; // "NIST"
+
+// Put latency bin k counts puts that took [2^k, 2^(k+1)) nanoseconds.
+const int kStatsLatencyBins = 32;
+// readers that get an entry; more can connect but are not counted
+const int kMaxStatsReaders = 32;
+
+struct alignas(64) FrameBufferReaderStats
+{
+    std::atomic<int32_t>  pid;            // 0 if this entry is free
+    std::atomic<uint32_t> policy;         // LagPolicy
+    std::atomic<int64_t>  last_frame;     // number of the last frame it got
+    std::atomic<uint64_t> frames_read;
+    std::atomic<uint64_t> frames_skipped;
+    std::atomic<uint64_t> queue_full;     // frame messages its queue had no room for
+};
+
+struct FrameBufferStats
+{
+    uint32_t magic;
+    std::atomic<int32_t>  writer_pid;
+    // the writer's counters, on their own cache lines
+    alignas(64) std::atomic<int64_t> last_frame; // number of the newest frame
+    std::atomic<uint64_t> frames_written;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> put_errors;
+    std::atomic<uint64_t> put_ns_total;   // time spent in PutNewFrame/CommitFrame
+    std::atomic<uint64_t> put_ns_max;
+    std::atomic<uint64_t> put_ns_bins[kStatsLatencyBins];
+    std::atomic<uint64_t> blocked_puts;   // puts that waited for a kLagBlock reader
+    std::atomic<uint64_t> blocked_ns_total;
+    std::atomic<uint64_t> queue_full;     // mq_send found a reader's queue full
+    std::atomic<uint64_t> queue_errors;   // other mq_send failures
+    FrameBufferReaderStats readers[kMaxStatsReaders];
+};
+
+// Add to a counter that only this thread writes.
+template <typename T>
+inline void StatsAdd(std::atomic<T> &counter, T n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Monotonic nanoseconds; clock_gettime goes through the vDSO, no system call.
+inline uint64_t StatsClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+inline int StatsLatencyBin(uint64_t ns)
+{
+    if (ns == 0) return 0;
+    int bin = 63 - __builtin_clzll(ns);
+    return bin < kStatsLatencyBins ? bin : kStatsLatencyBins - 1;
+}
+
+#endif // __NIMS_FRAMEBUFFER_STATS_H__
@@ -0,0 +1,307 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_calibration.cpp
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#include "frame_calibration.h"
+
+#include <algorithm>  // max, min
+#include <cfloat>     // FLT_MIN
+#include <cmath>      // log10, pow
+#include <cstring>    // memcpy
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+
+// Closer than this, the range is taken as this, for the log of it.
+const double kMinRangeM = 0.1;
+
+//-----------------------------------------------------------------------------
+// Row kernels
+/*
+ The gain is the same across a row of beams, so each kernel does a row with
+ one gain.  The SSE path is always there on x86-64, and uses fused
+ multiply-adds when built with -mfma (or -march=native).  The ends of rows
+ are done one sample at a time, with the library log and exponential.
+*/
+namespace {
+
+#if defined(__SSE2__)
+inline __m128 MulAdd(__m128 x, __m128 a, __m128 b)
+{
+#if defined(__FMA__)
+    return _mm_fmadd_ps(x, a, b);
+#else
+    return _mm_add_ps(_mm_mul_ps(x, a), b);
+#endif
+}
+#endif
+
+// out = a*x + b; out may be x
+void MultiplyAdd(const float *x, int count, float a, float b, float *out)
+{
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b);
+    for (; k + 4 <= count; k += 4)
+        _mm_storeu_ps(out + k, MulAdd(_mm_loadu_ps(x + k), va, vb));
+#endif
+    for (; k < count; ++k) out[k] = a*x[k] + b;
+}
+
+// out = a*x + b of 16-bit samples
+void MultiplyAddUInt16(const uint16_t *x, int count, float a, float b, float *out)
+{
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b);
+    const __m128i zero = _mm_setzero_si128();
+    for (; k + 8 <= count; k += 8)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(x + k));
+        __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(s, zero));
+        __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(s, zero));
+        _mm_storeu_ps(out + k, MulAdd(lo, va, vb));
+        _mm_storeu_ps(out + k + 4, MulAdd(hi, va, vb));
+    }
+#endif
+    for (; k < count; ++k) out[k] = a*x[k] + b;
+}
+
+// out = a*x*x; out may be x
+void SquareScale(const float *x, int count, float a, float *out)
+{
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128 va = _mm_set1_ps(a);
+    for (; k + 4 <= count; k += 4)
+    {
+        __m128 v = _mm_loadu_ps(x + k);
+        _mm_storeu_ps(out + k, _mm_mul_ps(_mm_mul_ps(v, v), va));
+    }
+#endif
+    for (; k < count; ++k) out[k] = a*x[k]*x[k];
+}
+
+// out = a*power[x] of 16-bit samples
+void ScalePowers(const uint16_t *x, int count, const float *power, float a, float *out)
+{
+    for (int k=0; k<count; ++k) out[k] = a*power[x[k]];
+}
+
+#if defined(__SSE2__)
+// Natural log and exponential of four floats, with the polynomials of the
+// Cephes logf and expf; within a couple of ulps of the library functions.
+// x must be a normal number for the log.
+inline __m128 Log4(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    // x = m*2^e with m in [sqrt(1/2), sqrt(2))
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+    __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)),
+                                             _mm_set1_epi32(0x3f000000)));
+    __m128 small = _mm_cmplt_ps(m, _mm_set1_ps(0.707106781186547524f));
+    e = _mm_sub_ps(e, _mm_and_ps(small, one));
+    m = _mm_sub_ps(_mm_add_ps(m, _mm_and_ps(small, m)), one);
+
+    __m128 z = _mm_mul_ps(m, m);
+    __m128 y = _mm_set1_ps(7.0376836292E-2f);
+    y = MulAdd(y, m, _mm_set1_ps(-1.1514610310E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(1.1676998740E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(-1.2420140846E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(1.4249322787E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(-1.6668057665E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(2.0000714765E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(-2.4999993993E-1f));
+    y = MulAdd(y, m, _mm_set1_ps(3.3333331174E-1f));
+    y = _mm_mul_ps(_mm_mul_ps(y, m), z);
+    y = MulAdd(e, _mm_set1_ps(-2.12194440e-4f), y);
+    y = MulAdd(z, _mm_set1_ps(-0.5f), y);
+    return MulAdd(e, _mm_set1_ps(0.693359375f), _mm_add_ps(m, y));
+}
+
+inline __m128 Exp4(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
+    // x = n*ln(2) + r, |r| <= ln(2)/2
+    __m128 fx = MulAdd(x, _mm_set1_ps(1.44269504088896341f), _mm_set1_ps(0.5f));
+    __m128i n = _mm_cvttps_epi32(fx);
+    __m128 fn = _mm_cvtepi32_ps(n);
+    __m128 above = _mm_cmpgt_ps(fn, fx);  // truncated up, below 0
+    fn = _mm_sub_ps(fn, _mm_and_ps(above, _mm_set1_ps(1.0f)));
+    n = _mm_cvtps_epi32(fn);
+    x = MulAdd(fn, _mm_set1_ps(-0.693359375f), x);
+    x = MulAdd(fn, _mm_set1_ps(2.12194440e-4f), x);
+
+    __m128 z = _mm_mul_ps(x, x);
+    __m128 y = _mm_set1_ps(1.9875691500E-4f);
+    y = MulAdd(y, x, _mm_set1_ps(1.3981999507E-3f));
+    y = MulAdd(y, x, _mm_set1_ps(8.3334519073E-3f));
+    y = MulAdd(y, x, _mm_set1_ps(4.1665795894E-2f));
+    y = MulAdd(y, x, _mm_set1_ps(1.6666665459E-1f));
+    y = MulAdd(y, x, _mm_set1_ps(5.0000001201E-1f));
+    y = _mm_add_ps(MulAdd(y, z, x), _mm_set1_ps(1.0f));
+    // times 2^n
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(scale));
+}
+#endif
+
+// out = 10*log10(x), from FLT_MIN up; out may be x
+void Decibels(const float *x, int count, float *out)
+{
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128 db = _mm_set1_ps(10.0/log(10.0)), least = _mm_set1_ps(FLT_MIN);
+    for (; k + 4 <= count; k += 4)
+        _mm_storeu_ps(out + k, _mm_mul_ps(Log4(_mm_max_ps(_mm_loadu_ps(x + k), least)), db));
+#endif
+    for (; k < count; ++k) out[k] = 10.0f*log10(std::max(x[k], FLT_MIN));
+}
+
+// out = 10^((x + b)/10); out may be x
+void Power(const float *x, int count, float b, float *out)
+{
+    int k = 0;
+#if defined(__SSE2__)
+    const __m128 a = _mm_set1_ps(0.1*log(10.0)), vb = _mm_set1_ps(0.1*log(10.0)*b);
+    for (; k + 4 <= count; k += 4)
+        _mm_storeu_ps(out + k, Exp4(MulAdd(_mm_loadu_ps(x + k), a, vb)));
+#endif
+    for (; k < count; ++k) out[k] = pow(10.0f, 0.1f*(x[k] + b));
+}
+
+} // namespace
+
+//-----------------------------------------------------------------------------
+FrameCalibration::FrameCalibration(const CalibrationParams &params)
+    : params_(params), num_samples_(0), range_min_m_(0.0), range_max_m_(0.0),
+      power_scale_(0.0), power_offset_(0.0)
+{
+}
+
+//-----------------------------------------------------------------------------
+void FrameCalibration::UpdateGains(const FrameHeader &hdr, const FrameTVG &tvg)
+{
+    if (hdr.num_samples == num_samples_ && hdr.range_min_m == range_min_m_
+        && hdr.range_max_m == range_max_m_ && tvg == tvg_)
+        return;
+    num_samples_ = hdr.num_samples;
+    range_min_m_ = hdr.range_min_m;
+    range_max_m_ = hdr.range_max_m;
+    tvg_ = tvg;
+    NIMS_LOG_DEBUG << "calibration: gains for " << num_samples_ << " samples, "
+                   << range_min_m_ << " to " << range_max_m_ << " m";
+
+    const double step = (num_samples_ > 1)
+                      ? ((double)range_max_m_ - range_min_m_)/(num_samples_ - 1) : 0.0;
+    gain_db_.resize(num_samples_);
+    gain_.resize(num_samples_);
+    for (uint32_t m=0; m<num_samples_; ++m)
+    {
+        const double r = std::max(range_min_m_ + m*step, kMinRangeM);
+        double applied = tvg.spreading*log10(r) + tvg.absorption_db_km*r/1000.0
+                       + tvg.offset_db;
+        if (tvg.limit_db != 0.0) applied = std::min(applied, (double)tvg.limit_db);
+        const double gain = params_.spreading*log10(r)
+                          + 2.0*params_.absorption_db_km*r/1000.0
+                          + params_.offset_db - applied;
+        gain_db_[m] = gain;
+        gain_[m] = pow(10.0, 0.1*gain);
+    }
+} // FrameCalibration::UpdateGains
+
+//-----------------------------------------------------------------------------
+void FrameCalibration::UpdatePowers(const FrameHeader &hdr)
+{
+    if (!power_.empty() && hdr.data_scale == power_scale_
+        && hdr.data_offset == power_offset_)
+        return;
+    power_scale_ = hdr.data_scale;
+    power_offset_ = hdr.data_offset;
+    power_.resize(65536);
+    for (int s=0; s<65536; ++s)
+        power_[s] = pow(10.0, 0.1*((double)power_scale_*s + power_offset_));
+} // FrameCalibration::UpdatePowers
+
+//-----------------------------------------------------------------------------
+int FrameCalibration::Apply(Frame *frame)
+{
+    FrameHeader &hdr = frame->header;
+    if (hdr.units != kUnitsSonar) return -1;
+    const int num_samples = hdr.num_samples;
+    const int num_beams = hdr.num_beams;
+    const size_t count = (size_t)num_samples*num_beams;
+    if (count == 0) return -1;
+    UpdateGains(hdr, frame->tvg);
+
+    // float samples are done where they are, others into out_
+    const bool in_place = (hdr.encoding == kSampleFloat32);
+    const bool uint16 = (hdr.encoding == kSampleUInt16);
+    const void *in = frame->data_ptr();
+    framedata_t *out = frame->data_ptr();
+    if (!in_place)
+    {
+        out_.resize(count);
+        out = out_.data();
+    }
+    if (uint16 && params_.input_decibels && !params_.decibels) UpdatePowers(hdr);
+
+    for (int m=0; m<num_samples; ++m)
+    {
+        const size_t first = (size_t)m*num_beams;
+        const uint16_t *samples = (const uint16_t *)in + first;
+        framedata_t *row = out + first;
+        if (params_.input_decibels)
+        {
+            if (uint16 && params_.decibels)
+                MultiplyAddUInt16(samples, num_beams, hdr.data_scale,
+                                  hdr.data_offset + gain_db_[m], row);
+            else if (uint16)
+                ScalePowers(samples, num_beams, power_.data(), gain_[m], row);
+            else
+            {
+                if (!in_place) DecodeSamples(hdr, in, first, num_beams, row);
+                if (params_.decibels)
+                    MultiplyAdd(row, num_beams, 1.0f, gain_db_[m], row);
+                else
+                    Power(row, num_beams, gain_db_[m], row);
+            }
+        }
+        else
+        {
+            if (uint16)
+                MultiplyAddUInt16(samples, num_beams, hdr.data_scale, hdr.data_offset, row);
+            else if (!in_place)
+                DecodeSamples(hdr, in, first, num_beams, row);
+            SquareScale(row, num_beams, gain_[m], row);
+            if (params_.decibels) Decibels(row, num_beams, row);
+        }
+    }
+
+    if (!in_place)
+    {
+        // the ping is copied, so it can go back where it was
+        const size_t size = count*sizeof(framedata_t);
+        frame->malloc_data(size);
+        if (frame->size() != size)
+        {
+            NIMS_LOG_ERROR << "Error allocating memory for calibrated frame data.";
+            return -1;
+        }
+        memcpy(frame->data_ptr(), out_.data(), size);
+    }
+    hdr.encoding = kSampleFloat32;
+    hdr.data_scale = 1.0;
+    hdr.data_offset = 0.0;
+    hdr.units = params_.decibels ? kUnitsSvDecibels : kUnitsSvLinear;
+    return 0;
+} // FrameCalibration::Apply
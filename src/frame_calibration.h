@@ -0,0 +1,85 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_calibration.h
+ *
+ *  Turns the samples of a ping into volume backscattering strength before
+ *  it goes into the frame buffer, so the stages after the ingester do not
+ *  each redo the range compensation.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#ifndef __NIMS_FRAME_CALIBRATION_H__
+#define __NIMS_FRAME_CALIBRATION_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "frame_buffer.h"
+
+// Calibration, from the calibration section of a sonar's config.
+struct CalibrationParams {
+  float spreading;        // range compensation in dB per decade of range
+  float absorption_db_km; // one-way absorption of the water
+  float offset_db;        // constant of the sonar: source level, gains,
+                          // pulse volume
+  bool input_decibels;    // the samples are dB of power, not amplitude
+  bool decibels;          // publish Sv in dB, not linear sv
+
+  CalibrationParams()
+  {
+      spreading = 20.0;
+      absorption_db_km = 0.0;
+      offset_db = 0.0;
+      input_decibels = false;
+      decibels = true;
+  };
+};
+
+/*
+ Calibrates a ping to volume backscattering strength,
+   Sv = received level - TVG(r) + spreading*log10(r) + 2*absorption*r + offset
+ where the received level is 20*log10 of an amplitude sample, or a dB
+ power sample as it is, and TVG is the gain the sonar applied, from
+ Frame::tvg.  The gain of each range bin is worked out once for a range
+ and TVG and kept until they change, so a ping is a multiply-add (dB in,
+ dB out) or a square and multiply (amplitude in, linear out) per sample,
+ done with SSE a row at a time.  The other two ways around add a log or
+ an exponential, done with SSE polynomials; 16-bit dB samples to linear
+ go through a table of their 65536 values instead.  The result is always
+ float samples, in place when the samples were float already.
+*/
+class FrameCalibration
+{
+    public:
+        explicit FrameCalibration(const CalibrationParams &params);
+
+        // Calibrate the frame.  Returns -1, leaving the frame as it was,
+        // if it is calibrated already or its data cannot be allocated.
+        int Apply(Frame *frame);
+
+    private:
+        // the gain of each range bin of the frame, in dB and linear
+        void UpdateGains(const FrameHeader &hdr, const FrameTVG &tvg);
+        // 10^(value/10) of every 16-bit sample of the frame
+        void UpdatePowers(const FrameHeader &hdr);
+
+        CalibrationParams params_;
+        // what the gains are for
+        uint32_t num_samples_;
+        float range_min_m_;
+        float range_max_m_;
+        FrameTVG tvg_;
+        std::vector<float> gain_db_;
+        std::vector<float> gain_;
+        // what the powers are for
+        float power_scale_;
+        float power_offset_;
+        std::vector<float> power_;
+        std::vector<framedata_t> out_; // the ping, if not done in place
+
+}; // class FrameCalibration
+
+#endif // __NIMS_FRAME_CALIBRATION_H__
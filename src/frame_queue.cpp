@@ -0,0 +1,94 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_queue.cpp
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#include "frame_queue.h"
+
+#include <cassert>
+#include <cerrno>
+#include <ctime>          // timespec
+
+#include <linux/futex.h>  // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h>  // SYS_futex
+#include <unistd.h>       // syscall
+
+static long futex(std::atomic<uint32_t> *uaddr, int op, uint32_t val,
+                  const struct timespec *timeout=nullptr)
+{
+    return syscall(SYS_futex, (uint32_t *)uaddr, op | FUTEX_PRIVATE_FLAG, val,
+                   timeout, nullptr, 0);
+}
+
+FrameQueue::FrameQueue(int size) : frames_(size), back_(nullptr), head_(0), dropped_(0),
+                                   max_depth_(0), ready_seq_(0), tail_(0), waiting_(0)
+{
+    assert(size > 0);
+}
+
+bool FrameQueue::full() const
+{
+    return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire)
+           >= frames_.size();
+}
+
+//-----------------------------------------------------------------------------
+Frame* FrameQueue::Back()
+{
+    if (full())
+        back_ = &spare_;
+    else
+        back_ = &frames_[head_.load(std::memory_order_relaxed) % frames_.size()];
+    return back_;
+} // FrameQueue::Back
+
+//-----------------------------------------------------------------------------
+void FrameQueue::Push()
+{
+    // the consumer may have made room since Back(), but the ping is in
+    // the spare by now
+    if (back_ == &spare_)
+    {
+        dropped_.store(dropped_.load(std::memory_order_relaxed) + 1);
+        return;
+    }
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    head_.store(head + 1, std::memory_order_release);
+
+    const int depth = (int)(head + 1 - tail_.load());
+    if (depth > max_depth_.load(std::memory_order_relaxed)) max_depth_.store(depth);
+
+    ready_seq_.fetch_add(1);
+    if (waiting_.load() > 0)
+        futex(&ready_seq_, FUTEX_WAKE, 1);
+} // FrameQueue::Push
+
+//-----------------------------------------------------------------------------
+Frame* FrameQueue::Front(int timeout_ms)
+{
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    while (head_.load(std::memory_order_acquire) == tail)
+    {
+        // same handshake as the frame ring's readers use on notify_seq
+        waiting_.store(1);
+        uint32_t seq = ready_seq_.load();
+        if (head_.load(std::memory_order_acquire) != tail) break;
+
+        struct timespec timeout = { timeout_ms/1000, (timeout_ms % 1000)*1000000L };
+        long ret = futex(&ready_seq_, FUTEX_WAIT, seq, &timeout);
+        waiting_.store(0);
+        if (ret == -1 && (errno == ETIMEDOUT || errno == EINTR)) return nullptr;
+    }
+    waiting_.store(0);
+    return &frames_[tail % frames_.size()];
+} // FrameQueue::Front
+
+//-----------------------------------------------------------------------------
+void FrameQueue::Pop()
+{
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+} // FrameQueue::Pop
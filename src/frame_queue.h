@@ -0,0 +1,77 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_queue.h
+ *
+ *  A bounded queue of pooled frames between two threads, so a data source
+ *  can keep reading pings while another thread puts them in the frame
+ *  buffer.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#ifndef __NIMS_FRAME_QUEUE_H__
+#define __NIMS_FRAME_QUEUE_H__
+
+#include <atomic>
+#include <cstdint>  // fixed width integer types
+#include <vector>
+
+#include "frame_buffer.h"
+
+/*
+ A lock-free queue for one producer thread and one consumer thread.  The
+ queue owns its frames and they are reused in place:  the producer fills
+ Back() and calls Push(), the consumer uses Front() and calls Pop(), so
+ after the first few pings no frame data is allocated.
+
+ The producer never waits.  If the consumer has fallen behind and the
+ queue is full, Back() is a spare frame that Push() drops, so the
+ producer keeps draining its socket and only the newest ping is lost.
+
+ head_ and tail_ count frames pushed and popped, each written by one
+ thread only.  The consumer sleeps on ready_seq_ with a futex when the
+ queue is empty; the waiting flag lets the producer skip the wake-up
+ system call while the consumer is busy.
+*/
+class FrameQueue
+{
+    public:
+        explicit FrameQueue(int size);
+
+        // producer
+        Frame* Back(); // the frame to fill next
+        void Push();   // hand Back() to the consumer, or drop it if full
+
+        // consumer
+        // Wait up to timeout_ms for a frame.  Returns the oldest frame,
+        // or nullptr on time out or if a signal arrived.
+        Frame* Front(int timeout_ms);
+        void Pop();    // done with Front()
+
+        int size() const { return (int)frames_.size(); };
+        int depth() const { return (int)(head_.load() - tail_.load()); };
+        int max_depth() const { return max_depth_.load(); };
+        uint64_t frames_pushed() const { return head_.load(); };
+        uint64_t frames_dropped() const { return dropped_.load(); };
+
+    private:
+        FrameQueue(const FrameQueue&);            // not copyable
+        FrameQueue& operator=(const FrameQueue&);
+
+        bool full() const;
+
+        std::vector<Frame> frames_;
+        Frame spare_;  // Back() when the queue is full
+        Frame *back_;  // last returned by Back()
+        alignas(64) std::atomic<uint64_t> head_; // written by the producer
+        std::atomic<uint64_t> dropped_;
+        std::atomic<int>      max_depth_;
+        std::atomic<uint32_t> ready_seq_; // futex word, bumped for each frame
+        alignas(64) std::atomic<uint64_t> tail_; // written by the consumer
+        std::atomic<uint32_t> waiting_;   // consumer is sleeping on ready_seq_
+
+}; // class FrameQueue
+
+#endif // __NIMS_FRAME_QUEUE_H__
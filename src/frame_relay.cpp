@@ -0,0 +1,371 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_relay.cpp
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+#include <cstring>      // memcpy, memcmp
+#include <cerrno>
+#include <chrono>       // system_clock
+
+#include <unistd.h>      // close
+#include <sys/socket.h>
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>   // inet_addr, inet_ntoa
+
+#include <zlib.h>
+
+#include "frame_relay.h"
+#include "log.h"         // NIMS logging
+
+using namespace std;
+
+// The most frame data a record may carry, a ping of kMaxBeams by
+// kMaxSamples float samples, and the biggest record, with its headers and
+// what deflate adds to data that does not compress.  Anything bigger is
+// not from a NIMS relay.
+const uint64_t kMaxRelayData = (uint64_t)kMaxBeams*kMaxSamples*sizeof(framedata_t);
+const uint64_t kMaxRelayRecord = sizeof(RelayFrameInfo) + sizeof(FrameHeader)
+                                 + compressBound(kMaxRelayData);
+
+double RelayClock()
+{
+    return chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Gather byte k of every sample_size-byte sample, for k = 0, 1, ...
+// Bytes after the last whole sample are copied as they are.
+static void ShuffleBytes(const char *in, size_t size, size_t sample_size, char *out)
+{
+    const size_t n = size/sample_size;
+    for (size_t k=0; k<sample_size; ++k)
+    {
+        const char *p = in + k;
+        for (size_t i=0; i<n; ++i, p+=sample_size) *out++ = *p;
+    }
+    memcpy(out, in + n*sample_size, size - n*sample_size);
+}
+
+static void UnshuffleBytes(const char *in, size_t size, size_t sample_size, char *out)
+{
+    const size_t n = size/sample_size;
+    for (size_t k=0; k<sample_size; ++k)
+    {
+        char *p = out + k;
+        for (size_t i=0; i<n; ++i, p+=sample_size) *p = *in++;
+    }
+    memcpy(out + n*sample_size, in, size - n*sample_size);
+}
+
+//-----------------------------------------------------------------------------
+FrameRelaySender::FrameRelaySender(const std::string &host_addr, int port,
+                                   bool compress, int send_buffer_bytes)
+{
+    memset(&host_, 0, sizeof(host_));
+    host_.sin_family = AF_INET;
+    host_.sin_addr.s_addr = inet_addr(host_addr.c_str());
+    host_.sin_port = htons(port);
+    compress_ = compress;
+    send_buffer_bytes_ = send_buffer_bytes;
+    sock_ = -1;
+    geometry_id_ = 0;
+
+} // FrameRelaySender Constructor
+
+int FrameRelaySender::Connect()
+{
+    Disconnect();
+    sock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock_ == -1)
+    {
+        nims_perror("FrameRelaySender socket");
+        return -1;
+    }
+    if (send_buffer_bytes_ > 0)
+        setsockopt(sock_, SOL_SOCKET, SO_SNDBUF, &send_buffer_bytes_, sizeof(int));
+    // frames are sent whole, with MSG_MORE on all but the last part
+    int one = 1;
+    setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if ( ::connect(sock_, (struct sockaddr *)&host_, sizeof(host_)) == -1 )
+    {
+        nims_perror("FrameRelaySender connect");
+        Disconnect();
+        return -1;
+    }
+
+    RelayHello hello;
+    memcpy(hello.magic, kRelayMagic, sizeof(kRelayMagic));
+    hello.header_size = sizeof(FrameHeader);
+    hello.geometry_size = sizeof(FrameGeometry);
+    if (SendAll(&hello, sizeof(hello), false) == -1) return -1;
+    geometry_id_ = 0; // the receiver needs the geometry again
+    return 0;
+
+} // FrameRelaySender::Connect
+
+void FrameRelaySender::Disconnect()
+{
+    if (sock_ != -1) close(sock_);
+    sock_ = -1;
+
+} // FrameRelaySender::Disconnect
+
+int FrameRelaySender::SendFrame(const FrameView &view)
+{
+    if (sock_ == -1) return -1;
+
+    // Copy or compress the data before sending anything, so a frame the
+    // writer overwrote meanwhile can be dropped whole.
+    const FrameHeader &hdr = view.header();
+    const char *data = (const char *)view.data_ptr();
+    const size_t data_size = view.size();
+    uint32_t flags = 0;
+    if (compress_ && data_size > 0)
+    {
+        shuffled_.resize(data_size);
+        ShuffleBytes(data, data_size, SampleSize(hdr.encoding), shuffled_.data());
+        payload_.resize(compressBound(data_size));
+        uLongf len = payload_.size();
+        if (Z_OK == compress2((Bytef *)payload_.data(), &len, (const Bytef *)shuffled_.data(),
+                              data_size, Z_BEST_SPEED)
+            && len < data_size)
+        {
+            payload_.resize(len);
+            flags = kRelayDeflate;
+        }
+    }
+    if (flags == 0) payload_.assign(data, data + data_size);
+    if (!view.valid()) return 0;
+
+    const FrameGeometry *geom = view.geometry();
+    if (geom != nullptr && geom->generation != geometry_id_)
+    {
+        RelayRecord rec = { kRelayGeometryRecord, 0, sizeof(FrameGeometry) };
+        if (SendAll(&rec, sizeof(rec), true) == -1
+            || SendAll(geom, sizeof(FrameGeometry), false) == -1) return -1;
+        geometry_id_ = geom->generation;
+        stats_.wire_bytes += sizeof(rec) + sizeof(FrameGeometry);
+    }
+
+    RelayRecord rec = { kRelayFrameRecord, flags,
+                        sizeof(RelayFrameInfo) + sizeof(FrameHeader) + payload_.size() };
+    RelayFrameInfo info;
+    info.frame_number = view.frame_number();
+    info.send_time = RelayClock();
+    info.data_size = data_size;
+    char head[sizeof(rec) + sizeof(info) + sizeof(FrameHeader)];
+    memcpy(head, &rec, sizeof(rec));
+    memcpy(head + sizeof(rec), &info, sizeof(info));
+    memcpy(head + sizeof(rec) + sizeof(info), &hdr, sizeof(FrameHeader));
+    if (SendAll(head, sizeof(head), true) == -1
+        || SendAll(payload_.data(), payload_.size(), false) == -1) return -1;
+
+    stats_.frames++;
+    stats_.data_bytes += data_size;
+    stats_.wire_bytes += sizeof(head) + payload_.size();
+    return 1;
+
+} // FrameRelaySender::SendFrame
+
+int FrameRelaySender::SendAll(const void *buf, size_t len, bool more)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        // EINTR too:  the only handled signal is SIGINT
+        ssize_t n = send(sock_, p, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n == -1)
+        {
+            nims_perror("FrameRelaySender send");
+            Disconnect();
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+
+} // FrameRelaySender::SendAll
+
+//-----------------------------------------------------------------------------
+FrameRelayReceiver::FrameRelayReceiver(int port)
+{
+    port_ = port;
+    listen_sock_ = -1;
+    sock_ = -1;
+
+} // FrameRelayReceiver Constructor
+
+FrameRelayReceiver::~FrameRelayReceiver()
+{
+    Disconnect();
+    if (listen_sock_ != -1) close(listen_sock_);
+
+} // FrameRelayReceiver Destructor
+
+int FrameRelayReceiver::Listen()
+{
+    listen_sock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_sock_ == -1)
+    {
+        nims_perror("FrameRelayReceiver socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(listen_sock_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+    if ( bind(listen_sock_, (struct sockaddr *)&addr, sizeof(addr)) == -1
+         || listen(listen_sock_, 1) == -1 )
+    {
+        nims_perror("FrameRelayReceiver bind/listen");
+        close(listen_sock_);
+        listen_sock_ = -1;
+        return -1;
+    }
+    return 0;
+
+} // FrameRelayReceiver::Listen
+
+int FrameRelayReceiver::Accept()
+{
+    Disconnect();
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    sock_ = accept(listen_sock_, (struct sockaddr *)&addr, &addr_len);
+    if (sock_ == -1)
+    {
+        if (errno != EINTR) nims_perror("FrameRelayReceiver accept");
+        return -1;
+    }
+    peer_ = string(inet_ntoa(addr.sin_addr)) + ":" + to_string(ntohs(addr.sin_port));
+
+    RelayHello hello;
+    if (ReceiveAll(&hello, sizeof(hello)) != 1) return -1;
+    if ( memcmp(hello.magic, kRelayMagic, sizeof(kRelayMagic)) != 0
+         || hello.header_size != sizeof(FrameHeader)
+         || hello.geometry_size != sizeof(FrameGeometry) )
+    {
+        NIMS_LOG_ERROR << "relay sender " << peer_ << " is not a compatible NIMS relay";
+        Disconnect();
+        return -1;
+    }
+    geometry_.reset();
+    return 0;
+
+} // FrameRelayReceiver::Accept
+
+void FrameRelayReceiver::Disconnect()
+{
+    if (sock_ != -1) close(sock_);
+    sock_ = -1;
+
+} // FrameRelayReceiver::Disconnect
+
+long FrameRelayReceiver::ReceiveFrame(Frame* frame, double* send_time)
+{
+    if (sock_ == -1) return -1;
+    while (1)
+    {
+        RelayRecord rec;
+        int ret = ReceiveAll(&rec, sizeof(rec));
+        if (ret != 1) return ret;
+        if (rec.size > kMaxRelayRecord)
+        {
+            NIMS_LOG_ERROR << "relay sender " << peer_ << " sent a record of " << rec.size
+                           << " bytes; disconnecting";
+            Disconnect();
+            return -1;
+        }
+        stats_.wire_bytes += sizeof(rec) + rec.size;
+
+        if (rec.type == kRelayGeometryRecord && rec.size == sizeof(FrameGeometry))
+        {
+            std::shared_ptr<FrameGeometry> geom = std::make_shared<FrameGeometry>();
+            if (ReceiveAll(geom.get(), sizeof(FrameGeometry)) != 1) return -1;
+            geometry_ = geom;
+            continue;
+        }
+        if (rec.type != kRelayFrameRecord)
+        {
+            payload_.resize(rec.size);
+            if (ReceiveAll(payload_.data(), rec.size) != 1) return -1;
+            continue;
+        }
+
+        RelayFrameInfo info;
+        FrameHeader header;
+        if ( rec.size < sizeof(info) + sizeof(header)
+             || ReceiveAll(&info, sizeof(info)) != 1
+             || ReceiveAll(&header, sizeof(header)) != 1 ) return -1;
+        const size_t payload_size = rec.size - sizeof(info) - sizeof(header);
+        if (info.data_size > kMaxRelayData)
+        {
+            NIMS_LOG_ERROR << "relay sender " << peer_ << " sent a frame of " << info.data_size
+                           << " bytes; disconnecting";
+            Disconnect();
+            return -1;
+        }
+        frame->malloc_data(info.data_size);
+        if (frame->size() != info.data_size)
+        {
+            NIMS_LOG_ERROR << "no memory for a relayed frame of " << info.data_size << " bytes";
+            return -1;
+        }
+
+        char *data = (char *)frame->data_ptr();
+        if (rec.flags & kRelayDeflate)
+        {
+            payload_.resize(payload_size);
+            shuffled_.resize(info.data_size);
+            uLongf len = info.data_size;
+            if (ReceiveAll(payload_.data(), payload_size) != 1) return -1;
+            if ( Z_OK != uncompress((Bytef *)shuffled_.data(), &len,
+                                    (const Bytef *)payload_.data(), payload_size)
+                 || len != info.data_size )
+            {
+                NIMS_LOG_ERROR << "error inflating relayed frame " << info.frame_number;
+                return -1;
+            }
+            UnshuffleBytes(shuffled_.data(), len, SampleSize(header.encoding), data);
+        }
+        else if ( payload_size != info.data_size
+                  || ReceiveAll(data, payload_size) != 1 ) return -1;
+
+        frame->header = header;
+        frame->geometry = geometry_;
+        if (send_time != nullptr) *send_time = info.send_time;
+        stats_.frames++;
+        stats_.data_bytes += info.data_size;
+        return info.frame_number;
+    }
+
+} // FrameRelayReceiver::ReceiveFrame
+
+// Returns 1 when len bytes are received, 0 if the sender closed the
+// connection before the first byte, or -1.
+int FrameRelayReceiver::ReceiveAll(void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    const size_t total = len;
+    while (len > 0)
+    {
+        ssize_t n = recv(sock_, p, len, 0);
+        if (n == 0 && len == total) return 0;
+        if (n <= 0)
+        {
+            if (n == 0) NIMS_LOG_ERROR << "relay sender closed the connection mid-record";
+            else if (errno != EINTR) nims_perror("FrameRelayReceiver recv");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+
+} // FrameRelayReceiver::ReceiveAll
@@ -0,0 +1,166 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_relay.h
+ *
+ *  Streams frames from one NIMS node to another over TCP, so detection and
+ *  tracking can run on a different machine than the ingester.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#ifndef __NIMS_FRAME_RELAY_H__
+#define __NIMS_FRAME_RELAY_H__
+
+#include <netinet/in.h> // sockaddr_in
+#include <cstdint>      // fixed width integer types
+#include <string>
+#include <vector>
+#include <memory>       // shared_ptr
+
+#include "frame_buffer.h"
+
+/*
+ Relay stream (native byte order, packed):
+
+   RelayHello    sent once by the sender after it connects
+   records       each a RelayRecord followed by size bytes:
+                   kRelayGeometryRecord:  FrameGeometry, sent before the
+                                          first frame and whenever the
+                                          geometry changes
+                   kRelayFrameRecord:     RelayFrameInfo, FrameHeader, and
+                                          the frame data, deflated if the
+                                          record has kRelayDeflate
+
+ The headers are sent as they are in memory, so both ends must be the same
+ build on the same kind of machine; the hello carries their sizes to catch
+ a mismatch.  Records of an unknown type are skipped.
+*/
+const char kRelayMagic[8] = { 'N', 'I', 'M', 'S', 'R', 'L', 'Y', '1' };
+
+enum RelayRecordType { kRelayGeometryRecord = 1, kRelayFrameRecord = 2 };
+
+// RelayRecord::flags
+// The frame data was byte shuffled (the first byte of every sample, then
+// the second, ...) and deflated with zlib.  Shuffling puts the exponent
+// and high order bytes of the samples together, which compress far better
+// than the samples as they are.
+const uint32_t kRelayDeflate = 1;
+
+struct __attribute__ ((__packed__)) RelayHello
+{
+    char     magic[8];
+    uint32_t header_size;   // sizeof(FrameHeader)
+    uint32_t geometry_size; // sizeof(FrameGeometry)
+};
+
+struct __attribute__ ((__packed__)) RelayRecord
+{
+    uint32_t type;
+    uint32_t flags;
+    uint64_t size;     // bytes that follow
+};
+
+struct __attribute__ ((__packed__)) RelayFrameInfo
+{
+    int64_t  frame_number; // in the sender's frame buffer
+    double   send_time;    // sender's clock when the frame was sent (s)
+    uint64_t data_size;    // bytes of frame data, before compression
+};
+
+// Totals since the relay was created.
+struct RelayStats
+{
+    long     frames;
+    uint64_t data_bytes; // frame data, before compression
+    uint64_t wire_bytes; // everything sent or received on the socket
+
+    RelayStats() { frames = 0; data_bytes = 0; wire_bytes = 0; };
+};
+
+// Seconds since Jan 1, 1970, as in RelayFrameInfo::send_time.
+double RelayClock();
+
+//-----------------------------------------------------------------------------
+// The sending end.  Reads nothing itself; the relay process gets frames
+// from its frame buffer and hands them to SendFrame.
+class FrameRelaySender
+{
+    public:
+        // Deflate the frame data if compress is set.  A send_buffer_bytes
+        // of 0 keeps the system's socket buffer size; a smaller buffer
+        // keeps fewer frames in flight on a slow link.
+        FrameRelaySender(const std::string &host_addr, int port, bool compress,
+                         int send_buffer_bytes=0);
+        ~FrameRelaySender() { Disconnect(); };
+
+        // Connect to the receiver.  Returns -1 on error.
+        int Connect();
+        void Disconnect();
+        bool connected() const { return sock_ != -1; };
+
+        // Send a frame, and its geometry if that changed.  Returns 1 if the
+        // frame was sent, 0 if the writer overwrote it while it was being
+        // read (nothing was sent), or -1 on error, which disconnects.
+        int SendFrame(const FrameView &view);
+
+        const RelayStats& stats() const { return stats_; };
+
+    private:
+        int SendAll(const void *buf, size_t len, bool more);
+
+        struct sockaddr_in host_;
+        bool compress_;
+        int send_buffer_bytes_;
+        int sock_;
+        uint32_t geometry_id_;     // generation of the last geometry sent
+        std::vector<char> shuffled_;
+        std::vector<char> payload_;
+        RelayStats stats_;
+
+}; // class FrameRelaySender
+
+//-----------------------------------------------------------------------------
+// The receiving end.  Takes one sender at a time.
+class FrameRelayReceiver
+{
+    public:
+        FrameRelayReceiver(int port);
+        ~FrameRelayReceiver();
+
+        // Start listening for senders.  Returns -1 on error.
+        int Listen();
+        // Wait for a sender to connect.  Returns -1 on error or if
+        // interrupted by a signal.
+        int Accept();
+        void Disconnect();
+        bool connected() const { return sock_ != -1; };
+        // address of the connected sender
+        const std::string& peer() const { return peer_; };
+
+        // Receive the next frame, with memory from frame->allocator if it
+        // is set (e.g. the local FrameBufferWriter), and the geometry the
+        // sender last sent.  Returns the sender's number for the frame, 0 if
+        // the sender closed the connection, or -1 on error.  The caller
+        // should Disconnect on 0 or -1.  A record too big to be a frame
+        // disconnects the sender here, before anything is allocated for it.
+        long ReceiveFrame(Frame* frame, double* send_time=nullptr);
+
+        const RelayStats& stats() const { return stats_; };
+
+    private:
+        int ReceiveAll(void *buf, size_t len);
+
+        int port_;
+        int listen_sock_;
+        int sock_;
+        std::string peer_;
+        std::shared_ptr<const FrameGeometry> geometry_;
+        std::vector<char> shuffled_;
+        std::vector<char> payload_;
+        RelayStats stats_;
+
+}; // class FrameRelayReceiver
+
+#endif // __NIMS_FRAME_RELAY_H__
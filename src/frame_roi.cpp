@@ -0,0 +1,157 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_roi.cpp
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#include "frame_roi.h"
+
+#include <algorithm>  // min, max
+#include <cfloat>     // FLT_MIN
+#include <cmath>      // ceil, floor, pow, log10
+
+#include "log.h"
+
+FrameROI::FrameROI(const ROIParams &params) : params_(params), in_beams_(0),
+                                              first_beam_(0), last_beam_(0),
+                                              warned_no_geometry_(false)
+{
+    params_.range_decimation = std::max(params_.range_decimation, 1);
+    params_.beam_merge = std::max(params_.beam_merge, 1);
+}
+
+bool FrameROI::whole_ping() const
+{
+    return params_.range_min_m <= 0.0 && params_.range_max_m <= 0.0
+           && params_.bearing_min_deg <= -180.0 && params_.bearing_max_deg >= 180.0
+           && params_.range_decimation == 1 && params_.beam_merge == 1;
+}
+
+//-----------------------------------------------------------------------------
+void FrameROI::FindBeams(const Frame &frame)
+{
+    if (frame.geometry == in_geometry_ && frame.header.num_beams == in_beams_) return;
+    in_geometry_ = frame.geometry;
+    in_beams_ = frame.header.num_beams;
+    out_geometry_.reset();
+
+    // without beam angles, every beam is in the window
+    first_beam_ = 0;
+    last_beam_ = in_beams_;
+    if (!in_geometry_)
+    {
+        if ( !warned_no_geometry_ && (params_.bearing_min_deg > -180.0
+                                      || params_.bearing_max_deg < 180.0) )
+        {
+            NIMS_LOG_WARNING << "ping " << frame.header.ping_num << " has no beam angles;"
+                             << " keeping all beams, not just the bearing window";
+            warned_no_geometry_ = true;
+        }
+        return;
+    }
+    const FrameGeometry &in = *in_geometry_;
+    last_beam_ = std::min(in_beams_, in.num_beams);
+
+    // the angles go one way across the beams, so the window is contiguous
+    while (first_beam_ < last_beam_
+           && (in.beam_angles_deg[first_beam_] < params_.bearing_min_deg
+               || in.beam_angles_deg[first_beam_] > params_.bearing_max_deg))
+        ++first_beam_;
+    while (last_beam_ > first_beam_
+           && (in.beam_angles_deg[last_beam_-1] < params_.bearing_min_deg
+               || in.beam_angles_deg[last_beam_-1] > params_.bearing_max_deg))
+        --last_beam_;
+
+    const int merge = params_.beam_merge;
+    if (merge == 1 && first_beam_ == 0 && last_beam_ == (int)in.num_beams)
+    {
+        out_geometry_ = in_geometry_;
+        return;
+    }
+    FrameGeometry out;
+    out.num_beams = (last_beam_ - first_beam_)/merge;
+    for (uint32_t n=0; n<out.num_beams; ++n)
+    {
+        double sum = 0.0;
+        for (int b=0; b<merge; ++b) sum += in.beam_angles_deg[first_beam_ + n*merge + b];
+        out.beam_angles_deg[n] = sum/merge;
+    }
+    out_geometry_ = std::make_shared<const FrameGeometry>(out);
+} // FrameROI::FindBeams
+
+//-----------------------------------------------------------------------------
+int FrameROI::Apply(Frame *frame)
+{
+    FrameHeader &hdr = frame->header;
+    const int num_samples = hdr.num_samples;
+    const int num_beams = hdr.num_beams;
+    if (num_samples == 0 || num_beams == 0) return -1;
+
+    // range bins [first_bin, last_bin) in the range window
+    const double step = (num_samples > 1)
+                      ? (hdr.range_max_m - hdr.range_min_m)/(num_samples - 1) : 0.0;
+    int first_bin = 0, last_bin = num_samples;
+    if (step > 0.0 && params_.range_min_m > hdr.range_min_m)
+        first_bin = std::min((int)ceil((params_.range_min_m - hdr.range_min_m)/step), num_samples);
+    if (step > 0.0 && params_.range_max_m > 0.0)
+        last_bin = std::min(std::max((int)floor((params_.range_max_m - hdr.range_min_m)/step) + 1, 0),
+                            num_samples);
+    const int decimation = params_.range_decimation;
+    const int out_samples = std::max(last_bin - first_bin, 0)/decimation;
+
+    FindBeams(*frame);
+    const int merge = params_.beam_merge;
+    const int out_beams = (last_beam_ - first_beam_)/merge;
+
+    if (out_samples == 0 || out_beams == 0)
+    {
+        NIMS_LOG_WARNING << "ping " << hdr.ping_num << " has nothing in the region of interest";
+        return -1;
+    }
+    if (out_samples == num_samples && out_beams == num_beams) return 0;
+
+    // Output row m is written after its input rows are read, and the input
+    // rows of the rows after it start past its end, so one pass in place
+    // does not overwrite samples still to be read.
+    const size_t sample_size = SampleSize(hdr.encoding);
+    char *data = (char *)frame->data_ptr();
+    const int in_row = out_beams*merge;
+    row_.resize(in_row);
+    sum_.resize(out_beams);
+    const float norm = 1.0f/(decimation*merge);
+    for (int m=0; m<out_samples; ++m)
+    {
+        std::fill(sum_.begin(), sum_.end(), 0.0f);
+        for (int d=0; d<decimation; ++d)
+        {
+            const size_t first = (size_t)(first_bin + m*decimation + d)*num_beams + first_beam_;
+            DecodeSamples(hdr, data, first, in_row, row_.data());
+            if (params_.decibels)
+                for (int k=0; k<in_row; ++k) row_[k] = pow(10.0f, 0.1f*row_[k]);
+            for (int n=0; n<out_beams; ++n)
+                for (int b=0; b<merge; ++b) sum_[n] += row_[n*merge + b];
+        }
+        for (int n=0; n<out_beams; ++n)
+        {
+            sum_[n] *= norm;
+            if (params_.decibels) sum_[n] = 10.0f*log10(std::max(sum_[n], FLT_MIN));
+        }
+        EncodeSamples(hdr, sum_.data(), out_beams, data + (size_t)m*out_beams*sample_size);
+    }
+
+    const float range_min = hdr.range_min_m + (first_bin + 0.5*(decimation - 1))*step;
+    hdr.range_min_m = range_min;
+    hdr.range_max_m = range_min + (out_samples - 1)*decimation*step;
+    // the sampling window, in proportion to the range bins kept
+    const float bin_sec = hdr.winlen_sec/num_samples;
+    hdr.winstart_sec += first_bin*bin_sec;
+    hdr.winlen_sec = out_samples*decimation*bin_sec;
+    hdr.num_samples = out_samples;
+    hdr.num_beams = out_beams;
+    frame->shrink_data((size_t)out_samples*out_beams*sample_size);
+    if (out_geometry_) frame->geometry = out_geometry_;
+    return 0;
+} // FrameROI::Apply
@@ -0,0 +1,82 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  frame_roi.h
+ *
+ *  Cuts the pings down to a region of interest before they go into the
+ *  frame buffer, so the stages after the ingester only get the ranges and
+ *  beams they look at.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#ifndef __NIMS_FRAME_ROI_H__
+#define __NIMS_FRAME_ROI_H__
+
+#include <memory>   // shared_ptr
+#include <vector>
+
+#include "frame_buffer.h"
+
+// Region of interest, from the roi section of a sonar's config.
+struct ROIParams {
+  float range_min_m;      // keep the samples from this range
+  float range_max_m;      // to this one; 0 for the last sample
+  float bearing_min_deg;  // keep the beams between these angles
+  float bearing_max_deg;
+  int range_decimation;   // average this many range bins into one
+  int beam_merge;         // average this many adjacent beams into one
+  bool decibels;          // the samples are dB, so average their power
+
+  ROIParams()
+  {
+      range_min_m = range_max_m = 0.0;
+      bearing_min_deg = -180.0;
+      bearing_max_deg = 180.0;
+      range_decimation = beam_merge = 1;
+      decibels = false;
+  };
+};
+
+/*
+ Crops a ping to a window of range and bearing, and averages groups of
+ range bins and of adjacent beams.  The frame is done in place, a row of
+ samples at a time, so a ping decoded straight into the frame buffer stays
+ there; the header, data size and geometry are updated to match, and the
+ sampling window is cut down with the range bins.  Each range bin of the
+ result is at the middle of the bins averaged into it, and each beam at
+ the mean angle of its beams.  Pings without a geometry have no angles to
+ pick beams by, so all their beams are kept.  Leftover bins or beams at
+ the far end of the window that do not make a whole group are dropped.
+*/
+class FrameROI
+{
+    public:
+        explicit FrameROI(const ROIParams &params);
+
+        // True if every ping is kept as it is.
+        bool whole_ping() const;
+
+        // Cut the frame down to the region.  Returns -1, leaving the frame
+        // as it was, if no whole range bin or beam of it is in the region.
+        int Apply(Frame *frame);
+
+    private:
+        // the beams [first, last) of the last geometry in the bearing window
+        void FindBeams(const Frame &frame);
+
+        ROIParams params_;
+        std::vector<framedata_t> row_;  // samples of an input row
+        std::vector<framedata_t> sum_;  // averages of an output row
+        // the geometry of the last ping, and what it is cut down to
+        std::shared_ptr<const FrameGeometry> in_geometry_;
+        std::shared_ptr<const FrameGeometry> out_geometry_;
+        uint32_t in_beams_;
+        int first_beam_;
+        int last_beam_;
+        bool warned_no_geometry_;
+
+}; // class FrameROI
+
+#endif // __NIMS_FRAME_ROI_H__
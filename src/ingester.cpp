@@ -12,6 +12,12 @@
 #include <string>   // for strings
 #include <sys/inotify.h> // watch a directory
 #include <signal.h>
+#include <pthread.h> // pthread_kill
+#include <thread>
+#include <atomic>
+#include <chrono>   // time stuff
+#include <map>
+#include <memory>   // unique_ptr
 
 //#include <opencv2/opencv.hpp>
 
@@ -22,6 +28,9 @@
 #include "data_source_blueview.h"
 #include "data_source_ek60.h"
 #include "frame_buffer.h"
+#include "frame_queue.h"
+#include "frame_roi.h"
+#include "frame_calibration.h"
 #include "nims_ipc.h" 
 #include "log.h"
 
@@ -37,6 +46,139 @@ namespace fs = boost::filesystem;
 #define NIMS_SONAR_BLUEVIEW 2
 #define NIMS_SONAR_EK60 3
 
+// Frame buffer of each channel a source reads; sources with one channel
+// use channel 0.
+typedef std::map< uint32_t, std::unique_ptr<FrameBufferWriter> > ChannelBuffers;
+
+// Put a ping in the frame buffer of its channel.
+static void PutPing(const ChannelBuffers &fbs, const Frame &frame)
+{
+    NIMS_LOG_DEBUG << "got ping " << frame.header.ping_num << " on channel "
+                   << frame.header.channel;
+    NIMS_LOG_DEBUG << frame.header << endl;
+    ChannelBuffers::const_iterator fb = fbs.find(frame.header.channel);
+    if (fb == fbs.end())
+        NIMS_LOG_WARNING << "no frame buffer for channel " << frame.header.channel;
+    else
+        fb->second->PutNewFrame(frame);
+}
+
+// Region of interest from the roi section of a sonar's config; the whole
+// ping if there is none.
+static ROIParams ReadROI(const YAML::Node &sonar)
+{
+    ROIParams params;
+    YAML::Node roi = sonar["roi"];
+    if (!roi) return params;
+    params.range_min_m = roi["range_min_m"].as<float>(params.range_min_m);
+    params.range_max_m = roi["range_max_m"].as<float>(params.range_max_m);
+    params.bearing_min_deg = roi["bearing_min_deg"].as<float>(params.bearing_min_deg);
+    params.bearing_max_deg = roi["bearing_max_deg"].as<float>(params.bearing_max_deg);
+    params.range_decimation = roi["range_decimation"].as<int>(params.range_decimation);
+    params.beam_merge = roi["beam_merge"].as<int>(params.beam_merge);
+    NIMS_LOG_DEBUG << "roi: range " << params.range_min_m << " to " << params.range_max_m
+                   << " m, bearing " << params.bearing_min_deg << " to "
+                   << params.bearing_max_deg << " deg, range_decimation "
+                   << params.range_decimation << ", beam_merge " << params.beam_merge;
+    return params;
+}
+
+// Calibration from the calibration section of a sonar's config.  Returns
+// false if there is none.
+static bool ReadCalibration(const YAML::Node &sonar, CalibrationParams *params)
+{
+    YAML::Node calibration = sonar["calibration"];
+    if (!calibration) return false;
+    params->spreading = calibration["spreading"].as<float>(params->spreading);
+    params->absorption_db_km = calibration["absorption_db_km"].as<float>(params->absorption_db_km);
+    params->offset_db = calibration["offset_db"].as<float>(params->offset_db);
+    params->decibels = calibration["decibels"].as<bool>(params->decibels);
+    NIMS_LOG_DEBUG << "calibration: spreading " << params->spreading << ", absorption_db_km "
+                   << params->absorption_db_km << ", offset_db " << params->offset_db
+                   << ", decibels " << params->decibels;
+    return true;
+}
+
+// What is done to each ping between the source and the frame buffer; a
+// stage that is not used is nullptr.
+struct PingStages {
+    FrameROI *roi;
+    FrameCalibration *calibration;
+};
+
+// Returns -1 if the ping is dropped.
+static int ApplyStages(const PingStages &stages, Frame *frame)
+{
+    if ( stages.roi != nullptr && -1 == stages.roi->Apply(frame) ) return -1;
+    if ( stages.calibration != nullptr && -1 == stages.calibration->Apply(frame) ) return -1;
+    return 0;
+}
+
+// Receive thread:  read pings from the source into the queue until the
+// source fails or ends, or SIGINT.  It does nothing else, so the source
+// is drained as fast as it can be.
+static void ReceivePings(DataSource *input, FrameQueue *queue, std::atomic<bool> *done)
+{
+    while ( input->more_data() && !sigint_received )
+    {
+        if ( -1 == input->GetPing(queue->Back()) ) break;
+        queue->Push();
+    }
+    done->store(true);
+}
+
+// Publish the pings from a receive thread, which keeps reading the source
+// while a frame goes through the ping stages and into the frame buffer.
+// Returns the number published.
+static size_t PublishPings(DataSource *input, const PingStages &stages,
+                           const ChannelBuffers &fbs, int queue_pings, double report_secs)
+{
+    FrameQueue queue(queue_pings);
+    std::atomic<bool> done(false);
+    std::thread receiver(ReceivePings, input, &queue, &done);
+
+    size_t frame_count = 0;
+    uint64_t last_dropped = 0;
+    auto last_report = chrono::steady_clock::now();
+    while ( !sigint_received )
+    {
+        Frame *frame = queue.Front(100);
+        if (frame == nullptr)
+        {
+            if ( done.load() && queue.depth() == 0 ) break;
+            continue;
+        }
+        if ( 0 == ApplyStages(stages, frame) )
+        {
+            PutPing(fbs, *frame);
+            ++frame_count;
+        }
+        queue.Pop();
+
+        auto now = chrono::steady_clock::now();
+        if (chrono::duration<double>(now - last_report).count() >= report_secs)
+        {
+            const uint64_t dropped = queue.frames_dropped();
+            if (dropped > last_dropped)
+                NIMS_LOG_WARNING << "receive queue full, dropped " << dropped - last_dropped
+                                 << " pings";
+            NIMS_LOG_DEBUG << "receive queue: " << queue.frames_pushed() << " pings, depth "
+                           << queue.depth() << " (max " << queue.max_depth() << " of "
+                           << queue.size() << "), " << dropped << " dropped";
+            last_dropped = dropped;
+            last_report = now;
+        }
+    }
+
+    // SIGINT may have gone to another thread; interrupt a blocking read
+    if ( !done.load() ) pthread_kill(receiver.native_handle(), SIGINT);
+    receiver.join();
+    if (queue.frames_dropped() > 0)
+        NIMS_LOG_WARNING << "receive queue full, dropped " << queue.frames_dropped()
+                         << " pings in all";
+    return frame_count;
+}
+
 
 int main (int argc, char * argv[]) {
 
@@ -55,7 +197,16 @@ int main (int argc, char * argv[]) {
   // TODO: make this virtual, like source
   EK60Params ek60_params; // EK60 parameters
 BlueViewParams bv_params; // BlueView data directory
+    string m3_file; // M3 recording to ingest instead of the sonar
+    double m3_replay_rate = 0;
 	string fb_name;
+    map<uint32_t, string> channel_fb_names; // EK60 channel frame buffers
+    FrameBufferParams fb_params;
+    ROIParams roi_params;
+    CalibrationParams calibration_params;
+    bool calibrate = false;
+    int receive_queue_pings;
+    double report_secs;
     try 
     {
         YAML::Node config = YAML::LoadFile(cfgpath);
@@ -65,6 +216,15 @@ BlueViewParams bv_params; // BlueView data directory
         sonar_host_addr = config["SONAR_HOST_ADDR"].as<string>();
         NIMS_LOG_DEBUG << "SONAR_HOST_ADDR: " << sonar_host_addr;
         
+        if (sonar_type == NIMS_SONAR_M3 && config["SONAR_M3"])
+        {
+          YAML::Node params = config["SONAR_M3"];
+          m3_file = params["file"].as<string>("");
+          NIMS_LOG_DEBUG << "file: " << m3_file;
+          m3_replay_rate = params["replay_rate"].as<double>(1.0);
+          NIMS_LOG_DEBUG << "replay_rate: " << m3_replay_rate;
+        }
+        
         if (sonar_type == NIMS_SONAR_BLUEVIEW)
         {
           YAML::Node params = config["SONAR_BLUEVIEW"];
@@ -72,6 +232,10 @@ BlueViewParams bv_params; // BlueView data directory
           bv_params.host_addr = config["SONAR_HOST_ADDR"].as<string>();
           bv_params.datadir = params["directory"].as<string>();
           bv_params.pulse_rate_hz = params["ping_rate_hz"].as<int>();
+          bv_params.pace = params["pace"].as<bool>(true);
+          NIMS_LOG_DEBUG << "pace: " << bv_params.pace;
+          bv_params.image_threads = params["image_threads"].as<int>(1);
+          NIMS_LOG_DEBUG << "image_threads: " << bv_params.image_threads;
         }
         
         if (sonar_type == NIMS_SONAR_EK60)
@@ -93,9 +257,64 @@ BlueViewParams bv_params; // BlueView data directory
           NIMS_LOG_DEBUG << "athwart_offset: " << ek60_params.athwart_offset;
           ek60_params.ping_rate_hz = params["ping_rate_hz"].as<int>();
            NIMS_LOG_DEBUG << "ping_rate_hz: " << ek60_params.ping_rate_hz;
+          YAML::Node channels = params["channels"];
+          for (size_t k=0; k<channels.size(); ++k)
+          {
+              EK60Channel channel;
+              channel.number = channels[k]["channel"].as<int>();
+              channel.along_sensitivity = channels[k]["along_sensitivity"]
+                  .as<float>(ek60_params.along_sensitivity);
+              channel.along_offset = channels[k]["along_offset"].as<float>(ek60_params.along_offset);
+              ek60_params.channels.push_back(channel);
+              channel_fb_names[channel.number] = channels[k]["framebuffer_name"].as<string>();
+              NIMS_LOG_DEBUG << "channel " << channel.number << ": "
+                             << channel_fb_names[channel.number] << ", along_sensitivity "
+                             << channel.along_sensitivity << ", along_offset "
+                             << channel.along_offset;
+          }
        }
+        string sonar_section;
+        if (sonar_type == NIMS_SONAR_M3) sonar_section = "SONAR_M3";
+        if (sonar_type == NIMS_SONAR_BLUEVIEW) sonar_section = "SONAR_BLUEVIEW";
+        if (sonar_type == NIMS_SONAR_EK60) sonar_section = "SONAR_EK60";
+        if (!sonar_section.empty())
+        {
+            roi_params = ReadROI(config[sonar_section]);
+            calibrate = ReadCalibration(config[sonar_section], &calibration_params);
+        }
+        // EK60 samples are dB of power
+        roi_params.decibels = (sonar_type == NIMS_SONAR_EK60);
+        calibration_params.input_decibels = (sonar_type == NIMS_SONAR_EK60);
         fb_name = config["FRAMEBUFFER_NAME"].as<string>();
         NIMS_LOG_DEBUG << "FRAMEBUFFER_NAME: " << fb_name;
+        // the EK60 reads channel 1 into FRAMEBUFFER_NAME unless told otherwise
+        if (sonar_type == NIMS_SONAR_EK60 && channel_fb_names.empty())
+            channel_fb_names[1] = fb_name;
+        if (channel_fb_names.empty())
+            channel_fb_names[0] = fb_name;
+        // without a FRAMEBUFFER section, a frame per shared memory object
+        YAML::Node fb_config = config["FRAMEBUFFER"];
+        fb_params.ring = fb_config["ring"].as<bool>(fb_params.ring);
+        NIMS_LOG_DEBUG << "ring: " << fb_params.ring;
+        fb_params.num_slots = fb_config["ring_slots"].as<int>(fb_params.num_slots);
+        NIMS_LOG_DEBUG << "ring_slots: " << fb_params.num_slots;
+        const float max_frame_mb = fb_config["max_frame_mb"].as<float>(
+            fb_params.slot_bytes/(1024.0*1024.0));
+        fb_params.slot_bytes = max_frame_mb*1024*1024;
+        NIMS_LOG_DEBUG << "max_frame_mb: " << max_frame_mb;
+        fb_params.huge_pages = fb_config["huge_pages"].as<bool>(fb_params.huge_pages);
+        NIMS_LOG_DEBUG << "huge_pages: " << fb_params.huge_pages;
+        fb_params.persistent = fb_config["persistent"].as<bool>(fb_params.persistent);
+        NIMS_LOG_DEBUG << "persistent: " << fb_params.persistent;
+        YAML::Node ingester_config = config["INGESTER"];
+        // By default only the EK60, whose UDP datagrams are lost if its
+        // socket is not drained, has a receive queue; the others decode
+        // straight into the frame buffer.
+        receive_queue_pings = ingester_config["receive_queue_pings"].as<int>(
+            (sonar_type == NIMS_SONAR_EK60) ? 8 : 0);
+        NIMS_LOG_DEBUG << "receive_queue_pings: " << receive_queue_pings;
+        report_secs = ingester_config["report_seconds"].as<double>(60.0);
+        NIMS_LOG_DEBUG << "report_seconds: " << report_secs;
      }
      catch( const std::exception& e )
     {
@@ -107,11 +326,16 @@ BlueViewParams bv_params; // BlueView data directory
     SubprocessCheckin(getpid()); // sync with main NIMS process
     
     // create fb before datasource
-    FrameBufferWriter fb(fb_name);
-    if ( -1 == fb.Initialize() )
+    ChannelBuffers fbs;
+    for (auto it = channel_fb_names.begin(); it != channel_fb_names.end(); ++it)
     {
-       NIMS_LOG_ERROR << "Error initializing frame buffer writer.";
-       return -1;
+        std::unique_ptr<FrameBufferWriter> fb(new FrameBufferWriter(it->second, fb_params));
+        if ( -1 == fb->Initialize() )
+        {
+           NIMS_LOG_ERROR << "Error initializing frame buffer writer " << it->second;
+           return -1;
+        }
+        fbs[it->first] = std::move(fb);
     }
    
  	DataSource *input; // This is a virtual class.   
@@ -120,6 +344,15 @@ BlueViewParams bv_params; // BlueView data directory
 	switch ( sonar_type )
 	{
 	    case NIMS_SONAR_M3 :  
+            if ( !m3_file.empty() )
+            {
+                NIMS_LOG_DEBUG << "opening M3 recording " << m3_file << " as datasource";
+                input = new DataSourceM3File(m3_file, m3_replay_rate);
+                // every ping of a recording is wanted, and there is no
+                // socket to keep draining
+                receive_queue_pings = 0;
+                break;
+            }
             NIMS_LOG_DEBUG << "opening M3 sonar as datasource";
             input = new DataSourceM3(sonar_host_addr);
             break;
@@ -171,9 +404,19 @@ BlueViewParams bv_params; // BlueView data directory
    {
        NIMS_LOG_DEBUG << "connected to source!";
        size_t frame_count=0;
-       while ( input->more_data() )
+       FrameROI roi(roi_params);
+       FrameCalibration calibration(calibration_params);
+       PingStages stages;
+       stages.roi = roi.whole_ping() ? nullptr : &roi;
+       stages.calibration = calibrate ? &calibration : nullptr;
+       if (receive_queue_pings > 0)
+           frame_count = PublishPings(input, stages, fbs, receive_queue_pings, report_secs);
+       else while ( input->more_data() )
        {
            Frame frame;
+           // decode the ping directly into shared memory, if there is only
+           // one frame buffer it can go to
+           if (fbs.size() == 1) frame.allocator = fbs.begin()->second.get();
            if ( -1 == input->GetPing(&frame) ) break;
     
            // if we get INT during a recv(), GetPing returns -1 
@@ -181,10 +424,10 @@ BlueViewParams bv_params; // BlueView data directory
                NIMS_LOG_WARNING << "exiting due to SIGINT";
                break;
            }
+           // cut down and calibrated where it is, in shared memory or not
+           if ( -1 == ApplyStages(stages, &frame) ) continue;
     
-           NIMS_LOG_DEBUG << "got ping " << frame.header.ping_num;
-           NIMS_LOG_DEBUG << frame.header << endl;
-           fb.PutNewFrame(frame);
+           PutPing(fbs, frame);
            ++frame_count;
         } // 
     }
@@ -0,0 +1,170 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  m3_format.h
+ *
+ *  Packet layout of the M3 beamformed data stream, shared by DataSourceM3
+ *  and the tests that feed it.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+
+#ifndef __NIMS_M3_FORMAT_H__
+#define __NIMS_M3_FORMAT_H__
+
+#include <stdint.h> // fixed width integer types
+
+//-----------------------------------------------------------------------------
+// from M3 IMB Beamformed Data Format, document 922-20007002
+//-----------------------------------------------------------------------------
+    
+
+#define INT32U  uint32_t
+#define INT32S  int32_t
+#define INT16U  uint16_t
+#define INT16S  int16_t
+#define INT8U   uint8_t
+
+#define HDR_SYNC_INT16U_1     (INT16U)0x8000
+#define HDR_SYNC_INT16U_2     (INT16U)0x8000
+#define HDR_SYNC_INT16U_3     (INT16U)0x8000
+#define HDR_SYNC_INT16U_4     (INT16U)0x8000
+
+#define PKT_DATA_TYPE_BEAMFORMED (INT16U)0x1002
+
+#define MAX_NUM_BEAMS           (INT32U)1024
+
+
+typedef struct
+{
+    float   I;
+    float   Q;
+} Ipp32fc_Type;
+
+
+// Time Varying Gain (TVG)
+// see section 9.9.3 Changing the TVG, p. 94 in User's Manual
+// Chu, D. and Hufnagle, Jr., L., "Time varying gain (TVG) measurements
+//    of a multibeam echo sounder for applications to quantitative acoustics.", 2006
+// www.dtic.mil/cgi-bin/GetTRDoc?AD=ADA498689
+// http://www.hydro-international.com/issues/articles/id890-Digital_Sidescan_is_this_the_end_of_TVG_and_AGC.html
+//
+// TL = max(A log10 r + B r + C, L)
+// where TL is transmission loss, r is range
+typedef struct
+{
+    INT16U  A; // the spreading coefficient
+    INT16U  B; // the absorption coefficient in dB/km
+    float   C; // the TVG curve offset in dB
+    float   L; // the maximum gain limit in dB
+} TVG_Params_Type;
+
+typedef struct
+{
+	float fOffsetA;	// rotator offset A in meters
+	float fOffsetB;	// rotator offset B in meters
+	float fOffsetR;	// rotator offset R in degrees
+	float fAngle;	// rotator angle in degrees
+
+}M3_ROTATOR_OFFSETS;
+
+typedef struct
+{
+    INT16U sync_word_1;
+    INT16U sync_word_2;
+    INT16U sync_word_3;
+    INT16U sync_word_4;
+    INT16U data_type;       // always 0x1002
+    INT16U reserved_field;  // NOTE:  this is in spec but not in load_image_data.c
+    INT32U reserved[10];
+    INT32U packet_body_size;
+} Packet_Header_Struct;
+
+typedef struct
+{
+    INT32U packet_body_size; // this should match value in header
+    INT32U reserved[10];
+} Packet_Footer_Struct;
+
+/****************************
+ * Data header               *
+ ****************************/
+typedef struct
+{
+    INT32U  dwVersion;
+    INT32U  dwSonarID;
+    INT32U  dwSonarInfo[8];
+    INT32U  dwTimeSec;
+    INT32U  dwTimeMillisec;
+    float   fVelocitySound;
+    INT32U  nNumSamples;
+    float   fNearRange;
+    float   fFarRange;
+    float   fSWST;
+    float   fSWL;
+    INT16U  nNumBeams;
+    INT16U  wReserved1;
+    float   fBeamList[MAX_NUM_BEAMS];
+    float   fImageSampleInterval;
+    INT16U  wImageDestination;
+    INT16U  wReserved2;
+    INT32U  dwModeID;
+    INT32S  nNumHybridPRI;
+    INT32S  nHybridIndex;
+    INT16U  nPhaseSeqLength;
+    INT16U  iPhaseSeqIndex;
+    INT16U  nNumImages;
+    INT16U  iSubImageIndex;
+    
+    INT32U  dwSonarFreq;
+    INT32U  dwPulseLength;
+    INT32U  dwPingNumber;
+    
+    float   fRXFilterBW;
+    float   fRXNominalResolution;
+    float   fPulseRepFreq;
+    char    strAppName[128];
+    char    strTXPulseName[64];
+    TVG_Params_Type sTVGParameters;
+    float   fCompassHeading;
+    float   fMagneticVariation;
+    float   fPitch;
+    float   fRoll;
+    float   fDepth;
+    float   fTemperature;
+    
+    float   fXOffset;  // M3_OFFSET
+    float   fYOffset;
+    float   fZOffset;
+    float   fXRotOffset;
+    float   fYRotOffset;
+    float   fZRotOffset;
+	INT32U dwMounting;
+    
+    double  dbLatitude;
+    double  dbLongitude;
+    float   fTXWST;
+    
+	unsigned char bHeadSensorsVersion;
+	unsigned char bHeadHWStatus;
+    INT8U   byReserved1;
+    INT8U   byReserved2;
+    
+    float fInternalSensorHeading;
+	float fInternalSensorPitch;
+	float fInternalSensorRoll;
+	M3_ROTATOR_OFFSETS aAxesRotatorOffsets[3];
+
+    INT16U nStartElement;
+    INT16U nEndElement;
+    char   strCustomText1[32];
+    char   strCustomText2[32];
+    float  fLocalTimeOffset;
+    
+    unsigned char  reserved[3876];
+    
+    
+ } Data_Header_Struct;
+
+#endif // __NIMS_M3_FORMAT_H__
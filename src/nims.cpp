@@ -316,6 +316,60 @@ static void WarmRestart(std::string &cfgpath)
     sigaction(SIGCHLD, &old_action, NULL);
 }
 
+/*
+  With a persistent frame ring, the frame buffer readers carry on when
+  the ingester restarts.  If the ingester is the only child that exited,
+  relaunch just that one so the others keep their state (the detector's
+  background, for instance).  Returns false if a warm restart is needed.
+*/
+static bool RelaunchIngester(std::string &cfgpath)
+{
+    if (NULL == child_tasks_) return false;
+    
+    bool persistent = false;
+    try {
+        YAML::Node fb_config = YAML::LoadFile(cfgpath)["FRAMEBUFFER"];
+        persistent = fb_config["ring"].as<bool>(false) 
+                     && fb_config["persistent"].as<bool>(false)
+                     && !fb_config["huge_pages"].as<bool>(false);
+    }
+    catch( const std::exception& e ) {
+        NIMS_LOG_ERROR << "Error reading config file: " << e.what();
+    }
+    if (!persistent) return false;
+    
+    // look without reaping, so a warm restart can still wait for them
+    nims::Task *ingester = NULL;
+    vector<nims::Task *>::iterator it;
+    for (it = child_tasks_->begin(); it != child_tasks_->end(); ++it) {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (-1 == waitid(P_PID, (*it)->get_pid(), &info, WEXITED | WNOHANG | WNOWAIT)
+            || 0 == info.si_pid)
+            continue;
+        if ((*it)->name() != "ingester") return false;
+        ingester = *it;
+    }
+    if (NULL == ingester) return false;
+    
+    int status;
+    HANDLE_EINTR(waitpid(ingester->get_pid(), &status, 0));
+    NIMS_LOG_WARNING << "relaunching " << ingester->name();
+    
+    mqd_t mq = CreateMessageQueue(MQ_SUBPROCESS_CHECKIN_QUEUE, sizeof(pid_t), false);
+    if (-1 == mq) {
+        NIMS_LOG_ERROR << "failed to create checkin message queue";
+        exit(1);
+    }
+    if (ingester->launch())
+        WaitForTaskLaunch(ingester, mq);
+    else
+        NIMS_LOG_ERROR << "Failed to launch " << ingester->name();
+    mq_close(mq);
+    mq_unlink(MQ_SUBPROCESS_CHECKIN_QUEUE);
+    return true;
+}
+
 int main (int argc, char * argv[]) {
 	//--------------------------------------------------------------------------
     // PARSE COMMAND LINE
@@ -473,10 +527,15 @@ int main (int argc, char * argv[]) {
                 time_t current_time = time(NULL);
 #define MIN_RELAUNCH_TIME_INTERVAL 60
                 if ((current_time - last_relaunch_time_) > MIN_RELAUNCH_TIME_INTERVAL) {
-                    NIMS_LOG_ERROR << "attempting warm restart";
-                    WarmRestart(cfgpath);
+                    if (RelaunchIngester(cfgpath)) {
+                        NIMS_LOG_ERROR << "relaunched ingester";
+                    }
+                    else {
+                        NIMS_LOG_ERROR << "attempting warm restart";
+                        WarmRestart(cfgpath);
+                        NIMS_LOG_ERROR << "warm restart succeeded";
+                    }
                     last_relaunch_time_ = current_time;
-                    NIMS_LOG_ERROR << "warm restart succeeded";
                 }
                 else {
                     // stop and let atexit clean up
@@ -13,8 +13,12 @@
 #include <assert.h>   // assert
 #include <sys/stat.h>
 #include <sys/mman.h> // mmap, shm_open
+#include <sys/socket.h> // socket, sendmsg, recvmsg
+#include <sys/un.h>     // sockaddr_un
+#include <stddef.h>     // offsetof
 
 #include <cstring> // memcpy
+#include <algorithm> // min
 
 #include <boost/program_options.hpp>
 
@@ -170,6 +174,110 @@ int share_data(const string& shared_name, size_t hdr_size, char* phdr, size_t da
 
 }; // share_data()
 
+//************************************************************************
+// Unix Domain Sockets
+
+// Fill in an abstract socket address; returns the address length.
+static socklen_t UnixSocketAddress(const std::string &name, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    // leading NUL selects the abstract namespace
+    size_t len = std::min(name.size(), sizeof(addr->sun_path) - 1);
+    memcpy(addr->sun_path + 1, name.c_str(), len);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+int ListenUnixSocket(const std::string &name)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == sock) {
+        nims_perror("socket() in ListenUnixSocket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    socklen_t len = UnixSocketAddress(name, &addr);
+    if (0 != bind(sock, (struct sockaddr *)&addr, len) || 0 != listen(sock, 8)) {
+        nims_perror("bind() in ListenUnixSocket");
+        close(sock);
+        return -1;
+    }
+    return sock;
+    
+} // ListenUnixSocket
+
+int ConnectUnixSocket(const std::string &name)
+{
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == sock) {
+        nims_perror("socket() in ConnectUnixSocket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    socklen_t len = UnixSocketAddress(name, &addr);
+    if (0 != connect(sock, (struct sockaddr *)&addr, len)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+    
+} // ConnectUnixSocket
+
+int SendFileDescriptor(int sock, int fd)
+{
+    char byte = 'f'; // need to send at least one byte with the descriptor
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    
+    if (-1 == sendmsg(sock, &msg, MSG_NOSIGNAL)) {
+        nims_perror("sendmsg() in SendFileDescriptor");
+        return -1;
+    }
+    return 0;
+    
+} // SendFileDescriptor
+
+int ReceiveFileDescriptor(int sock)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        nims_perror("recvmsg() in ReceiveFileDescriptor");
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET 
+        || cmsg->cmsg_type != SCM_RIGHTS) {
+        NIMS_LOG_ERROR << "ReceiveFileDescriptor: no descriptor in message";
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+    
+} // ReceiveFileDescriptor
+
 int parse_command_line(int argc, char * argv[], std::string& cfgpath, std::string& log_level)
 {
     po::options_description desc;
@@ -26,6 +26,8 @@ void setup_signal_handling();
 #define MQ_DETECTOR_TRACKER_QUEUE "/nims_detector_tracker_queue"
 #define MQ_DETECTOR_VIEWER_QUEUE "/nims_detector_viewer_queue"
 #define MQ_TRACKER_ARCHIVER_QUEUE "/nims_tracker_archiver_queue"
+#define MQ_TRACKER_CAPTURE_QUEUE "/nims_tracker_capture_queue"
+#define MQ_CAPTURE_TRIGGER_QUEUE "/nims_capture_trigger_queue"
 
 // create/open a POSIX message queue with read/write permissions
 // the default mode is blocking
@@ -47,6 +49,22 @@ int share_data(const std::string& shared_name,
                size_t data_size=0, char* pdata=nullptr );
 
 
+//************************************************************************
+// Unix Domain Sockets
+//
+// Used to hand a file descriptor (e.g. a memfd with no name in /dev/shm)
+// to another process.  The socket names are in the abstract namespace, so
+// there is no file to clean up.
+
+// Create a listening socket; returns the socket or -1.
+int ListenUnixSocket(const std::string &name);
+// Connect to a listening socket; returns the socket or -1.
+int ConnectUnixSocket(const std::string &name);
+// Send an open file descriptor over a connected socket.
+int SendFileDescriptor(int sock, int fd);
+// Receive a file descriptor; returns the new descriptor or -1.
+int ReceiveFileDescriptor(int sock);
+
 //************************************************************************
 // Command Line
 //
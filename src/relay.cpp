@@ -0,0 +1,253 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  relay.cpp
+ *
+ *  Relays the frame buffer to another NIMS node over TCP, so the detector
+ *  and tracker can run on a bigger machine than the one with the sonar.
+ *
+ *  In send mode the relay reads the local frame buffer and streams each
+ *  frame to the receiver.  If the link cannot keep up, the relay keeps at
+ *  most max_queue_frames frames waiting and skips ahead to the newest
+ *  ones.  In receive mode the relay accepts one sender at a time and puts
+ *  its frames in a local frame buffer, in place of an ingester.
+ *
+ *  Copyright 2016 Pacific Northwest National Laboratory. All rights reserved.
+ *
+ */
+#include <iostream> // cout, cin, cerr
+#include <string>   // for strings
+#include <algorithm> // max
+
+#include <unistd.h> // sleep
+
+#include "yaml-cpp/yaml.h"
+
+#include "nims_ipc.h" // NIMS signal handling, queues, shared mem
+#include "log.h"      // NIMS logging
+#include "frame_buffer.h"
+#include "frame_relay.h"
+
+using namespace std;
+
+// Throughput and latency since the last report.
+struct RelayReport
+{
+    double start;
+    RelayStats last;
+    long frames_dropped;
+    double latency_sum;
+    double latency_max;
+    double age_sum;     // ping to republished, on the receiver
+
+    RelayReport() { Reset(RelayStats()); };
+    void Reset(const RelayStats &stats)
+    {
+        start = RelayClock();
+        last = stats;
+        frames_dropped = 0;
+        latency_sum = latency_max = age_sum = 0.0;
+    };
+    void Add(double latency, double age)
+    {
+        latency_sum += latency;
+        latency_max = std::max(latency_max, latency);
+        age_sum += age;
+    };
+    void Log(const char *what, const RelayStats &stats)
+    {
+        const double secs = RelayClock() - start;
+        const long frames = stats.frames - last.frames;
+        const double data_mb = (stats.data_bytes - last.data_bytes)/1048576.0;
+        const double wire_mb = (stats.wire_bytes - last.wire_bytes)/1048576.0;
+        NIMS_LOG_DEBUG << what << " " << frames/secs << " frames/s, "
+                       << wire_mb/secs << " MB/s on the link ("
+                       << (wire_mb > 0.0 ? data_mb/wire_mb : 0.0) << "x compression), "
+                       << frames_dropped << " frames dropped";
+        if (frames > 0 && latency_sum > 0.0)
+            NIMS_LOG_DEBUG << "relay latency " << 1000*latency_sum/frames << " ms mean, "
+                           << 1000*latency_max << " ms max; ping to frame buffer "
+                           << 1000*age_sum/frames << " ms mean";
+        Reset(stats);
+    };
+};
+
+static int RunSender(const string &fb_name, const string &host, int port, bool compress,
+                     int send_buffer_bytes, long max_queue_frames, double report_secs)
+{
+    // The relay is the buffer:  frames not sent yet wait in the frame
+    // buffer, so never hold up the writer.
+    FrameBufferReader fb(fb_name);
+    if ( -1 == fb.Connect(kLagDropOldest) )
+    {
+        NIMS_LOG_ERROR << "Error connecting to framebuffer.";
+        return -1;
+    }
+
+    FrameRelaySender relay(host, port, compress, send_buffer_bytes);
+    RelayReport report;
+    FrameView view;
+    while ( !sigint_received )
+    {
+        if ( !relay.connected() )
+        {
+            if (relay.Connect() == -1)
+            {
+                sleep(1);
+                continue;
+            }
+            NIMS_LOG_DEBUG << "relaying frames to " << host << ":" << port;
+            // start with the newest frame
+            if (fb.latest_frame() > 0) fb.SeekFrame(fb.latest_frame());
+        }
+
+        // drop to the latest frames if the link is not keeping up
+        const long lag = fb.lag();
+        if (lag > max_queue_frames)
+        {
+            fb.SeekFrame(fb.latest_frame() - max_queue_frames + 1);
+            report.frames_dropped += lag - max_queue_frames;
+        }
+        const long skipped = fb.frames_skipped();
+
+        if (fb.GetNextFrame(&view) == -1) break;
+        report.frames_dropped += fb.frames_skipped() - skipped;
+        int ret = relay.SendFrame(view);
+        if (ret == 0) report.frames_dropped++;
+        if (ret == -1) NIMS_LOG_WARNING << "lost the connection to the relay receiver";
+
+        if (RelayClock() - report.start >= report_secs) report.Log("sent", relay.stats());
+    }
+    return 0;
+}
+
+static int RunReceiver(const string &fb_name, const FrameBufferParams &fb_params,
+                       int port, double report_secs)
+{
+    FrameRelayReceiver relay(port);
+    if (relay.Listen() == -1) return -1;
+
+    FrameBufferWriter fb(fb_name, fb_params);
+    if ( -1 == fb.Initialize() )
+    {
+        NIMS_LOG_ERROR << "Error initializing frame buffer!";
+        return -1;
+    }
+
+    RelayReport report;
+    Frame frame;
+    frame.allocator = &fb; // received straight into the frame buffer
+    long last_frame = 0;   // sender's number of the last frame received
+    while ( !sigint_received )
+    {
+        if ( !relay.connected() )
+        {
+            if (relay.Accept() == -1) continue;
+            NIMS_LOG_DEBUG << "receiving frames from " << relay.peer();
+            last_frame = 0;
+        }
+
+        double send_time;
+        long frame_number = relay.ReceiveFrame(&frame, &send_time);
+        if (frame_number <= 0)
+        {
+            NIMS_LOG_WARNING << "lost the connection to the relay sender " << relay.peer();
+            relay.Disconnect();
+            continue;
+        }
+        fb.PutNewFrame(frame);
+
+        // Latencies across machines are only as good as their clocks.
+        const double now = RelayClock();
+        const FrameHeader &hdr = frame.header;
+        report.Add(std::max(0.0, now - send_time),
+                   now - (hdr.ping_sec + hdr.ping_millisec/1000.0));
+        if (last_frame > 0) report.frames_dropped += frame_number - last_frame - 1;
+        last_frame = frame_number;
+
+        if (now - report.start >= report_secs) report.Log("received", relay.stats());
+    }
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  MAIN
+///////////////////////////////////////////////////////////////////////////////
+int main (int argc, char * argv[]) {
+
+    string cfgpath, log_level;
+    if ( parse_command_line(argc, argv, cfgpath, log_level) != 0 ) return -1;
+    setup_logging(string(basename(argv[0])), cfgpath, log_level);
+    setup_signal_handling();
+
+    // READ CONFIG FILE
+    string fb_name; // frame buffer
+    FrameBufferParams fb_params;
+    string mode;
+    string host;
+    int port;
+    bool compress;
+    int send_buffer_kb;
+    long max_queue_frames;
+    double report_secs;
+
+    try
+    {
+        YAML::Node config = YAML::LoadFile(cfgpath); // throws exception if bad path
+        fb_name = config["FRAMEBUFFER_NAME"].as<string>();
+        YAML::Node fb_config = config["FRAMEBUFFER"];
+        fb_params.ring = fb_config["ring"].as<bool>(fb_params.ring);
+        fb_params.num_slots = fb_config["ring_slots"].as<int>(fb_params.num_slots);
+        fb_params.slot_bytes = fb_config["max_frame_mb"].as<float>(
+            fb_params.slot_bytes/(1024.0*1024.0))*1024*1024;
+        fb_params.huge_pages = fb_config["huge_pages"].as<bool>(fb_params.huge_pages);
+        fb_params.persistent = fb_config["persistent"].as<bool>(fb_params.persistent);
+
+        YAML::Node params = config["RELAY"];
+        mode = params["mode"].as<string>();
+        NIMS_LOG_DEBUG << "mode = " << mode;
+        host = params["host"].as<string>();
+        NIMS_LOG_DEBUG << "host = " << host;
+        port = params["port"].as<int>();
+        NIMS_LOG_DEBUG << "port = " << port;
+        compress = params["compress"].as<bool>();
+        NIMS_LOG_DEBUG << "compress = " << compress;
+        send_buffer_kb = params["send_buffer_kb"].as<int>();
+        NIMS_LOG_DEBUG << "send_buffer_kb = " << send_buffer_kb;
+        max_queue_frames = params["max_queue_frames"].as<long>();
+        NIMS_LOG_DEBUG << "max_queue_frames = " << max_queue_frames;
+        report_secs = params["report_seconds"].as<double>();
+        NIMS_LOG_DEBUG << "report_seconds = " << report_secs;
+        if (params["framebuffer_name"])
+        {
+            fb_name = params["framebuffer_name"].as<string>();
+            NIMS_LOG_DEBUG << "framebuffer_name = " << fb_name;
+        }
+    }
+    catch( const std::exception& e )
+    {
+        NIMS_LOG_ERROR << "Error reading config file: " << cfgpath << endl;
+        NIMS_LOG_ERROR << e.what() << endl;
+        return -1;
+    }
+    if (mode != "send" && mode != "receive")
+    {
+        NIMS_LOG_ERROR << "RELAY mode must be send or receive, not " << mode;
+        return -1;
+    }
+
+	//--------------------------------------------------------------------------
+	// DO STUFF
+    NIMS_LOG_DEBUG << "Starting " << argv[0];
+    SubprocessCheckin(getpid()); // Synchronize with main NIMS process.
+
+    int ret;
+    if (mode == "send")
+        ret = RunSender(fb_name, host, port, compress, send_buffer_kb*1024,
+                        std::max(1L, max_queue_frames), report_secs);
+    else
+        ret = RunReceiver(fb_name, fb_params, port, report_secs);
+
+    NIMS_LOG_DEBUG << "Ending " << argv[0];
+    return ret;
+}
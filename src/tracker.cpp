@@ -186,6 +186,13 @@ std::ostream& operator<<(std::ostream& strm, const TracksMessage& tm)
         NIMS_LOG_ERROR << "Error creating MQ_TRACKER_ARCHIVER_QUEUE";
         return -1;
     }
+    // A message goes to one receiver, so capture gets its own copy.
+    mqd_t mq_cap = CreateMessageQueue(MQ_TRACKER_CAPTURE_QUEUE, sizeof(TracksMessage), true);
+    if (mq_cap < 0) 
+    {
+        NIMS_LOG_ERROR << "Error creating MQ_TRACKER_CAPTURE_QUEUE";
+        return -1;
+    }
     NIMS_LOG_DEBUG << "message queues created";
     if (sigint_received) {
         NIMS_LOG_WARNING << "exiting due to SIGINT";
@@ -351,6 +358,7 @@ if (TEST)
 
     TracksMessage msg_complete(msg_det.frame_num, msg_det.ping_num, msg_det.ping_time, completed);            
     mq_send(mq_arc, (const char *)&msg_complete, sizeof(msg_complete), 0); // non-blocking
+    mq_send(mq_cap, (const char *)&msg_complete, sizeof(msg_complete), 0); // non-blocking
 
  //       NIMS_LOG_DEBUG << "sent completed tracks message (" << sizeof(msg_complete)
  //               << " bytes);  num_tracks = " << msg_complete.num_tracks;
@@ -9,6 +9,7 @@
  */
 #include <iostream> // cout, cin, cerr
 #include <string>   // for strings
+#include <poll.h>   // poll
 
 
 #include <boost/filesystem.hpp>
@@ -28,7 +29,8 @@ namespace fs = boost::filesystem;
 using namespace cv;
 
 // Generate the mapping from beam-range to x-y for display
-int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray _map_y)
+int PingImagePolarToCart(const FrameHeader &hdr, const FrameGeometry &geom, 
+                         OutputArray _map_x, OutputArray _map_y)
 {
     // range bin resolution in meters per pixel
     float rng_step = (hdr.range_max_m - hdr.range_min_m)/(hdr.num_samples - 1);
@@ -36,13 +38,13 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
     float y1 = hdr.range_min_m; // y coordinate of first row of image pixels
     float y2 = hdr.range_max_m; // y coordinate of first row of image pixels
     
-    //float beam_step = hdr.beam_angles_deg[1] - hdr.beam_angles_deg[0];
-    double theta1 = (double)hdr.beam_angles_deg[0] * M_PI/180.0;
-    double theta2 = (double)hdr.beam_angles_deg[hdr.num_beams-1] * M_PI/180.0;
+    //float beam_step = geom.beam_angles_deg[1] - geom.beam_angles_deg[0];
+    double theta1 = (double)geom.beam_angles_deg[0] * M_PI/180.0;
+    double theta2 = (double)geom.beam_angles_deg[geom.num_beams-1] * M_PI/180.0;
     float x1 = hdr.range_max_m*sin(theta1);
     float x2 = hdr.range_max_m*sin(theta2);
-    cout << "PingImagePolarToCart: beam angles from " << hdr.beam_angles_deg[0]
-    << " to " << hdr.beam_angles_deg[hdr.num_beams-1];
+    cout << "PingImagePolarToCart: beam angles from " << geom.beam_angles_deg[0]
+    << " to " << geom.beam_angles_deg[geom.num_beams-1];
     //cout << "PingImagePolarToCart: beam angle step is " << beam_step;
     cout << "PingImagePolarToCart: x1 = " << x1 << ", x2 = " << x2;
     
@@ -60,8 +62,8 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
     map_x = Mat::zeros(nrows, ncols, CV_32FC1);
     map_y = Mat::zeros(nrows, ncols, CV_32FC1);
 
-    vector<float> beam_angles_deg(hdr.beam_angles_deg,
-        hdr.beam_angles_deg + hdr.num_beams );
+    vector<float> beam_angles_deg(geom.beam_angles_deg,
+        geom.beam_angles_deg + geom.num_beams );
     vector<float>::iterator low,up;
     float x,y, rng,beam_deg,i_rng,i_beam;
     // each row is a range
@@ -79,7 +81,7 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
             //cout << endl << "rng = " << rng << ", beam_deg = " << beam_deg << endl;
             // convert beam-range to indices
            if (rng >= hdr.range_min_m && rng <= hdr.range_max_m 
-            && beam_deg >= hdr.beam_angles_deg[0] && beam_deg <= hdr.beam_angles_deg[hdr.num_beams-1])
+            && beam_deg >= geom.beam_angles_deg[0] && beam_deg <= geom.beam_angles_deg[geom.num_beams-1])
            {
                i_rng = (rng - hdr.range_min_m) / rng_step;
                up = upper_bound(beam_angles_deg.begin(), beam_angles_deg.end(), beam_deg);
@@ -87,7 +89,7 @@ int PingImagePolarToCart(const FrameHeader &hdr, OutputArray _map_x, OutputArray
                 if (up != beam_angles_deg.end() ) 
                     i_beam = up - beam_angles_deg.begin() - (*up - beam_deg)/(*up - *(up -1));
                 else
-                    i_beam = hdr.num_beams-1;
+                    i_beam = geom.num_beams-1;
 
                 map_x(m,n) = i_beam;
                 map_y(m,n) = i_rng;
@@ -133,20 +135,27 @@ int main (int argc, char * argv[]) {
   // connect to frame buffer to get raw ping data
   //cout << "connecting to frame buffer ... ";
     FrameBufferReader fb(fb_name);
-    if ( -1 == fb.Connect() )
+    if ( -1 == fb.Connect(kLagLatest) ) // only display the newest ping
     {
         cerr << "Error connecting to framebuffer.";
         return -1;
     }
 cout << "connected." << endl;
 
-    Frame raw_ping;
+    FrameView raw_ping;
     fb.GetNextFrame(&raw_ping);
-    FrameHeader *fh = &raw_ping.header; // for notational convenience
-    //float beam_max = fh->beam_angles_deg[(fh->num_beams-1)];
-    //float beam_min = fh->beam_angles_deg[0];
+    FrameHeader first_hdr = raw_ping.header(); // view is reused in main loop
+    FrameHeader *fh = &first_hdr; // for notational convenience
+    if (raw_ping.geometry() == nullptr)
+    {
+        cerr << "First ping has no beam geometry.";
+        return -1;
+    }
+    FrameGeometry geom = *raw_ping.geometry();
+    //float beam_max = geom.beam_angles_deg[(geom.num_beams-1)];
+    //float beam_min = geom.beam_angles_deg[0];
     Mat map_x, map_y;
-    PingImagePolarToCart(raw_ping.header, map_x, map_y);
+    PingImagePolarToCart(*fh, geom, map_x, map_y);
     
     double min_beam, min_rng, max_beam, max_rng;
     minMaxIdx(map_x, &min_beam, &max_beam);
@@ -161,10 +170,10 @@ int nrows = fh->num_samples;
 int ncols = fh->num_beams;
 long total_samples = nrows*ncols;
 int cv_type = sizeof(framedata_t)==4 ? CV_32FC1 : CV_64FC1;
-//vector<float> brg(fh->beam_angles_deg, fh->beam_angles_deg+fh->num_beams);
+//vector<float> brg(geom.beam_angles_deg, geom.beam_angles_deg+geom.num_beams);
 float range_res = (fh->range_max_m - fh->range_min_m) / (fh->num_samples-1);
 float ymin = fh->range_min_m;
-float theta1 = (double)fh->beam_angles_deg[0] * M_PI/180.0;
+float theta1 = (double)geom.beam_angles_deg[0] * M_PI/180.0;
 float xmin = fh->range_max_m*sin(theta1);
 
 /*
@@ -172,8 +181,9 @@ vector<float> rng;
 for (int r=0;r<fh->num_samples;++r)
   rng.push_back(fh->range_min_m + r*range_res);
 */
-  // connect to detector to get detection messages
-    mqd_t mq_det = CreateMessageQueue(MQ_DETECTOR_VIEWER_QUEUE, sizeof(DetectionMessage));
+  // connect to detector to get detection messages; don't wait on them, 
+  // since frames and detections are both polled below
+    mqd_t mq_det = CreateMessageQueue(MQ_DETECTOR_VIEWER_QUEUE, sizeof(DetectionMessage), true);
     if (mq_det < 0) 
     {
         NIMS_LOG_ERROR << "Error creating MQ_DETECTOR_VIEWER_QUEUE";
@@ -182,17 +192,77 @@ for (int r=0;r<fh->num_samples;++r)
 
   // connect to tracker to get track messages
 	
-    int frame_index = -1;
-    while ( (frame_index = fb.GetNextFrame(&raw_ping)) != -1 && 0 == sigint_received)
+    // Wait on new pings and detections together, so neither source
+    // stalls the other.  Each ping is drawn with the latest detections.
+    int fb_fd = fb.GetReadyFd();
+    if (fb_fd < 0)
+    {
+        NIMS_LOG_ERROR << "Error getting frame buffer descriptor";
+        return -1;
+    }
+    struct pollfd fds[2];
+    fds[0].fd = fb_fd;  fds[0].events = POLLIN;
+    fds[1].fd = mq_det; fds[1].events = POLLIN;
+    DetectionMessage msg_det; // latest detections
+    
+    long frame_index = -1;
+    while (0 == sigint_received)
     {    
+        int nfds = poll(fds, 2, 100);
         if (sigint_received) {
             cout << "received SIGINT; exiting main loop" << endl;
             break;
         }
+        if (nfds < 0)
+        {
+            if (errno == EINTR) continue;
+            nims_perror("Viewer poll");
+            break;
+        }
+        
+        // keep only the newest detections
+        if (fds[1].revents & POLLIN)
+        {
+            DetectionMessage msg;
+            while (mq_receive(mq_det, (char *)&msg, sizeof(msg), nullptr) > 0)
+                msg_det = msg;
+            if (errno != EAGAIN)
+            {
+                nims_perror("Viewer mq_receive");
+                NIMS_LOG_ERROR << "error receiving message from detector";
+            }
+            NIMS_LOG_DEBUG << "received detections message with " 
+                           << msg_det.num_detections << " detections";
+        }
+        
+        // kLagLatest gets the newest ping, so one call is enough
+        if ( 0 == (frame_index = fb.TryGetNextFrame(&raw_ping)) )
+        {
+            waitKey(1); // keep the window responsive
+            continue;
+        }
+        if (frame_index == -1) break;
+        
+        // rebuild the image mapping only when the geometry changes
+        if (raw_ping.geometry() != nullptr 
+            && raw_ping.geometry()->generation != geom.generation
+            && raw_ping.geometry()->num_beams == geom.num_beams)
+        {
+            geom = *raw_ping.geometry();
+            PingImagePolarToCart(*fh, geom, map_x, map_y);
+            theta1 = (double)geom.beam_angles_deg[0] * M_PI/180.0;
+            xmin = fh->range_max_m*sin(theta1);
+        }
 
             double v1,v2;
            // ping data as 1 x total_samples vector, 32F from 0.0 to ?
-            Mat ping_data(1,total_samples,cv_type,raw_ping.data_ptr());
+            Mat ping_data(1,total_samples,cv_type,(void *)raw_ping.data_ptr());
+            if (raw_ping.header().encoding != kSampleFloat32)
+            {
+                ping_data = Mat(1,total_samples,cv_type);
+                DecodeSamples(raw_ping.header(), raw_ping.data_ptr(), 0, total_samples,
+                              ping_data.ptr<framedata_t>());
+            }
              // reshape to single channel, num_samples rows
             //Mat im1 = ping_data.reshape(0,nrows);
             minMaxIdx(ping_data, &v1, &v2);
@@ -209,17 +279,7 @@ for (int r=0;r<fh->num_samples;++r)
             remap(im3, im_out, map_x, map_y,
                    INTER_LINEAR, BORDER_CONSTANT, Scalar(0,0,0));
 
-       DetectionMessage msg_det;
-        int ret =  mq_receive(mq_det, (char *)&msg_det, sizeof(DetectionMessage), nullptr);
-        if (ret < 0)
-        {
-            nims_perror("Viewer mq_receive");
-            NIMS_LOG_ERROR << "error receiving message from detector";
-            NIMS_LOG_WARNING << "sigint_received is " << sigint_received;
-        }
-        NIMS_LOG_DEBUG << "received detections message with " 
-                       << msg_det.num_detections << " detections";
-        if (ret > 0 & msg_det.num_detections > 0)
+        if (msg_det.num_detections > 0)
         {
             int n_obj = msg_det.num_detections;
             vector<float>::iterator it_x, it_y;
@@ -236,7 +296,7 @@ for (int r=0;r<fh->num_samples;++r)
             //stringstream pngfilepath;
             //pngfilepath <<  "ping-" << frame_index % 30 << ".png";
            // imwrite(pngfilepath.str(), im_out);
-        imshow(WIN_PING, im_out); waitKey(25);
+        imshow(WIN_PING, im_out); waitKey(1);
     } // main loop
 	   
 	cout << endl << "Ending " << argv[0] << endl << endl;
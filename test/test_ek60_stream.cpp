@@ -0,0 +1,164 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_ek60_stream.cpp
+ *
+ *  Sends DataSourceEK60 angle and power datagrams of three transceiver
+ *  channels, split over several UDP packets like the EK60 does, on the
+ *  loopback, with one channel of one ping missing a packet.  Every whole
+ *  ping of the two channels read should come through with its channel,
+ *  the ping number it shares with the other channel, and the power samples
+ *  in the virtual beams of their angles.  The rate the source keeps up
+ *  with is reported.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <vector>
+#include <thread>
+#include <chrono>     // time stuff
+#include <cstring>    // memcpy
+#include <cstdio>     // snprintf
+#include <cmath>      // fabs
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> // inet_addr
+#include <unistd.h>    // close, usleep
+
+#include "data_source_ek60.h"
+#include "log.h"
+
+using namespace std;
+
+const int kPort = 47302;
+const int kNumSamples = 20000;    // 16-bit samples per datagram
+const int kSamplesPerPacket = 1400;
+
+const int kNumChannels = 3;        // sent; the source reads 1 and 2
+
+static int8_t Angle(int ping, int ch, int r) { return (int8_t)((ping + ch*5 + r) % 256 - 128); }
+static int16_t Power(int ping, int ch, int r) { return (int16_t)(ping*7 + ch*1000 + r); }
+
+// Send one datagram as packets:  type, ping time, packet number, end of
+// data flag, first byte, byte count, data.
+static void SendDatagram(int sock, const struct sockaddr_in &addr, const char *type,
+                         int ping, const vector<int16_t> &samples, int skip_packet)
+{
+    const int num_packets = (kNumSamples + kSamplesPerPacket - 1)/kSamplesPerPacket;
+    char packet[18 + 2*kSamplesPerPacket];
+    for (int k=0; k<num_packets; ++k)
+    {
+        const int first = k*kSamplesPerPacket;
+        const int16_t bytes = 2*min(kSamplesPerPacket, kNumSamples - first);
+        char time[16];
+        snprintf(time, sizeof(time), "%02d%02d%02d%02d", 12, 34, ping/100 % 60, ping % 100);
+        memcpy(packet, type, 2);
+        packet[2] = ',';
+        memcpy(packet + 3, time, 8);
+        packet[11] = ',';
+        packet[12] = (char)k;
+        packet[13] = (k == num_packets - 1) ? (char)0x80 : 0;
+        const int16_t firstbyte = 2*first;
+        memcpy(packet + 14, &firstbyte, 2);
+        memcpy(packet + 16, &bytes, 2);
+        memcpy(packet + 18, samples.data() + first, bytes);
+        if (k != skip_packet)
+            sendto(sock, packet, 18 + bytes, 0, (const struct sockaddr *)&addr, sizeof(addr));
+    }
+}
+
+static void RunEchosounder(int num_pings, int bad_ping)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(kPort);
+
+    vector<int16_t> samples(kNumSamples);
+    for (int ping=1; ping<=num_pings; ++ping)
+    {
+        // the angles of every channel, then the power of every channel
+        for (int ch=1; ch<=kNumChannels; ++ch)
+        {
+            // the alongship angle is the low byte in memory
+            for (int r=0; r<kNumSamples; ++r) samples[r] = (uint8_t)Angle(ping, ch, r);
+            const char type[] = { 'B', (char)('0' + ch) };
+            SendDatagram(sock, addr, type, ping, samples, -1);
+            usleep(300); // do not outrun the loopback's socket buffers
+        }
+        for (int ch=1; ch<=kNumChannels; ++ch)
+        {
+            for (int r=0; r<kNumSamples; ++r) samples[r] = Power(ping, ch, r);
+            const char type[] = { 'W', (char)('0' + ch) };
+            SendDatagram(sock, addr, type, ping, samples, (ping == bad_ping && ch == 1) ? 3 : -1);
+            usleep(300);
+        }
+    }
+    close(sock);
+}
+
+int main (int argc, char * const argv[]) {
+
+    setup_logging(string(basename(argv[0])), "config.yaml", "warning");
+	cout << endl << "Starting " << argv[0] << endl;
+
+    EK60Params params;
+    params.port = kPort;
+    params.along_sensitivity = params.athwart_sensitivity = 23.0;
+    params.along_offset = params.athwart_offset = 0.0;
+    params.along_beamwidth = params.athwart_beamwidth = 7.0;
+    params.ping_rate_hz = 1;
+    EK60Channel channel1 = { 1, 23.0, 0.0 }, channel2 = { 2, 21.0, 0.5 };
+    params.channels.push_back(channel1);
+    params.channels.push_back(channel2);
+    DataSourceEK60 source("127.0.0.1", params);
+    if (source.connect() == -1)
+    {
+        cerr << "Error binding the EK60 port" << endl;
+        return -1;
+    }
+
+    const int num_pings = 200, bad_ping = 50;
+    auto t0 = chrono::steady_clock::now();
+    std::thread echosounder(RunEchosounder, num_pings, bad_ping);
+
+    // the next ping starts with its angle datagrams, so only the bad
+    // channel of the bad ping is lost
+    int received = 0, bad = 0;
+    Frame frame;
+    for (int ping=1; ping<=num_pings; ++ping)
+    for (int ch=1; ch<=2; ++ch)
+    {
+        if (ping == bad_ping && ch == 1) continue;
+        if (source.GetPing(&frame) == -1) { ++bad; break; }
+        ++received;
+        const uint16_t *data = (const uint16_t *)frame.data_ptr();
+        const float sensitivity = (ch == 1) ? 23.0 : 21.0, offset = (ch == 1) ? 0.0 : 0.5;
+        if (frame.header.channel != (uint32_t)ch || frame.header.ping_num != (uint32_t)ping
+            || frame.header.num_samples != kNumSamples || frame.header.num_beams != 256
+            || frame.header.ping_millisec != 10*(ping % 100) || !frame.geometry
+            || fabs(frame.geometry->beam_angles_deg[129] - (1.40625/sensitivity + offset)) > 1e-5)
+        {
+            ++bad;
+            continue;
+        }
+        for (int r=0; r<kNumSamples; ++r)
+            if (data[(Angle(ping, ch, r) + 128)*kNumSamples + r]
+                    != (uint16_t)(Power(ping, ch, r) + 32768)
+                || data[((Angle(ping, ch, r) + 129) % 256)*kNumSamples + r] != 0)
+            {
+                ++bad;
+                break;
+            }
+    }
+    echosounder.join();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cout << "received " << received << " of " << 2*num_pings - 1 << " pings, " << bad
+         << " bad, " << received/secs << " pings/s" << endl;
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
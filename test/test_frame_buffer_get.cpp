@@ -41,6 +41,7 @@ int main (int argc, char * const argv[]) {
 	("help",                                                    "print help message")
   ("cfg,c", po::value<string>()->default_value("config.yaml"),         "path to config file")
 	("buffer,b", po::value<string>()->default_value( "test" ),    "name of frame buffer")
+	("replay,r", po::value<long>()->default_value(0),           "first get the last n frames already in the buffer")
 	//("bar,b",   po::value<unsigned int>()->default_value( 101 ),"an integer value")
 	;
 	po::variables_map options;
@@ -89,6 +90,13 @@ int main (int argc, char * const argv[]) {
             cerr << argv[0] << " Error connecting to frame buffer!" << endl;
             return -1;
         }
+        long replay = options["replay"].as<long>();
+        if (replay > 0)
+        {
+            cout << argv[0] << ": frames " << fb.oldest_frame() << " to " 
+                 << fb.latest_frame() << " are in the buffer" << endl;
+            fb.SeekFrame(fb.latest_frame() - replay + 1);
+        }
         Frame next_frame;
         long frame_index = -1;
         while (!sigint_received_ && (frame_index = fb.GetNextFrame(&next_frame)) != -1)
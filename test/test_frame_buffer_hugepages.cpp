@@ -0,0 +1,164 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_frame_buffer_hugepages.cpp
+ *
+ *  Benchmark of the frame ring with normal and huge pages.  A writer
+ *  process puts frames in the ring and a reader process makes a pass over
+ *  each frame like the detector's background update and thresholding,
+ *  reporting page faults and frames per second for each backing.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <chrono>     // time stuff
+#include <exception>  // exception class
+#include <cmath>      // sqrt
+
+#include <unistd.h>       // fork
+#include <sys/wait.h>     // waitpid
+#include <sys/resource.h> // getrusage
+
+#include <boost/program_options.hpp>
+
+#include "frame_buffer.h"
+#include "log.h"
+
+using namespace std;
+using namespace boost;
+namespace po = boost::program_options;
+
+// Read every frame and time it.
+static int RunReader(const string &fb_name, int num_frames)
+{
+    FrameBufferReader fb(fb_name);
+    if ( -1 == fb.Connect(kLagBlock) )
+    {
+        cerr << "reader: Error connecting to framebuffer." << endl;
+        return -1;
+    }
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    auto t0 = chrono::steady_clock::now();
+
+    FrameView ping;
+    double total = 0.0;
+    long above = 0;
+    for (int k=0; k<num_frames; ++k)
+    {
+        if ( fb.GetNextFrame(&ping) == -1 ) break;
+        // mean and std dev, then a threshold pass, as in the detector
+        const long n = ping.size()/sizeof(framedata_t);
+        const framedata_t *p = ping.data_ptr();
+        double sum = 0.0, sum_sq = 0.0;
+        for (long i=0; i<n; ++i) { sum += p[i]; sum_sq += p[i]*p[i]; }
+        double mean = sum/n;
+        double thresh = mean + 3.0*sqrt(sum_sq/n - mean*mean);
+        for (long i=0; i<n; ++i) above += (p[i] > thresh);
+        total += mean;
+    }
+
+    auto t1 = chrono::steady_clock::now();
+    getrusage(RUSAGE_SELF, &ru1);
+    double secs = chrono::duration<double>(t1 - t0).count();
+    cout << "   reader: " << num_frames/secs << " frames/s, "
+         << ru1.ru_minflt - ru0.ru_minflt << " minor faults, "
+         << ru1.ru_majflt - ru0.ru_majflt << " major faults"
+         << " (" << above << " above threshold)" << endl;
+    return 0;
+}
+
+static int RunBenchmark(const FrameBufferParams &params, int num_frames, size_t frame_bytes)
+{
+    const string fb_name = "nims_test_hugepages";
+    cout << (params.huge_pages ? "huge pages:" : "normal pages:") << endl;
+
+    FrameBufferWriter fb(fb_name, params);
+    if ( -1 == fb.Initialize() )
+    {
+        cerr << "Error initializing frame buffer!" << endl;
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) _exit( RunReader(fb_name, num_frames) );
+    sleep(1); // let the reader connect
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    auto t0 = chrono::steady_clock::now();
+    for (int k=0; k<num_frames; ++k)
+    {
+        Frame frame;
+        frame.allocator = &fb;
+        frame.header.ping_num = k;
+        frame.malloc_data(frame_bytes);
+        framedata_t *p = frame.data_ptr();
+        for (size_t i=0; i<frame_bytes/sizeof(framedata_t); ++i)
+            p[i] = (i*(k+1)) % 1000;
+        fb.PutNewFrame(frame);
+    }
+    auto t1 = chrono::steady_clock::now();
+    getrusage(RUSAGE_SELF, &ru1);
+    double secs = chrono::duration<double>(t1 - t0).count();
+
+    int status;
+    waitpid(pid, &status, 0);
+    cout << "   writer: " << num_frames/secs << " frames/s, "
+         << ru1.ru_minflt - ru0.ru_minflt << " minor faults" << endl;
+    return 0;
+}
+
+int main (int argc, char * const argv[]) {
+	//--------------------------------------------------------------------------
+    // PARSE COMMAND LINE
+	//
+	po::options_description desc;
+	desc.add_options()
+	("help",                                                    "print help message")
+  ("cfg,c", po::value<string>()->default_value("config.yaml"),         "path to config file")
+	("frames,n", po::value<int>()->default_value(500),          "number of frames")
+	("slots,s", po::value<int>()->default_value(100),           "number of ring slots")
+	("mb,m", po::value<float>()->default_value(2.7),            "frame size (MB); 2.7 is an M3 ping")
+	;
+	po::variables_map options;
+    try
+    {
+        po::store( po::parse_command_line( argc, argv, desc ), options );
+    }
+    catch( const std::exception& e )
+    {
+        cerr << "Sorry, couldn't parse that: " << e.what() << endl;
+        cerr << desc << endl;
+        return -1;
+    }
+
+	po::notify( options );
+
+    if( options.count( "help" ) > 0 )
+    {
+        cerr << desc << endl;
+        return 0;
+    }
+    setup_logging(string(basename(argv[0])), options["cfg"].as<string>(), "warning");
+
+	//--------------------------------------------------------------------------
+	// DO STUFF
+	cout << endl << "Starting " << argv[0] << endl;
+
+    const int num_frames = options["frames"].as<int>();
+    const size_t frame_bytes = options["mb"].as<float>()*1024*1024;
+    FrameBufferParams params;
+    params.ring = true;
+    params.num_slots = options["slots"].as<int>();
+    params.slot_bytes = frame_bytes;
+
+    params.huge_pages = false;
+    RunBenchmark(params, num_frames, frame_bytes);
+    params.huge_pages = true;
+    RunBenchmark(params, num_frames, frame_bytes);
+
+	cout << endl << "Ending " << argv[0] << endl << endl;
+    return 0;
+}
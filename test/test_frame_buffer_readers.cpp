@@ -0,0 +1,432 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_frame_buffer_readers.cpp
+ *
+ *  Checks what readers of the frame buffer get, in per-frame and ring mode.
+ *  Each check runs in a reader process that asks the writer, in this
+ *  process, for frames over a pipe, so it knows exactly what was written:
+ *  a kLagDropOldest reader that falls behind gets the newest frames and
+ *  counts the rest as skipped; a kLagLatest reader gets only the newest;
+ *  frames are found by number and ping time, replayed with SeekFrame, and
+ *  taken in batches with both GetNextFrames; GetReadyFd is readable just
+ *  while there are frames to get; a reader of a persistent ring keeps
+ *  reading after the writer is restarted; and the reader's counters in the
+ *  statistics block match what it got.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <memory>     // unique_ptr
+#include <vector>
+
+#include <unistd.h>   // fork, pipe
+#include <fcntl.h>    // O_RDONLY
+#include <poll.h>     // poll
+#include <sys/mman.h> // shm_open, mmap
+#include <sys/wait.h> // waitpid
+
+#include "frame_buffer.h"
+#include "frame_buffer_stats.h"
+#include "log.h"
+
+using namespace std;
+
+const string kBufferName = "nims_test_readers";
+const int kNumBeams = 8;
+const int kNumSamples = 32;
+// Frames a reader that falls behind can catch up on:  the messages its
+// queue holds in per-frame mode (CreateMessageQueue in nims_ipc.cpp), and
+// the slots of the test ring.
+const int kQueuedFrames = 10;
+// Asks the writer to exit and start again instead of putting frames.
+const long kRestartWriter = -1;
+
+// Ping time of frame n, in milliseconds.
+static uint64_t PingTime(long n) { return 1000000 + 100*n; }
+
+static void MakeFrame(long n, Frame *frame)
+{
+    FrameHeader &hdr = frame->header;
+    hdr.ping_num = n;
+    hdr.ping_sec = PingTime(n)/1000;
+    hdr.ping_millisec = PingTime(n)%1000;
+    hdr.num_samples = kNumSamples;
+    hdr.num_beams = kNumBeams;
+    frame->malloc_data(kNumSamples*kNumBeams*sizeof(framedata_t));
+    for (int k=0; k<kNumSamples*kNumBeams; ++k) frame->data_ptr()[k] = n + k;
+}
+
+//-----------------------------------------------------------------------------
+// The writer side:  put the frames each request asks for, and answer with
+// the number of the last frame written.
+static int ServeReader(const FrameBufferParams &params, int requests, int replies)
+{
+    unique_ptr<FrameBufferWriter> fb(new FrameBufferWriter(kBufferName, params));
+    if ( -1 == fb->Initialize() ) return -1;
+
+    int bad = 0;
+    long last = 0;
+    long request;
+    if (write(replies, &last, sizeof(last)) != sizeof(last)) return -1;
+    while (read(requests, &request, sizeof(request)) == sizeof(request))
+    {
+        if (request == kRestartWriter)
+        {
+            fb.reset();
+            fb.reset(new FrameBufferWriter(kBufferName, params));
+            if ( -1 == fb->Initialize() ) return -1;
+        }
+        for (long k=0; k<request; ++k)
+        {
+            Frame frame;
+            MakeFrame(++last, &frame);
+            if (fb->PutNewFrame(frame) != last) ++bad;
+        }
+        if (write(replies, &last, sizeof(last)) != sizeof(last)) break;
+    }
+    return bad;
+}
+
+//-----------------------------------------------------------------------------
+// How a reader got a frame.
+enum GotBy {
+    kGotNext,     // as the next frame; it should come after the last one
+    kGotReplay,   // again, after SeekFrame
+    kGotLookup    // by number, which does not count as reading it
+};
+
+// The reader side:  a reader, its way to the writer, and what it has got.
+class ReaderCheck
+{
+    public:
+        ReaderCheck(const string &name, int requests, int replies)
+          : name_(name), fb_(kBufferName), requests_(requests), replies_(replies),
+            bad_(0), frames_read_(0), last_read_(0), skipped_(0), latest_(0) {};
+
+        FrameBufferReader& fb() { return fb_; };
+        int bad() const { return bad_; };
+        long latest() const { return latest_; };
+
+        // Connect once the writer is there, and read until the writer is
+        // sending this reader frames.
+        int Connect(LagPolicy policy);
+        // Have the writer put num_frames frames (or kRestartWriter).
+        long Put(long num_frames);
+        // Check that a frame this reader got is frame n, and count it.
+        void Got(long n, const FrameHeader &hdr, const framedata_t *data, GotBy by=kGotNext);
+        void Got(long n, const FrameView &view, GotBy by=kGotNext)
+            { Got(n, view.header(), view.data_ptr(), by); };
+        void Got(long n, const Frame &frame, GotBy by=kGotNext)
+            { Got(n, frame.header, frame.data_ptr(), by); };
+        // Check a condition.
+        void Expect(bool ok, const string &what);
+        // Check the frames skipped since the last call.
+        void ExpectSkipped(long num_frames);
+        // Check this reader's and the writer's counters in the statistics block.
+        void CheckStats(LagPolicy policy);
+        // Wait for the ready descriptor to be readable, or not.
+        bool Ready(int fd, int timeout_ms);
+
+    private:
+        string name_;
+        FrameBufferReader fb_;
+        int requests_, replies_;
+        int bad_;
+        long frames_read_, last_read_, skipped_, latest_;
+};
+
+int ReaderCheck::Connect(LagPolicy policy)
+{
+    if (read(replies_, &latest_, sizeof(latest_)) != sizeof(latest_)) return -1;
+    if (-1 == fb_.Connect(policy)) return -1;
+
+    // In per-frame mode the writer opens the reader's queue on its own
+    // thread; frames written until then do not reach the reader.
+    FrameView view;
+    for (int k=0; k<100; ++k)
+    {
+        Put(1);
+        usleep(10000);
+        long n;
+        bool got = false;
+        while ((n = fb_.TryGetNextFrame(&view)) > 0) { Got(n, view); got = true; }
+        if (got) break;
+    }
+    Expect(last_read_ == latest_, "connected");
+    skipped_ = fb_.frames_skipped();
+    return 0;
+}
+
+long ReaderCheck::Put(long num_frames)
+{
+    if (write(requests_, &num_frames, sizeof(num_frames)) != sizeof(num_frames)
+        || read(replies_, &latest_, sizeof(latest_)) != sizeof(latest_))
+    {
+        Expect(false, "writer");
+        return -1;
+    }
+    return latest_;
+}
+
+void ReaderCheck::Got(long n, const FrameHeader &hdr, const framedata_t *data, GotBy by)
+{
+    bool ok = (n > 0 && hdr.ping_num == n);
+    for (int k=0; ok && k<kNumSamples*kNumBeams; ++k) ok = (data[k] == n + k);
+    if (by == kGotNext && n <= last_read_) ok = false;
+    if (by != kGotLookup)
+    {
+        last_read_ = n;
+        ++frames_read_;
+    }
+    Expect(ok, "frame " + to_string(n));
+}
+
+void ReaderCheck::Expect(bool ok, const string &what)
+{
+    if (ok) return;
+    cerr << "   " << name_ << ": " << what << " is wrong" << endl;
+    ++bad_;
+}
+
+void ReaderCheck::ExpectSkipped(long num_frames)
+{
+    Expect(fb_.frames_skipped() - skipped_ == num_frames,
+           "frames skipped (" + to_string(fb_.frames_skipped() - skipped_) + ")");
+    skipped_ = fb_.frames_skipped();
+}
+
+void ReaderCheck::CheckStats(LagPolicy policy)
+{
+    const string stats_name = "/" + kBufferName + "-stats";
+    int fd = shm_open(stats_name.c_str(), O_RDONLY, 0);
+    if (-1 == fd) return Expect(false, "statistics block");
+    void *map = mmap(NULL, sizeof(FrameBufferStats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) return Expect(false, "statistics block");
+
+    const FrameBufferStats *stats = (const FrameBufferStats *)map;
+    Expect(stats->magic == kStatsMagic && stats->writer_pid.load() == getppid(), "writer pid");
+    Expect(stats->last_frame.load() == latest_, "writer last frame");
+    Expect(stats->frames_written.load() == (uint64_t)latest_, "frames written");
+    const FrameBufferReaderStats *entry = nullptr;
+    for (int k=0; k<kMaxStatsReaders; ++k)
+        if (stats->readers[k].pid.load() == getpid()) entry = &(stats->readers[k]);
+    Expect(entry != nullptr, "reader entry");
+    if (entry != nullptr)
+    {
+        Expect(entry->policy.load() == (uint32_t)policy, "reader policy");
+        Expect(entry->frames_read.load() == (uint64_t)frames_read_, "frames read");
+        Expect(entry->frames_skipped.load() == (uint64_t)fb_.frames_skipped(),
+               "reader frames skipped");
+        Expect(entry->last_frame.load() == last_read_, "reader last frame");
+    }
+    munmap(map, sizeof(FrameBufferStats));
+}
+
+bool ReaderCheck::Ready(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+//-----------------------------------------------------------------------------
+// A kLagDropOldest reader that falls behind gets the newest frames it can.
+static void CheckDropOldest(ReaderCheck &check)
+{
+    FrameBufferReader &fb = check.fb();
+    const long last = check.Put(20);
+    check.Expect(fb.lag() >= kQueuedFrames, "lag");
+    FrameView view;
+    long n, count = 0;
+    while ((n = fb.TryGetNextFrame(&view)) > 0) { check.Got(n, view); ++count; }
+    check.Expect(count == kQueuedFrames && view.empty(), "frames got");
+    check.ExpectSkipped(20 - kQueuedFrames);
+    check.Expect(fb.lag() == 0, "lag after catching up");
+
+    // one at a time, none skipped
+    for (int k=0; k<3; ++k)
+    {
+        check.Put(1);
+        Frame frame;
+        check.Got(fb.GetNextFrame(&frame), frame);
+    }
+    check.ExpectSkipped(0);
+    check.Expect(fb.latest_frame() == last + 3, "latest frame");
+    check.CheckStats(kLagDropOldest);
+}
+
+// A kLagLatest reader gets only the newest frame, and cannot seek.
+static void CheckLatest(ReaderCheck &check)
+{
+    FrameBufferReader &fb = check.fb();
+    long last = check.Put(20);
+    FrameView view;
+    check.Got(fb.GetNextFrame(&view), view);
+    check.Expect(view.frame_number() == last, "latest frame");
+    check.ExpectSkipped(19);
+    check.Expect(fb.TryGetNextFrame(&view) == 0, "nothing more");
+    check.Expect(fb.SeekFrame(last - 5) == -1, "seek");
+
+    last = check.Put(5);
+    FrameView views[4];
+    check.Expect(fb.GetNextFrames(views, 4) == 1 && views[0].frame_number() == last
+                 && views[1].empty(), "batch of the latest");
+    check.Got(views[0].frame_number(), views[0]);
+    check.ExpectSkipped(4);
+    check.CheckStats(kLagLatest);
+}
+
+// Frames by number and time, replays, and batches of frames.
+static void CheckLookups(ReaderCheck &check)
+{
+    FrameBufferReader &fb = check.fb();
+    const long last = check.Put(6);
+    check.Expect(fb.latest_frame() == last && fb.oldest_frame() <= last - 5, "frame range");
+    for (long n=last-5; n<=last; ++n)
+    {
+        Frame frame;
+        FrameView view;
+        check.Got(fb.GetFrameAt(n, &frame), frame, kGotLookup);
+        check.Got(fb.GetFrameAt(n, &view), view, kGotLookup);
+        check.Expect(view.frame_number() == n && view.valid(), "view of frame " + to_string(n));
+    }
+    Frame frame;
+    check.Expect(fb.GetFrameAt(last + 1, &frame) == -1, "frame not written yet");
+
+    const uint64_t msec = PingTime(last - 3);
+    check.Expect(fb.FindFrame(msec/1000, msec%1000) == last - 3, "time of a frame");
+    check.Expect(fb.FindFrame((msec - 50)/1000, (msec - 50)%1000) == last - 3,
+                 "time between frames");
+    check.Expect(fb.FindFrame(PingTime(last + 1)/1000, PingTime(last + 1)%1000) == -1,
+                 "time after the last frame");
+
+    // getting frames by number leaves the next frame where it was, and a
+    // batch takes no more than it is asked for
+    FrameView views[16];
+    check.Expect(fb.GetNextFrames(views, 2) == 2 && views[0].frame_number() == last - 5,
+                 "batch of two");
+    for (int k=0; k<2; ++k) check.Got(views[k].frame_number(), views[k]);
+
+    // replay from the first, without getting the rest again from the queue
+    check.Expect(fb.SeekFrame(last - 5) == last - 5, "seek");
+    vector<FrameHeader> headers(16);
+    const size_t stride = kNumSamples*kNumBeams*sizeof(framedata_t);
+    vector<char> data(16*stride);
+    long numbers[16];
+    int count = fb.GetNextFrames(headers.data(), data.data(), stride, 16, numbers);
+    check.Expect(count == 6, "replayed batch");
+    for (int k=0; k<count; ++k)
+        check.Got(numbers[k], headers[k], (const framedata_t *)(data.data() + k*stride),
+                  k < 2 ? kGotReplay : kGotNext);
+    check.Expect(fb.TryGetNextFrame(&views[0]) == 0, "nothing more after replay");
+
+    // a batch of all that is ready
+    const long more = check.Put(3);
+    count = fb.GetNextFrames(views, 16);
+    check.Expect(count == 3 && views[0].frame_number() == more - 2, "batch of views");
+    for (int k=0; k<count; ++k) check.Got(views[k].frame_number(), views[k]);
+    check.ExpectSkipped(0);
+    check.CheckStats(kLagDropOldest);
+}
+
+// The ready descriptor is readable while there are frames to get.
+static void CheckReadyFd(ReaderCheck &check, bool restart)
+{
+    FrameBufferReader &fb = check.fb();
+    int fd = fb.GetReadyFd();
+    check.Expect(fd != -1, "ready descriptor");
+    if (fd == -1) return;
+
+    // a ring writer sends to the new queue once it has seen it
+    FrameView view;
+    long n;
+    for (int k=0; k<100 && !check.Ready(fd, 10); ++k) check.Put(1);
+    while ((n = fb.TryGetNextFrame(&view)) > 0) check.Got(n, view);
+    check.Expect(!check.Ready(fd, 0), "not ready when caught up");
+
+    for (int pass=0; pass<(restart ? 3 : 1); ++pass)
+    {
+        if (pass > 0) check.Put(kRestartWriter);
+        check.Put(2);
+        check.Expect(check.Ready(fd, 1000), "ready");
+        int count = 0;
+        while ((n = fb.TryGetNextFrame(&view)) > 0) { check.Got(n, view); ++count; }
+        check.Expect(count == 2, "frames when ready");
+        check.Expect(!check.Ready(fd, 0), "not ready after getting them");
+    }
+    check.ExpectSkipped(0);
+    check.CheckStats(kLagDropOldest);
+}
+
+//-----------------------------------------------------------------------------
+// Run a check in a reader process; returns the number of problems.
+static int RunCheck(const string &name, const FrameBufferParams &params, LagPolicy policy,
+                    void (*run)(ReaderCheck &check))
+{
+    int requests[2], replies[2];
+    if (-1 == pipe(requests) || -1 == pipe(replies)) return 1;
+    pid_t pid = fork();
+    if (pid == -1) return 1;
+    if (pid == 0)
+    {
+        close(requests[0]);
+        close(replies[1]);
+        int bad = 1;
+        {
+            ReaderCheck check(name, requests[1], replies[0]);
+            if (0 == check.Connect(policy))
+            {
+                run(check);
+                bad = check.bad();
+            }
+        }
+        _exit(bad ? 1 : 0);
+    }
+
+    close(requests[1]);
+    close(replies[0]);
+    int bad = ServeReader(params, requests[0], replies[1]);
+    close(requests[0]);
+    close(replies[1]);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ++bad;
+    cout << name << (bad ? ": FAILED" : ": OK") << endl;
+    return bad ? 1 : 0;
+}
+
+static void CheckReady(ReaderCheck &check) { CheckReadyFd(check, false); }
+static void CheckRestart(ReaderCheck &check) { CheckReadyFd(check, true); }
+
+int main (int argc, char * const argv[]) {
+
+    setup_logging(string(basename(argv[0])), "config.yaml", "warning");
+	cout << endl << "Starting " << argv[0] << endl;
+
+    FrameBufferParams ring;
+    ring.ring = true;
+    ring.num_slots = kQueuedFrames;
+    ring.slot_bytes = 64*1024;
+    // a writer of a ring that is not persistent removes any left behind
+    FrameBufferWriter(kBufferName, ring).Initialize();
+
+    int bad = 0;
+    for (int mode=0; mode<2; ++mode)
+    {
+        const FrameBufferParams params = mode ? ring : FrameBufferParams();
+        const string prefix = mode ? "ring " : "per-frame ";
+        bad += RunCheck(prefix + "drop oldest", params, kLagDropOldest, CheckDropOldest);
+        bad += RunCheck(prefix + "latest", params, kLagLatest, CheckLatest);
+        bad += RunCheck(prefix + "lookups", params, kLagDropOldest, CheckLookups);
+        bad += RunCheck(prefix + "ready descriptor", params, kLagDropOldest, CheckReady);
+    }
+
+    ring.persistent = true;
+    bad += RunCheck("persistent ring takeover", ring, kLagDropOldest, CheckRestart);
+    ring.persistent = false;
+    FrameBufferWriter(kBufferName, ring).Initialize();
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
@@ -0,0 +1,180 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_frame_calibration.cpp
+ *
+ *  Calibrates pings with known samples with FrameCalibration:  float
+ *  amplitudes with a TVG applied, like the M3's, 16-bit dB power like the
+ *  EK60's, and half precision amplitudes, to Sv in dB and linear, with a
+ *  number of beams that leaves the ends of rows to the scalar code.  The
+ *  samples should match the formula worked out in double precision, a
+ *  change of range should get new gains, and a calibrated ping should not
+ *  be calibrated again.  The rate a big ping is calibrated at is reported.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <vector>
+#include <chrono>     // time stuff
+#include <algorithm>  // max, min
+#include <cmath>      // fabs, log10, pow
+
+#include "frame_calibration.h"
+#include "log.h"
+
+using namespace std;
+
+const int kNumBeams = 37;
+const int kNumSamples = 500;
+// (10*log10(2)/256, as in data_source_ek60.cpp
+const double kPowerScale = 0.011758984205624;
+
+// a sample, repeatable from its range bin and beam
+static float Amplitude(int m, int n) { return 0.01 + 0.002*m + 0.03*n; }
+static uint16_t Power(int m, int n) { return (uint16_t)(20000 + 37*m + 101*n); }
+
+static void MakePing(Frame *frame, uint32_t encoding, float range_min, float range_max)
+{
+    FrameHeader &hdr = frame->header;
+    hdr = FrameHeader();
+    hdr.num_samples = kNumSamples;
+    hdr.num_beams = kNumBeams;
+    hdr.range_min_m = range_min;
+    hdr.range_max_m = range_max;
+    hdr.encoding = encoding;
+    frame->malloc_data(kNumSamples*kNumBeams*SampleSize(encoding));
+    if (encoding == kSampleUInt16)
+    {
+        hdr.data_scale = kPowerScale;
+        hdr.data_offset = -32768*kPowerScale;
+        uint16_t *data = (uint16_t *)frame->data_ptr();
+        for (int m=0; m<kNumSamples; ++m)
+            for (int n=0; n<kNumBeams; ++n)
+                data[m*kNumBeams + n] = Power(m, n);
+        return;
+    }
+    vector<framedata_t> samples(kNumSamples*kNumBeams);
+    for (int m=0; m<kNumSamples; ++m)
+        for (int n=0; n<kNumBeams; ++n)
+            samples[m*kNumBeams + n] = Amplitude(m, n);
+    EncodeSamples(hdr, samples.data(), samples.size(), frame->data_ptr());
+}
+
+// Calibrate a ping and check it against the formula; returns the number of
+// bad samples and fields.
+static int Check(const string &name, const CalibrationParams &params, uint32_t encoding,
+                 const FrameTVG &tvg, FrameCalibration *calibration,
+                 float range_min, float range_max)
+{
+    Frame frame;
+    MakePing(&frame, encoding, range_min, range_max);
+    frame.tvg = tvg;
+    const FrameHeader in = frame.header;
+    vector<framedata_t> samples(kNumSamples*kNumBeams);
+    DecodeSamples(in, frame.data_ptr(), 0, samples.size(), samples.data());
+    if (calibration->Apply(&frame) == -1) return 1;
+
+    const FrameHeader &hdr = frame.header;
+    int bad = 0;
+    if (hdr.encoding != kSampleFloat32
+        || hdr.units != (params.decibels ? kUnitsSvDecibels : kUnitsSvLinear)
+        || frame.size() != kNumSamples*kNumBeams*sizeof(framedata_t))
+        return 1;
+    const double step = ((double)range_max - range_min)/(kNumSamples - 1);
+    for (int m=0; m<kNumSamples; ++m)
+    {
+        const double r = max(range_min + m*step, 0.1);
+        double applied = tvg.spreading*log10(r) + tvg.absorption_db_km*r/1000.0 + tvg.offset_db;
+        if (tvg.limit_db != 0.0) applied = min(applied, (double)tvg.limit_db);
+        const double gain = params.spreading*log10(r) + 2.0*params.absorption_db_km*r/1000.0
+                          + params.offset_db - applied;
+        for (int n=0; n<kNumBeams; ++n)
+        {
+            const double x = samples[m*kNumBeams + n];
+            const double level = params.input_decibels ? x : 20.0*log10(x);
+            const double sv_db = level + gain;
+            const double value = frame.get(m, n);
+            if (params.decibels ? fabs(value - sv_db) > 1e-3
+                                : fabs(value/pow(10.0, 0.1*sv_db) - 1.0) > 1e-4)
+                ++bad;
+        }
+    }
+    if (calibration->Apply(&frame) != -1) ++bad;
+    cout << name << ": " << bad << " bad" << endl;
+    return bad;
+}
+
+// Calibrate an M3-sized ping over and over; returns pings per second.
+static double Rate(const CalibrationParams &params, const FrameTVG &tvg)
+{
+    FrameCalibration calibration(params);
+    Frame frame;
+    const int num_samples = 1500, num_beams = 512, num_pings = 50;
+    frame.malloc_data(num_samples*num_beams*sizeof(framedata_t));
+    auto t0 = chrono::steady_clock::now();
+    for (int k=0; k<num_pings; ++k)
+    {
+        frame.header = FrameHeader();
+        frame.header.num_samples = num_samples;
+        frame.header.num_beams = num_beams;
+        frame.header.range_max_m = 40.0;
+        frame.tvg = tvg;
+        framedata_t *data = frame.data_ptr();
+        for (size_t i=0; i<frame.size()/sizeof(framedata_t); i+=997) data[i] = 1.0;
+        calibration.Apply(&frame);
+    }
+    return num_pings/chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+int main (int argc, char * const argv[]) {
+
+    setup_logging(string(basename(argv[0])), "config.yaml", "warning");
+	cout << endl << "Starting " << argv[0] << endl;
+
+    int bad = 0;
+    FrameTVG tvg;
+    tvg.spreading = 20;
+    tvg.absorption_db_km = 30;
+    tvg.offset_db = -10;
+    tvg.limit_db = 30;  // reached past 40 m or so
+    CalibrationParams params;
+    params.absorption_db_km = 10.0;
+    params.offset_db = -60.0;
+
+    {
+        FrameCalibration calibration(params);
+        bad += Check("amplitude to dB", params, kSampleFloat32, tvg, &calibration, 0.0, 60.0);
+        // new ranges, new gains
+        bad += Check("other ranges", params, kSampleFloat32, tvg, &calibration, 5.0, 20.0);
+        bad += Check("no TVG", params, kSampleFloat32, FrameTVG(), &calibration, 5.0, 20.0);
+        bad += Check("float16 amplitude", params, kSampleFloat16, tvg, &calibration, 5.0, 20.0);
+    }
+    params.decibels = false;
+    {
+        FrameCalibration calibration(params);
+        bad += Check("amplitude to linear", params, kSampleFloat32, tvg, &calibration, 0.0, 60.0);
+        bad += Check("float16 to linear", params, kSampleFloat16, tvg, &calibration, 0.0, 60.0);
+    }
+
+    params.input_decibels = true;
+    params.decibels = true;
+    {
+        FrameCalibration calibration(params);
+        bad += Check("dB power to dB", params, kSampleUInt16, FrameTVG(), &calibration, 1.0, 300.0);
+    }
+    params.decibels = false;
+    {
+        FrameCalibration calibration(params);
+        bad += Check("dB power to linear", params, kSampleUInt16, FrameTVG(), &calibration, 1.0, 300.0);
+        bad += Check("float dB to linear", params, kSampleFloat32, FrameTVG(), &calibration, 1.0, 300.0);
+    }
+
+    params = CalibrationParams();
+    params.decibels = false;
+    cout << "1500 x 512 amplitude to linear: " << Rate(params, tvg) << " pings/s" << endl;
+    params.decibels = true;
+    cout << "1500 x 512 amplitude to dB: " << Rate(params, tvg) << " pings/s" << endl;
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
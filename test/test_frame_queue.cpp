@@ -0,0 +1,96 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_frame_queue.cpp
+ *
+ *  A producer thread fills frames and a consumer takes them off the queue,
+ *  first at a pace the consumer keeps up with, then as fast as it can,
+ *  with the consumer stalling now and then.
+ *  Every frame the consumer gets should be whole and in order, and the
+ *  frames consumed and dropped should add up to the frames produced.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <thread>
+#include <chrono>     // time stuff
+#include <atomic>
+
+#include <unistd.h>   // usleep
+
+#include "frame_queue.h"
+
+using namespace std;
+
+const size_t kFrameSamples = 512*1500;
+
+static void Produce(FrameQueue *queue, int num_frames, int interval_us,
+                    std::atomic<bool> *done)
+{
+    for (int k=1; k<=num_frames; ++k)
+    {
+        if (interval_us > 0) usleep(interval_us);
+        Frame *frame = queue->Back();
+        frame->header.ping_num = k;
+        frame->malloc_data(kFrameSamples*sizeof(framedata_t));
+        framedata_t *p = frame->data_ptr();
+        for (size_t n=0; n<kFrameSamples; n+=1024) p[n] = k;
+        queue->Push();
+    }
+    done->store(true);
+}
+
+static int Consume(int queue_size, int num_frames, int interval_us, int stall_every)
+{
+    FrameQueue queue(queue_size);
+    std::atomic<bool> done(false);
+    auto t0 = chrono::steady_clock::now();
+    std::thread producer(Produce, &queue, num_frames, interval_us, &done);
+
+    int received = 0, bad = 0;
+    uint32_t last = 0;
+    while (true)
+    {
+        Frame *frame = queue.Front(100);
+        if (frame == nullptr)
+        {
+            if (done.load() && queue.depth() == 0) break;
+            continue;
+        }
+        const uint32_t ping = frame->header.ping_num;
+        if (ping <= last) ++bad;
+        const framedata_t *p = frame->data_ptr();
+        for (size_t n=0; n<kFrameSamples; n+=1024)
+            if (p[n] != ping) { ++bad; break; }
+        last = ping;
+        ++received;
+        if (stall_every > 0 && received % stall_every == 0) usleep(2000);
+        queue.Pop();
+    }
+    producer.join();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    const uint64_t dropped = queue.frames_dropped();
+    if (received + dropped != (uint64_t)num_frames) ++bad;
+    if (dropped > 0 && queue.max_depth() < queue_size) ++bad;
+    if (interval_us > 0 && stall_every == 0 && dropped > 0) ++bad; // should keep up
+    cout << "queue of " << queue_size << ", " << interval_us << " us per frame"
+         << (stall_every ? ", stalling: " : ": ")
+         << received << " frames, " << dropped << " dropped, max depth "
+         << queue.max_depth() << ", " << num_frames/secs << " frames/s, " << bad << " bad"
+         << endl;
+    return bad;
+}
+
+int main (int argc, char * const argv[]) {
+
+	cout << endl << "Starting " << argv[0] << endl;
+
+    int bad = 0;
+    bad += Consume(8, 500, 1000, 0);
+    bad += Consume(8, 2000, 0, 0);
+    bad += Consume(8, 2000, 0, 10);
+    bad += Consume(1, 2000, 0, 0);
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
@@ -0,0 +1,245 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_frame_relay.cpp
+ *
+ *  Relays frames over loopback, with and without compression.  A writer
+ *  puts frames in a frame ring, a sender thread reads them and relays them
+ *  to a receiver thread, which checks every frame arrives whole and in
+ *  order, and reports throughput and latency.  A sender that claims a
+ *  bigger frame than any sonar makes should be disconnected.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <vector>
+#include <thread>
+#include <chrono>     // time stuff
+#include <cstring>    // memcmp
+#include <cmath>      // exp
+#include <cstdlib>    // rand
+
+#include <unistd.h>   // sleep
+#include <sys/socket.h>
+#include <arpa/inet.h> // inet_addr
+
+#include <boost/program_options.hpp>
+
+#include "frame_buffer.h"
+#include "frame_relay.h"
+#include "log.h"
+
+using namespace std;
+using namespace boost;
+namespace po = boost::program_options;
+
+const int kPort = 47301;
+
+// Speckle-like intensities, repeatable from the ping number.
+static void FillFrame(uint32_t ping_num, framedata_t *p, size_t n)
+{
+    unsigned int seed = ping_num;
+    for (size_t i=0; i<n; ++i)
+        p[i] = exp(0.001*(rand_r(&seed) % 4000)) - 1.0;
+}
+
+static void RunSender(const string &fb_name, int num_frames, bool compress)
+{
+    FrameBufferReader fb(fb_name);
+    FrameRelaySender relay("127.0.0.1", kPort, compress);
+    if ( -1 == fb.Connect(kLagBlock) || -1 == relay.Connect() )
+    {
+        cerr << "sender: Error connecting." << endl;
+        return;
+    }
+    FrameView view;
+    for (int k=0; k<num_frames; ++k)
+    {
+        if ( fb.GetNextFrame(&view) == -1 || relay.SendFrame(view) != 1 )
+        {
+            cerr << "sender: Error relaying frame " << k << endl;
+            return;
+        }
+    }
+}
+
+static int RunReceiver(FrameRelayReceiver *relay, int num_frames, size_t frame_bytes)
+{
+    if (relay->Accept() == -1)
+    {
+        cerr << "receiver: Error accepting sender." << endl;
+        return 1;
+    }
+    vector<framedata_t> expected(frame_bytes/sizeof(framedata_t));
+    Frame frame;
+    double latency = 0.0;
+    long last = 0;
+    int bad = 0;
+    for (int k=0; k<num_frames; ++k)
+    {
+        double send_time;
+        long n = relay->ReceiveFrame(&frame, &send_time);
+        if (n <= 0)
+        {
+            cerr << "receiver: lost the sender at frame " << k << endl;
+            return 1;
+        }
+        latency += RelayClock() - send_time;
+        FillFrame(frame.header.ping_num, expected.data(), expected.size());
+        if ( (last > 0 && n != last + 1) || frame.size() != frame_bytes
+             || memcmp(frame.data_ptr(), expected.data(), frame_bytes) != 0
+             || frame.geometry == nullptr || frame.geometry->num_beams != 128 )
+            ++bad;
+        last = n;
+    }
+    relay->Disconnect();
+    const RelayStats &stats = relay->stats();
+    cout << "   " << (double)stats.data_bytes/stats.wire_bytes << "x compression, "
+         << 1000*latency/num_frames << " ms mean latency, " << bad << " bad" << endl;
+    return bad;
+}
+
+static int RunRelay(const string &fb_name, int num_frames, size_t frame_bytes, bool compress)
+{
+    cout << (compress ? "deflate:" : "uncompressed:") << endl;
+    FrameBufferParams params;
+    params.ring = true;
+    params.num_slots = 20;
+    params.slot_bytes = frame_bytes;
+    FrameBufferWriter fb(fb_name, params);
+    FrameRelayReceiver relay(kPort);
+    if ( -1 == fb.Initialize() || -1 == relay.Listen() )
+    {
+        cerr << "Error initializing frame buffer or relay!" << endl;
+        return 1;
+    }
+
+    int bad = 1;
+    std::thread receiver([&]{ bad = RunReceiver(&relay, num_frames, frame_bytes); });
+    std::thread sender(RunSender, fb_name, num_frames, compress);
+    sleep(1); // let the sender connect
+
+    std::shared_ptr<FrameGeometry> geom = std::make_shared<FrameGeometry>();
+    geom->num_beams = 128;
+    auto t0 = chrono::steady_clock::now();
+    for (int k=0; k<num_frames; ++k)
+    {
+        Frame frame;
+        frame.allocator = &fb;
+        frame.geometry = geom;
+        frame.header.ping_num = k;
+        frame.malloc_data(frame_bytes);
+        FillFrame(k, frame.data_ptr(), frame_bytes/sizeof(framedata_t));
+        fb.PutNewFrame(frame);
+    }
+    sender.join();
+    receiver.join();
+    auto t1 = chrono::steady_clock::now();
+    double secs = chrono::duration<double>(t1 - t0).count();
+    cout << "   " << num_frames/secs << " frames/s, "
+         << num_frames*frame_bytes/secs/1048576.0 << " MB/s of frames" << endl;
+    return bad;
+}
+
+// Send the start of a frame record of record_bytes that says it has
+// data_bytes of (deflated) frame data.
+static void SendOversized(uint64_t record_bytes, uint64_t data_bytes)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(kPort);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) return;
+
+    RelayHello hello;
+    memcpy(hello.magic, kRelayMagic, sizeof(kRelayMagic));
+    hello.header_size = sizeof(FrameHeader);
+    hello.geometry_size = sizeof(FrameGeometry);
+    RelayRecord rec;
+    rec.type = kRelayFrameRecord;
+    rec.flags = kRelayDeflate;
+    rec.size = record_bytes;
+    RelayFrameInfo info;
+    info.frame_number = 1;
+    info.send_time = RelayClock();
+    info.data_size = data_bytes;
+    FrameHeader header;
+    send(sock, &hello, sizeof(hello), MSG_NOSIGNAL);
+    send(sock, &rec, sizeof(rec), MSG_NOSIGNAL);
+    send(sock, &info, sizeof(info), MSG_NOSIGNAL);
+    send(sock, &header, sizeof(header), MSG_NOSIGNAL);
+    sleep(1);
+    close(sock);
+}
+
+static int RunOversized()
+{
+    cout << "oversized frame:" << endl;
+    FrameRelayReceiver relay(kPort);
+    if (relay.Listen() == -1) return 1;
+    int bad = 0;
+    // a record too big, and a frame too big in a record that is not
+    const uint64_t headers = sizeof(RelayFrameInfo) + sizeof(FrameHeader);
+    const uint64_t too_big = (uint64_t)1 << 40;
+    const uint64_t sizes[2][2] = { { too_big, 1024 }, { headers + 1024, too_big } };
+    for (int k=0; k<2; ++k)
+    {
+        std::thread sender(SendOversized, sizes[k][0], sizes[k][1]);
+        Frame frame;
+        if ( relay.Accept() == -1 || relay.ReceiveFrame(&frame) != -1
+             || relay.connected() || frame.size() != 0 )
+            ++bad;
+        sender.join();
+    }
+    cout << "   " << bad << " bad" << endl;
+    return bad;
+}
+
+int main (int argc, char * const argv[]) {
+	//--------------------------------------------------------------------------
+    // PARSE COMMAND LINE
+	//
+	po::options_description desc;
+	desc.add_options()
+	("help",                                                    "print help message")
+  ("cfg,c", po::value<string>()->default_value("config.yaml"),         "path to config file")
+	("frames,n", po::value<int>()->default_value(200),          "number of frames")
+	("mb,m", po::value<float>()->default_value(2.7),            "frame size (MB); 2.7 is an M3 ping")
+	;
+	po::variables_map options;
+    try
+    {
+        po::store( po::parse_command_line( argc, argv, desc ), options );
+    }
+    catch( const std::exception& e )
+    {
+        cerr << "Sorry, couldn't parse that: " << e.what() << endl;
+        cerr << desc << endl;
+        return -1;
+    }
+
+	po::notify( options );
+
+    if( options.count( "help" ) > 0 )
+    {
+        cerr << desc << endl;
+        return 0;
+    }
+    setup_logging(string(basename(argv[0])), options["cfg"].as<string>(), "warning");
+
+	//--------------------------------------------------------------------------
+	// DO STUFF
+	cout << endl << "Starting " << argv[0] << endl;
+
+    const int num_frames = options["frames"].as<int>();
+    const size_t frame_bytes = (size_t)(options["mb"].as<float>()*1024*1024/4)*4;
+    int bad = 0;
+    bad += RunRelay("nims_test_relay", num_frames, frame_bytes, false);
+    bad += RunRelay("nims_test_relay", num_frames, frame_bytes, true);
+    bad += RunOversized();
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
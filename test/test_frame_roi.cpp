@@ -0,0 +1,155 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_frame_roi.cpp
+ *
+ *  Cuts pings with known samples down with FrameROI:  a range and bearing
+ *  window, range bins and beams averaged together, the samples stored as
+ *  16-bit integers, and dB samples averaged as power.  The samples, ranges,
+ *  sampling window and beam angles left should be the ones in the window,
+ *  averaged, and a window with nothing in it should leave the ping as it
+ *  was.  A ping without beam angles keeps all its beams.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <memory>     // make_shared
+#include <cmath>      // fabs, log10, pow
+
+#include "frame_roi.h"
+#include "log.h"
+
+using namespace std;
+
+const int kNumBeams = 64;
+const int kNumSamples = 1000;
+
+// a sample, repeatable from its range bin and beam
+static float Sample(int m, int n) { return 0.5*m + 0.25*n; }
+
+static void MakePing(Frame *frame, uint32_t encoding)
+{
+    FrameHeader &hdr = frame->header;
+    hdr.ping_num = 1;
+    hdr.num_samples = kNumSamples;
+    hdr.num_beams = kNumBeams;
+    hdr.range_min_m = 1.0;
+    hdr.range_max_m = 1.0 + 0.1*(kNumSamples - 1);
+    hdr.winstart_sec = 0.01;
+    hdr.winlen_sec = 1e-4*kNumSamples;
+    hdr.encoding = encoding;
+    hdr.data_scale = 0.25;
+    hdr.data_offset = 0.0;
+    frame->malloc_data(kNumSamples*kNumBeams*SampleSize(encoding));
+    vector<framedata_t> samples(kNumSamples*kNumBeams);
+    for (int m=0; m<kNumSamples; ++m)
+        for (int n=0; n<kNumBeams; ++n)
+            samples[m*kNumBeams + n] = Sample(m, n);
+    EncodeSamples(hdr, samples.data(), samples.size(), frame->data_ptr());
+    FrameGeometry geometry;
+    geometry.num_beams = kNumBeams;
+    for (int n=0; n<kNumBeams; ++n) geometry.beam_angles_deg[n] = -63.0 + 2.0*n;
+    frame->geometry = make_shared<const FrameGeometry>(geometry);
+}
+
+// Apply a region to a ping and check what is left against the samples it
+// should be the average of; returns the number of bad samples and fields.
+static int Check(const string &name, const ROIParams &params, uint32_t encoding,
+                 int first_bin, int num_bins, int first_beam, int num_beams)
+{
+    Frame frame;
+    MakePing(&frame, encoding);
+    FrameROI roi(params);
+    int bad = 0;
+    if (roi.Apply(&frame) == -1) return 1;
+
+    const FrameHeader &hdr = frame.header;
+    const int dec = params.range_decimation, merge = params.beam_merge;
+    if ((int)hdr.num_samples != num_bins || (int)hdr.num_beams != num_beams
+        || frame.size() != num_bins*num_beams*SampleSize(encoding)
+        || !frame.geometry || (int)frame.geometry->num_beams != num_beams)
+        return 1;
+    if (fabs(hdr.range_min_m - (1.0 + 0.1*(first_bin + 0.5*(dec - 1)))) > 1e-4
+        || fabs(hdr.range_max_m - hdr.range_min_m - 0.1*dec*(num_bins - 1)) > 1e-3)
+        ++bad;
+    if (fabs(hdr.winstart_sec - (0.01 + 1e-4*first_bin)) > 1e-7
+        || fabs(hdr.winlen_sec - 1e-4*dec*num_bins) > 1e-7)
+        ++bad;
+    for (int n=0; n<num_beams; ++n)
+        if (fabs(frame.geometry->beam_angles_deg[n]
+                 - (-63.0 + 2.0*(first_beam + n*merge) + (merge - 1))) > 1e-4)
+            ++bad;
+
+    const float tolerance = (encoding == kSampleUInt16) ? 0.25 : 1e-3;
+    for (int m=0; m<num_bins; ++m)
+        for (int n=0; n<num_beams; ++n)
+        {
+            double expected = 0.0;
+            for (int d=0; d<dec; ++d)
+                for (int b=0; b<merge; ++b)
+                {
+                    const float sample = Sample(first_bin + m*dec + d, first_beam + n*merge + b);
+                    expected += params.decibels ? pow(10.0, 0.1*sample) : sample;
+                }
+            expected /= dec*merge;
+            if (params.decibels) expected = 10.0*log10(expected);
+            if (fabs(DecodeSample(hdr, frame.data_ptr(), m*num_beams + n) - expected) > tolerance)
+                ++bad;
+        }
+    cout << name << ": " << hdr.num_samples << " samples of " << hdr.num_beams
+         << " beams, " << bad << " bad" << endl;
+    return bad;
+}
+
+int main (int argc, char * const argv[]) {
+
+    setup_logging(string(basename(argv[0])), "config.yaml", "warning");
+	cout << endl << "Starting " << argv[0] << endl;
+
+    int bad = 0;
+    ROIParams params;
+    if (!FrameROI(params).whole_ping()) ++bad;
+
+    // bins 90 to 490 are 10 m to 50 m; beams 18 to 45 are -27 to 27 deg
+    params.range_min_m = 9.95;
+    params.range_max_m = 50.05;
+    params.bearing_min_deg = -28.0;
+    params.bearing_max_deg = 28.0;
+    bad += Check("crop", params, kSampleFloat32, 90, 401, 18, 28);
+
+    // 401 bins make 100 groups of 4, 28 beams 9 groups of 3
+    params.range_decimation = 4;
+    params.beam_merge = 3;
+    bad += Check("decimate and merge", params, kSampleFloat32, 90, 100, 18, 9);
+    bad += Check("uint16", params, kSampleUInt16, 90, 100, 18, 9);
+    bad += Check("float16", params, kSampleFloat16, 90, 100, 18, 9);
+    params.decibels = true;
+    bad += Check("decibels", params, kSampleFloat32, 90, 100, 18, 9);
+
+    // no range before the end of the ping; the far end is the last bin
+    params = ROIParams();
+    params.range_min_m = 59.95;
+    params.range_decimation = 2;
+    bad += Check("range only", params, kSampleFloat32, 590, 205, 0, kNumBeams);
+
+    // nothing in the window:  the ping is left alone
+    params = ROIParams();
+    params.bearing_min_deg = 70.0;
+    Frame frame;
+    MakePing(&frame, kSampleFloat32);
+    if (FrameROI(params).Apply(&frame) != -1 || frame.header.num_beams != kNumBeams
+        || frame.size() != kNumSamples*kNumBeams*sizeof(framedata_t))
+        ++bad;
+
+    // no beam angles:  the bearing window is not applied, only the range
+    params.range_max_m = 50.05;
+    params.bearing_min_deg = -28.0;
+    MakePing(&frame, kSampleFloat32);
+    frame.geometry.reset();
+    if (FrameROI(params).Apply(&frame) != 0 || frame.header.num_beams != kNumBeams
+        || frame.header.num_samples != 491)
+        ++bad;
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
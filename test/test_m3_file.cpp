@@ -0,0 +1,176 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_m3_file.cpp
+ *
+ *  Writes a recording of beamformed packets like m3sim records, with
+ *  garbage between two of them and a ping cut off at the end, and reads it
+ *  back with DataSourceM3File as fast as it goes, then paced at ten times
+ *  the recorded ping rate.  Every whole ping should come through, in
+ *  order, and the paced replay should take a tenth of the recorded time.
+ *  Replayed through a FrameQueue, as the ingester's receive thread does,
+ *  every ping should calibrate, though the queue's frames are reused.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <fstream>    // ofstream
+#include <string>     // for strings
+#include <vector>
+#include <chrono>     // time stuff
+#include <cstdio>     // remove
+#include <cmath>      // sqrt, fabs
+#include <cstring>    // memcmp
+
+#include "data_source_m3.h"
+#include "frame_queue.h"
+#include "frame_calibration.h"
+#include "m3_format.h"
+#include "log.h"
+
+using namespace std;
+
+const int kNumBeams = 96;
+const int kNumSamples = 500;
+const int kNumPings = 50;
+const int kPingIntervalMs = 100;   // recorded
+
+// I and Q of a sample, repeatable from the ping number
+static float SampleI(uint32_t ping, int n, int m) { return ping + 0.25*n; }
+static float SampleQ(uint32_t ping, int n, int m) { return 0.5*m; }
+
+static vector<char> MakePacket(uint32_t ping)
+{
+    const size_t data_bytes = sizeof(Ipp32fc_Type)*kNumBeams*kNumSamples;
+    vector<char> packet(sizeof(Packet_Header_Struct) + sizeof(Data_Header_Struct)
+                        + data_bytes + sizeof(Packet_Footer_Struct), 0);
+    Packet_Header_Struct *packet_header = (Packet_Header_Struct *)packet.data();
+    packet_header->sync_word_1 = HDR_SYNC_INT16U_1;
+    packet_header->sync_word_2 = HDR_SYNC_INT16U_2;
+    packet_header->sync_word_3 = HDR_SYNC_INT16U_3;
+    packet_header->sync_word_4 = HDR_SYNC_INT16U_4;
+    packet_header->data_type = PKT_DATA_TYPE_BEAMFORMED;
+    packet_header->packet_body_size = sizeof(Data_Header_Struct) + data_bytes;
+    Data_Header_Struct *header = (Data_Header_Struct *)(packet_header + 1);
+    header->dwPingNumber = ping;
+    const uint32_t ping_ms = 1000*1000 + ping*kPingIntervalMs;
+    header->dwTimeSec = ping_ms/1000;
+    header->dwTimeMillisec = ping_ms % 1000;
+    header->nNumBeams = kNumBeams;
+    header->nNumSamples = kNumSamples;
+    for (int n=0; n<kNumBeams; ++n)
+        header->fBeamList[n] = -60.0 + n*120.0/kNumBeams;
+    Ipp32fc_Type *data = (Ipp32fc_Type *)(header + 1);
+    for (int n=0; n<kNumBeams; ++n)
+        for (int m=0; m<kNumSamples; ++m)
+        {
+            data[n*kNumSamples + m].I = SampleI(ping, n, m);
+            data[n*kNumSamples + m].Q = SampleQ(ping, n, m);
+        }
+    Packet_Footer_Struct *packet_footer = (Packet_Footer_Struct *)(data + kNumBeams*kNumSamples);
+    packet_footer->packet_body_size = packet_header->packet_body_size;
+    return packet;
+}
+
+// Read the whole recording; returns the number of bad pings.
+static int Replay(const string &path, double rate)
+{
+    DataSourceM3File source(path, rate);
+    if (source.connect() == -1 || source.num_pings() != kNumPings)
+    {
+        cerr << "Error indexing " << path << endl;
+        return 1;
+    }
+
+    int received = 0, bad = 0;
+    Frame frame;
+    auto t0 = chrono::steady_clock::now();
+    while (source.more_data())
+    {
+        if (source.GetPing(&frame) == -1) { ++bad; break; }
+        const uint32_t ping = frame.header.ping_num;
+        if (ping != (uint32_t)received + 1) ++bad;
+        ++received;
+        const framedata_t *data = frame.data_ptr();
+        for (int m=0; m<kNumSamples; m+=7)
+            for (int n=0; n<kNumBeams; ++n)
+            {
+                const double i = SampleI(ping, n, m), q = SampleQ(ping, n, m);
+                if (fabs(data[m*kNumBeams + n] - sqrt(i*i + q*q)) > 1e-3) ++bad;
+            }
+        if (!frame.geometry || frame.geometry->num_beams != kNumBeams) ++bad;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    if (received != kNumPings || source.GetPing(&frame) != -1) ++bad;
+
+    if (rate > 0)
+    {
+        // the first ping goes out right away
+        const double expected = (kNumPings - 1)*kPingIntervalMs/1000.0/rate;
+        if (secs < expected || secs > expected + 0.25) ++bad;
+        cout << "rate " << rate << ": " << received << " pings in " << secs
+             << " s, expected " << expected << " s, " << bad << " bad" << endl;
+    }
+    else
+        cout << "max speed: " << received << " pings, " << received/secs << " pings/s, "
+             << bad << " bad" << endl;
+    return bad;
+}
+
+// Replay into a small FrameQueue and calibrate each ping as it comes off
+// the front, as the ingester does with a receive queue; each should match
+// the ping read into a new frame.
+static int Calibrate(const string &path)
+{
+    DataSourceM3File source(path, 0), fresh_source(path, 0);
+    if (source.connect() == -1 || fresh_source.connect() == -1) return 1;
+    FrameQueue queue(4);
+    CalibrationParams params;
+    FrameCalibration calibration(params), fresh_calibration(params);
+    int calibrated = 0, bad = 0;
+    while (source.more_data())
+    {
+        Frame fresh;
+        if (source.GetPing(queue.Back()) == -1 || fresh_source.GetPing(&fresh) == -1
+            || fresh_calibration.Apply(&fresh) == -1) { ++bad; break; }
+        queue.Push();
+        Frame *frame = queue.Front(0);
+        if (frame == nullptr) { ++bad; break; }
+        if (calibration.Apply(frame) == 0 && frame->header.units == kUnitsSvDecibels
+            && frame->header.ping_num == fresh.header.ping_num
+            && frame->size() == fresh.size()
+            && memcmp(frame->data_ptr(), fresh.data_ptr(), fresh.size()) == 0)
+            ++calibrated;
+        queue.Pop();
+    }
+    if (calibrated != kNumPings) ++bad;
+    cout << "through a queue: " << calibrated << " pings calibrated, " << bad << " bad" << endl;
+    return bad;
+}
+
+int main (int argc, char * const argv[]) {
+
+    setup_logging(string(basename(argv[0])), "config.yaml", "warning");
+	cout << endl << "Starting " << argv[0] << endl;
+
+    const string path = "/tmp/test_m3_file.imb";
+    {
+        ofstream out(path, ios::binary);
+        for (int ping=1; ping<=kNumPings; ++ping)
+        {
+            vector<char> packet = MakePacket(ping);
+            if (ping == 20) out.write("not a ping", 10);
+            out.write(packet.data(), packet.size());
+        }
+        vector<char> last = MakePacket(kNumPings + 1);
+        out.write(last.data(), last.size()/3); // the recording stopped here
+    }
+
+    int bad = 0;
+    bad += Replay(path, 0);
+    bad += Replay(path, 10);
+    bad += Calibrate(path);
+    remove(path.c_str());
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
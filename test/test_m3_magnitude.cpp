@@ -0,0 +1,112 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_m3_magnitude.cpp
+ *
+ *  Checks IQMagnitudeTranspose against the conversion DataSourceM3 used to
+ *  do sample by sample, for M3 ping sizes and for odd sizes that leave
+ *  edges outside the vector tiles, and times the two.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <vector>
+#include <chrono>     // time stuff
+#include <cmath>      // sqrt, pow, fabs
+#include <cstdlib>    // rand
+
+#include <boost/program_options.hpp>
+
+#include "data_source_m3.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+// the original conversion in DataSourceM3::GetPing
+static void ReferenceMagnitude(const float *iq, int num_beams, int num_samples,
+                               framedata_t *out)
+{
+    for (int n = 0; n < num_beams; ++n) // beam
+        for (int m = 0; m < num_samples; ++m) // sample
+        {
+            const float *x = iq + 2*((size_t)n*num_samples + m);
+            out[m*num_beams + n] = sqrt(pow(x[0],2) + pow(x[1],2));
+        }
+}
+
+static int Compare(int num_beams, int num_samples, int reps)
+{
+    const size_t n = (size_t)num_beams*num_samples;
+    vector<float> iq(2*n);
+    for (size_t k=0; k<2*n; ++k)
+        iq[k] = (rand() % 200001 - 100000)/1000.0;
+    vector<framedata_t> expected(n), actual(n);
+
+    auto t0 = chrono::steady_clock::now();
+    for (int k=0; k<reps; ++k)
+        ReferenceMagnitude(iq.data(), num_beams, num_samples, expected.data());
+    auto t1 = chrono::steady_clock::now();
+    for (int k=0; k<reps; ++k)
+        IQMagnitudeTranspose(iq.data(), num_beams, num_samples, actual.data());
+    auto t2 = chrono::steady_clock::now();
+    double ref_secs = chrono::duration<double>(t1 - t0).count()/reps;
+    double secs = chrono::duration<double>(t2 - t1).count()/reps;
+
+    // single precision tiles are within a couple of ulps of the original
+    double worst = 0.0;
+    int bad = 0;
+    for (size_t k=0; k<n; ++k)
+    {
+        double err = fabs(actual[k] - expected[k]);
+        if (expected[k] != 0.0) err /= expected[k];
+        worst = max(worst, err);
+        if (err > 2.5e-7) ++bad;
+    }
+    cout << num_beams << " beams x " << num_samples << " samples: worst error " << worst
+         << ", " << bad << " bad; " << ref_secs*1000 << " ms before, " << secs*1000
+         << " ms now (" << ref_secs/secs << "x)" << endl;
+    return bad;
+}
+
+int main (int argc, char * const argv[]) {
+	//--------------------------------------------------------------------------
+    // PARSE COMMAND LINE
+	//
+	po::options_description desc;
+	desc.add_options()
+	("help",                                                    "print help message")
+	("beams,b", po::value<int>()->default_value(512),           "number of beams")
+	("samples,s", po::value<int>()->default_value(1500),        "number of samples")
+	("reps,r", po::value<int>()->default_value(20),             "conversions to time")
+	;
+	po::variables_map options;
+    try
+    {
+        po::store( po::parse_command_line( argc, argv, desc ), options );
+    }
+    catch( const std::exception& e )
+    {
+        cerr << "Sorry, couldn't parse that: " << e.what() << endl;
+        cerr << desc << endl;
+        return -1;
+    }
+
+	po::notify( options );
+
+    if( options.count( "help" ) > 0 )
+    {
+        cerr << desc << endl;
+        return 0;
+    }
+
+	cout << endl << "Starting " << argv[0] << endl;
+
+    int bad = 0;
+    bad += Compare(options["beams"].as<int>(), options["samples"].as<int>(),
+                   options["reps"].as<int>());
+    bad += Compare(128, 5300, 5); // narrow sector, long range
+    bad += Compare(37, 101, 5);   // nothing lines up with a tile
+    bad += Compare(7, 3, 5);      // smaller than a tile
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_m3_stream.cpp
+ *
+ *  Feeds DataSourceM3 a stream of beamformed packets with garbage between
+ *  them, a packet of another type, a truncated packet, a packet whose
+ *  footer does not match and one with a corrupt sample count, from a fake
+ *  M3 host on the loopback.  Every
+ *  good ping should come through, in order, and every bad one cost only
+ *  itself.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <string>     // for strings
+#include <vector>
+#include <thread>
+#include <cstring>    // memset
+#include <cstdlib>    // rand
+#include <cmath>      // sqrt, fabs
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h> // inet_addr
+#include <unistd.h>    // close
+
+#include "data_source_m3.h"
+#include "m3_format.h"
+#include "log.h"
+
+using namespace std;
+
+const int kNumBeams = 96;
+const int kNumSamples = 500;
+
+// I and Q of a sample, repeatable from the ping number
+static float SampleI(uint32_t ping, int n, int m) { return ping + 0.25*n; }
+static float SampleQ(uint32_t ping, int n, int m) { return 0.5*m; }
+
+static vector<char> MakePacket(uint32_t ping)
+{
+    const size_t data_bytes = sizeof(Ipp32fc_Type)*kNumBeams*kNumSamples;
+    vector<char> packet(sizeof(Packet_Header_Struct) + sizeof(Data_Header_Struct)
+                        + data_bytes + sizeof(Packet_Footer_Struct), 0);
+    Packet_Header_Struct *packet_header = (Packet_Header_Struct *)packet.data();
+    packet_header->sync_word_1 = HDR_SYNC_INT16U_1;
+    packet_header->sync_word_2 = HDR_SYNC_INT16U_2;
+    packet_header->sync_word_3 = HDR_SYNC_INT16U_3;
+    packet_header->sync_word_4 = HDR_SYNC_INT16U_4;
+    packet_header->data_type = PKT_DATA_TYPE_BEAMFORMED;
+    packet_header->packet_body_size = sizeof(Data_Header_Struct) + data_bytes;
+    Data_Header_Struct *header = (Data_Header_Struct *)(packet_header + 1);
+    header->dwPingNumber = ping;
+    header->nNumBeams = kNumBeams;
+    header->nNumSamples = kNumSamples;
+    for (int n=0; n<kNumBeams; ++n)
+        header->fBeamList[n] = -60.0 + n*120.0/kNumBeams;
+    Ipp32fc_Type *data = (Ipp32fc_Type *)(header + 1);
+    for (int n=0; n<kNumBeams; ++n)
+        for (int m=0; m<kNumSamples; ++m)
+        {
+            data[n*kNumSamples + m].I = SampleI(ping, n, m);
+            data[n*kNumSamples + m].Q = SampleQ(ping, n, m);
+        }
+    Packet_Footer_Struct *packet_footer = (Packet_Footer_Struct *)(data + kNumBeams*kNumSamples);
+    packet_footer->packet_body_size = packet_header->packet_body_size;
+    return packet;
+}
+
+static void Send(int sock, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = send(sock, data, size, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        data += n;
+        size -= n;
+    }
+}
+
+// The fake M3 host; returns the ping numbers that should arrive.
+static void RunHost(int listener, vector<uint32_t> *expected)
+{
+    int sock = accept(listener, NULL, NULL);
+    if (sock == -1) return;
+    for (uint32_t ping=1; ping<=40; ++ping)
+    {
+        vector<char> packet = MakePacket(ping);
+        switch (ping % 8)
+        {
+            case 2: // garbage before the packet
+            {
+                vector<char> garbage(1 + rand() % 5000);
+                for (size_t k=0; k<garbage.size(); ++k) garbage[k] = rand();
+                Send(sock, garbage.data(), garbage.size());
+                break;
+            }
+            case 3: // not beamformed data
+                ((Packet_Header_Struct *)packet.data())->data_type = 0x1001;
+                Send(sock, packet.data(), packet.size());
+                continue;
+            case 5: // cut off, then the next packet
+                Send(sock, packet.data(), packet.size()/2);
+                continue;
+            case 6: // footer does not match
+                packet[packet.size() - sizeof(Packet_Footer_Struct)] ^= 1;
+                Send(sock, packet.data(), packet.size());
+                continue;
+            case 7: // many more samples than the packet has
+                ((Data_Header_Struct *)(packet.data() + sizeof(Packet_Header_Struct)))
+                    ->nNumSamples = 20*kNumSamples;
+                Send(sock, packet.data(), packet.size());
+                continue;
+        }
+        Send(sock, packet.data(), packet.size());
+        expected->push_back(ping);
+    }
+    close(sock);
+}
+
+int main (int argc, char * const argv[]) {
+
+    setup_logging(string(basename(argv[0])), "config.yaml", "warning");
+	cout << endl << "Starting " << argv[0] << endl;
+
+    // DataSourceM3 always connects to the M3 host port
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(20001);
+    if ( -1 == bind(listener, (struct sockaddr *)&addr, sizeof(addr))
+         || -1 == listen(listener, 1) )
+    {
+        perror("Error listening on port 20001");
+        return -1;
+    }
+
+    vector<uint32_t> expected;
+    std::thread host(RunHost, listener, &expected);
+    DataSourceM3 source("127.0.0.1");
+    if (source.connect() == -1)
+    {
+        cerr << "Error connecting to the fake M3 host" << endl;
+        host.join();
+        return -1;
+    }
+
+    vector<uint32_t> received;
+    int bad = 0;
+    Frame frame;
+    while (source.GetPing(&frame) == 0)
+    {
+        const uint32_t ping = frame.header.ping_num;
+        received.push_back(ping);
+        const framedata_t *data = frame.data_ptr();
+        for (int m=0; m<kNumSamples; ++m)
+            for (int n=0; n<kNumBeams; ++n)
+            {
+                const double i = SampleI(ping, n, m), q = SampleQ(ping, n, m);
+                if (fabs(data[m*kNumBeams + n] - sqrt(i*i + q*q)) > 1e-3) ++bad;
+            }
+        if (!frame.geometry || frame.geometry->num_beams != kNumBeams) ++bad;
+    }
+    host.join();
+    close(listener);
+
+    if (received != expected) ++bad;
+    cout << "received " << received.size() << " of " << expected.size() << " good pings, "
+         << bad << " bad" << endl;
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
@@ -0,0 +1,81 @@
+/*
+ *  Nekton Interaction Monitoring System (NIMS)
+ *
+ *  test_sample_encoding.cpp
+ *
+ *  Round trip of frame samples through the 16-bit encodings, checking the
+ *  error is within the quantization of each encoding, and the time to
+ *  widen a frame of samples.
+ *
+ */
+#include <iostream>   // cout, cin, cerr
+#include <vector>
+#include <chrono>     // time stuff
+#include <cmath>      // fabs
+#include <cstdlib>    // rand
+
+#include "frame_buffer.h"
+
+using namespace std;
+
+static int RoundTrip(const char *name, const FrameHeader &hdr,
+                     const vector<framedata_t> &samples, double max_error, bool relative)
+{
+    const size_t n = samples.size();
+    vector<char> encoded(n*SampleSize(hdr.encoding));
+    vector<framedata_t> decoded(n);
+    EncodeSamples(hdr, samples.data(), n, encoded.data());
+
+    auto t0 = chrono::steady_clock::now();
+    const int reps = 50;
+    for (int k=0; k<reps; ++k)
+        DecodeSamples(hdr, encoded.data(), 0, n, decoded.data());
+    auto t1 = chrono::steady_clock::now();
+    double secs = chrono::duration<double>(t1 - t0).count()/reps;
+
+    double worst = 0.0;
+    int bad = 0;
+    for (size_t k=0; k<n; ++k)
+    {
+        double err = fabs(decoded[k] - samples[k]);
+        if (relative && samples[k] != 0.0) err /= fabs(samples[k]);
+        worst = max(worst, err);
+        if (err > max_error) ++bad;
+        if (DecodeSample(hdr, encoded.data(), k) != decoded[k]) ++bad;
+    }
+    cout << name << ": " << n*SampleSize(hdr.encoding) << " bytes, worst error "
+         << worst << ", " << bad << " bad, decoded in " << secs*1000 << " ms ("
+         << n*sizeof(framedata_t)/secs/1e9 << " GB/s out)" << endl;
+    return bad;
+}
+
+int main (int argc, char * const argv[]) {
+
+	cout << endl << "Starting " << argv[0] << endl;
+
+    // an M3 ping
+    const size_t n = 128*5300;
+    vector<framedata_t> samples(n);
+    FrameHeader hdr;
+    int bad = 0;
+
+    // half precision keeps 11 significant bits
+    for (size_t k=0; k<n; ++k)
+        samples[k] = (rand() % 100000)/10.0 - 5000.0;
+    hdr.encoding = kSampleFloat16;
+    bad += RoundTrip("float16", hdr, samples, 1.0/2048, true);
+
+    // 16-bit samples are exact to within half a step
+    hdr.encoding = kSampleUInt16;
+    hdr.data_scale = 0.011758984205624; // EK60 power
+    hdr.data_offset = -32768*hdr.data_scale;
+    for (size_t k=0; k<n; ++k)
+        samples[k] = hdr.data_scale*((rand() % 65536) - 32768);
+    bad += RoundTrip("uint16", hdr, samples, 0.5*hdr.data_scale, false);
+
+    hdr.encoding = kSampleFloat32;
+    bad += RoundTrip("float32", hdr, samples, 0.0, false);
+
+	cout << endl << "Ending " << argv[0] << (bad ? " FAILED" : " OK") << endl << endl;
+    return bad ? -1 : 0;
+}
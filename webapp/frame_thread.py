@@ -141,7 +141,7 @@ class FrameThread(threading.Thread):
                         continue
                     mapped = mmap(shm_frame.fd, shm_frame.size)
                     shm_frame.close_fd()
-                    frame_buffer = frames.frame_buffer(mapped.read(frame.frame_length))
+                    frame_buffer = frames.frame_buffer(mapped.read(frame.frame_length), frame.shm_location)
                     mapped.close()
                     if frame_buffer.valid is False:
                         logger.info(' -- Error Parsing Frame')
@@ -1,21 +1,111 @@
 #!/usr/bin/python
 
 # Python modules
+from mmap import mmap
 from struct import *
+from math import ldexp
 import sys
 
 # 3rd party modules
+from posix_ipc import SharedMemory, O_RDONLY
 
 
-class frame_buffer:
+class frame_geometry:
+    max_beams = 1024       # kMaxBeams in frame_buffer.h
+    max_geometries = 8     # kMaxGeometries in frame_buffer.h
+    entry_format = 'III' + 'f' * max_beams  # published, generation, num_beams, angles
+
+    # the last geometry read, by geometry table name; geometries rarely change
+    latest = {}
+
+    def __init__(self, shm_location, geometry_id):
+        """
+        Beam geometry of a frame, read from the geometry table the ingester keeps in shared memory.
+        Args:
+            shm_location: shared memory name of the frame, which starts with the frame buffer name
+            geometry_id: the frame's geometry_id
+        """
+        self.table_name = shm_location.rsplit('-', 1)[0] + '-geometry'
+        self.valid = self.read_entry(geometry_id)
 
-    def __init__(self, buff):
+    def read_entry(self, geometry_id):
+        """
+        Reads the table entry for a geometry.
+        Args:
+            geometry_id: generation of the geometry
+
+        Returns: boolean representing whether the geometry is still in the table
+        """
+        try:
+            shm = SharedMemory(self.table_name, O_RDONLY)
+            mapped = mmap(shm.fd, shm.size)
+            shm.close_fd()
+            entry_size = calcsize(self.entry_format)
+            mapped.seek(calcsize('II') + (geometry_id % self.max_geometries) * entry_size)
+            entry = unpack(self.entry_format, mapped.read(entry_size))
+            mapped.close()
+
+            published, self.generation, self.num_beams = entry[0:3]
+            self.beam_angles_deg = entry[3:3 + self.num_beams]
+            return published == geometry_id and self.generation == geometry_id
+        except:
+            print "Failed to read frame geometry:", sys.exc_info()
+            return False
+
+    @classmethod
+    def get(cls, shm_location, geometry_id):
+        """
+        Returns the geometry of a frame, reading it only if it is not the last one read.
+        """
+        table_name = shm_location.rsplit('-', 1)[0] + '-geometry'
+        geometry = cls.latest.get(table_name)
+        if geometry is None or geometry.generation != geometry_id:
+            geometry = cls(shm_location, geometry_id)
+            if not geometry.valid:
+                return None
+            cls.latest[table_name] = geometry
+        return geometry
+
+
+def half_to_float(h):
+    """
+    Converts an IEEE 754 half precision sample (kSampleFloat16) to a float.
+    """
+    sign = -1.0 if h & 0x8000 else 1.0
+    exp = (h >> 10) & 0x1f
+    mant = h & 0x3ff
+    if exp == 0:
+        return sign * ldexp(mant, -24)
+    if exp == 31:
+        return sign * float('inf') if mant == 0 else float('nan')
+    return sign * ldexp(mant | 0x400, exp - 25)
+
+
+class frame_buffer:
+    # SampleEncoding in frame_buffer.h
+    sample_float32 = 0
+    sample_float16 = 1
+    sample_uint16 = 2
+    # SampleUnits in frame_buffer.h
+    units_sonar = 0
+    units_sv_linear = 1
+    units_sv_decibels = 2
+
+    def __init__(self, buff, shm_location=None):
         """
         Reads a byte array and converts it to the frame buffer specified by ingester
         Args:
             buff: a byte array
+            shm_location: shared memory name of the frame, used to look up the beam geometry
         """
         self.valid = self.parse_buffer(buff)
+        if self.valid and shm_location is not None:
+            geometry = frame_geometry.get(shm_location, self.geometry_id[0])
+            if geometry is None:
+                print "No geometry for frame:", self.geometry_id[0]
+                self.valid = False
+            else:
+                self.beam_angles_deg = geometry.beam_angles_deg
 
     def unpacker(self, fmt, buff):
         """
@@ -51,14 +141,31 @@ class frame_buffer:
             self.winstart_sec, buff = self.unpacker('f', buff)
             self.winlen_sec, buff = self.unpacker('f', buff)
             self.num_beams, buff = self.unpacker('I', buff)
-            self.beam_angles_deg, buff = self.unpacker('f' * 512, buff)
+            self.geometry_id, buff = self.unpacker('I', buff)
             self.freq_hz, buff = self.unpacker('I', buff)
             self.pulselen_microsec, buff = self.unpacker('I', buff)
             self.pulserep_hz, buff = self.unpacker('f', buff)
             #print self.pulserep_hz
+            self.encoding, buff = self.unpacker('I', buff)
+            self.data_scale, buff = self.unpacker('f', buff)
+            self.data_offset, buff = self.unpacker('f', buff)
+            self.channel, buff = self.unpacker('I', buff)
+            self.units, buff = self.unpacker('I', buff)
             self.data_len, buff = self.unpacker('Q', buff)
             tot_samples = self.num_samples[0] * self.num_beams[0]
-            self.image, buff = self.unpacker('f' * tot_samples, buff)
+            encoding = self.encoding[0]
+            if encoding == self.sample_float32:
+                self.image, buff = self.unpacker('f' * tot_samples, buff)
+            elif encoding == self.sample_uint16:
+                samples, buff = self.unpacker('H' * tot_samples, buff)
+                scale, offset = self.data_scale[0], self.data_offset[0]
+                self.image = tuple(scale * x + offset for x in samples)
+            elif encoding == self.sample_float16:
+                samples, buff = self.unpacker('H' * tot_samples, buff)
+                self.image = tuple(half_to_float(x) for x in samples)
+            else:
+                print "Unknown sample encoding:", encoding
+                return False
 
             return True
         except:
@@ -82,9 +189,15 @@ class frame_buffer:
         print "    window start:", self.winstart_sec[0]
         print "   window length:",  self.winlen_sec[0]
         print "       num beams:", self.num_beams[0]
+        print "     geometry id:", self.geometry_id[0]
         print "       freq (hz):", self.freq_hz[0]
         print "  pulse len (ms):", self.pulselen_microsec[0]
         print "  pulse rep (hz):", self.pulserep_hz[0]
+        print "        encoding:", self.encoding[0]
+        print "      data scale:", self.data_scale[0]
+        print "     data offset:", self.data_offset[0]
+        print "         channel:", self.channel[0]
+        print "           units:", self.units[0]
         print "        data len:", self.data_len
 
 
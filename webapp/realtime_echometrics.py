@@ -75,7 +75,7 @@ def fetch_framebuffer(mq):
 
     mapped = mmap(shm_frame.fd, shm_frame.size)
     shm_frame.close_fd()
-    frame_buffer = frames.frame_buffer(mapped.read(frame.frame_length))
+    frame_buffer = frames.frame_buffer(mapped.read(frame.frame_length), frame.shm_location)
     mapped.close()
 
     if frame_buffer.valid is False:
@@ -269,7 +269,9 @@ def main():
     try:
         #logger.info('Connecting to' + nims_fb_name)
         framebuffer_mq = MessageQueue(nims_fb_name, O_RDONLY)
-        framebuffer_mq.send(emmq_name)
+        # queue name and LagPolicy (frame_buffer.h); 1 is kLagDropOldest,
+        # so the ingester never waits for us
+        framebuffer_mq.send(emmq_name + ' 1')
         logger.info(" -- sent private queue: " + emmq_name)
     except ExistentialError as e:
         logger.error(' -- Could not connect to' + nims_fb_name + e.__repr__())
@@ -290,11 +292,15 @@ def main():
         mq_state = poller.poll()
         for state in mq_state:
             if state[0] == em_mq.mqd:
-                frame_buffer = fetch_framebuffer(em_mq)
-                if frame_buffer:
-                    if mode == 1: # multbeam
-                        frame_buffer = compress_beams(frame_buffer)
-                    current_frames.append(frame_buffer)
+                # take every frame already queued, up to a full bin, for this wake-up
+                while True:
+                    frame_buffer = fetch_framebuffer(em_mq)
+                    if frame_buffer:
+                        if mode == 1: # multbeam
+                            frame_buffer = compress_beams(frame_buffer)
+                        current_frames.append(frame_buffer)
+                    if em_mq.current_messages == 0 or len(current_frames) >= bin_ping:
+                        break
             if state[0] == em_request_mq.mqd: # TODO catch error to drop this person.
                 client = accept_new_client(em_request_mq)
                 if client: